@@ -0,0 +1,239 @@
+/**
+ * bench.c
+ * Common helpers for the library benchmarks.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+/* Labels used to build realistic looking menus. */
+static const char *labels[] = {
+	"Welcome to the gopherspace!",
+	"",
+	"About this server",
+	"Phlog - Thoughts from an old computer enthusiast",
+	"==============================================================",
+	"Software archive (DOS, Windows 3.x, Mac OS Classic)",
+	"README.TXT",
+	"Search the archive"
+};
+
+/* Item types used to build realistic looking menus. */
+static const char types[] = { 'i', 'i', '0', '1', 'i', '1', '0', '7' };
+
+/**
+ * Gets a monotonic timestamp.
+ *
+ * @return Number of seconds since an arbitrary point in time.
+ */
+double bench_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+/**
+ * Prints out the throughput of a benchmark run.
+ *
+ * @param name  Name of the benchmark.
+ * @param bytes Number of bytes processed.
+ * @param secs  Number of seconds it took.
+ */
+void bench_report(const char *name, size_t bytes, double secs) {
+	printf("  %-28s %10.1f MB/s  (%.3f s)\n", name,
+		   (bytes / secs) / (1024.0 * 1024.0), secs);
+}
+
+/**
+ * Prints out the rate of operations of a benchmark run.
+ *
+ * @param name  Name of the benchmark.
+ * @param count Number of operations performed.
+ * @param unit  Name of the operations.
+ * @param secs  Number of seconds it took.
+ */
+void bench_report_rate(const char *name, size_t count, const char *unit,
+					   double secs) {
+	printf("  %-28s %10.1f %s/s  (%.3f s)\n", name, count / secs, unit, secs);
+}
+
+/**
+ * Builds a menu with a number of uniform directory lines.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param lines Number of lines in the menu.
+ * @param len   Pointer to store the length of the menu.
+ *
+ * @return Newly allocated menu contents.
+ */
+char *bench_menu_synthetic(size_t lines, size_t *len) {
+	char *menu;
+	char *p;
+	size_t i;
+
+	menu = (char *)malloc((lines + 1) * 64);
+	p = menu;
+	for (i = 0; i < lines; i++) {
+		p += sprintf(p, "1Item %lu\t/sel/%lu\tlocalhost\t70\r\n",
+			(unsigned long)i, (unsigned long)i);
+	}
+	p += sprintf(p, ".\r\n");
+	*len = p - menu;
+
+	return menu;
+}
+
+/**
+ * Builds a menu that resembles the ones found on real servers, with lots of
+ * information lines, varying lengths, and the odd LF line ending.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param lines Number of lines in the menu.
+ * @param len   Pointer to store the length of the menu.
+ *
+ * @return Newly allocated menu contents.
+ */
+char *bench_menu_realistic(size_t lines, size_t *len) {
+	char *menu;
+	char *p;
+	size_t i;
+	int n;
+
+	menu = (char *)malloc((lines + 1) * 160);
+	p = menu;
+	for (i = 0; i < lines; i++) {
+		n = (int)(i % (sizeof(types) / sizeof(types[0])));
+		if (types[n] == 'i') {
+			p += sprintf(p, "i%s\tfake\t(NULL)\t0", labels[n]);
+		} else {
+			p += sprintf(p, "%c%s\t/%c/archive/%lu/%s\tgopher.example.org\t70",
+				types[n], labels[n], types[n], (unsigned long)i,
+				(n == 6) ? "readme.txt" : "");
+		}
+		p += sprintf(p, (i % 97) ? "\r\n" : "\n");
+	}
+	p += sprintf(p, ".\r\n");
+	*len = p - menu;
+
+	return menu;
+}
+
+/**
+ * Reads an entire file into memory.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param path Path to the file.
+ * @param len  Pointer to store the length of the file.
+ *
+ * @return Newly allocated file contents or NULL if an error occurred.
+ */
+char *bench_file_slurp(const char *path, size_t *len) {
+	FILE *fh;
+	char *buf;
+	long size;
+
+	fh = fopen(path, "rb");
+	if (fh == NULL)
+		return NULL;
+	fseek(fh, 0, SEEK_END);
+	size = ftell(fh);
+	fseek(fh, 0, SEEK_SET);
+	buf = (char *)malloc(size + 1);
+	*len = fread(buf, 1, size, fh);
+	fclose(fh);
+
+	return buf;
+}
+
+/**
+ * Forks a pool of minimal Gopher server workers that answer every request on a
+ * loopback port with the same canned response.
+ *
+ * @param port    Pointer to store the port the server is listening on.
+ * @param resp    Response to be sent to every client.
+ * @param len     Length of the response.
+ * @param workers Number of worker processes accepting connections.
+ * @param pids    Array to store the PIDs of the workers.
+ *
+ * @return 0 if the server was started.
+ */
+int bench_server_start(uint16_t *port, const char *resp, size_t len,
+					   int workers, pid_t *pids) {
+	struct sockaddr_in sin;
+	socklen_t sin_len;
+	char sel[256];
+	int sockfd;
+	int qlen;
+	int fd;
+	int i;
+
+	/* Listen on a random loopback port. */
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+#ifdef TCP_FASTOPEN
+	/* Take requests carried in the SYN if the system allows it. */
+	qlen = 1024;
+	setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+#else
+	(void)qlen;
+#endif /* TCP_FASTOPEN */
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = 0;
+	sin_len = sizeof(sin);
+	if ((bind(sockfd, (struct sockaddr *)&sin, sin_len) != 0) ||
+			(listen(sockfd, 1024) != 0) ||
+			(getsockname(sockfd, (struct sockaddr *)&sin, &sin_len) != 0)) {
+		close(sockfd);
+		return -1;
+	}
+	*port = ntohs(sin.sin_port);
+
+	/* Fork off the workers. */
+	for (i = 0; i < workers; i++) {
+		pids[i] = fork();
+		if (pids[i] != 0)
+			continue;
+
+		/* Serve requests until we are killed. */
+		while ((fd = accept(sockfd, NULL, NULL)) >= 0) {
+			recv(fd, sel, sizeof(sel), 0);
+			send(fd, resp, len, 0);
+			close(fd);
+		}
+		_exit(0);
+	}
+	close(sockfd);
+
+	return 0;
+}
+
+/**
+ * Stops the workers of a benchmark server.
+ *
+ * @param pids    PIDs of the workers.
+ * @param workers Number of workers.
+ */
+void bench_server_stop(pid_t *pids, int workers) {
+	int i;
+
+	for (i = 0; i < workers; i++) {
+		kill(pids[i], SIGTERM);
+		waitpid(pids[i], NULL, 0);
+	}
+}
@@ -0,0 +1,26 @@
+/**
+ * bench.h
+ * Common helpers for the library benchmarks.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _BENCH_BENCH_H_
+#define _BENCH_BENCH_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+double bench_now(void);
+void bench_report(const char *name, size_t bytes, double secs);
+void bench_report_rate(const char *name, size_t count, const char *unit,
+					   double secs);
+char *bench_menu_synthetic(size_t lines, size_t *len);
+char *bench_menu_realistic(size_t lines, size_t *len);
+char *bench_file_slurp(const char *path, size_t *len);
+int bench_server_start(uint16_t *port, const char *resp, size_t len,
+					   int workers, pid_t *pids);
+void bench_server_stop(pid_t *pids, int workers);
+
+#endif /* _BENCH_BENCH_H_ */
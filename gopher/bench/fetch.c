@@ -0,0 +1,198 @@
+/**
+ * fetch.c
+ * Benchmarks mass downloads of small files through the blocking path and the
+ * multi request engine backends.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "gopher.h"
+
+/* Private definitions. */
+#define FETCH_FILES   5000
+#define FETCH_SIZE    4096
+#define FETCH_WORKERS 4
+#define FETCH_INFLIGHT 64
+typedef struct {
+	gopher_multi_t *multi;
+	gopher_file_t *files[FETCH_INFLIGHT];
+	size_t added;
+	size_t done;
+	size_t failed;
+} fetch_state_t;
+static void bench_blocking(void);
+static void bench_multi(const char *name, gopher_multi_backend_t backend);
+static int fetch_add(fetch_state_t *st, int slot);
+static void fetch_done(gopher_file_t *gf, int err, void *arg);
+
+/* Local server and download directory. */
+static uint16_t port;
+static char dir[64];
+
+/**
+ * Benchmark's main entry point.
+ *
+ * @return Return code.
+ */
+int main(void) {
+	pid_t pids[FETCH_WORKERS];
+	char *data;
+
+	/* Start up our local server. */
+	data = (char *)malloc(FETCH_SIZE);
+	memset(data, 'x', FETCH_SIZE);
+	if (bench_server_start(&port, data, FETCH_SIZE, FETCH_WORKERS, pids) != 0) {
+		perror("bench_server_start");
+		return 1;
+	}
+	strcpy(dir, "/tmp/fetch_bench.XXXXXX");
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	/* Run the benchmarks. */
+	printf("%d files of %d bytes\n", FETCH_FILES, FETCH_SIZE);
+	bench_blocking();
+	bench_multi("gopher_multi (select)", GOPHER_MULTI_SELECT);
+	bench_multi("gopher_multi (epoll)", GOPHER_MULTI_EPOLL);
+	bench_multi("gopher_multi (io_uring)", GOPHER_MULTI_URING);
+
+	/* Clean up. */
+	rmdir(dir);
+	bench_server_stop(pids, FETCH_WORKERS);
+	free(data);
+
+	return 0;
+}
+
+/**
+ * Benchmarks downloading the files one after the other with the blocking
+ * gopher_file_download path.
+ */
+static void bench_blocking(void) {
+	gopher_addr_t *addr;
+	gopher_file_t *gf;
+	char path[128];
+	double start;
+	size_t failed;
+	int i;
+
+	sprintf(path, "%s/blocking", dir);
+	failed = 0;
+	start = bench_now();
+	for (i = 0; i < FETCH_FILES; i++) {
+		addr = gopher_addr_new("127.0.0.1", port, "/file", GOPHER_TYPE_BINARY);
+		gf = gopher_file_new(addr, path, GOPHER_TYPE_BINARY);
+		if ((gopher_connect(addr) != 0) || (gopher_file_download(gf) != 0) ||
+				(gf->fsize != FETCH_SIZE)) {
+			failed++;
+		}
+		gopher_disconnect(addr);
+		gopher_file_free(gf);
+		gopher_addr_free(addr);
+	}
+	bench_report_rate("gopher_file_download", FETCH_FILES, "files",
+		bench_now() - start);
+	if (failed)
+		printf("  (%lu downloads failed)\n", (unsigned long)failed);
+	unlink(path);
+}
+
+/**
+ * Benchmarks downloading the files concurrently with the multi request engine,
+ * keeping a fixed number of downloads in flight.
+ *
+ * @param name    Name of the benchmark.
+ * @param backend Multi request engine backend to use.
+ */
+static void bench_multi(const char *name, gopher_multi_backend_t backend) {
+	fetch_state_t st;
+	char path[128];
+	double start;
+	int i;
+
+	/* Set up the engine. */
+	memset(&st, 0, sizeof(st));
+	st.multi = gopher_multi_new(backend);
+	if (gopher_multi_backend(st.multi) != backend) {
+		printf("  %-28s unavailable\n", name);
+		gopher_multi_free(st.multi);
+		return;
+	}
+
+	/* Keep the engine busy until everything was downloaded. */
+	start = bench_now();
+	for (i = 0; i < FETCH_INFLIGHT; i++)
+		fetch_add(&st, i);
+	gopher_multi_run(st.multi);
+	bench_report_rate(name, FETCH_FILES, "files", bench_now() - start);
+	if (st.failed)
+		printf("  (%lu downloads failed)\n", (unsigned long)st.failed);
+
+	/* Clean up. */
+	gopher_multi_free(st.multi);
+	for (i = 0; i < FETCH_INFLIGHT; i++) {
+		sprintf(path, "%s/%d", dir, i);
+		unlink(path);
+	}
+}
+
+/**
+ * Adds a new download to the engine in a slot if there's anything left to
+ * download.
+ *
+ * @param st   Benchmark state.
+ * @param slot Slot of the download.
+ *
+ * @return 0 if a download was added.
+ */
+static int fetch_add(fetch_state_t *st, int slot) {
+	gopher_addr_t *addr;
+	char path[128];
+
+	if (st->added == FETCH_FILES)
+		return -1;
+
+	sprintf(path, "%s/%d", dir, slot);
+	addr = gopher_addr_new("127.0.0.1", port, "/file", GOPHER_TYPE_BINARY);
+	st->files[slot] = gopher_file_new(addr, path, GOPHER_TYPE_BINARY);
+	st->added++;
+	if (gopher_multi_add_file(st->multi, st->files[slot], fetch_done, st) != 0) {
+		st->failed++;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Handles a finished download by starting another one in its slot.
+ *
+ * @param gf  Gopher file download object.
+ * @param err Error code of the download.
+ * @param arg Benchmark state.
+ */
+static void fetch_done(gopher_file_t *gf, int err, void *arg) {
+	fetch_state_t *st;
+	int slot;
+
+	/* Account for the download. */
+	st = (fetch_state_t *)arg;
+	st->done++;
+	if ((err != 0) || (gf->fsize != FETCH_SIZE))
+		st->failed++;
+
+	/* Free it and reuse its slot. */
+	for (slot = 0; st->files[slot] != gf; slot++) {
+	}
+	gopher_addr_free(gf->addr);
+	gopher_file_free(gf);
+	st->files[slot] = NULL;
+	fetch_add(st, slot);
+}
@@ -0,0 +1 @@
+../gopher.c
\ No newline at end of file
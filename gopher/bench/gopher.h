@@ -0,0 +1 @@
+../gopher.h
\ No newline at end of file
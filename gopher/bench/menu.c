@@ -0,0 +1,150 @@
+/**
+ * menu.c
+ * Benchmarks the menu parsers and delimiter scanners.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+#include "gopher.h"
+
+/* Private definitions. */
+#define MENU_LINES   200000
+#define TARGET_BYTES (256 * 1024 * 1024)
+static void bench_menu(const char *name, const char *buf, size_t len);
+static void bench_line_parser(const char *buf, size_t len, int iters);
+static void bench_buffer_parser(const char *buf, size_t len, int iters,
+								gopher_simd_t level);
+
+/**
+ * Benchmark's main entry point.
+ *
+ * @param argc Number of command line arguments.
+ * @param argv Optional menu files captured from real servers.
+ *
+ * @return Return code.
+ */
+int main(int argc, char **argv) {
+	size_t len;
+	char *buf;
+	int i;
+
+	/* Synthetic menus. */
+	buf = bench_menu_synthetic(MENU_LINES, &len);
+	bench_menu("synthetic", buf, len);
+	free(buf);
+	buf = bench_menu_realistic(MENU_LINES, &len);
+	bench_menu("realistic", buf, len);
+	free(buf);
+
+	/* Menus captured from real servers. */
+	for (i = 1; i < argc; i++) {
+		buf = bench_file_slurp(argv[i], &len);
+		if (buf == NULL) {
+			perror(argv[i]);
+			continue;
+		}
+		bench_menu(argv[i], buf, len);
+		free(buf);
+	}
+
+	return 0;
+}
+
+/**
+ * Runs all of the parser benchmarks on a menu.
+ *
+ * @param name Name of the menu.
+ * @param buf  Menu contents.
+ * @param len  Length of the menu.
+ */
+static void bench_menu(const char *name, const char *buf, size_t len) {
+	int iters;
+
+	/* Process roughly the same amount of data for every menu. */
+	iters = (int)(TARGET_BYTES / len);
+	if (iters < 1)
+		iters = 1;
+	printf("%s: %lu bytes x %d\n", name, (unsigned long)len, iters);
+
+	bench_line_parser(buf, len, (iters / 8) + 1);
+	bench_buffer_parser(buf, len, iters, GOPHER_SIMD_SCALAR);
+	bench_buffer_parser(buf, len, iters, GOPHER_SIMD_SSE2);
+	bench_buffer_parser(buf, len, iters, GOPHER_SIMD_AVX2);
+}
+
+/**
+ * Benchmarks parsing a menu line by line into item objects, just like a
+ * directory request does.
+ *
+ * @param buf   Menu contents.
+ * @param len   Length of the menu.
+ * @param iters Number of times to parse the menu.
+ */
+static void bench_line_parser(const char *buf, size_t len, int iters) {
+	gopher_item_t *item;
+	const char *p;
+	const char *eol;
+	char line[1024];
+	double start;
+	int i;
+
+	start = bench_now();
+	for (i = 0; i < iters; i++) {
+		for (p = buf; p < (buf + len); p = eol + 1) {
+			size_t n;
+
+			eol = (const char *)memchr(p, '\n', (buf + len) - p);
+			if (eol == NULL)
+				eol = buf + len - 1;
+			n = eol - p + 1;
+			if (n >= sizeof(line))
+				continue;
+			memcpy(line, p, n);
+			line[n] = '\0';
+			if (gopher_is_termline(line) || (line[0] == '\r'))
+				continue;
+
+			if (gopher_item_parse(&item, line) == 0)
+				gopher_item_free(item, RECURSE_NONE);
+		}
+	}
+	bench_report("gopher_item_parse", len * iters, bench_now() - start);
+}
+
+/**
+ * Benchmarks parsing an entire menu buffer with a specific delimiter scanner.
+ *
+ * @param buf   Menu contents.
+ * @param len   Length of the menu.
+ * @param iters Number of times to parse the menu.
+ * @param level Instruction set to use for scanning.
+ */
+static void bench_buffer_parser(const char *buf, size_t len, int iters,
+								gopher_simd_t level) {
+	static const char *names[] = {
+		"gopher_menu_parse (auto)", "gopher_menu_parse (scalar)",
+		"gopher_menu_parse (SSE2)", "gopher_menu_parse (AVX2)"
+	};
+	gopher_menu_t *menu;
+	gopher_simd_t used;
+	double start;
+	int i;
+
+	/* Check if the CPU supports the instruction set. */
+	used = gopher_simd_select(level);
+	if (used != level) {
+		printf("  %-28s not supported\n", names[level]);
+		return;
+	}
+
+	start = bench_now();
+	for (i = 0; i < iters; i++) {
+		gopher_menu_parse(buf, len, &menu);
+		gopher_menu_free(menu);
+	}
+	bench_report(names[level], len * iters, bench_now() - start);
+}
@@ -0,0 +1,151 @@
+/**
+ * sock.c
+ * Benchmarks the socket tuning profiles against menu fetches and large
+ * downloads from a local server.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "gopher.h"
+
+/* Private definitions. */
+#define SOCK_MENUS      5000
+#define SOCK_MENU_LINES 40
+#define SOCK_FILES      16
+#define SOCK_FILE_SIZE  (32 * 1024 * 1024)
+#define SOCK_WORKERS    2
+static void bench_menus(const char *name, gopher_sockprof_t profile);
+static void bench_files(const char *name, gopher_sockprof_t profile,
+						int flags);
+
+/* Local servers and download path. */
+static uint16_t menu_port;
+static uint16_t file_port;
+static char path[64];
+
+/**
+ * Benchmark's main entry point.
+ *
+ * @return Return code.
+ */
+int main(void) {
+	pid_t menu_pids[SOCK_WORKERS];
+	pid_t file_pids[SOCK_WORKERS];
+	size_t len;
+	char *menu;
+	char *data;
+
+	/* Start up our local servers. */
+	menu = bench_menu_realistic(SOCK_MENU_LINES, &len);
+	data = (char *)malloc(SOCK_FILE_SIZE);
+	memset(data, 'x', SOCK_FILE_SIZE);
+	if ((bench_server_start(&menu_port, menu, len, SOCK_WORKERS,
+			menu_pids) != 0) ||
+			(bench_server_start(&file_port, data, SOCK_FILE_SIZE, SOCK_WORKERS,
+			file_pids) != 0)) {
+		perror("bench_server_start");
+		return 1;
+	}
+	sprintf(path, "/tmp/sock_bench.%d", (int)getpid());
+
+	/* Run the benchmarks. */
+	printf("%d menus of %d lines\n", SOCK_MENUS, SOCK_MENU_LINES);
+	bench_menus("default profile", GOPHER_SOCKPROF_DEFAULT);
+	bench_menus("latency profile", GOPHER_SOCKPROF_LATENCY);
+	printf("%d files of %d bytes\n", SOCK_FILES, SOCK_FILE_SIZE);
+	bench_files("default profile", GOPHER_SOCKPROF_DEFAULT, GOPHER_FLAG_NONE);
+	bench_files("bulk profile", GOPHER_SOCKPROF_BULK, GOPHER_FLAG_NONE);
+	bench_files("bulk profile, pipelined", GOPHER_SOCKPROF_BULK,
+		GOPHER_FLAG_PIPELINE);
+	bench_files("bulk profile, mmap", GOPHER_SOCKPROF_BULK, GOPHER_FLAG_MMAP);
+
+	/* Clean up. */
+	bench_server_stop(menu_pids, SOCK_WORKERS);
+	bench_server_stop(file_pids, SOCK_WORKERS);
+	free(menu);
+	free(data);
+
+	return 0;
+}
+
+/**
+ * Benchmarks fetching menus one after the other, where the round trips of
+ * setting up each connection dominate.
+ *
+ * @param name    Name of the benchmark.
+ * @param profile Socket tuning profile to connect with.
+ */
+static void bench_menus(const char *name, gopher_sockprof_t profile) {
+	gopher_addr_t *addr;
+	gopher_dir_t *dir;
+	double start;
+	size_t failed;
+	int i;
+
+	failed = 0;
+	start = bench_now();
+	for (i = 0; i < SOCK_MENUS; i++) {
+		addr = gopher_addr_new("127.0.0.1", menu_port, "/", GOPHER_TYPE_DIR);
+		addr->flags = GOPHER_FLAG_FASTTERM | GOPHER_FLAG_ARENA;
+		addr->profile = profile;
+		dir = NULL;
+		if ((gopher_connect(addr) != 0) ||
+				(gopher_dir_request(addr, &dir) != 0) ||
+				(dir->items_len != SOCK_MENU_LINES)) {
+			failed++;
+		}
+		gopher_disconnect(addr);
+		if (dir) {
+			gopher_dir_free(dir, RECURSE_NONE, 1);
+		} else {
+			gopher_addr_free(addr);
+		}
+	}
+	bench_report_rate(name, SOCK_MENUS, "menus", bench_now() - start);
+	if (failed)
+		printf("  (%lu fetches failed)\n", (unsigned long)failed);
+}
+
+/**
+ * Benchmarks downloading large binary files one after the other, where the
+ * receive path dominates.
+ *
+ * @param name    Name of the benchmark.
+ * @param profile Socket tuning profile to connect with.
+ * @param flags   Connection flags to use.
+ */
+static void bench_files(const char *name, gopher_sockprof_t profile,
+						int flags) {
+	gopher_addr_t *addr;
+	gopher_file_t *gf;
+	double start;
+	size_t failed;
+	int i;
+
+	failed = 0;
+	start = bench_now();
+	for (i = 0; i < SOCK_FILES; i++) {
+		addr = gopher_addr_new("127.0.0.1", file_port, "/file",
+			GOPHER_TYPE_BINARY);
+		addr->flags = flags;
+		addr->profile = profile;
+		gf = gopher_file_new(addr, path, GOPHER_TYPE_BINARY);
+		if ((gopher_connect(addr) != 0) || (gopher_file_download(gf) != 0) ||
+				(gf->fsize != SOCK_FILE_SIZE)) {
+			failed++;
+		}
+		gopher_disconnect(addr);
+		gopher_file_free(gf);
+		gopher_addr_free(addr);
+	}
+	bench_report(name, (size_t)SOCK_FILES * SOCK_FILE_SIZE,
+		bench_now() - start);
+	if (failed)
+		printf("  (%lu downloads failed)\n", (unsigned long)failed);
+	unlink(path);
+}
@@ -6,4 +6,4 @@ RM  = rm -f
 # Flags
 CFLAGS  = -Wall --std=gnu89
 LDFLAGS =
-LIBS    =
+LIBS    = -lpthread
@@ -18,6 +18,9 @@
 #else
 	#include <unistd.h>
 	#include <libgen.h>
+	#include <pthread.h>
+	#include <time.h>
+	#include <limits.h>
 #endif /* _WIN32 */
 
 /* Networking includes. */
@@ -27,11 +30,55 @@
 	#include <windows.h>
 #else
 	#include <sys/socket.h>
+	#include <sys/select.h>
 	#include <arpa/inet.h>
 	#include <netinet/in.h>
+	#include <netinet/tcp.h>
 	#include <netdb.h>
+	#include <fcntl.h>
+	#include <poll.h>
+	#include <sys/uio.h>
 #endif /* _WIN32 */
 
+/* Readiness notification mechanisms for the multi request engine. */
+#ifdef __linux__
+	#define GOPHER_HAS_EPOLL
+	#include <sys/epoll.h>
+#endif /* __linux__ */
+#if defined(__linux__) && !defined(GOPHER_NO_URING)
+	/* Define GOPHER_NO_URING if the kernel headers predate Linux 5.7. */
+	#define GOPHER_HAS_URING
+	#include <linux/io_uring.h>
+	#include <sys/mman.h>
+	#include <sys/syscall.h>
+#endif /* __linux__ && !GOPHER_NO_URING */
+
+/* Zero-copy transfers from sockets to files. */
+#if defined(__linux__) && !defined(GOPHER_NO_SPLICE)
+	#define GOPHER_HAS_SPLICE
+	#include <sys/syscall.h>
+	#ifndef SPLICE_F_MOVE
+		#define SPLICE_F_MOVE 0x01
+	#endif /* !SPLICE_F_MOVE */
+	#ifndef F_SETPIPE_SZ
+		#define F_SETPIPE_SZ 1031
+		#define F_GETPIPE_SZ 1032
+	#endif /* !F_SETPIPE_SZ */
+#endif /* __linux__ && !GOPHER_NO_SPLICE */
+
+/* Preallocated and memory-mapped download files. */
+#if !defined(_WIN32) && !defined(GOPHER_NO_MMAP)
+	#define GOPHER_HAS_MMAP
+	#include <sys/mman.h>
+#endif /* !_WIN32 && !GOPHER_NO_MMAP */
+
+/* SIMD intrinsics for the delimiter scanner. */
+#if (defined(__GNUC__) || defined(__clang__)) && \
+		(defined(__x86_64__) || defined(__i386__))
+	#define GOPHER_SIMD_X86
+	#include <immintrin.h>
+#endif /* (__GNUC__ || __clang__) && (__x86_64__ || __i386__) */
+
 /* Cross-platform socket function return error code. */
 #ifndef SOCKET_ERROR
 	#define SOCKET_ERROR (-1)
@@ -53,6 +100,42 @@
 	#define sockerrno errno
 #endif /* _WIN32 */
 
+/* Cross-platform shim for closing a socket. */
+#ifdef _WIN32
+	#define sockclose(fd) closesocket(fd)
+#else
+	#define sockclose(fd) close(fd)
+#endif /* _WIN32 */
+
+/* Cross-platform shim for scatter-gather socket buffers. */
+#ifdef _WIN32
+	typedef WSABUF sockiov_t;
+	#define sockiov_set(iov, b, l) \
+		((iov).buf = (CHAR *)(b), (iov).len = (ULONG)(l))
+	#define sockiov_base(iov) ((iov).buf)
+	#define sockiov_len(iov)  ((size_t)(iov).len)
+#else
+	typedef struct iovec sockiov_t;
+	#define sockiov_set(iov, b, l) \
+		((iov).iov_base = (void *)(b), (iov).iov_len = (l))
+	#define sockiov_base(iov) ((iov).iov_base)
+	#define sockiov_len(iov)  ((iov).iov_len)
+#endif /* _WIN32 */
+
+/* Cross-platform shim for non-blocking socket operation error codes. */
+#ifdef _WIN32
+	#define SOCK_INPROGRESS(err) ((err) == WSAEWOULDBLOCK)
+	#define SOCK_WOULDBLOCK(err) ((err) == WSAEWOULDBLOCK)
+#else
+	#define SOCK_INPROGRESS(err) ((err) == EINPROGRESS)
+	#define SOCK_WOULDBLOCK(err) (((err) == EAGAIN) || ((err) == EWOULDBLOCK))
+#endif /* _WIN32 */
+
+/* Ensure we have an error code for cancelled operations. */
+#ifndef ECANCELED
+	#define ECANCELED EINTR
+#endif /* !ECANCELED */
+
 /* Ensure we have ssize_t. */
 #ifndef ssize_t
 	#ifdef _WIN32
@@ -74,11 +157,441 @@
 #define FORMAT_MESSAGE_LANG MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT)
 #endif /* _WIN32 */
 
-/* Gopher line receive buffer size. */
-#define RECV_LINE_BUF 200
+/* Gopher connection receive buffer size. */
+#define RECV_CONN_BUF 16384
+
+/* Maximum number of TAB separated fields in a request line. */
+#define REQ_MAX_FIELDS 8
+
+/* Initial size of the line buffer handed out by the connection reader. */
+#define RECV_LINE_BUF 256
+
+/* Size of the chunks allocated by memory arenas. */
+#define ARENA_CHUNK_SIZE 65536
+
+/* Alignment of objects allocated from memory arenas. */
+#define ARENA_ALIGN (sizeof(void *) * 2)
+
+/* Size of the memory arena chunk header, padded to keep the data aligned. */
+#define ARENA_HEADER_SIZE \
+	((sizeof(gopher_arena_t) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+/* Initial number of items allocated for a parsed menu. */
+#define MENU_ITEMS_INIT 64
 
 /* Gopher file download buffer size. */
-#define RECV_FILE_BUF 1024
+#define RECV_FILE_BUF 16384
+
+/* Size of the pipe used to splice downloads from the socket to the file. */
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+
+/* Size of the window of a memory-mapped download file that's written to. */
+#define MMAP_WINDOW (4 * 1024 * 1024)
+
+/* Size of the extents a memory-mapped download file grows by. */
+#define MMAP_EXTENT (32 * 1024 * 1024)
+
+/* Size of the chunks that files downloaded to memory are kept in. */
+#define MEM_CHUNK_SIZE (32 * 1024)
+
+/* Number of buffers going around in a pipelined download. */
+#define PIPELINE_BUFS 4
+
+/* Initial and maximum sizes of the buffers of a pipelined download. */
+#define PIPELINE_BUF_MIN (64 * 1024)
+#define PIPELINE_BUF_MAX (1024 * 1024)
+
+/* Number of bytes scanned for delimiters at once. */
+#define DELIM_BLOCK 64
+
+/* Maximum number of readiness events handled per multi engine wait. */
+#define MULTI_EVENTS 64
+
+/* Number of submission queue entries in the multi engine io_uring. */
+#define URING_ENTRIES 256
+
+/* Default number of milliseconds name resolutions are cached for. */
+#define DNS_CACHE_TTL 60000
+
+/* Default number of milliseconds failed name resolutions are cached for. */
+#define DNS_NEGATIVE_TTL 5000
+
+/* Maximum number of hosts kept in the name resolution cache. */
+#define DNS_CACHE_MAX 256
+
+/* Largest response in bytes the response cache keeps by default. */
+#define CACHE_MAX_ENTRY (64 * 1024)
+
+/* Default number of milliseconds responses are served from the cache for. */
+#define CACHE_TTL 300000
+
+/* Maximum number of addresses to race when connecting to a server. */
+#define HE_MAX_ATTEMPTS 8
+
+/* Delay between connection attempts to different addresses in milliseconds. */
+#define HE_ATTEMPT_DELAY 250
+
+/* Default number of threads in a name resolver pool. */
+#define RESOLVER_THREADS 4
+
+/* Interval in milliseconds to check for finished name resolutions on systems
+ * where the resolver can't wake up the multi request engine. */
+#define RESOLVER_POLL_INTERVAL 10
+
+/* Maximum number of idle connections kept warm for a single server. */
+#define POOL_MAX_PER_HOST 8
+
+/* Maximum number of servers kept warm at once. */
+#define POOL_MAX_HOSTS 16
+
+/* Default number of milliseconds an idle warm connection is trusted for. */
+#define POOL_MAX_IDLE 10000
+
+/* Default number of milliseconds a server is kept warm after its last use. */
+#define POOL_HOST_TTL 60000
+
+/* Connection deadline in milliseconds for warming up a connection. */
+#define POOL_CONNECT_TIMEOUT 5000
+
+/* Delay in milliseconds before retrying to warm up a server that failed. */
+#define POOL_RETRY_DELAY 1000
+
+/* Maximum interval in milliseconds between sweeps of stale connections. */
+#define POOL_SWEEP_INTERVAL 1000
+
+/* Number of milliseconds worth of transfer a bandwidth cap lets through in a
+ * single burst. */
+#define RATE_BURST_MS 250
+
+/* Minimum size in bytes of the burst let through by a bandwidth cap. */
+#define RATE_MIN_BURST 1024
+
+/* Number of bytes a capped transfer waits to be allowed to receive at once,
+ * keeping its pace smooth without waking up for every few bytes. */
+#define RATE_MIN_READ (16 * 1024)
+
+/* Maximum number of milliseconds to hold back a transfer before checking if
+ * its bandwidth caps have changed. */
+#define RATE_MAX_SLEEP 100
+
+/* Maximum number of milliseconds to wait before checking if an operation was
+ * cancelled, where there's no wakeup pipe to wait on. */
+#define CANCEL_POLL_SLICE 50
+
+/* Receive buffer size in bytes asked for by the bulk socket profile. */
+#define SOCKPROF_RCVBUF (1024 * 1024)
+
+/* Minimum number of bytes to wake up a reader in the bulk socket profile. */
+#define SOCKPROF_RCVLOWAT (16 * 1024)
+
+/* Delimiter tokenizer state. */
+typedef struct {
+	const char *buf;
+	size_t len;
+	size_t base;
+	uint64_t mask;
+} gopher_tok_t;
+
+/* Directory being built from parsed menu items. */
+typedef struct {
+	gopher_dir_t *dir;
+	gopher_item_t *last;
+	int err;
+} gopher_dir_builder_t;
+
+/* Streaming directory request state. */
+typedef struct {
+	gopher_dir_item_func item_cb;
+	void *item_cb_arg;
+	int err;
+} gopher_dir_streamer_t;
+
+/* Cross-platform mutex. */
+#ifdef _WIN32
+typedef CRITICAL_SECTION gopher_mutex_t;
+#else
+typedef pthread_mutex_t gopher_mutex_t;
+#endif /* _WIN32 */
+
+/* Mutex guarding global state, usable without explicit initialization. */
+typedef struct {
+#ifdef _WIN32
+	volatile LONG users;
+	volatile LONG ready;
+#endif /* _WIN32 */
+	gopher_mutex_t mutex;
+} gopher_global_lock_t;
+#ifdef _WIN32
+	#define GOPHER_GLOBAL_LOCK_INIT { 0, 0 }
+#else
+	#define GOPHER_GLOBAL_LOCK_INIT { PTHREAD_MUTEX_INITIALIZER }
+#endif /* _WIN32 */
+
+/* Cross-platform event that can be waited on with a timeout. */
+typedef struct {
+#ifdef _WIN32
+	HANDLE handle;
+#else
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int set;
+#endif /* _WIN32 */
+} gopher_event_t;
+
+/* Cross-platform thread entry point. */
+typedef void (*gopher_thread_func)(void *arg);
+typedef struct {
+	gopher_thread_func func;
+	void *arg;
+} gopher_thread_t;
+
+/* Name resolution job that may outlive its requester. */
+typedef struct {
+	char *host;
+	uint16_t port;
+	struct addrinfo *ai;
+	int ret;
+
+	gopher_event_t done;
+	gopher_mutex_t lock;
+	int refs;
+} gopher_dns_job_t;
+
+/* Cached answer to a name resolution. */
+typedef struct gopher_dns_entry_s {
+	char *host;
+	uint16_t port;
+	struct addrinfo *ai;
+	int err;
+	unsigned long expires;
+
+	struct gopher_dns_entry_s *next;
+} gopher_dns_entry_t;
+
+/* Host pinned to a specific IP address. */
+typedef struct gopher_dns_pin_s {
+	char *host;
+	char *ip;
+
+	struct gopher_dns_pin_s *next;
+} gopher_dns_pin_t;
+
+/* Request waiting on an asynchronous name resolution. */
+typedef struct gopher_resolver_req_s {
+	gopher_addr_t *addr;
+	gopher_resolver_func func;
+	void *arg;
+
+	struct gopher_resolver_req_s *next;
+} gopher_resolver_req_t;
+
+/* Asynchronous name resolution shared by every request for the same host. */
+typedef struct gopher_resolver_job_s {
+	char *host;
+	uint16_t port;
+	unsigned long timeout;
+	struct addrinfo *query;
+	int err;
+
+	gopher_resolver_req_t *reqs;
+	gopher_resolver_req_t **reqs_tail;
+	struct gopher_resolver_job_s *next;
+} gopher_resolver_job_t;
+
+/* Pool of threads resolving names in the background. */
+struct gopher_resolver_s {
+	gopher_mutex_t lock;
+	gopher_event_t work;
+	int notify[2];
+
+	gopher_resolver_job_t *queued;
+	gopher_resolver_job_t **queued_tail;
+	gopher_resolver_job_t *active;
+	gopher_resolver_job_t *done;
+	gopher_resolver_job_t **done_tail;
+
+	size_t pending;
+	int refs;
+	int closing;
+};
+
+/* Idle connection kept warm in the pool. */
+typedef struct {
+	int sockfd;
+	struct sockaddr *ipaddr;
+	socklen_t ipaddr_len;
+	unsigned long since;
+} gopher_pool_conn_t;
+
+/* Server whose connections are kept warm. */
+typedef struct gopher_pool_host_s {
+	char *host;
+	uint16_t port;
+	gopher_sockprof_t profile;
+	gopher_pool_conn_t conns[POOL_MAX_PER_HOST];
+	size_t count;
+	size_t opening;
+	unsigned long used;
+	unsigned long retry_at;
+
+	struct gopher_pool_host_s *next;
+} gopher_pool_host_t;
+
+/* Cancellation token. The pipe wakes up anyone waiting on a socket. */
+struct gopher_cancel_s {
+	gopher_mutex_t lock;
+	int triggered;
+#ifndef _WIN32
+	int fds[2];
+#endif /* !_WIN32 */
+};
+
+/* Directory fetch shared by everyone who asked for it at the same time. */
+typedef struct gopher_flight_s {
+	char *key;
+	gopher_dir_t *dir;
+	gopher_event_t landed;
+	int done;
+	int err;
+	size_t refs;
+
+	struct gopher_flight_s *next;
+} gopher_flight_t;
+
+/* Response cache entry, either a shared directory or a copy of a document. */
+typedef struct gopher_cache_entry_s {
+	char *key;
+	gopher_flight_t *flight;
+	char *text;
+	size_t len;
+	size_t bytes;
+
+	unsigned long stored_at;
+	unsigned long ttl;
+	unsigned long stale;
+	int refreshing;
+
+	struct gopher_cache_entry_s *prev;
+	struct gopher_cache_entry_s *next;
+} gopher_cache_entry_t;
+
+/* Background revalidation of a stale response cache entry. */
+typedef struct {
+	gopher_addr_t *addr;
+	char *key;
+} gopher_cache_refresh_t;
+
+/* Fixed-size chunk of a file downloaded to memory. */
+struct gopher_file_chunk_s {
+	char *data;
+	size_t len;
+	size_t size;
+
+	struct gopher_file_chunk_s *next;
+};
+
+/* Chunk of a pipelined download. */
+typedef struct gopher_pipeline_buf_s {
+	char *data;
+	size_t len;
+	size_t size;
+
+	struct gopher_pipeline_buf_s *next;
+} gopher_pipeline_buf_t;
+
+/* Pipelined download shared between the network and the writer threads. */
+typedef struct {
+	FILE *fh;
+	gopher_pipeline_buf_t bufs[PIPELINE_BUFS];
+
+	gopher_mutex_t lock;
+	gopher_event_t filled;
+	gopher_event_t drained;
+	gopher_event_t done;
+
+	gopher_pipeline_buf_t *queue;
+	gopher_pipeline_buf_t **queue_tail;
+	gopher_pipeline_buf_t *free;
+
+	int finished;
+	int err;
+	int refs;
+} gopher_pipeline_t;
+
+/* Multi request engine transfer states. */
+typedef enum {
+	XFER_RESOLVING = 0,
+	XFER_CONNECTING,
+	XFER_SENDING,
+	XFER_RECEIVING,
+	XFER_WRITING
+} gopher_xfer_state_t;
+
+#ifdef GOPHER_HAS_URING
+/* Minimal io_uring instance set up with raw system calls. */
+typedef struct {
+	int fd;
+	unsigned int pending;
+	unsigned int inflight;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int sq_entries;
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+} gopher_uring_t;
+#endif /* GOPHER_HAS_URING */
+
+/* Multi request engine transfer. */
+typedef struct gopher_xfer_s {
+	gopher_multi_t *multi;
+	gopher_addr_t *addr;
+	gopher_xfer_state_t state;
+
+	char *req;
+	size_t req_len;
+	size_t req_sent;
+
+	gopher_menu_parser_t *mp;
+	gopher_dir_builder_t db;
+	gopher_multi_dir_func dir_cb;
+
+	gopher_file_t *gf;
+	FILE *fh;
+	gopher_multi_file_func file_cb;
+
+	void *cb_arg;
+	int busy;
+	struct gopher_xfer_s *prev;
+	struct gopher_xfer_s *next;
+} gopher_xfer_t;
+
+/* Multi request engine. */
+struct gopher_multi_s {
+	gopher_multi_backend_t backend;
+	int epfd;
+#ifdef GOPHER_HAS_URING
+	gopher_uring_t *ring;
+#endif /* GOPHER_HAS_URING */
+	gopher_resolver_t *resolver;
+	int resolver_armed;
+
+	gopher_xfer_t *xfers;
+	size_t running;
+	size_t resolving;
+	int closing;
+};
 
 /* Log levels. */
 typedef enum {
@@ -105,9 +618,198 @@ const char *strdupsep(char **buf, const char *str, char sep);
 
 /* Private methods. */
 int sockaddrstr(char **buf, const struct sockaddr *sock_addr);
-int gopher_getaddrinfo(const gopher_addr_t *addr, struct addrinfo **ai);
+int gopher_getaddrinfo(const char *host, uint16_t port, int flags,
+					   struct addrinfo **ai);
+int gopher_getaddrinfo_timed(const char *host, uint16_t port,
+							 unsigned long timeout,
+							 const gopher_cancel_t *cancel,
+							 struct addrinfo **ai);
+void gopher_dns_job_run(void *arg);
+void gopher_dns_job_release(gopher_dns_job_t *job);
+int gopher_connect_race(gopher_addr_t *addr, struct addrinfo **cands,
+						size_t count);
+int gopher_connect_start(const struct addrinfo *ai, gopher_sockprof_t profile,
+						 int tfo, int *err);
+size_t gopher_he_order(struct addrinfo *query, struct addrinfo **cands,
+					   size_t max);
+int gopher_lookup(const char *host, uint16_t port, unsigned long timeout,
+				  const gopher_cancel_t *cancel, int nowait,
+				  struct addrinfo **query);
+int gopher_addr_setip(gopher_addr_t *addr, const struct addrinfo *ai);
+int gopher_dns_cache_find(const char *host, uint16_t port,
+						  struct addrinfo **query, char **pinned, int *err);
+void gopher_dns_cache_store(const char *host, uint16_t port,
+							const struct addrinfo *ai, int err);
+void gopher_dns_cache_purge(int all);
+int gopher_dns_negative(int err);
+void gopher_dns_entry_free(gopher_dns_entry_t *entry);
+struct addrinfo *gopher_addrinfo_dup(const struct addrinfo *ai);
+void gopher_addrinfo_free(struct addrinfo *ai);
+void gopher_resolver_work(void *arg);
+gopher_resolver_job_t *gopher_resolver_find(gopher_resolver_job_t *jobs,
+											const char *host, uint16_t port);
+void gopher_resolver_job_free(gopher_resolver_job_t *job);
+void gopher_resolver_release(gopher_resolver_t *res);
+int gopher_pool_take(gopher_addr_t *addr);
+void gopher_pool_work(void *arg);
+int gopher_pool_kick(void);
+gopher_pool_host_t *gopher_pool_find(const char *host, uint16_t port,
+									 gopher_sockprof_t profile, int add);
+void gopher_pool_sweep(int all);
+int gopher_pool_alive(const gopher_pool_conn_t *conn, unsigned long now);
+void gopher_pool_conn_close(gopher_pool_conn_t *conn);
+void gopher_pool_host_free(gopher_pool_host_t *ph);
+int gopher_rate_wait(gopher_addr_t *addr, size_t *len);
+void gopher_rate_charge(gopher_addr_t *addr, size_t len);
+unsigned long gopher_rate_burst(unsigned long rate);
+void gopher_rate_refill(double *tokens, unsigned long *at, unsigned long rate,
+						unsigned long burst, unsigned long now);
+int gopher_send_iov(const gopher_addr_t *addr, sockiov_t *iov, size_t count,
+					size_t *sent_len);
+int gopher_dir_fetch_in(const gopher_addr_t *addr, gopher_dir_t **dir,
+						int lookup);
+char *gopher_fetch_key(const gopher_addr_t *addr, gopher_type_t type);
+gopher_addr_t *gopher_fetch_addr(const gopher_addr_t *addr,
+								 gopher_type_t type);
+gopher_flight_t *gopher_flight_new(char *key);
+int gopher_flight_wait(gopher_flight_t *flight, gopher_cancel_t *cancel);
+int gopher_flight_fetch(const gopher_addr_t *addr, gopher_dir_t **dir);
+void gopher_flight_release(gopher_flight_t *flight);
+int gopher_text_fetch_in(const gopher_addr_t *addr, char **text, size_t *len,
+						 int lookup);
+int gopher_cache_get(const gopher_addr_t *addr, const char *key,
+					 gopher_flight_t **flight, char **text, size_t *len);
+void gopher_cache_put(const gopher_addr_t *addr, const char *key,
+					  gopher_flight_t *flight, const char *text, size_t len);
+void gopher_cache_revalidate(const gopher_addr_t *addr, const char *key,
+							 gopher_type_t type);
+void gopher_cache_refresh(void *arg);
+void gopher_cache_unmark(const char *key);
+void gopher_cache_trim(size_t max_bytes);
+void gopher_cache_unlink(gopher_cache_entry_t *entry);
+void gopher_cache_entry_free(gopher_cache_entry_t *entry);
+size_t gopher_cache_dir_size(const gopher_dir_t *dir);
+int gopher_timeouts_active(const gopher_addr_t *addr);
+long gopher_deadline(const gopher_addr_t *addr, unsigned long phase,
+					 unsigned long since, int phase_err, int *err);
+int gopher_recv_wait(gopher_addr_t *addr);
+int gopher_socket_wait(gopher_addr_t *addr, int write, long timeout);
+int gopher_socket_poll(const int *fds, int *ready, size_t count, int write,
+					   long timeout, const gopher_cancel_t *cancel);
+unsigned long gopher_clock_ms(void);
+void gopher_sleep_ms(unsigned long ms);
+void gopher_mutex_init(gopher_mutex_t *mutex);
+void gopher_mutex_lock(gopher_mutex_t *mutex);
+void gopher_mutex_unlock(gopher_mutex_t *mutex);
+void gopher_mutex_destroy(gopher_mutex_t *mutex);
+void gopher_global_lock(gopher_global_lock_t *lock);
+void gopher_global_unlock(gopher_global_lock_t *lock);
+int gopher_event_init(gopher_event_t *ev);
+void gopher_event_set(gopher_event_t *ev);
+void gopher_event_reset(gopher_event_t *ev);
+int gopher_event_wait(gopher_event_t *ev, long timeout);
+void gopher_event_destroy(gopher_event_t *ev);
+int gopher_thread_spawn(gopher_thread_func func, void *arg);
+gopher_addr_t *gopher_addr_new_in(gopher_arena_t **arena, const char *host,
+								  size_t host_len, uint16_t port,
+								  const char *selector, size_t selector_len,
+								  gopher_type_t type);
 gopher_item_t *gopher_item_new(const char *label, gopher_addr_t *addr);
+gopher_item_t *gopher_item_new_in(gopher_arena_t **arena, const char *label,
+								  size_t label_len, gopher_addr_t *addr);
+int gopher_item_parse_in(gopher_arena_t **arena, gopher_item_t **item,
+						 const char *line);
+const char *gopher_line_split(gopher_tok_t *tok, const char *line,
+							  gopher_strview_t *fields, int *nfields);
+uint16_t gopher_port_parse(const gopher_strview_t *port);
+gopher_item_t *gopher_item_from_view(gopher_arena_t **arena,
+									 const gopher_item_view_t *view);
+int gopher_dir_parse(gopher_addr_t *addr, gopher_menu_item_func func,
+					 void *arg, uint16_t *err_count);
+int gopher_dir_receive(gopher_addr_t *addr, gopher_dir_t **dir);
+int gopher_file_receive(gopher_file_t *gf);
+void gopher_file_progress_start(gopher_file_t *gf);
+void gopher_file_report(gopher_file_t *gf, int finished);
+int gopher_file_recv_mem(gopher_file_t *gf);
+int gopher_file_mem_append(gopher_file_t *gf, const char *buf, size_t len);
+gopher_file_chunk_t *gopher_file_mem_tail(gopher_file_t *gf);
+gopher_file_chunk_t *gopher_file_chunk_new(size_t size);
+int gopher_file_pipeline(gopher_file_t *gf, FILE *fh);
+gopher_pipeline_t *gopher_pipeline_new(FILE *fh);
+gopher_pipeline_buf_t *gopher_pipeline_take(gopher_pipeline_t *pl, size_t want,
+											int *err);
+void gopher_pipeline_push(gopher_pipeline_t *pl, gopher_pipeline_buf_t *pb);
+int gopher_pipeline_finish(gopher_pipeline_t *pl);
+void gopher_pipeline_work(void *arg);
+void gopher_pipeline_release(gopher_pipeline_t *pl);
+#ifdef GOPHER_HAS_MMAP
+int gopher_file_mmap(gopher_file_t *gf, int fd);
+int gopher_file_extend(int fd, size_t *alloc, size_t len);
+#endif /* GOPHER_HAS_MMAP */
+#ifdef GOPHER_HAS_SPLICE
+int gopher_file_splice(gopher_file_t *gf, int fd);
+int gopher_file_write(int fd, const char *buf, size_t len);
+#endif /* GOPHER_HAS_SPLICE */
+int gopher_dir_push(const gopher_item_view_t *view, void *arg);
+int gopher_dir_stream(const gopher_item_view_t *view, void *arg);
+int gopher_menu_push(const gopher_item_view_t *view, void *arg);
+void gopher_menu_parser_init(gopher_menu_parser_t *mp,
+							 gopher_menu_item_func func, void *arg);
+int gopher_menu_parser_keep(gopher_menu_parser_t *mp, const char *buf,
+							size_t len);
+size_t gopher_menu_lines(gopher_menu_parser_t *mp, const char *buf, size_t len,
+						 int final);
+int gopher_menu_recv(gopher_addr_t *addr, gopher_menu_parser_t *mp);
 gopher_dir_t *gopher_dir_new(gopher_addr_t *addr);
+int gopher_resolve(gopher_addr_t *addr, int nowait);
+int gopher_socket_open(gopher_addr_t *addr);
+int gopher_socket_nonblock(int sockfd, int enable);
+void gopher_socket_tune(int sockfd, gopher_sockprof_t profile, int tfo);
+void gopher_socket_tune_connected(int sockfd, gopher_sockprof_t profile);
+gopher_xfer_t *gopher_multi_xfer_new(gopher_multi_t *multi,
+									 gopher_addr_t *addr, void *arg);
+int gopher_multi_watch(gopher_multi_t *multi, gopher_xfer_t *xfer, int op);
+int gopher_multi_wait(gopher_multi_t *multi, int timeout);
+void gopher_multi_event(gopher_multi_t *multi, gopher_xfer_t *xfer);
+int gopher_multi_xfer_send(gopher_multi_t *multi, gopher_xfer_t *xfer);
+int gopher_multi_xfer_start(gopher_multi_t *multi, gopher_xfer_t *xfer);
+int gopher_multi_xfer_connect(gopher_multi_t *multi, gopher_xfer_t *xfer);
+int gopher_multi_resolver(gopher_multi_t *multi);
+void gopher_multi_resolved(gopher_addr_t *addr, int err, void *arg);
+int gopher_multi_xfer_recv(gopher_xfer_t *xfer, int *finished);
+int gopher_multi_xfer_menu(gopher_xfer_t *xfer, int *finished);
+#ifdef GOPHER_HAS_URING
+gopher_uring_t *gopher_uring_new(unsigned int entries);
+void gopher_uring_free(gopher_uring_t *ring);
+struct io_uring_sqe *gopher_uring_sqe(gopher_uring_t *ring, int op, int fd,
+									  void *data);
+int gopher_uring_queue(gopher_multi_t *multi, gopher_xfer_t *xfer);
+int gopher_uring_wait(gopher_multi_t *multi, int timeout);
+void gopher_uring_complete(gopher_multi_t *multi, gopher_xfer_t *xfer,
+						   int res);
+#endif /* GOPHER_HAS_URING */
+void gopher_multi_xfer_done(gopher_multi_t *multi, gopher_xfer_t *xfer,
+							int err);
+gopher_arena_t *gopher_arena_new(size_t size);
+void *gopher_arena_alloc(gopher_arena_t **arena, size_t size);
+char *gopher_arena_strndup(gopher_arena_t **arena, const char *str,
+						   size_t len);
+void gopher_arena_free(gopher_arena_t *arena);
+void gopher_tok_init(gopher_tok_t *tok, const char *buf, size_t len);
+size_t gopher_tok_next(gopher_tok_t *tok, size_t from);
+size_t gopher_tok_eol(gopher_tok_t *tok, size_t from);
+uint64_t gopher_delims_scalar(const char *block);
+#ifdef GOPHER_SIMD_X86
+uint64_t gopher_delims_sse2(const char *block);
+uint64_t gopher_delims_avx2(const char *block);
+#endif /* GOPHER_SIMD_X86 */
+int gopher_ctz64(uint64_t x);
+gopher_rbuf_t *gopher_rbuf_new(void);
+gopher_rbuf_t *gopher_rbuf_attach(gopher_addr_t *addr);
+void gopher_rbuf_reset(gopher_rbuf_t *rb);
+void gopher_rbuf_free(gopher_rbuf_t *rb);
+int gopher_rbuf_fill(gopher_addr_t *addr);
+int gopher_rbuf_getline(gopher_addr_t *addr, char **line, size_t *len);
 
 /*
  * +===========================================================================+
@@ -134,10 +836,37 @@ gopher_dir_t *gopher_dir_new(gopher_addr_t *addr);
  */
 gopher_addr_t *gopher_addr_new(const char *host, uint16_t port,
 							   const char *selector, gopher_type_t type) {
+	return gopher_addr_new_in(NULL, host, (host) ? strlen(host) : 0, port,
+		selector, (selector) ? strlen(selector) : 0, type);
+}
+
+/**
+ * Allocates and populates a gopherspace address object inside a memory arena.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param arena        Optional. Memory arena to allocate the object from. The
+ *                     heap is used if NULL or pointing to NULL.
+ * @param host         Optional. Domain name or IP address of the server.
+ * @param host_len     Length of the host string.
+ * @param port         Port to use for communicating with the Gopher server.
+ * @param selector     Optional. Selector of the content to retrieve.
+ * @param selector_len Length of the selector string.
+ * @param type         Entry type character. Use NUL if should be omitted.
+ *
+ * @return Newly populated gopherspace address object. NULL if an error
+ *         occurred. Check errno case of failure.
+ *
+ * @see gopher_addr_new
+ */
+gopher_addr_t *gopher_addr_new_in(gopher_arena_t **arena, const char *host,
+								  size_t host_len, uint16_t port,
+								  const char *selector, size_t selector_len,
+								  gopher_type_t type) {
 	gopher_addr_t *addr;
 
 	/* Allocate the object. */
-	addr = (gopher_addr_t *)malloc(sizeof(gopher_addr_t));
+	addr = (gopher_addr_t *)gopher_arena_alloc(arena, sizeof(gopher_addr_t));
 	if (addr == NULL) {
 		log_errno(LOG_ERROR, "Failed to allocate memory for gopherspace "
 			"address");
@@ -145,13 +874,27 @@ gopher_addr_t *gopher_addr_new(const char *host, uint16_t port,
 	}
 
 	/* Populate the object. */
-	addr->host = (host) ? strdup(host) : NULL;
+	addr->host = (host) ? gopher_arena_strndup(arena, host, host_len) : NULL;
 	addr->port = port;
-	addr->selector = (selector) ? strdup(selector) : NULL;
+	addr->selector = (selector) ?
+		gopher_arena_strndup(arena, selector, selector_len) : NULL;
 	addr->type = type;
 	addr->sockfd = INVALID_SOCKET;
 	addr->ipaddr = NULL;
 	addr->ipaddr_len = 0;
+	addr->rbuf = NULL;
+	addr->flags = ((arena != NULL) && (*arena != NULL)) ?
+		GOPHER_FLAG_INARENA : GOPHER_FLAG_NONE;
+	addr->profile = GOPHER_SOCKPROF_DEFAULT;
+	memset(&addr->timeouts, 0, sizeof(gopher_timeouts_t));
+	addr->started = 0;
+	addr->last_io = 0;
+	addr->recvd = 0;
+	addr->rate_limit = 0;
+	addr->rate_tokens = 0;
+	addr->rate_at = 0;
+	addr->cache_ttl = 0;
+	addr->cancel = NULL;
 
 	return addr;
 }
@@ -238,33 +981,164 @@ gopher_addr_t *gopher_addr_parse(const char *uri) {
 }
 
 /**
- * Resolves an IP address structure for connecting via plain sockets from a
- * gopherspace address object.
+ * Resolves an IP address structure for connecting via plain sockets to a
+ * server.
  *
  * @warning This function dinamically allocates memory.
  *
- * @param addr Gopherspace address object.
- * @param ai   IP address information structure to be allocated and populated.
+ * @param host  Domain name or IP address of the server.
+ * @param port  Port of the server.
+ * @param flags Additional getaddrinfo() hint flags, such as AI_NUMERICHOST.
+ * @param ai    IP address information structure to be allocated and populated.
  *
  * @return 0 if the operation was successful. Check return against strerror() in
  *         case of failure.
  *
  * @see getaddrinfo
  */
-int gopher_getaddrinfo(const gopher_addr_t *addr, struct addrinfo **ai) {
+int gopher_getaddrinfo(const char *host, uint16_t port, int flags,
+					   struct addrinfo **ai) {
 	struct addrinfo hints;
-	char port[6];
+	char sport[6];
 
 	/* Build up the hints for the address we want to resolve. */
 	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;
+	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = flags;
 
 	/* Convert port to string. */
-	snprintf(port, 6, "%u", addr->port);
-	port[5] = '\0';
+	snprintf(sport, 6, "%u", port);
+	sport[5] = '\0';
+
+	return getaddrinfo(host, sport, &hints, ai);
+}
+
+/**
+ * Resolves an IP address structure giving up after a deadline or when the
+ * lookup gets cancelled. Since there's no way to interrupt getaddrinfo(), the
+ * lookup runs on a separate thread that is simply abandoned if we give up.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param host    Domain name or IP address of the server.
+ * @param port    Port of the server.
+ * @param timeout Maximum number of milliseconds to wait for the lookup, or 0
+ *                to wait until it gets cancelled.
+ * @param cancel  Optional. Cancellation token to keep an eye on.
+ * @param ai      IP address information structure to be allocated and
+ *                populated.
+ *
+ * @return 0 if the operation was successful, GOPHER_ERR_DNS_TIMEOUT if the
+ *         deadline was reached, GOPHER_ERR_CANCELLED if the lookup was
+ *         cancelled, or a getaddrinfo() error code.
+ *
+ * @see gopher_getaddrinfo
+ */
+int gopher_getaddrinfo_timed(const char *host, uint16_t port,
+							 unsigned long timeout,
+							 const gopher_cancel_t *cancel,
+							 struct addrinfo **ai) {
+	gopher_dns_job_t *job;
+	unsigned long started;
+	unsigned long elapsed;
+	long wait;
+	int ret;
+
+	/* Set up the lookup job. */
+	job = (gopher_dns_job_t *)malloc(sizeof(gopher_dns_job_t));
+	if (job == NULL)
+		return EAI_MEMORY;
+	job->host = strdup(host);
+	job->port = port;
+	job->ai = NULL;
+	job->ret = EAI_FAIL;
+	job->refs = 2;
+	if ((job->host == NULL) || (gopher_event_init(&job->done) != 0)) {
+		if (job->host)
+			free(job->host);
+		free(job);
+		return EAI_MEMORY;
+	}
+	gopher_mutex_init(&job->lock);
+
+	/* Run the lookup on its own thread. */
+	if (gopher_thread_spawn(gopher_dns_job_run, job) != 0) {
+		job->refs = 1;
+		job->ret = gopher_getaddrinfo(job->host, job->port, 0, &job->ai);
+		gopher_event_set(&job->done);
+	}
+
+	/* Wait for it to finish, checking back on the cancellation token. */
+	started = gopher_clock_ms();
+	for (;;) {
+		wait = (long)timeout;
+		if (timeout) {
+			elapsed = gopher_clock_ms() - started;
+			wait = (elapsed < timeout) ? (long)(timeout - elapsed) : 0;
+		}
+		if ((cancel != NULL) && (!timeout || (wait > CANCEL_POLL_SLICE)))
+			wait = CANCEL_POLL_SLICE;
+
+		if (gopher_event_wait(&job->done, wait)) {
+			*ai = job->ai;
+			job->ai = NULL;
+			ret = job->ret;
+			break;
+		}
+		if (gopher_cancel_triggered(cancel)) {
+			log_printf(LOG_ERROR, "Cancelled resolving %s\n", host);
+			ret = GOPHER_ERR_CANCELLED;
+			break;
+		}
+		if (timeout && ((gopher_clock_ms() - started) >= timeout)) {
+			log_printf(LOG_ERROR, "Timed out resolving %s\n", host);
+			ret = GOPHER_ERR_DNS_TIMEOUT;
+			break;
+		}
+	}
+	gopher_dns_job_release(job);
+
+	return ret;
+}
+
+/**
+ * Performs a name resolution job. Meant to be run on its own thread.
+ *
+ * @param arg Name resolution job.
+ */
+void gopher_dns_job_run(void *arg) {
+	gopher_dns_job_t *job;
+
+	job = (gopher_dns_job_t *)arg;
+	job->ret = gopher_getaddrinfo(job->host, job->port, 0, &job->ai);
+	gopher_event_set(&job->done);
+	gopher_dns_job_release(job);
+}
+
+/**
+ * Releases a reference to a name resolution job, freeing it if it was the last
+ * one.
+ *
+ * @param job Name resolution job.
+ */
+void gopher_dns_job_release(gopher_dns_job_t *job) {
+	int refs;
+
+	/* Drop our reference. */
+	gopher_mutex_lock(&job->lock);
+	refs = --job->refs;
+	gopher_mutex_unlock(&job->lock);
+	if (refs > 0)
+		return;
 
-	return getaddrinfo(addr->host, port, &hints, ai);
+	/* Free the job. */
+	if (job->ai)
+		freeaddrinfo(job->ai);
+	free(job->host);
+	gopher_event_destroy(&job->done);
+	gopher_mutex_destroy(&job->lock);
+	free(job);
 }
 
 /**
@@ -441,7 +1315,8 @@ void gopher_addr_print(const gopher_addr_t *addr) {
 }
 
 /**
- * Frees an gopherspace address object.
+ * Frees an gopherspace address object. Objects that live inside a memory arena
+ * are only disconnected, their memory is released together with the arena.
  *
  * @param addr Gopherspace address object to be free'd.
  */
@@ -450,6 +1325,16 @@ void gopher_addr_free(gopher_addr_t *addr) {
 	if (addr == NULL)
 		return;
 
+	/* Objects inside an arena are free'd with it. */
+	if (addr->flags & GOPHER_FLAG_INARENA) {
+		if (addr->sockfd != INVALID_SOCKET)
+			gopher_disconnect(addr);
+		if (addr->rbuf)
+			gopher_rbuf_free(addr->rbuf);
+		addr->rbuf = NULL;
+		return;
+	}
+
 	/* Free the object's members. */
 	if (addr->host)
 		free(addr->host);
@@ -463,6 +1348,8 @@ void gopher_addr_free(gopher_addr_t *addr) {
 		log_printf(LOG_WARNING, "Disconnecting the socket on address free\n");
 		gopher_disconnect(addr);
 	}
+	if (addr->rbuf)
+		gopher_rbuf_free(addr->rbuf);
 
 	/* Free the object itself. */
 	free(addr);
@@ -477,7 +1364,13 @@ void gopher_addr_free(gopher_addr_t *addr) {
  */
 
 /**
- * Establishes a connection to a Gopher server.
+ * Establishes a connection to a Gopher server, taking an idle one out of the
+ * warm pool if there's one available. The socket is tuned according to the
+ * profile of the address object.
+ *
+ * @warning With the latency profile the handshake may be deferred until the
+ *          request is sent in order to use TCP Fast Open, in which case a
+ *          server that refuses the connection is only reported when sending.
  *
  * @param addr Gopherspace address object.
  *
@@ -487,127 +1380,658 @@ void gopher_addr_free(gopher_addr_t *addr) {
  * @see gopher_disconnect
  */
 int gopher_connect(gopher_addr_t *addr) {
-	int ret;
+	struct addrinfo *cands[HE_MAX_ATTEMPTS];
 	struct addrinfo *query;
-	struct addrinfo *ai;
-
-	/* Resolve the server's IP address. */
-	ret = gopher_getaddrinfo(addr, &query);
-	if (ret != 0) {
-		log_printf(LOG_ERROR, "Failed to get address IP: (%d) %s\n", ret,
-			gai_strerror(ret));
-		freeaddrinfo(query);
-		return ret;
-	}
-
-	/* Search for a resolved address that is compatible. */
-	ai = NULL;
-	for (ai = query; ai != NULL; ai = ai->ai_next) {
-		if (ai->ai_family == AF_INET)
-			break;
-	}
-	if (ai == NULL) {
-		log_printf(LOG_ERROR, "Couldn't resolve an address for %s\n",
-			addr->host);
-		freeaddrinfo(query);
-#ifdef EAFNOSUPPORT
-		return EAFNOSUPPORT;
-#else
-		return EINVAL;
-#endif /* EAFNOSUPPORT */
-	}
+	size_t count;
+	int ret;
 
-	/* Allocate memory for the IP address. */
-	addr->ipaddr_len = ai->ai_addrlen;
-	addr->ipaddr = (struct sockaddr_in *)malloc(addr->ipaddr_len);
-	if (addr->ipaddr == NULL) {
-		log_printf(LOG_ERROR, "Failed to allocate memory for server IP address"
-			"\n");
-		freeaddrinfo(query);
-		return ENOMEM;
+	/* Start the clock for our deadlines. */
+	addr->recvd = 0;
+	if (gopher_timeouts_active(addr))
+		addr->started = gopher_clock_ms();
+	if (gopher_cancel_triggered(addr->cancel))
+		return GOPHER_ERR_CANCELLED;
+
+	/* Skip the handshake if there's a warm connection waiting for us. */
+	if (!(addr->flags & GOPHER_FLAG_NOPOOL) && (gopher_pool_take(addr) == 0)) {
+		gopher_socket_tune_connected(addr->sockfd, addr->profile);
+		if (gopher_timeouts_active(addr))
+			addr->last_io = gopher_clock_ms();
+		return 0;
 	}
 
-	/* Copy the server's IP address and free the resolve object. */
-	memcpy(addr->ipaddr, ai->ai_addr, addr->ipaddr_len);
-	freeaddrinfo(query);
-	query = NULL;
+	/* Resolve the server's IP addresses. */
+	ret = gopher_lookup(addr->host, addr->port, addr->timeouts.dns,
+		addr->cancel, 0, &query);
+	if (ret != 0)
+		return ret;
+	count = gopher_he_order(query, cands, HE_MAX_ATTEMPTS);
 
-	/* Get a socket file descriptor for our connection. */
-	addr->sockfd = socket(PF_INET, SOCK_STREAM, 0);
-	if (addr->sockfd == INVALID_SOCKET) {
-		log_sockerrno(LOG_FATAL, "Couldn't get a socket for our connection",
-			sockerrno);
-		return sockerrno;
+	/* Race the candidates unless there's a single one to block on. */
+	if ((count > 1) || addr->timeouts.connect || addr->timeouts.total ||
+			(addr->cancel != NULL)) {
+		ret = gopher_connect_race(addr, cands, count);
+		gopher_addrinfo_free(query);
+		return ret;
 	}
 
-#ifdef DEBUG
-	/* Log information about the address. */
-	if (1) {
-		char *buf;
-		ret = sockaddrstr(&buf, (struct sockaddr *)addr->ipaddr);
-		if (ret == 0) {
-			log_printf(LOG_INFO, "sockaddr addr->ipaddr %s:%d\n", buf,
-				ntohs(addr->ipaddr->sin_port));
-			free(buf);
-		} else {
-			log_errno(LOG_ERROR, "Couldn't get debug address information");
-		}
-	}
-#endif /* DEBUG */
+	/* Get a socket for the only address we've got. */
+	ret = gopher_addr_setip(addr, cands[0]);
+	gopher_addrinfo_free(query);
+	if (ret != 0)
+		return ret;
+	ret = gopher_socket_open(addr);
+	if (ret != 0)
+		return ret;
 
 	/* Connect ourselves to the address. */
-	if (connect(addr->sockfd, (struct sockaddr *)addr->ipaddr,
-				addr->ipaddr_len) == SOCKET_ERROR) {
+	if (connect(addr->sockfd, addr->ipaddr, addr->ipaddr_len) ==
+			SOCKET_ERROR) {
 		log_sockerrno(LOG_ERROR, "Couldn't connect to server", sockerrno);
 		return sockerrno;
 	}
+	gopher_socket_tune_connected(addr->sockfd, addr->profile);
+	if (gopher_timeouts_active(addr))
+		addr->last_io = gopher_clock_ms();
 
 	return ret;
 }
 
 /**
- * Disconnects gracefully from a Gopher server.
- *
- * @param addr Gopherspace address object.
+ * Races connections to multiple addresses of a server, as described in RFC 8305
+ * (Happy Eyeballs), keeping the first one to be established. Attempts are
+ * started in order, each one a short delay after the previous one, or right
+ * away if the previous one has already failed. TCP Fast Open is only used when
+ * there's a single candidate, since a deferred handshake would always win.
  *
- * @return 0 if the operation was successful. Check return against strerror() in
- *         case of failure.
+ * @param addr  Gopherspace address object.
+ * @param cands Candidate addresses in the order they should be attempted.
+ * @param count Number of candidate addresses.
  *
- * @see gopher_connect
+ * @return 0 if the operation was successful. Check return against
+ *         gopher_strerror() in case of failure.
  */
-int gopher_disconnect(gopher_addr_t *addr) {
-	char c;
+int gopher_connect_race(gopher_addr_t *addr, struct addrinfo **cands,
+						size_t count) {
+	struct addrinfo *owner[HE_MAX_ATTEMPTS];
+	int fds[HE_MAX_ATTEMPTS];
+	int ready[HE_MAX_ATTEMPTS];
+	unsigned long next_at;
+	socklen_t len;
+	size_t active;
+	size_t kept;
+	size_t next;
+	size_t i;
+	long wait;
+	long left;
+	int winner;
+	int tfo;
+	int err;
 	int ret;
+	int fd;
+
+	active = 0;
+	tfo = (count == 1) && !(addr->flags & GOPHER_FLAG_NOTFO);
+	next = 0;
+	next_at = 0;
+	winner = INVALID_SOCKET;
+	err = ECONNREFUSED;
+	while (winner == INVALID_SOCKET) {
+		/* Start the next attempt if it's due or nothing else is in flight. */
+		if ((next < count) && ((active == 0) ||
+				((long)(gopher_clock_ms() - next_at) >= 0))) {
+			fd = gopher_connect_start(cands[next++], addr->profile, tfo, &ret);
+			if (fd == INVALID_SOCKET) {
+				err = ret;
+				continue;
+			}
 
-	/* Is this even a valid address or socket? */
-	if ((addr == NULL) || (addr->sockfd == INVALID_SOCKET))
-		return EBADF;
-
-	/* Check if a shutdown is needed. */
-	if (recv(addr->sockfd, &c, 1, MSG_PEEK) != 0) {
-		log_printf(LOG_INFO, "Socket still connected, performing shutdown\n");
+			/* Loopback connections may be established right away. */
+			if (ret == 0) {
+				winner = fd;
+				for (i = 0; i < active; i++)
+					sockclose(fds[i]);
+				active = 0;
+				owner[0] = cands[next - 1];
+				break;
+			}
 
-		/* Shutdown the connection. */
-#ifdef _WIN32
-		ret = shutdown(addr->sockfd, SD_BOTH);
-#else
-		ret = shutdown(addr->sockfd, SHUT_RDWR);
-#endif /* _WIN32 */
-		if (ret == SOCKET_ERROR) {
-			log_sockerrno(LOG_WARNING, "Failed to shutdown connection",
-				sockerrno);
+			fds[active] = fd;
+			owner[active] = cands[next - 1];
+			active++;
+			next_at = gopher_clock_ms() + HE_ATTEMPT_DELAY;
+			continue;
 		}
-	}
 
-	/* Close the socket file descriptor. */
-#ifdef _WIN32
-	ret = closesocket(addr->sockfd);
-#else
-	ret = close(addr->sockfd);
-#endif /* _WIN32 */
-	addr->sockfd = INVALID_SOCKET;
-	if (ret == SOCKET_ERROR)
-		log_sockerrno(LOG_ERROR, "Failed to close socket", sockerrno);
+		/* Have we run out of candidates? */
+		if (active == 0) {
+			log_sockerrno(LOG_ERROR, "Couldn't connect to server", err);
+			return err;
+		}
+
+		/* Figure out how long we can wait. */
+		left = gopher_deadline(addr, addr->timeouts.connect, addr->started,
+			GOPHER_ERR_CONNECT_TIMEOUT, &ret);
+		if (left == 0) {
+			log_printf(LOG_ERROR, "Timed out connecting to server\n");
+			for (i = 0; i < active; i++)
+				sockclose(fds[i]);
+			return ret;
+		}
+		wait = left;
+		if (next < count) {
+			wait = (long)(next_at - gopher_clock_ms());
+			if (wait < 0)
+				wait = 0;
+			if ((left >= 0) && (left < wait))
+				wait = left;
+		}
+
+		/* Wait for any of the attempts to finish. */
+		if (gopher_socket_poll(fds, ready, active, 1, wait, addr->cancel) < 0) {
+			err = sockerrno;
+			log_sockerrno(LOG_ERROR, "Failed to wait for connection", err);
+			for (i = 0; i < active; i++)
+				sockclose(fds[i]);
+			return err;
+		}
+		if (gopher_cancel_triggered(addr->cancel)) {
+			log_printf(LOG_ERROR, "Cancelled connecting to server\n");
+			for (i = 0; i < active; i++)
+				sockclose(fds[i]);
+			return GOPHER_ERR_CANCELLED;
+		}
+
+		/* Check how the finished attempts went. */
+		for (i = 0; i < active; i++) {
+			if (!ready[i])
+				continue;
+
+			len = sizeof(ret);
+			if (getsockopt(fds[i], SOL_SOCKET, SO_ERROR, (char *)&ret,
+					&len) == SOCKET_ERROR) {
+				ret = sockerrno;
+			}
+			if (ret == 0) {
+				winner = fds[i];
+				owner[0] = owner[i];
+				fds[i] = INVALID_SOCKET;
+				break;
+			}
+
+			/* Drop the failed attempt. */
+			log_sockerrno(LOG_INFO, "Connection attempt failed", ret);
+			err = ret;
+			sockclose(fds[i]);
+			fds[i] = INVALID_SOCKET;
+		}
+
+		/* Compact the list of attempts in flight. */
+		for (i = 0, kept = 0; i < active; i++) {
+			if (fds[i] == INVALID_SOCKET)
+				continue;
+			if (winner != INVALID_SOCKET) {
+				sockclose(fds[i]);
+				continue;
+			}
+			fds[kept] = fds[i];
+			owner[kept] = owner[i];
+			kept++;
+		}
+		active = kept;
+	}
+
+	/* Keep the winning connection. */
+	addr->sockfd = winner;
+	addr->last_io = gopher_clock_ms();
+	ret = gopher_addr_setip(addr, owner[0]);
+	if (ret == 0)
+		ret = gopher_socket_nonblock(addr->sockfd, 0);
+	gopher_socket_tune_connected(addr->sockfd, addr->profile);
+
+	return ret;
+}
+
+/**
+ * Starts a non-blocking connection attempt to an address.
+ *
+ * @param ai      Address to connect to.
+ * @param profile Tuning profile of the socket.
+ * @param tfo     Allow the handshake to be deferred for TCP Fast Open?
+ * @param err     Error code of the attempt, 0 if it was established right away,
+ *                or EINPROGRESS if it's still in flight.
+ *
+ * @return Socket file descriptor of the attempt or INVALID_SOCKET if it failed.
+ */
+int gopher_connect_start(const struct addrinfo *ai, gopher_sockprof_t profile,
+						 int tfo, int *err) {
+	int fd;
+
+	/* Get a non-blocking socket. */
+	fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (fd == INVALID_SOCKET) {
+		*err = sockerrno;
+		log_sockerrno(LOG_ERROR, "Couldn't get a socket for our connection",
+			*err);
+		return INVALID_SOCKET;
+	}
+	*err = gopher_socket_nonblock(fd, 1);
+	if (*err != 0) {
+		sockclose(fd);
+		return INVALID_SOCKET;
+	}
+	gopher_socket_tune(fd, profile, tfo);
+
+	/* Start connecting. */
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) == SOCKET_ERROR) {
+		*err = sockerrno;
+		if (!SOCK_INPROGRESS(*err)) {
+			log_sockerrno(LOG_INFO, "Connection attempt failed", *err);
+			sockclose(fd);
+			return INVALID_SOCKET;
+		}
+		*err = EINPROGRESS;
+	}
+
+	return fd;
+}
+
+/**
+ * Orders the resolved addresses of a server for connection attempts, as
+ * described in RFC 8305, alternating between address families starting with
+ * the one that was preferred by the resolver.
+ *
+ * @param query Addresses returned by the resolver.
+ * @param cands Array to be populated with the ordered candidates.
+ * @param max   Maximum number of candidates.
+ *
+ * @return Number of candidates.
+ */
+size_t gopher_he_order(struct addrinfo *query, struct addrinfo **cands,
+					   size_t max) {
+	struct addrinfo *first;
+	struct addrinfo *other;
+	size_t count;
+	int family;
+
+	first = query;
+	other = query;
+	family = query->ai_family;
+	count = 0;
+	while ((count < max) && ((first != NULL) || (other != NULL))) {
+		/* Next address of the preferred family. */
+		while ((first != NULL) && (first->ai_family != family))
+			first = first->ai_next;
+		if (first != NULL) {
+			cands[count++] = first;
+			first = first->ai_next;
+		}
+
+		/* Next address of any other family. */
+		while ((other != NULL) && (other->ai_family == family))
+			other = other->ai_next;
+		if ((other != NULL) && (count < max)) {
+			cands[count++] = other;
+			other = other->ai_next;
+		}
+	}
+
+	return count;
+}
+
+/**
+ * Resolves the IP address of the server in a gopherspace address object.
+ *
+ * @param addr   Gopherspace address object.
+ * @param nowait Give up with EAGAIN instead of blocking on the resolver?
+ *
+ * @return 0 if the operation was successful. Check return against
+ *         gopher_strerror() in case of failure.
+ */
+int gopher_resolve(gopher_addr_t *addr, int nowait) {
+	struct addrinfo *cands[1];
+	struct addrinfo *query;
+	int ret;
+
+	/* Use the address we'd attempt first. */
+	ret = gopher_lookup(addr->host, addr->port, addr->timeouts.dns,
+		addr->cancel, nowait, &query);
+	if (ret != 0)
+		return ret;
+	gopher_he_order(query, cands, 1);
+	ret = gopher_addr_setip(addr, cands[0]);
+	gopher_addrinfo_free(query);
+
+	return ret;
+}
+
+/**
+ * Looks up all of the IP addresses of a server, going through the pinned hosts
+ * and the resolver cache first.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param host    Domain name or IP address of the server.
+ * @param port    Port of the server.
+ * @param timeout Name resolution deadline in milliseconds or 0 for none.
+ * @param cancel  Optional. Cancellation token to keep an eye on.
+ * @param nowait  Give up with EAGAIN if the system resolver would have to be
+ *                queried? Numeric addresses are still resolved.
+ * @param query   Resolved addresses. Must be freed with gopher_addrinfo_free().
+ *
+ * @return 0 if the operation was successful. Check return against
+ *         gopher_strerror() in case of failure.
+ */
+int gopher_lookup(const char *host, uint16_t port, unsigned long timeout,
+				  const gopher_cancel_t *cancel, int nowait,
+				  struct addrinfo **query) {
+	struct addrinfo *result;
+	char *pinned;
+	int ret;
+
+	/* Check if we already know the answer. */
+	*query = NULL;
+	if (gopher_dns_cache_find(host, port, query, &pinned, &ret)) {
+		if (ret != 0) {
+			log_printf(LOG_ERROR, "Failed to get address IP (cached): (%d) "
+				"%s\n", ret, gai_strerror(ret));
+			return ret;
+		} else if (*query == NULL) {
+			return ENOMEM;
+		}
+
+		return 0;
+	}
+
+	/* Resolve the server's IP addresses. */
+	result = NULL;
+	if (nowait && (pinned == NULL)) {
+		/* Only numeric addresses can be resolved without blocking. */
+		ret = gopher_getaddrinfo(host, port, AI_NUMERICHOST, &result);
+		if (ret != 0) {
+			if (result)
+				freeaddrinfo(result);
+			return EAGAIN;
+		}
+	} else if (timeout || (cancel != NULL)) {
+		ret = gopher_getaddrinfo_timed((pinned) ? pinned : host, port, timeout,
+			cancel, &result);
+	} else {
+		ret = gopher_getaddrinfo((pinned) ? pinned : host, port, 0, &result);
+	}
+	if ((ret == GOPHER_ERR_DNS_TIMEOUT) || (ret == GOPHER_ERR_CANCELLED)) {
+		if (pinned)
+			free(pinned);
+		return ret;
+	} else if (ret != 0) {
+		log_printf(LOG_ERROR, "Failed to get address IP: (%d) %s\n", ret,
+			gai_strerror(ret));
+		if (result)
+			freeaddrinfo(result);
+		result = NULL;
+	}
+
+	/* Remember the answer for next time. */
+	if (pinned == NULL)
+		gopher_dns_cache_store(host, port, result, ret);
+	else
+		free(pinned);
+	if (ret != 0)
+		return ret;
+
+	/* Make sure we've actually got something. */
+	if (result == NULL) {
+		log_printf(LOG_ERROR, "Couldn't resolve an address for %s\n", host);
+#ifdef EAFNOSUPPORT
+		return EAFNOSUPPORT;
+#else
+		return EINVAL;
+#endif /* EAFNOSUPPORT */
+	}
+
+	/* Hand out our own copy of the addresses. */
+	*query = gopher_addrinfo_dup(result);
+	freeaddrinfo(result);
+	if (*query == NULL)
+		return ENOMEM;
+
+	return 0;
+}
+
+/**
+ * Stores the IP address of the server in a gopherspace address object.
+ *
+ * @param addr Gopherspace address object.
+ * @param ai   Resolved address of the server.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_addr_setip(gopher_addr_t *addr, const struct addrinfo *ai) {
+	/* Allocate memory for the IP address. */
+	if (addr->ipaddr)
+		free(addr->ipaddr);
+	addr->ipaddr_len = ai->ai_addrlen;
+	addr->ipaddr = (struct sockaddr *)malloc(addr->ipaddr_len);
+	if (addr->ipaddr == NULL) {
+		log_printf(LOG_ERROR, "Failed to allocate memory for server IP address"
+			"\n");
+		return ENOMEM;
+	}
+
+	/* Copy the server's IP address. */
+	memcpy(addr->ipaddr, ai->ai_addr, addr->ipaddr_len);
+
+#ifdef DEBUG
+	/* Log information about the address. */
+	if (1) {
+		char *buf;
+		int ret;
+
+		ret = sockaddrstr(&buf, addr->ipaddr);
+		if (ret == 0) {
+			log_printf(LOG_INFO, "sockaddr addr->ipaddr %s port %u\n", buf,
+				addr->port);
+			free(buf);
+		} else {
+			log_errno(LOG_ERROR, "Couldn't get debug address information");
+		}
+	}
+#endif /* DEBUG */
+
+	return 0;
+}
+
+/**
+ * Gets a socket file descriptor for a connection to an already resolved
+ * address, tuned according to the profile of the address.
+ *
+ * @param addr Gopherspace address object with its IP address resolved.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_socket_open(gopher_addr_t *addr) {
+	addr->sockfd = socket(addr->ipaddr->sa_family, SOCK_STREAM, 0);
+	if (addr->sockfd == INVALID_SOCKET) {
+		log_sockerrno(LOG_FATAL, "Couldn't get a socket for our connection",
+			sockerrno);
+		return sockerrno;
+	}
+	gopher_socket_tune(addr->sockfd, addr->profile,
+		!(addr->flags & GOPHER_FLAG_NOTFO));
+
+	return 0;
+}
+
+/**
+ * Sets the options of a socket that has yet to be connected according to a
+ * tuning profile. Options that aren't supported by the system are skipped,
+ * since none of them are required for the connection to work.
+ *
+ * @param sockfd  Socket file descriptor that isn't connected yet.
+ * @param profile Tuning profile to apply.
+ * @param tfo     Allow the handshake to be deferred until the request is sent,
+ *                so that it can be carried in the SYN with TCP Fast Open?
+ */
+void gopher_socket_tune(int sockfd, gopher_sockprof_t profile, int tfo) {
+	int val;
+
+	switch (profile) {
+	case GOPHER_SOCKPROF_LATENCY:
+#ifdef TCP_FASTOPEN_CONNECT
+		/* Send the request along with the SYN if we have a cookie. */
+		val = 1;
+		if (tfo && (setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+				(const char *)&val, sizeof(val)) == SOCKET_ERROR)) {
+			log_sockerrno(LOG_INFO, "TCP Fast Open unavailable", sockerrno);
+		}
+#else
+		(void)tfo;
+#endif /* TCP_FASTOPEN_CONNECT */
+
+		/* Don't hold back small writes. */
+		val = 1;
+		if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (const char *)&val,
+				sizeof(val)) == SOCKET_ERROR) {
+			log_sockerrno(LOG_WARNING, "Failed to disable Nagle's algorithm",
+				sockerrno);
+		}
+		break;
+	case GOPHER_SOCKPROF_BULK:
+		/* Large receive buffer, set before the window scale is negotiated. */
+		val = SOCKPROF_RCVBUF;
+		if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, (const char *)&val,
+				sizeof(val)) == SOCKET_ERROR) {
+			log_sockerrno(LOG_WARNING, "Failed to set the receive buffer size",
+				sockerrno);
+		}
+
+#ifndef _WIN32
+		/* Only wake up the reader for a decent chunk of data. */
+		val = SOCKPROF_RCVLOWAT;
+		if (setsockopt(sockfd, SOL_SOCKET, SO_RCVLOWAT, (const char *)&val,
+				sizeof(val)) == SOCKET_ERROR) {
+			log_sockerrno(LOG_WARNING, "Failed to set the receive low water "
+				"mark", sockerrno);
+		}
+#endif /* !_WIN32 */
+		break;
+	case GOPHER_SOCKPROF_DEFAULT:
+		break;
+	}
+}
+
+/**
+ * Sets the options of a socket that only make sense once it's connected
+ * according to a tuning profile.
+ *
+ * @param sockfd  Connected socket file descriptor.
+ * @param profile Tuning profile to apply.
+ */
+void gopher_socket_tune_connected(int sockfd, gopher_sockprof_t profile) {
+#ifdef TCP_QUICKACK
+	int val;
+
+	/* Acknowledge the response right away instead of waiting on more data. */
+	val = 1;
+	if ((profile == GOPHER_SOCKPROF_LATENCY) &&
+			(setsockopt(sockfd, IPPROTO_TCP, TCP_QUICKACK, (const char *)&val,
+			sizeof(val)) == SOCKET_ERROR)) {
+		log_sockerrno(LOG_INFO, "Failed to enable quick ACKs", sockerrno);
+	}
+#else
+	(void)sockfd;
+	(void)profile;
+#endif /* TCP_QUICKACK */
+}
+
+/**
+ * Switches a socket in and out of non-blocking mode.
+ *
+ * @param sockfd Socket file descriptor.
+ * @param enable Should the socket be non-blocking?
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_socket_nonblock(int sockfd, int enable) {
+#ifdef _WIN32
+	u_long mode;
+
+	mode = (enable) ? 1 : 0;
+	if (ioctlsocket(sockfd, FIONBIO, &mode) == SOCKET_ERROR) {
+		log_sockerrno(LOG_ERROR, "Failed to change socket blocking mode",
+			sockerrno);
+		return sockerrno;
+	}
+#else
+	int fl;
+
+	fl = fcntl(sockfd, F_GETFL, 0);
+	if (fl != -1)
+		fl = (enable) ? (fl | O_NONBLOCK) : (fl & ~O_NONBLOCK);
+	if ((fl == -1) || (fcntl(sockfd, F_SETFL, fl) == -1)) {
+		log_errno(LOG_ERROR, "Failed to change socket blocking mode");
+		return errno;
+	}
+#endif /* _WIN32 */
+
+	return 0;
+}
+
+/**
+ * Disconnects gracefully from a Gopher server. If the server has already closed
+ * its end of the connection, or the GOPHER_FLAG_FASTTERM flag is set, the
+ * socket is simply closed without any further system calls.
+ *
+ * @param addr Gopherspace address object.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_connect
+ */
+int gopher_disconnect(gopher_addr_t *addr) {
+	char c;
+	int ret;
+
+	/* Is this even a valid address or socket? */
+	if ((addr == NULL) || (addr->sockfd == INVALID_SOCKET))
+		return EBADF;
+
+	/* Check if a shutdown is needed. */
+	if (((addr->rbuf != NULL) && addr->rbuf->eof) ||
+			(addr->flags & GOPHER_FLAG_FASTTERM)) {
+		log_printf(LOG_INFO, "Transfer finished, closing socket right away\n");
+	} else if (recv(addr->sockfd, &c, 1, MSG_PEEK) != 0) {
+		log_printf(LOG_INFO, "Socket still connected, performing shutdown\n");
+
+		/* Shutdown the connection. */
+#ifdef _WIN32
+		ret = shutdown(addr->sockfd, SD_BOTH);
+#else
+		ret = shutdown(addr->sockfd, SHUT_RDWR);
+#endif /* _WIN32 */
+		if (ret == SOCKET_ERROR) {
+			log_sockerrno(LOG_WARNING, "Failed to shutdown connection",
+				sockerrno);
+		}
+	}
+
+	/* Close the socket file descriptor. */
+#ifdef _WIN32
+	ret = closesocket(addr->sockfd);
+#else
+	ret = close(addr->sockfd);
+#endif /* _WIN32 */
+	addr->sockfd = INVALID_SOCKET;
+	if (ret == SOCKET_ERROR)
+		log_sockerrno(LOG_ERROR, "Failed to close socket", sockerrno);
+
+	/* Discard anything left over in the receive buffer. */
+	if (addr->rbuf)
+		gopher_rbuf_reset(addr->rbuf);
 
 	return ret;
 }
@@ -615,987 +2039,7550 @@ int gopher_disconnect(gopher_addr_t *addr) {
 /*
  * +===========================================================================+
  * |                                                                           |
- * |                            Directory Handling                             |
+ * |                           Name Resolution Cache                           |
+ * |                                                                           |
+ * +===========================================================================+
+ */
+
+/* Resolver cache state. */
+static gopher_global_lock_t gopher_dns_lock = GOPHER_GLOBAL_LOCK_INIT;
+static gopher_dns_entry_t *gopher_dns_entries = NULL;
+static gopher_dns_pin_t *gopher_dns_pins = NULL;
+static unsigned long gopher_dns_ttl = DNS_CACHE_TTL;
+static unsigned long gopher_dns_negative_ttl = DNS_NEGATIVE_TTL;
+static gopher_dns_stats_t gopher_dns_counters;
+
+/**
+ * Sets how long the results of name resolutions are kept around. Changing it
+ * flushes the cache.
+ *
+ * @param ttl          Number of milliseconds successful lookups are kept for,
+ *                     or 0 to disable the cache entirely.
+ * @param negative_ttl Number of milliseconds failed lookups are kept for, or 0
+ *                     to always retry them.
+ */
+void gopher_dns_cache_ttl(unsigned long ttl, unsigned long negative_ttl) {
+	gopher_global_lock(&gopher_dns_lock);
+	gopher_dns_ttl = ttl;
+	gopher_dns_negative_ttl = (ttl > 0) ? negative_ttl : 0;
+	gopher_dns_cache_purge(1);
+	gopher_global_unlock(&gopher_dns_lock);
+}
+
+/**
+ * Forgets the results of every name resolution performed so far.
+ */
+void gopher_dns_cache_flush(void) {
+	gopher_global_lock(&gopher_dns_lock);
+	gopher_dns_cache_purge(1);
+	gopher_global_unlock(&gopher_dns_lock);
+}
+
+/**
+ * Gets a snapshot of the resolver cache counters.
+ *
+ * @param stats Structure to be populated with the counters.
+ */
+void gopher_dns_cache_stats(gopher_dns_stats_t *stats) {
+	gopher_global_lock(&gopher_dns_lock);
+	*stats = gopher_dns_counters;
+	gopher_global_unlock(&gopher_dns_lock);
+}
+
+/**
+ * Pins a host name to a specific IP address, bypassing the system resolver
+ * entirely. Useful for tests and benchmarks.
+ *
+ * @param host Host name to be pinned.
+ * @param ip   IP address the host should resolve to, or NULL to unpin it.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_dns_override(const char *host, const char *ip) {
+	gopher_dns_pin_t **link;
+	gopher_dns_pin_t *pin;
+	char *dup;
+
+	/* Copy the address before taking the lock. */
+	dup = NULL;
+	if (ip != NULL) {
+		dup = strdup(ip);
+		if (dup == NULL)
+			return ENOMEM;
+	}
+
+	gopher_global_lock(&gopher_dns_lock);
+
+	/* Look for an existing pin for the host. */
+	for (link = &gopher_dns_pins; *link != NULL; link = &(*link)->next) {
+		if (strcmp((*link)->host, host) == 0)
+			break;
+	}
+	pin = *link;
+
+	/* Remove it or replace its address. */
+	if (pin != NULL) {
+		free(pin->ip);
+		pin->ip = dup;
+		if (dup == NULL) {
+			*link = pin->next;
+			free(pin->host);
+			free(pin);
+		}
+		gopher_global_unlock(&gopher_dns_lock);
+		return 0;
+	} else if (dup == NULL) {
+		gopher_global_unlock(&gopher_dns_lock);
+		return 0;
+	}
+
+	/* Add a new pin. */
+	pin = (gopher_dns_pin_t *)malloc(sizeof(gopher_dns_pin_t));
+	if (pin != NULL)
+		pin->host = strdup(host);
+	if ((pin == NULL) || (pin->host == NULL)) {
+		gopher_global_unlock(&gopher_dns_lock);
+		if (pin)
+			free(pin);
+		free(dup);
+		return ENOMEM;
+	}
+	pin->ip = dup;
+	pin->next = gopher_dns_pins;
+	gopher_dns_pins = pin;
+
+	gopher_global_unlock(&gopher_dns_lock);
+
+	return 0;
+}
+
+/**
+ * Checks if we already know the answer to a name resolution, either because the
+ * host was pinned or because it was cached.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param host   Host name to be resolved.
+ * @param port   Port of the server.
+ * @param query  Copy of the cached addresses if there was a successful hit.
+ * @param pinned Copy of the IP address the host is pinned to, or NULL.
+ * @param err    Cached error code if there was a negative hit.
+ *
+ * @return TRUE if the answer came from the cache.
+ */
+int gopher_dns_cache_find(const char *host, uint16_t port,
+						  struct addrinfo **query, char **pinned, int *err) {
+	gopher_dns_entry_t **link;
+	gopher_dns_entry_t *entry;
+	gopher_dns_pin_t *pin;
+	unsigned long now;
+
+	*pinned = NULL;
+	*err = 0;
+	gopher_global_lock(&gopher_dns_lock);
+
+	/* Pinned hosts always take precedence. */
+	for (pin = gopher_dns_pins; pin != NULL; pin = pin->next) {
+		if (strcmp(pin->host, host) == 0) {
+			*pinned = strdup(pin->ip);
+			gopher_dns_counters.overrides++;
+			gopher_global_unlock(&gopher_dns_lock);
+			return 0;
+		}
+	}
+
+	/* Look for the host in the cache. */
+	now = gopher_clock_ms();
+	for (link = &gopher_dns_entries; *link != NULL; link = &(*link)->next) {
+		entry = *link;
+		if ((entry->port != port) || (strcmp(entry->host, host) != 0))
+			continue;
+
+		/* Throw away stale entries. */
+		if ((long)(now - entry->expires) >= 0) {
+			*link = entry->next;
+			gopher_dns_entry_free(entry);
+			gopher_dns_counters.entries--;
+			break;
+		}
+
+		/* Hand out the cached answer. */
+		if (entry->ai != NULL) {
+			*query = gopher_addrinfo_dup(entry->ai);
+			gopher_dns_counters.hits++;
+		} else {
+			*err = entry->err;
+			gopher_dns_counters.negative_hits++;
+		}
+		gopher_global_unlock(&gopher_dns_lock);
+		return 1;
+	}
+
+	gopher_dns_counters.misses++;
+	gopher_global_unlock(&gopher_dns_lock);
+
+	return 0;
+}
+
+/**
+ * Stores the answer to a name resolution in the cache. Failures are only stored
+ * if the resolver was certain that the host doesn't exist.
+ *
+ * @param host Host name that was resolved.
+ * @param port Port of the server.
+ * @param ai   Resolved addresses or NULL if the resolution failed.
+ * @param err  Error code of the resolution.
+ */
+void gopher_dns_cache_store(const char *host, uint16_t port,
+							const struct addrinfo *ai, int err) {
+	gopher_dns_entry_t **link;
+	gopher_dns_entry_t *entry;
+	unsigned long ttl;
+
+	/* Check if this is something we should remember. */
+	if (err == 0) {
+		if (ai == NULL)
+			return;
+		ttl = gopher_dns_ttl;
+	} else if (gopher_dns_negative(err)) {
+		ttl = gopher_dns_negative_ttl;
+	} else {
+		return;
+	}
+	if (ttl == 0)
+		return;
+
+	/* Build up the entry outside of the lock. */
+	entry = (gopher_dns_entry_t *)malloc(sizeof(gopher_dns_entry_t));
+	if (entry == NULL)
+		return;
+	entry->host = strdup(host);
+	entry->port = port;
+	entry->ai = (ai) ? gopher_addrinfo_dup(ai) : NULL;
+	entry->err = err;
+	entry->expires = gopher_clock_ms() + ttl;
+	if ((entry->host == NULL) || ((ai != NULL) && (entry->ai == NULL))) {
+		gopher_dns_entry_free(entry);
+		return;
+	}
+
+	gopher_global_lock(&gopher_dns_lock);
+
+	/* Replace any previous answer for the same host. */
+	for (link = &gopher_dns_entries; *link != NULL; link = &(*link)->next) {
+		if (((*link)->port == port) && (strcmp((*link)->host, host) == 0)) {
+			gopher_dns_entry_t *old;
+
+			old = *link;
+			*link = old->next;
+			gopher_dns_entry_free(old);
+			gopher_dns_counters.entries--;
+			break;
+		}
+	}
+
+	/* Make room for the new entry. */
+	if (gopher_dns_counters.entries >= DNS_CACHE_MAX)
+		gopher_dns_cache_purge(0);
+	if (gopher_dns_counters.entries >= DNS_CACHE_MAX) {
+		/* Evict the oldest entry, which sits at the end of the list. */
+		for (link = &gopher_dns_entries; (*link)->next != NULL;
+				link = &(*link)->next)
+			;
+		gopher_dns_entry_free(*link);
+		*link = NULL;
+		gopher_dns_counters.entries--;
+	}
+
+	/* Newest entries go at the front of the list. */
+	entry->next = gopher_dns_entries;
+	gopher_dns_entries = entry;
+	gopher_dns_counters.entries++;
+
+	gopher_global_unlock(&gopher_dns_lock);
+}
+
+/**
+ * Removes entries from the resolver cache. Must be called with the cache lock
+ * held.
+ *
+ * @param all Remove every entry instead of just the stale ones?
+ */
+void gopher_dns_cache_purge(int all) {
+	gopher_dns_entry_t **link;
+	gopher_dns_entry_t *entry;
+	unsigned long now;
+
+	now = gopher_clock_ms();
+	link = &gopher_dns_entries;
+	while (*link != NULL) {
+		entry = *link;
+		if (all || ((long)(now - entry->expires) >= 0)) {
+			*link = entry->next;
+			gopher_dns_entry_free(entry);
+			gopher_dns_counters.entries--;
+		} else {
+			link = &entry->next;
+		}
+	}
+}
+
+/**
+ * Checks if a resolver error means that the host definitely doesn't exist, as
+ * opposed to a transient failure.
+ *
+ * @param err getaddrinfo() error code.
+ *
+ * @return TRUE if the failure can be cached.
+ */
+int gopher_dns_negative(int err) {
+#ifdef EAI_NODATA
+	if (err == EAI_NODATA)
+		return 1;
+#endif /* EAI_NODATA */
+
+	return err == EAI_NONAME;
+}
+
+/**
+ * Frees up a resolver cache entry.
+ *
+ * @param entry Resolver cache entry to be freed.
+ */
+void gopher_dns_entry_free(gopher_dns_entry_t *entry) {
+	if (entry->host)
+		free(entry->host);
+	if (entry->ai)
+		gopher_addrinfo_free(entry->ai);
+	free(entry);
+}
+
+/**
+ * Duplicates a list of resolved addresses. Each node and its address are kept
+ * in a single allocation.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param ai List of resolved addresses.
+ *
+ * @return Copy of the list to be freed with gopher_addrinfo_free(), or NULL if
+ *         we ran out of memory.
+ */
+struct addrinfo *gopher_addrinfo_dup(const struct addrinfo *ai) {
+	struct addrinfo *head;
+	struct addrinfo **tail;
+	struct addrinfo *node;
+
+	head = NULL;
+	tail = &head;
+	for (; ai != NULL; ai = ai->ai_next) {
+		node = (struct addrinfo *)malloc(sizeof(struct addrinfo) +
+			ai->ai_addrlen);
+		if (node == NULL) {
+			gopher_addrinfo_free(head);
+			return NULL;
+		}
+
+		/* Copy the node and its address. */
+		memcpy(node, ai, sizeof(struct addrinfo));
+		node->ai_canonname = NULL;
+		node->ai_addr = (struct sockaddr *)(node + 1);
+		memcpy(node->ai_addr, ai->ai_addr, ai->ai_addrlen);
+		node->ai_next = NULL;
+
+		*tail = node;
+		tail = &node->ai_next;
+	}
+
+	return head;
+}
+
+/**
+ * Frees up a list of resolved addresses duplicated by gopher_addrinfo_dup().
+ *
+ * @param ai List of resolved addresses.
+ */
+void gopher_addrinfo_free(struct addrinfo *ai) {
+	struct addrinfo *next;
+
+	while (ai != NULL) {
+		next = ai->ai_next;
+		free(ai);
+		ai = next;
+	}
+}
+
+/*
+ * +===========================================================================+
+ * |                                                                           |
+ * |                       Asynchronous Name Resolution                        |
+ * |                                                                           |
+ * +===========================================================================+
+ */
+
+/**
+ * Allocates a name resolver and starts up its pool of threads. Lookups are
+ * performed in the background and their results queued up until they're
+ * collected with gopher_resolver_poll().
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param threads Number of resolver threads or 0 for the default.
+ *
+ * @return Newly initialized name resolver or NULL if an error occurred.
+ *
+ * @see gopher_resolver_free
+ */
+gopher_resolver_t *gopher_resolver_new(unsigned int threads) {
+	gopher_resolver_t *res;
+	unsigned int i;
+
+	/* Allocate the object. */
+	res = (gopher_resolver_t *)malloc(sizeof(gopher_resolver_t));
+	if (res == NULL) {
+		log_errno(LOG_ERROR, "Failed to allocate memory for name resolver");
+		return NULL;
+	}
+
+	/* Initialize the object. */
+	res->notify[0] = -1;
+	res->notify[1] = -1;
+	res->queued = NULL;
+	res->queued_tail = &res->queued;
+	res->active = NULL;
+	res->done = NULL;
+	res->done_tail = &res->done;
+	res->pending = 0;
+	res->refs = 1;
+	res->closing = 0;
+	if (gopher_event_init(&res->work) != 0) {
+		free(res);
+		return NULL;
+	}
+	gopher_mutex_init(&res->lock);
+
+#ifndef _WIN32
+	/* Set up the pipe used to wake up event loops. */
+	if (pipe(res->notify) != 0) {
+		log_errno(LOG_ERROR, "Failed to create resolver notification pipe");
+		res->notify[0] = -1;
+		res->notify[1] = -1;
+		gopher_resolver_release(res);
+		return NULL;
+	}
+	fcntl(res->notify[0], F_SETFL, O_NONBLOCK);
+	fcntl(res->notify[1], F_SETFL, O_NONBLOCK);
+#endif /* !_WIN32 */
+
+	/* Start up the pool of threads, each holding a reference to the object. */
+	if (threads == 0)
+		threads = RESOLVER_THREADS;
+	for (i = 0; i < threads; i++) {
+		gopher_mutex_lock(&res->lock);
+		res->refs++;
+		gopher_mutex_unlock(&res->lock);
+		if (gopher_thread_spawn(gopher_resolver_work, res) != 0) {
+			gopher_mutex_lock(&res->lock);
+			res->refs--;
+			gopher_mutex_unlock(&res->lock);
+			break;
+		}
+	}
+	if (i == 0) {
+		log_printf(LOG_ERROR, "Failed to start any resolver threads\n");
+		gopher_resolver_release(res);
+		return NULL;
+	}
+
+	return res;
+}
+
+/**
+ * Gets a file descriptor that becomes readable whenever there are finished
+ * lookups waiting to be collected, so that the resolver can be watched by an
+ * event loop alongside its sockets.
+ *
+ * @param res Name resolver.
+ *
+ * @return File descriptor to watch for reading, or -1 under Windows, where
+ *         gopher_resolver_poll() must be called periodically instead.
+ */
+int gopher_resolver_fd(const gopher_resolver_t *res) {
+	return res->notify[0];
+}
+
+/**
+ * Requests the resolution of the server in a gopherspace address object. The
+ * request joins any lookup of the same host and port that is already under way
+ * instead of starting a new one.
+ *
+ * @param res  Name resolver.
+ * @param addr Gopherspace address object to be resolved. Must be kept around,
+ *             and left alone, until the callback is called.
+ * @param func Callback function called from gopher_resolver_poll() once the
+ *             resolution is done.
+ * @param arg  Optional. Parameter to be passed to the callback function.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_resolver_poll
+ */
+int gopher_resolver_add(gopher_resolver_t *res, gopher_addr_t *addr,
+						gopher_resolver_func func, void *arg) {
+	gopher_resolver_req_t *req;
+	gopher_resolver_job_t *job;
+
+	/* Set up the request. */
+	req = (gopher_resolver_req_t *)malloc(sizeof(gopher_resolver_req_t));
+	if (req == NULL)
+		return ENOMEM;
+	req->addr = addr;
+	req->func = func;
+	req->arg = arg;
+	req->next = NULL;
+
+	gopher_mutex_lock(&res->lock);
+
+	/* Piggyback on a lookup of the same host if there's one. */
+	job = gopher_resolver_find(res->queued, addr->host, addr->port);
+	if (job == NULL)
+		job = gopher_resolver_find(res->active, addr->host, addr->port);
+	if (job == NULL)
+		job = gopher_resolver_find(res->done, addr->host, addr->port);
+
+	/* Queue up a new lookup otherwise. */
+	if (job == NULL) {
+		job = (gopher_resolver_job_t *)malloc(sizeof(gopher_resolver_job_t));
+		if (job != NULL)
+			job->host = strdup(addr->host);
+		if ((job == NULL) || (job->host == NULL)) {
+			gopher_mutex_unlock(&res->lock);
+			if (job)
+				free(job);
+			free(req);
+			return ENOMEM;
+		}
+		job->port = addr->port;
+		job->timeout = addr->timeouts.dns;
+		job->query = NULL;
+		job->err = 0;
+		job->reqs = NULL;
+		job->reqs_tail = &job->reqs;
+		job->next = NULL;
+
+		*res->queued_tail = job;
+		res->queued_tail = &job->next;
+		gopher_event_set(&res->work);
+	}
+
+	/* Wait on the lookup. */
+	*job->reqs_tail = req;
+	job->reqs_tail = &req->next;
+	res->pending++;
+
+	gopher_mutex_unlock(&res->lock);
+
+	return 0;
+}
+
+/**
+ * Gets the number of requests whose callbacks haven't been called yet.
+ *
+ * @param res Name resolver.
+ *
+ * @return Number of pending requests.
+ */
+size_t gopher_resolver_pending(const gopher_resolver_t *res) {
+	return res->pending;
+}
+
+/**
+ * Collects the finished lookups of a name resolver, calling the callbacks of
+ * every request that was waiting on them. Never blocks.
+ *
+ * @param res Name resolver.
+ *
+ * @return Number of callbacks that were called.
+ */
+size_t gopher_resolver_poll(gopher_resolver_t *res) {
+	struct addrinfo *cands[1];
+	gopher_resolver_req_t *req;
+	gopher_resolver_job_t *job;
+	gopher_resolver_job_t *next;
+	size_t count;
+	int err;
+#ifndef _WIN32
+	char buf[64];
+
+	/* Clear the notification before looking at the queue so none gets lost. */
+	while (read(res->notify[0], buf, sizeof(buf)) > 0)
+		;
+#endif /* !_WIN32 */
+
+	/* Take every finished lookup at once. */
+	gopher_mutex_lock(&res->lock);
+	job = res->done;
+	res->done = NULL;
+	res->done_tail = &res->done;
+	gopher_mutex_unlock(&res->lock);
+
+	/* Hand the results over to the requests. */
+	count = 0;
+	for (; job != NULL; job = next) {
+		next = job->next;
+		if (job->err == 0)
+			gopher_he_order(job->query, cands, 1);
+
+		while (job->reqs != NULL) {
+			req = job->reqs;
+			job->reqs = req->next;
+			err = job->err;
+			if (err == 0)
+				err = gopher_addr_setip(req->addr, cands[0]);
+
+			res->pending--;
+			count++;
+			req->func(req->addr, err, req->arg);
+			free(req);
+		}
+
+		gopher_resolver_job_free(job);
+	}
+
+	return count;
+}
+
+/**
+ * Frees a name resolver. Requests still pending have their callbacks called
+ * with ECANCELED. Lookups under way are left to finish in the background.
+ *
+ * @param res Name resolver to be free'd.
+ */
+void gopher_resolver_free(gopher_resolver_t *res) {
+	gopher_resolver_req_t **tail;
+	gopher_resolver_req_t *reqs;
+	gopher_resolver_req_t *req;
+	gopher_resolver_job_t *jobs;
+	gopher_resolver_job_t *job;
+
+	/* Is this even necessary? */
+	if (res == NULL)
+		return;
+
+	gopher_mutex_lock(&res->lock);
+
+	/* Stop the threads and take back every lookup that isn't under way. */
+	res->closing = 1;
+	*res->queued_tail = res->done;
+	jobs = res->queued;
+	res->queued = NULL;
+	res->queued_tail = &res->queued;
+	res->done = NULL;
+	res->done_tail = &res->done;
+	gopher_event_set(&res->work);
+
+	/* Lookups under way are free'd by their threads once they're done. */
+	reqs = NULL;
+	tail = &reqs;
+	for (job = res->active; job != NULL; job = job->next) {
+		*tail = job->reqs;
+		if (job->reqs != NULL)
+			tail = job->reqs_tail;
+		job->reqs = NULL;
+		job->reqs_tail = &job->reqs;
+	}
+
+	gopher_mutex_unlock(&res->lock);
+
+	/* Free the lookups we took back. */
+	while (jobs != NULL) {
+		job = jobs;
+		jobs = job->next;
+		*tail = job->reqs;
+		if (job->reqs != NULL)
+			tail = job->reqs_tail;
+		gopher_resolver_job_free(job);
+	}
+
+	/* Cancel every pending request. */
+	while (reqs != NULL) {
+		req = reqs;
+		reqs = req->next;
+		res->pending--;
+		req->func(req->addr, ECANCELED, req->arg);
+		free(req);
+	}
+
+	gopher_resolver_release(res);
+}
+
+/**
+ * Performs the lookups queued up in a name resolver until it's free'd. Meant to
+ * be run on its own thread.
+ *
+ * @param arg Name resolver.
+ */
+void gopher_resolver_work(void *arg) {
+	gopher_resolver_job_t **link;
+	gopher_resolver_job_t *job;
+	gopher_resolver_t *res;
+	char c;
+
+	res = (gopher_resolver_t *)arg;
+	gopher_mutex_lock(&res->lock);
+	while (!res->closing) {
+		/* Wait for something to do. */
+		job = res->queued;
+		if (job == NULL) {
+			gopher_event_reset(&res->work);
+			gopher_mutex_unlock(&res->lock);
+			gopher_event_wait(&res->work, -1);
+			gopher_mutex_lock(&res->lock);
+			continue;
+		}
+
+		/* Take the lookup off the queue. */
+		res->queued = job->next;
+		if (res->queued == NULL)
+			res->queued_tail = &res->queued;
+		job->next = res->active;
+		res->active = job;
+		gopher_mutex_unlock(&res->lock);
+
+		/* Resolve the host, filling up the cache along the way. */
+		job->err = gopher_lookup(job->host, job->port, job->timeout, NULL, 0,
+			&job->query);
+
+		gopher_mutex_lock(&res->lock);
+		for (link = &res->active; *link != job; link = &(*link)->next)
+			;
+		*link = job->next;
+		job->next = NULL;
+
+		/* Throw the results away if every request was cancelled. */
+		if (job->reqs == NULL) {
+			gopher_resolver_job_free(job);
+			continue;
+		}
+
+		/* Queue up the results, waking up the event loop if needed. */
+		if (res->done == NULL) {
+			c = 0;
+#ifndef _WIN32
+			if ((write(res->notify[1], &c, 1) == -1) && (errno != EAGAIN))
+				log_errno(LOG_ERROR, "Failed to notify resolver completion");
+#endif /* !_WIN32 */
+		}
+		*res->done_tail = job;
+		res->done_tail = &job->next;
+	}
+	gopher_mutex_unlock(&res->lock);
+
+	gopher_resolver_release(res);
+}
+
+/**
+ * Looks for a lookup of a specific host in a list.
+ *
+ * @param jobs List of lookups.
+ * @param host Host name being looked up.
+ * @param port Port of the server.
+ *
+ * @return Lookup of the host or NULL if there isn't one.
+ */
+gopher_resolver_job_t *gopher_resolver_find(gopher_resolver_job_t *jobs,
+											const char *host, uint16_t port) {
+	for (; jobs != NULL; jobs = jobs->next) {
+		if ((jobs->port == port) && (strcmp(jobs->host, host) == 0))
+			return jobs;
+	}
+
+	return NULL;
+}
+
+/**
+ * Frees up a lookup. Its requests are left untouched.
+ *
+ * @param job Lookup to be free'd.
+ */
+void gopher_resolver_job_free(gopher_resolver_job_t *job) {
+	if (job->query)
+		gopher_addrinfo_free(job->query);
+	free(job->host);
+	free(job);
+}
+
+/**
+ * Releases a reference to a name resolver, freeing it if it was the last one.
+ *
+ * @param res Name resolver.
+ */
+void gopher_resolver_release(gopher_resolver_t *res) {
+	int refs;
+
+	/* Drop our reference. */
+	gopher_mutex_lock(&res->lock);
+	refs = --res->refs;
+	gopher_mutex_unlock(&res->lock);
+	if (refs > 0)
+		return;
+
+	/* Free the object's members. */
+#ifndef _WIN32
+	if (res->notify[0] != -1)
+		close(res->notify[0]);
+	if (res->notify[1] != -1)
+		close(res->notify[1]);
+#endif /* !_WIN32 */
+	gopher_event_destroy(&res->work);
+	gopher_mutex_destroy(&res->lock);
+
+	/* Free the object itself. */
+	free(res);
+}
+
+/*
+ * +===========================================================================+
+ * |                                                                           |
+ * |                           Connection Warm Pool                            |
+ * |                                                                           |
+ * +===========================================================================+
+ */
+
+/* Warm pool state. */
+static gopher_global_lock_t gopher_pool_lock = GOPHER_GLOBAL_LOCK_INIT;
+static gopher_pool_host_t *gopher_pool_hosts = NULL;
+static size_t gopher_pool_size = 0;
+static unsigned long gopher_pool_max_idle = POOL_MAX_IDLE;
+static unsigned long gopher_pool_host_ttl = POOL_HOST_TTL;
+static gopher_pool_stats_t gopher_pool_counters;
+static gopher_event_t gopher_pool_wakeup;
+static int gopher_pool_ready = 0;
+static int gopher_pool_worker = 0;
+
+/**
+ * Configures the pool of connections that are opened ahead of time to recently
+ * used servers, so that gopher_connect() doesn't have to wait on a handshake.
+ * The pool is disabled by default.
+ *
+ * @param per_host Number of idle connections to keep open to each server, or 0
+ *                 to disable the pool and close every idle connection.
+ * @param max_idle Number of milliseconds an idle connection is trusted for.
+ * @param host_ttl Number of milliseconds a server is kept warm after it was
+ *                 last connected to, or 0 to keep it warm forever.
+ */
+void gopher_pool_config(size_t per_host, unsigned long max_idle,
+						unsigned long host_ttl) {
+	gopher_global_lock(&gopher_pool_lock);
+
+	gopher_pool_size = (per_host > POOL_MAX_PER_HOST) ? POOL_MAX_PER_HOST :
+		per_host;
+	gopher_pool_max_idle = max_idle;
+	gopher_pool_host_ttl = host_ttl;
+	if (gopher_pool_size == 0)
+		gopher_pool_sweep(1);
+
+	/* Let the worker know that things have changed. */
+	gopher_pool_kick();
+
+	gopher_global_unlock(&gopher_pool_lock);
+}
+
+/**
+ * Starts keeping connections to a server warm before it's ever connected to,
+ * for example when the user is about to follow a link to it.
+ *
+ * @param host    Domain name or IP address of the server.
+ * @param port    Port of the server.
+ * @param profile Tuning profile of the connections that will be asked for.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_pool_warm(const char *host, uint16_t port,
+					 gopher_sockprof_t profile) {
+	gopher_pool_host_t *ph;
+	int ret;
+
+	gopher_global_lock(&gopher_pool_lock);
+
+	/* Is the pool even enabled? */
+	if (gopher_pool_size == 0) {
+		gopher_global_unlock(&gopher_pool_lock);
+		return EINVAL;
+	}
+
+	/* Register the server and get the worker going. */
+	ph = gopher_pool_find(host, port, profile, 1);
+	if (ph == NULL) {
+		gopher_global_unlock(&gopher_pool_lock);
+		return ENOMEM;
+	}
+	ph->used = gopher_clock_ms();
+	ret = gopher_pool_kick();
+
+	gopher_global_unlock(&gopher_pool_lock);
+
+	return ret;
+}
+
+/**
+ * Closes every idle connection in the pool and forgets about every server.
+ */
+void gopher_pool_flush(void) {
+	gopher_global_lock(&gopher_pool_lock);
+	gopher_pool_sweep(1);
+	gopher_global_unlock(&gopher_pool_lock);
+}
+
+/**
+ * Gets a snapshot of the warm pool counters.
+ *
+ * @param stats Structure to be populated with the counters.
+ */
+void gopher_pool_stats(gopher_pool_stats_t *stats) {
+	gopher_global_lock(&gopher_pool_lock);
+	*stats = gopher_pool_counters;
+	gopher_global_unlock(&gopher_pool_lock);
+}
+
+/**
+ * Takes a warm connection to the server of a gopherspace address object out of
+ * the pool. The server is remembered, so that the pool starts keeping it warm,
+ * even if there was no connection to be taken.
+ *
+ * @param addr Gopherspace address object that isn't connected.
+ *
+ * @return 0 if a connection was taken, ENOENT if there was none, or another
+ *         error code that can be checked against strerror().
+ */
+int gopher_pool_take(gopher_addr_t *addr) {
+	gopher_pool_conn_t conn;
+	gopher_pool_host_t *ph;
+	unsigned long now;
+	int found;
+
+	gopher_global_lock(&gopher_pool_lock);
+
+	/* Is the pool even enabled? */
+	if (gopher_pool_size == 0) {
+		gopher_global_unlock(&gopher_pool_lock);
+		return ENOENT;
+	}
+
+	/* Remember the server so that connections to it are kept warm. */
+	ph = gopher_pool_find(addr->host, addr->port, addr->profile, 1);
+	if (ph == NULL) {
+		gopher_global_unlock(&gopher_pool_lock);
+		return ENOMEM;
+	}
+	now = gopher_clock_ms();
+	ph->used = now;
+
+	/* Grab the freshest connection that's still alive. */
+	found = 0;
+	while (!found && (ph->count > 0)) {
+		conn = ph->conns[--ph->count];
+		gopher_pool_counters.idle--;
+		found = gopher_pool_alive(&conn, now);
+		if (!found) {
+			gopher_pool_conn_close(&conn);
+			gopher_pool_counters.stale++;
+		}
+	}
+	if (found) {
+		gopher_pool_counters.hits++;
+	} else {
+		gopher_pool_counters.misses++;
+	}
+
+	/* Get a replacement going. */
+	gopher_pool_kick();
+
+	gopher_global_unlock(&gopher_pool_lock);
+	if (!found)
+		return ENOENT;
+
+	/* Hand the connection over. */
+	log_printf(LOG_INFO, "Using a warm connection to %s\n", addr->host);
+	if (addr->ipaddr)
+		free(addr->ipaddr);
+	addr->ipaddr = conn.ipaddr;
+	addr->ipaddr_len = conn.ipaddr_len;
+	addr->sockfd = conn.sockfd;
+
+	return 0;
+}
+
+/**
+ * Opens connections to the servers in the pool that are short on them and
+ * throws away the ones that have gone stale, until the pool is disabled. Meant
+ * to be run on its own thread.
+ *
+ * @param arg Unused.
+ */
+void gopher_pool_work(void *arg) {
+	gopher_pool_host_t *ph;
+	gopher_addr_t *addr;
+	unsigned long now;
+	long wait;
+	int ret;
+
+	(void)arg;
+	gopher_global_lock(&gopher_pool_lock);
+	while (gopher_pool_size > 0) {
+		/* Throw away what has gone stale. */
+		gopher_pool_sweep(0);
+
+		/* Look for a server that is short on connections. */
+		now = gopher_clock_ms();
+		for (ph = gopher_pool_hosts; ph != NULL; ph = ph->next) {
+			if (((ph->count + ph->opening) < gopher_pool_size) &&
+					((long)(now - ph->retry_at) >= 0)) {
+				break;
+			}
+		}
+
+		/* Sleep until there's something to do or something to sweep. */
+		if (ph == NULL) {
+			wait = -1;
+			if (gopher_pool_hosts != NULL) {
+				wait = POOL_SWEEP_INTERVAL;
+				if ((gopher_pool_max_idle / 2) < (unsigned long)wait)
+					wait = (long)(gopher_pool_max_idle / 2) + 1;
+			}
+			gopher_event_reset(&gopher_pool_wakeup);
+			gopher_global_unlock(&gopher_pool_lock);
+			gopher_event_wait(&gopher_pool_wakeup, wait);
+			gopher_global_lock(&gopher_pool_lock);
+			continue;
+		}
+
+		/* Set up the connection. */
+		addr = gopher_addr_new(ph->host, ph->port, NULL, GOPHER_TYPE_UNKNOWN);
+		if (addr == NULL) {
+			ph->retry_at = now + POOL_RETRY_DELAY;
+			continue;
+		}
+		addr->flags = GOPHER_FLAG_NOPOOL | GOPHER_FLAG_FASTTERM |
+			GOPHER_FLAG_NOTFO;
+		addr->profile = ph->profile;
+		addr->timeouts.connect = POOL_CONNECT_TIMEOUT;
+		ph->opening++;
+
+		/* Connect without holding up everyone else. */
+		gopher_global_unlock(&gopher_pool_lock);
+		ret = gopher_connect(addr);
+		gopher_global_lock(&gopher_pool_lock);
+
+		/* The server may have been forgotten in the meantime. */
+		ph = gopher_pool_find(addr->host, addr->port, addr->profile, 0);
+		if (ph != NULL) {
+			if (ph->opening > 0)
+				ph->opening--;
+			if (ret != 0) {
+				log_printf(LOG_WARNING, "Failed to warm up a connection to "
+					"%s: %s\n", addr->host, gopher_strerror(ret));
+				ph->retry_at = gopher_clock_ms() + POOL_RETRY_DELAY;
+			} else if (ph->count < gopher_pool_size) {
+				/* Keep the connection in the pool. */
+				ph->conns[ph->count].sockfd = addr->sockfd;
+				ph->conns[ph->count].ipaddr = addr->ipaddr;
+				ph->conns[ph->count].ipaddr_len = addr->ipaddr_len;
+				ph->conns[ph->count].since = gopher_clock_ms();
+				ph->count++;
+				gopher_pool_counters.opened++;
+				gopher_pool_counters.idle++;
+				addr->sockfd = INVALID_SOCKET;
+				addr->ipaddr = NULL;
+			}
+		}
+		gopher_addr_free(addr);
+	}
+	gopher_pool_worker = 0;
+	gopher_global_unlock(&gopher_pool_lock);
+}
+
+/**
+ * Wakes up the pool worker, starting it up if needed. Must be called with the
+ * pool lock held.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_pool_kick(void) {
+	int ret;
+
+	/* Set up the event used to wake up the worker. */
+	if (!gopher_pool_ready) {
+		ret = gopher_event_init(&gopher_pool_wakeup);
+		if (ret != 0)
+			return ret;
+		gopher_pool_ready = 1;
+	}
+
+	/* Start up the worker if there's work for it. */
+	if (!gopher_pool_worker && (gopher_pool_size > 0) &&
+			(gopher_pool_hosts != NULL)) {
+		ret = gopher_thread_spawn(gopher_pool_work, NULL);
+		if (ret != 0) {
+			log_printf(LOG_ERROR, "Failed to start the warm pool worker\n");
+			return ret;
+		}
+		gopher_pool_worker = 1;
+	}
+
+	gopher_event_set(&gopher_pool_wakeup);
+
+	return 0;
+}
+
+/**
+ * Looks for a server in the pool. Must be called with the pool lock held.
+ * Connections to the same server with different tuning profiles are kept
+ * apart, since some of their options can't be changed once connected.
+ *
+ * @param host    Domain name or IP address of the server.
+ * @param port    Port of the server.
+ * @param profile Tuning profile of the connections.
+ * @param add     Add the server to the pool if it isn't there yet? The server
+ *                that was used the longest time ago is evicted if the pool is
+ *                full.
+ *
+ * @return Server in the pool or NULL if it wasn't found or couldn't be added.
+ */
+gopher_pool_host_t *gopher_pool_find(const char *host, uint16_t port,
+									 gopher_sockprof_t profile, int add) {
+	gopher_pool_host_t **oldest;
+	gopher_pool_host_t **link;
+	gopher_pool_host_t *ph;
+	size_t count;
+
+	/* Look for the server. */
+	count = 0;
+	oldest = NULL;
+	for (link = &gopher_pool_hosts; *link != NULL; link = &(*link)->next) {
+		ph = *link;
+		if ((ph->port == port) && (ph->profile == profile) &&
+				(strcmp(ph->host, host) == 0)) {
+			return ph;
+		}
+		if ((oldest == NULL) || ((long)(ph->used - (*oldest)->used) < 0))
+			oldest = link;
+		count++;
+	}
+	if (!add)
+		return NULL;
+
+	/* Make room for it. */
+	if (count >= POOL_MAX_HOSTS) {
+		ph = *oldest;
+		*oldest = ph->next;
+		gopher_pool_host_free(ph);
+	}
+
+	/* Add it to the pool. */
+	ph = (gopher_pool_host_t *)calloc(1, sizeof(gopher_pool_host_t));
+	if (ph == NULL)
+		return NULL;
+	ph->host = strdup(host);
+	if (ph->host == NULL) {
+		free(ph);
+		return NULL;
+	}
+	ph->port = port;
+	ph->profile = profile;
+	ph->used = gopher_clock_ms();
+	ph->retry_at = ph->used;
+	ph->next = gopher_pool_hosts;
+	gopher_pool_hosts = ph;
+
+	return ph;
+}
+
+/**
+ * Closes idle connections that have gone stale and forgets servers that
+ * haven't been used in a while. Must be called with the pool lock held.
+ *
+ * @param all Close every connection and forget every server instead?
+ */
+void gopher_pool_sweep(int all) {
+	gopher_pool_host_t **link;
+	gopher_pool_host_t *ph;
+	unsigned long now;
+	size_t kept;
+	size_t i;
+
+	now = gopher_clock_ms();
+	link = &gopher_pool_hosts;
+	while (*link != NULL) {
+		ph = *link;
+
+		/* Forget servers nobody cares about anymore. */
+		if (all || ((gopher_pool_host_ttl > 0) &&
+				((now - ph->used) >= gopher_pool_host_ttl))) {
+			*link = ph->next;
+			gopher_pool_host_free(ph);
+			continue;
+		}
+
+		/* Close the connections that have gone stale. */
+		kept = 0;
+		for (i = 0; i < ph->count; i++) {
+			if (gopher_pool_alive(&ph->conns[i], now)) {
+				ph->conns[kept++] = ph->conns[i];
+			} else {
+				gopher_pool_conn_close(&ph->conns[i]);
+				gopher_pool_counters.stale++;
+				gopher_pool_counters.idle--;
+			}
+		}
+		ph->count = kept;
+
+		link = &ph->next;
+	}
+}
+
+/**
+ * Checks if an idle connection can still be trusted. An idle connection has
+ * nothing to say, so anything to be read from it means that the server has
+ * hung up on us.
+ *
+ * @param conn Idle connection.
+ * @param now  Current time from gopher_clock_ms().
+ *
+ * @return TRUE if the connection is still alive.
+ */
+int gopher_pool_alive(const gopher_pool_conn_t *conn, unsigned long now) {
+	int ready;
+
+	if ((now - conn->since) >= gopher_pool_max_idle)
+		return 0;
+
+	return gopher_socket_poll(&conn->sockfd, &ready, 1, 0, 0, NULL) == 0;
+}
+
+/**
+ * Closes an idle connection.
+ *
+ * @param conn Idle connection to be closed.
+ */
+void gopher_pool_conn_close(gopher_pool_conn_t *conn) {
+	sockclose(conn->sockfd);
+	conn->sockfd = INVALID_SOCKET;
+	free(conn->ipaddr);
+	conn->ipaddr = NULL;
+}
+
+/**
+ * Frees up a server in the pool, closing its idle connections. Must be called
+ * with the pool lock held.
+ *
+ * @param ph Server to be free'd.
+ */
+void gopher_pool_host_free(gopher_pool_host_t *ph) {
+	size_t i;
+
+	for (i = 0; i < ph->count; i++)
+		gopher_pool_conn_close(&ph->conns[i]);
+	gopher_pool_counters.idle -= ph->count;
+	free(ph->host);
+	free(ph);
+}
+
+/*
+ * +===========================================================================+
+ * |                                                                           |
+ * |                            Bandwidth Limiting                             |
+ * |                                                                           |
+ * +===========================================================================+
+ */
+
+/* Shared bandwidth cap of background transfers. */
+static gopher_global_lock_t gopher_rate_lock = GOPHER_GLOBAL_LOCK_INIT;
+static unsigned long gopher_rate_global = 0;
+static unsigned long gopher_rate_global_burst = 0;
+static double gopher_rate_tokens = 0;
+static unsigned long gopher_rate_at = 0;
+
+/**
+ * Caps the combined bandwidth of every transfer flagged with
+ * GOPHER_FLAG_BACKGROUND, so that bulk jobs leave room on the link for the
+ * interactive requests that aren't flagged. Each connection may also be capped
+ * on its own through the rate_limit field of its address object. Both caps can
+ * be changed at any time, even while transfers are under way.
+ *
+ * @param rate  Maximum number of bytes per second to be received by background
+ *              transfers, or 0 to lift the cap.
+ * @param burst Maximum number of bytes that may be received at once after the
+ *              background transfers were idle, or 0 for a sensible default.
+ */
+void gopher_rate_limit(unsigned long rate, unsigned long burst) {
+	gopher_global_lock(&gopher_rate_lock);
+
+	/* Start off with a full bucket if we weren't capped before. */
+	if (gopher_rate_global == 0)
+		gopher_rate_at = 0;
+	gopher_rate_global = rate;
+	gopher_rate_global_burst = burst;
+
+	gopher_global_unlock(&gopher_rate_lock);
+}
+
+/**
+ * Holds back a connection until its bandwidth caps allow it to receive more
+ * data. Naps instead of polling and keeps checking the caps in case they are
+ * changed while we wait.
+ *
+ * @param addr Gopherspace address object about to receive data.
+ * @param len  Number of bytes we'd like to receive. Returns the number of bytes
+ *             we're allowed to receive right now.
+ *
+ * @return 0 if the operation was successful, GOPHER_ERR_TOTAL_TIMEOUT if the
+ *         deadline of the request was reached while waiting, or
+ *         GOPHER_ERR_CANCELLED if the connection was cancelled.
+ */
+int gopher_rate_wait(gopher_addr_t *addr, size_t *len) {
+	unsigned long burst;
+	unsigned long rate;
+	unsigned long now;
+	double avail;
+	double need;
+	double nap;
+	long left;
+	int err;
+
+	/* Are we even capped? */
+	if (!addr->rate_limit && !(addr->flags & GOPHER_FLAG_BACKGROUND))
+		return 0;
+
+	for (;;) {
+		now = gopher_clock_ms();
+		avail = -1;
+		need = (*len < RATE_MIN_READ) ? (double)*len : RATE_MIN_READ;
+		nap = 0;
+
+		/* Check our own cap. */
+		rate = addr->rate_limit;
+		if (rate > 0) {
+			burst = gopher_rate_burst(rate);
+			gopher_rate_refill(&addr->rate_tokens, &addr->rate_at, rate, burst,
+				now);
+			if (need > burst)
+				need = burst;
+			if (addr->rate_tokens < need)
+				nap = (need - addr->rate_tokens) * 1000.0 / rate;
+			avail = addr->rate_tokens;
+		}
+
+		/* Check the cap shared by all background transfers. */
+		if (addr->flags & GOPHER_FLAG_BACKGROUND) {
+			gopher_global_lock(&gopher_rate_lock);
+			rate = gopher_rate_global;
+			if (rate > 0) {
+				burst = (gopher_rate_global_burst > 0) ?
+					gopher_rate_global_burst : gopher_rate_burst(rate);
+				gopher_rate_refill(&gopher_rate_tokens, &gopher_rate_at, rate,
+					burst, now);
+				if (need > burst)
+					need = burst;
+				if ((gopher_rate_tokens < need) &&
+						(((need - gopher_rate_tokens) * 1000.0 / rate) > nap)) {
+					nap = (need - gopher_rate_tokens) * 1000.0 / rate;
+				}
+				if ((avail < 0) || (gopher_rate_tokens < avail))
+					avail = gopher_rate_tokens;
+			}
+			gopher_global_unlock(&gopher_rate_lock);
+		}
+
+		/* Let through as much as we have tokens for. */
+		if (avail < 0)
+			return 0;
+		if (nap <= 0) {
+			if (avail < (double)*len)
+				*len = (size_t)avail;
+			return 0;
+		}
+
+		/* Nap until there are enough tokens, unless we've been cancelled. */
+		if (gopher_cancel_triggered(addr->cancel))
+			return GOPHER_ERR_CANCELLED;
+		err = 0;
+		left = gopher_deadline(addr, 0, 0, 0, &err);
+		if (left == 0) {
+			log_printf(LOG_ERROR, "%s\n", gopher_strerror(err));
+			return err;
+		}
+		if (nap > RATE_MAX_SLEEP)
+			nap = RATE_MAX_SLEEP;
+		if ((left > 0) && (nap > left))
+			nap = left;
+		gopher_sleep_ms((nap < 1) ? 1 : (unsigned long)nap);
+
+		/* Time spent holding back doesn't count as the server being idle. */
+		if (gopher_timeouts_active(addr))
+			addr->last_io = gopher_clock_ms();
+	}
+}
+
+/**
+ * Takes the data a connection has just received out of its bandwidth caps.
+ *
+ * @param addr Gopherspace address object that received data.
+ * @param len  Number of bytes that were received.
+ */
+void gopher_rate_charge(gopher_addr_t *addr, size_t len) {
+	if (addr->rate_limit > 0)
+		addr->rate_tokens -= len;
+
+	if (addr->flags & GOPHER_FLAG_BACKGROUND) {
+		gopher_global_lock(&gopher_rate_lock);
+		if (gopher_rate_global > 0)
+			gopher_rate_tokens -= len;
+		gopher_global_unlock(&gopher_rate_lock);
+	}
+}
+
+/**
+ * Gets the default burst size of a bandwidth cap.
+ *
+ * @param rate Bandwidth cap in bytes per second.
+ *
+ * @return Maximum number of bytes let through at once.
+ */
+unsigned long gopher_rate_burst(unsigned long rate) {
+	unsigned long burst;
+
+	burst = rate / (1000 / RATE_BURST_MS);
+	return (burst < RATE_MIN_BURST) ? RATE_MIN_BURST : burst;
+}
+
+/**
+ * Tops up a token bucket with the tokens earned since it was last topped up.
+ * Buckets that were never used start off full.
+ *
+ * @param tokens Number of tokens in the bucket. May be negative when
+ *               concurrent transfers took out more than there was.
+ * @param at     Clock reading of when the bucket was last topped up, 0 if never.
+ * @param rate   Number of tokens earned per second.
+ * @param burst  Maximum number of tokens the bucket can hold.
+ * @param now    Current clock reading.
+ */
+void gopher_rate_refill(double *tokens, unsigned long *at, unsigned long rate,
+						unsigned long burst, unsigned long now) {
+	if (*at == 0) {
+		*tokens = burst;
+	} else {
+		*tokens += (double)(now - *at) * rate / 1000.0;
+		if (*tokens > burst)
+			*tokens = burst;
+	}
+	*at = now;
+}
+
+/*
+ * +===========================================================================+
+ * |                                                                           |
+ * |                               Cancellation                                |
+ * |                                                                           |
+ * +===========================================================================+
+ */
+
+/**
+ * Allocates a cancellation token. Attach it to the cancel field of any number
+ * of gopherspace address objects, then trigger it from any thread to make every
+ * blocking operation on those connections give up with GOPHER_ERR_CANCELLED.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @return Cancellation token or NULL if an error occurred and errno is set.
+ *
+ * @see gopher_cancel_free
+ */
+gopher_cancel_t *gopher_cancel_new(void) {
+	gopher_cancel_t *cancel;
+
+	/* Allocate the object. */
+	cancel = (gopher_cancel_t *)malloc(sizeof(gopher_cancel_t));
+	if (cancel == NULL) {
+		log_errno(LOG_ERROR, "Failed to allocate memory for cancellation "
+			"token");
+		return NULL;
+	}
+	cancel->triggered = 0;
+
+#ifndef _WIN32
+	/* Set up the pipe that wakes up anyone waiting on a socket. */
+	if (pipe(cancel->fds) != 0) {
+		log_errno(LOG_ERROR, "Failed to create cancellation token pipe");
+		free(cancel);
+		return NULL;
+	}
+	fcntl(cancel->fds[0], F_SETFL, fcntl(cancel->fds[0], F_GETFL) |
+		O_NONBLOCK);
+	fcntl(cancel->fds[1], F_SETFL, fcntl(cancel->fds[1], F_GETFL) |
+		O_NONBLOCK);
+#endif /* !_WIN32 */
+
+	gopher_mutex_init(&cancel->lock);
+
+	return cancel;
+}
+
+/**
+ * Cancels every operation on the connections a token is attached to. Safe to
+ * call from any thread and more than once.
+ *
+ * @param cancel Cancellation token.
+ */
+void gopher_cancel_trigger(gopher_cancel_t *cancel) {
+	gopher_mutex_lock(&cancel->lock);
+	if (!cancel->triggered) {
+		cancel->triggered = 1;
+#ifndef _WIN32
+		if (write(cancel->fds[1], "x", 1) != 1)
+			log_errno(LOG_WARNING, "Failed to wake up cancelled operations");
+#endif /* !_WIN32 */
+	}
+	gopher_mutex_unlock(&cancel->lock);
+}
+
+/**
+ * Checks if a cancellation token has been triggered.
+ *
+ * @param cancel Cancellation token. May be NULL.
+ *
+ * @return TRUE if the token has been triggered.
+ */
+int gopher_cancel_triggered(const gopher_cancel_t *cancel) {
+	int triggered;
+
+	if (cancel == NULL)
+		return 0;
+
+	gopher_mutex_lock((gopher_mutex_t *)&cancel->lock);
+	triggered = cancel->triggered;
+	gopher_mutex_unlock((gopher_mutex_t *)&cancel->lock);
+
+	return triggered;
+}
+
+/**
+ * Rearms a cancellation token so that it can be used for new operations. Must
+ * not be called while operations are still using it.
+ *
+ * @param cancel Cancellation token.
+ */
+void gopher_cancel_reset(gopher_cancel_t *cancel) {
+#ifndef _WIN32
+	char buf[16];
+#endif /* !_WIN32 */
+
+	gopher_mutex_lock(&cancel->lock);
+#ifndef _WIN32
+	while (read(cancel->fds[0], buf, sizeof(buf)) > 0)
+		;
+#endif /* !_WIN32 */
+	cancel->triggered = 0;
+	gopher_mutex_unlock(&cancel->lock);
+}
+
+/**
+ * Frees up a cancellation token. Must not be attached to any connection that's
+ * still being used.
+ *
+ * @param cancel Cancellation token to be free'd.
+ */
+void gopher_cancel_free(gopher_cancel_t *cancel) {
+	if (cancel == NULL)
+		return;
+
+#ifndef _WIN32
+	close(cancel->fds[0]);
+	close(cancel->fds[1]);
+#endif /* !_WIN32 */
+	gopher_mutex_destroy(&cancel->lock);
+	free(cancel);
+}
+
+/*
+ * +===========================================================================+
+ * |                                                                           |
+ * |                            Request Coalescing                             |
+ * |                                                                           |
+ * +===========================================================================+
+ */
+
+/* Request coalescing state. */
+static gopher_global_lock_t gopher_flight_lock = GOPHER_GLOBAL_LOCK_INIT;
+static gopher_flight_t *gopher_flights = NULL;
+static gopher_fetch_stats_t gopher_flight_counters;
+
+/**
+ * Connects to a server, requests a directory and disconnects, sharing the work
+ * with anyone else who's fetching the same directory at the same time. The
+ * first caller does the fetch while the others wait for it and get the very
+ * same directory object, or the very same error.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param addr Gopherspace address object of the directory. Its flags,
+ *             timeouts, socket profile, bandwidth cap and cancellation token
+ *             are used if we end up doing the fetch. It's never modified nor
+ *             taken over.
+ * @param dir  Pointer to where the directory will be stored. It's shared with
+ *             other callers, so it must be treated as read-only (no history
+ *             links either) and released with gopher_dir_release instead of
+ *             being free'd.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_dir_release
+ * @see gopher_cache_limits
+ */
+int gopher_dir_fetch(const gopher_addr_t *addr, gopher_dir_t **dir) {
+	return gopher_dir_fetch_in(addr, dir, 1);
+}
+
+/**
+ * Fetches a directory, sharing the work with identical fetches that are under
+ * way and storing the result in the response cache.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param addr   Gopherspace address object of the directory.
+ * @param dir    Pointer to where the shared directory will be stored.
+ * @param lookup Should we look for the directory in the response cache first?
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_dir_fetch
+ */
+int gopher_dir_fetch_in(const gopher_addr_t *addr, gopher_dir_t **dir,
+						int lookup) {
+	gopher_flight_t *flight;
+	char *key;
+	int ret;
+
+	*dir = NULL;
+	key = gopher_fetch_key(addr, GOPHER_TYPE_DIR);
+	if (key == NULL)
+		return ENOMEM;
+
+	/* Serve it straight from the response cache if we can. */
+	if (lookup && gopher_cache_get(addr, key, &flight, NULL, NULL)) {
+		free(key);
+		*dir = flight->dir;
+
+		return 0;
+	}
+
+	for (;;) {
+		gopher_global_lock(&gopher_flight_lock);
+
+		/* Look for an identical fetch that's still under way. */
+		for (flight = gopher_flights; flight != NULL; flight = flight->next) {
+			if (!flight->done && (strcmp(flight->key, key) == 0))
+				break;
+		}
+
+		/* Nobody is fetching it, so it's up to us. */
+		if (flight == NULL) {
+			flight = gopher_flight_new(key);
+			if (flight == NULL) {
+				gopher_global_unlock(&gopher_flight_lock);
+				free(key);
+				return ENOMEM;
+			}
+			flight->next = gopher_flights;
+			gopher_flights = flight;
+			gopher_flight_counters.fetches++;
+			gopher_global_unlock(&gopher_flight_lock);
+			break;
+		}
+
+		/* Tag along with the fetch that's under way. */
+		flight->refs++;
+		gopher_flight_counters.joined++;
+		gopher_global_unlock(&gopher_flight_lock);
+		ret = gopher_flight_wait(flight, addr->cancel);
+
+		/* Start over if whoever was fetching it got cancelled instead of us. */
+		if ((ret == GOPHER_ERR_CANCELLED) &&
+				!gopher_cancel_triggered(addr->cancel)) {
+			gopher_flight_release(flight);
+			continue;
+		}
+
+		free(key);
+		if (ret != 0) {
+			gopher_flight_release(flight);
+			return ret;
+		}
+		*dir = flight->dir;
+
+		return 0;
+	}
+
+	/* Fetch the directory and let everyone waiting on it know. */
+	ret = gopher_flight_fetch(addr, &flight->dir);
+	if (ret == 0)
+		gopher_cache_put(addr, flight->key, flight, NULL, 0);
+	gopher_global_lock(&gopher_flight_lock);
+	if ((ret != 0) && (flight->dir != NULL)) {
+		gopher_dir_free(flight->dir, RECURSE_NONE, 1);
+		flight->dir = NULL;
+	}
+	flight->err = ret;
+	flight->done = 1;
+	gopher_event_set(&flight->landed);
+	gopher_global_unlock(&gopher_flight_lock);
+
+	if (ret != 0) {
+		gopher_flight_release(flight);
+		return ret;
+	}
+	*dir = flight->dir;
+
+	return 0;
+}
+
+/**
+ * Releases a directory that was obtained with gopher_dir_fetch. It's only
+ * free'd once everyone it was shared with has released it.
+ *
+ * @param dir Gopher directory object to be released.
+ *
+ * @see gopher_dir_fetch
+ */
+void gopher_dir_release(gopher_dir_t *dir) {
+	gopher_flight_t *flight;
+
+	/* Is this even necessary? */
+	if (dir == NULL)
+		return;
+
+	/* Find the fetch it came from. */
+	gopher_global_lock(&gopher_flight_lock);
+	for (flight = gopher_flights; flight != NULL; flight = flight->next) {
+		if (flight->dir == dir)
+			break;
+	}
+	gopher_global_unlock(&gopher_flight_lock);
+	if (flight == NULL) {
+		log_printf(LOG_ERROR, "Released a directory that wasn't fetched\n");
+		return;
+	}
+
+	gopher_flight_release(flight);
+}
+
+/**
+ * Gets a snapshot of the request coalescing counters.
+ *
+ * @param stats Structure to be populated with the counters.
+ */
+void gopher_dir_fetch_stats(gopher_fetch_stats_t *stats) {
+	gopher_flight_t *flight;
+
+	gopher_global_lock(&gopher_flight_lock);
+	*stats = gopher_flight_counters;
+	stats->shared = 0;
+	for (flight = gopher_flights; flight != NULL; flight = flight->next)
+		stats->shared++;
+	gopher_global_unlock(&gopher_flight_lock);
+}
+
+/**
+ * Builds the key that identifies identical fetches, which is the normalized URL
+ * of what's being fetched.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param addr Gopherspace address object of what's being fetched.
+ * @param type Type of what's being fetched, regardless of the address type.
+ *
+ * @return Key string or NULL if an error occurred.
+ */
+char *gopher_fetch_key(const gopher_addr_t *addr, gopher_type_t type) {
+	gopher_addr_t norm;
+	char *key;
+	char *c;
+	size_t i;
+
+	/* Host names are case insensitive and the type doesn't go on the wire. */
+	norm = *addr;
+	norm.type = type;
+	if ((norm.selector != NULL) && (*norm.selector == '\0'))
+		norm.selector = NULL;
+	key = gopher_addr_str(&norm);
+	if (key == NULL)
+		return NULL;
+
+	/* Lowercase the host name that comes right after the scheme. */
+	c = key + 9;
+	for (i = 0; (i < strlen(addr->host)) && (*c != '\0'); i++, c++) {
+		if ((*c >= 'A') && (*c <= 'Z'))
+			*c += 'a' - 'A';
+	}
+
+	return key;
+}
+
+/**
+ * Allocates a directory fetch that's about to take off. Must be called with
+ * the request coalescing lock held.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param key Key of the fetch. Ownership is taken over if successful.
+ *
+ * @return Directory fetch object or NULL if an error occurred.
+ */
+gopher_flight_t *gopher_flight_new(char *key) {
+	gopher_flight_t *flight;
+
+	/* Allocate the object. */
+	flight = (gopher_flight_t *)malloc(sizeof(gopher_flight_t));
+	if (flight == NULL) {
+		log_errno(LOG_ERROR, "Failed to allocate memory for directory fetch");
+		return NULL;
+	}
+
+	/* Set up the event everyone waits on. */
+	if (gopher_event_init(&flight->landed) != 0) {
+		log_printf(LOG_ERROR, "Failed to initialize directory fetch event\n");
+		free(flight);
+		return NULL;
+	}
+
+	/* Populate the object. */
+	flight->key = key;
+	flight->dir = NULL;
+	flight->done = 0;
+	flight->err = 0;
+	flight->refs = 1;
+	flight->next = NULL;
+
+	return flight;
+}
+
+/**
+ * Waits for a directory fetch somebody else is doing to land.
+ *
+ * @param flight Directory fetch to wait on.
+ * @param cancel Optional. Cancellation token that cuts the wait short.
+ *
+ * @return Error code of the fetch or GOPHER_ERR_CANCELLED if we were cancelled
+ *         while waiting.
+ */
+int gopher_flight_wait(gopher_flight_t *flight, gopher_cancel_t *cancel) {
+	int ret;
+
+	/* Wait for it, checking every once in a while if we were cancelled. */
+	while (!gopher_event_wait(&flight->landed,
+			(cancel != NULL) ? CANCEL_POLL_SLICE : -1)) {
+		if (gopher_cancel_triggered(cancel))
+			return GOPHER_ERR_CANCELLED;
+	}
+
+	gopher_global_lock(&gopher_flight_lock);
+	ret = flight->err;
+	gopher_global_unlock(&gopher_flight_lock);
+
+	return ret;
+}
+
+/**
+ * Connects to a server, requests a directory and disconnects, using a private
+ * copy of the address that ends up belonging to the directory.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param addr Gopherspace address object of the directory.
+ * @param dir  Pointer to where the directory will be stored.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_flight_fetch(const gopher_addr_t *addr, gopher_dir_t **dir) {
+	gopher_addr_t *fetch;
+	int ret;
+
+	/* Copy the address along with how the caller wants it to be fetched. */
+	*dir = NULL;
+	fetch = gopher_fetch_addr(addr, GOPHER_TYPE_DIR);
+	if (fetch == NULL)
+		return ENOMEM;
+
+	/* Fetch the directory. */
+	ret = gopher_connect(fetch);
+	if (ret == 0) {
+		ret = gopher_dir_request(fetch, dir);
+		gopher_disconnect(fetch);
+	}
+
+	/* The directory outlives the caller's cancellation token. */
+	fetch->cancel = NULL;
+	if (*dir == NULL)
+		gopher_addr_free(fetch);
+
+	return ret;
+}
+
+/**
+ * Copies a gopherspace address object along with everything that affects how
+ * it's fetched.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param addr Gopherspace address object to be copied.
+ * @param type Type of what's being fetched.
+ *
+ * @return Unconnected copy of the address object or NULL if an error occurred.
+ */
+gopher_addr_t *gopher_fetch_addr(const gopher_addr_t *addr,
+								 gopher_type_t type) {
+	gopher_addr_t *fetch;
+
+	fetch = gopher_addr_new(addr->host, addr->port, addr->selector, type);
+	if (fetch == NULL)
+		return NULL;
+	fetch->flags = addr->flags & ~GOPHER_FLAG_INARENA;
+	fetch->profile = addr->profile;
+	fetch->timeouts = addr->timeouts;
+	fetch->rate_limit = addr->rate_limit;
+	fetch->cache_ttl = addr->cache_ttl;
+	fetch->cancel = addr->cancel;
+
+	return fetch;
+}
+
+/**
+ * Drops a reference to a directory fetch, freeing it along with its directory
+ * once nobody is using it anymore.
+ *
+ * @param flight Directory fetch to be released.
+ */
+void gopher_flight_release(gopher_flight_t *flight) {
+	gopher_flight_t **link;
+
+	/* Drop our reference and unlink it if we were the last ones. */
+	gopher_global_lock(&gopher_flight_lock);
+	if (--flight->refs > 0) {
+		gopher_global_unlock(&gopher_flight_lock);
+		return;
+	}
+	for (link = &gopher_flights; *link != NULL; link = &(*link)->next) {
+		if (*link == flight) {
+			*link = flight->next;
+			break;
+		}
+	}
+	gopher_global_unlock(&gopher_flight_lock);
+
+	/* Free the object. */
+	if (flight->dir != NULL)
+		gopher_dir_free(flight->dir, RECURSE_NONE, 1);
+	gopher_event_destroy(&flight->landed);
+	free(flight->key);
+	free(flight);
+}
+
+/*
+ * +===========================================================================+
+ * |                                                                           |
+ * |                              Response Cache                               |
+ * |                                                                           |
+ * +===========================================================================+
+ */
+
+/* Response cache state, most recently used entries first. */
+static gopher_global_lock_t gopher_cache_lock = GOPHER_GLOBAL_LOCK_INIT;
+static gopher_cache_entry_t *gopher_cache_head = NULL;
+static gopher_cache_entry_t *gopher_cache_tail = NULL;
+static size_t gopher_cache_max_bytes = 0;
+static size_t gopher_cache_max_entry = CACHE_MAX_ENTRY;
+static unsigned long gopher_cache_default_ttl = CACHE_TTL;
+static unsigned long gopher_cache_stale = 0;
+static gopher_cache_stats_t gopher_cache_counters;
+
+/**
+ * Connects to a server, downloads a small text document and disconnects,
+ * serving it from the response cache whenever possible.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param addr Gopherspace address object of the document. Its flags, timeouts,
+ *             socket profile, bandwidth cap, cache lifetime and cancellation
+ *             token are used if we end up fetching it. It's never modified nor
+ *             taken over.
+ * @param text Pointer to a NULL-terminated copy of the document exactly as the
+ *             server sent it. Must be free'd when no longer needed.
+ * @param len  Optional. Pointer to store the size of the document.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_cache_limits
+ */
+int gopher_text_fetch(const gopher_addr_t *addr, char **text, size_t *len) {
+	return gopher_text_fetch_in(addr, text, len, 1);
+}
+
+/**
+ * Sets how much memory the response cache may use. Least recently used entries
+ * are evicted right away if it's shrunk.
+ *
+ * @param max_bytes Maximum number of bytes used by all of the entries, or 0 to
+ *                  disable the cache entirely.
+ * @param max_entry Largest response in bytes worth keeping, or 0 for the
+ *                  default.
+ */
+void gopher_cache_limits(size_t max_bytes, size_t max_entry) {
+	gopher_global_lock(&gopher_cache_lock);
+	gopher_cache_max_bytes = max_bytes;
+	gopher_cache_max_entry = (max_entry > 0) ? max_entry : CACHE_MAX_ENTRY;
+	gopher_cache_trim(max_bytes);
+	gopher_global_unlock(&gopher_cache_lock);
+}
+
+/**
+ * Sets how long responses are kept around by default. Only applies to entries
+ * stored from now on, and can be overridden by the cache_ttl field of the
+ * address object being fetched.
+ *
+ * @param ttl   Number of milliseconds responses are served from the cache for.
+ * @param stale Number of milliseconds after that in which an expired response
+ *              is still served right away while being refreshed in the
+ *              background, or 0 to always wait for a fresh one.
+ */
+void gopher_cache_ttl(unsigned long ttl, unsigned long stale) {
+	gopher_global_lock(&gopher_cache_lock);
+	gopher_cache_default_ttl = ttl;
+	gopher_cache_stale = stale;
+	gopher_global_unlock(&gopher_cache_lock);
+}
+
+/**
+ * Forgets every response in the cache.
+ */
+void gopher_cache_flush(void) {
+	gopher_cache_entry_t *entry;
+
+	gopher_global_lock(&gopher_cache_lock);
+	while (gopher_cache_head != NULL) {
+		entry = gopher_cache_head;
+		gopher_cache_unlink(entry);
+		gopher_cache_entry_free(entry);
+	}
+	gopher_global_unlock(&gopher_cache_lock);
+}
+
+/**
+ * Gets a snapshot of the response cache counters.
+ *
+ * @param stats Structure to be populated with the counters.
+ */
+void gopher_cache_stats(gopher_cache_stats_t *stats) {
+	gopher_global_lock(&gopher_cache_lock);
+	*stats = gopher_cache_counters;
+	stats->max_bytes = gopher_cache_max_bytes;
+	gopher_global_unlock(&gopher_cache_lock);
+}
+
+/**
+ * Downloads a small text document, looking for it in the response cache first
+ * if asked to and storing it there afterwards.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param addr   Gopherspace address object of the document.
+ * @param text   Pointer to a NULL-terminated copy of the document.
+ * @param len    Optional. Pointer to store the size of the document.
+ * @param lookup Should we look for the document in the response cache first?
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_text_fetch
+ */
+int gopher_text_fetch_in(const gopher_addr_t *addr, char **text, size_t *len,
+						 int lookup) {
+	gopher_addr_t *fetch;
+	gopher_file_t *gf;
+	const char *buf;
+	size_t size;
+	char *key;
+	int ret;
+
+	*text = NULL;
+	if (len != NULL)
+		*len = 0;
+	key = gopher_fetch_key(addr, GOPHER_TYPE_TEXT);
+	if (key == NULL)
+		return ENOMEM;
+
+	/* Serve it straight from the response cache if we can. */
+	if (lookup && gopher_cache_get(addr, key, NULL, text, len)) {
+		free(key);
+		return 0;
+	}
+
+	/* Download the document to memory. */
+	fetch = gopher_fetch_addr(addr, GOPHER_TYPE_TEXT);
+	if (fetch == NULL) {
+		free(key);
+		return ENOMEM;
+	}
+	size = 0;
+	ret = gopher_connect(fetch);
+	if (ret == 0) {
+		gf = gopher_file_new_mem(fetch, 0, GOPHER_TYPE_TEXT);
+		if (gf == NULL) {
+			ret = ENOMEM;
+		} else {
+			ret = gopher_file_download(gf);
+			if (ret == 0)
+				ret = gopher_file_mem_buf(gf, &buf, &size);
+
+			/* Hand over a copy that outlives the download object. */
+			if (ret == 0) {
+				*text = (char *)malloc((size + 1) * sizeof(char));
+				if (*text == NULL) {
+					ret = ENOMEM;
+				} else {
+					memcpy(*text, buf, size + 1);
+				}
+			}
+			gopher_file_free(gf);
+		}
+		gopher_disconnect(fetch);
+	}
+	gopher_addr_free(fetch);
+
+	/* Keep it around for next time. */
+	if (ret == 0) {
+		gopher_cache_put(addr, key, NULL, *text, size);
+		if (len != NULL)
+			*len = size;
+	}
+	free(key);
+
+	return ret;
+}
+
+/**
+ * Looks for a response in the cache, kicking off its refresh in the background
+ * if it's stale.
+ *
+ * @param addr   Gopherspace address object of the response.
+ * @param key    Key of the response.
+ * @param flight Pointer to store the directory fetch of a menu, which gets an
+ *               extra reference. NULL if we're looking for a document.
+ * @param text   Pointer to a copy of a document. Unused for menus.
+ * @param len    Optional. Pointer to store the size of a document.
+ *
+ * @return TRUE if the response was served from the cache.
+ */
+int gopher_cache_get(const gopher_addr_t *addr, const char *key,
+					 gopher_flight_t **flight, char **text, size_t *len) {
+	gopher_cache_entry_t *entry;
+	unsigned long age;
+	int refresh;
+
+	/* Is this even necessary? */
+	if (addr->flags & GOPHER_FLAG_NOCACHE)
+		return 0;
+
+	gopher_global_lock(&gopher_cache_lock);
+	if (gopher_cache_max_bytes == 0) {
+		gopher_global_unlock(&gopher_cache_lock);
+		return 0;
+	}
+
+	/* Look for the entry. */
+	for (entry = gopher_cache_head; entry != NULL; entry = entry->next) {
+		if (strcmp(entry->key, key) == 0)
+			break;
+	}
+
+	/* Check if it's still fresh, or at least fresh enough. */
+	refresh = 0;
+	if (entry != NULL) {
+		age = gopher_clock_ms() - entry->stored_at;
+		if (age >= (entry->ttl + entry->stale)) {
+			gopher_cache_unlink(entry);
+			gopher_cache_entry_free(entry);
+			entry = NULL;
+		} else if (age >= entry->ttl) {
+			gopher_cache_counters.stale_hits++;
+			refresh = !entry->refreshing;
+			entry->refreshing = 1;
+		} else {
+			gopher_cache_counters.hits++;
+		}
+	}
+	if (entry == NULL) {
+		gopher_cache_counters.misses++;
+		gopher_global_unlock(&gopher_cache_lock);
+		return 0;
+	}
+
+	/* Hand it over. */
+	if (flight != NULL) {
+		gopher_global_lock(&gopher_flight_lock);
+		entry->flight->refs++;
+		gopher_global_unlock(&gopher_flight_lock);
+		*flight = entry->flight;
+	} else {
+		*text = (char *)malloc((entry->len + 1) * sizeof(char));
+		if (*text == NULL) {
+			gopher_global_unlock(&gopher_cache_lock);
+			return 0;
+		}
+		memcpy(*text, entry->text, entry->len + 1);
+		if (len != NULL)
+			*len = entry->len;
+	}
+
+	/* Make it the most recently used one. */
+	gopher_cache_unlink(entry);
+	entry->next = gopher_cache_head;
+	if (gopher_cache_head != NULL)
+		gopher_cache_head->prev = entry;
+	gopher_cache_head = entry;
+	if (gopher_cache_tail == NULL)
+		gopher_cache_tail = entry;
+	gopher_cache_counters.entries++;
+	gopher_cache_counters.bytes += entry->bytes;
+	gopher_global_unlock(&gopher_cache_lock);
+
+	/* Refresh it without keeping anyone waiting. */
+	if (refresh) {
+		gopher_cache_revalidate(addr, key,
+			(flight != NULL) ? GOPHER_TYPE_DIR : GOPHER_TYPE_TEXT);
+	}
+
+	return 1;
+}
+
+/**
+ * Stores a response in the cache, replacing any older copy of it and evicting
+ * the least recently used entries to make room.
+ *
+ * @param addr   Gopherspace address object of the response.
+ * @param key    Key of the response.
+ * @param flight Directory fetch of a menu, which gets an extra reference. NULL
+ *               if we're storing a document.
+ * @param text   Document to be copied. Unused for menus.
+ * @param len    Size of the document.
+ */
+void gopher_cache_put(const gopher_addr_t *addr, const char *key,
+					  gopher_flight_t *flight, const char *text, size_t len) {
+	gopher_cache_entry_t *entry;
+	size_t bytes;
+
+	/* Is this even necessary? */
+	if (addr->flags & GOPHER_FLAG_NOCACHE)
+		return;
+
+	/* Figure out how much memory it's going to take. */
+	bytes = sizeof(gopher_cache_entry_t) + strlen(key) + 1;
+	bytes += (flight != NULL) ? gopher_cache_dir_size(flight->dir) : len + 1;
+
+	gopher_global_lock(&gopher_cache_lock);
+	if ((bytes > gopher_cache_max_entry) || (bytes > gopher_cache_max_bytes)) {
+		gopher_global_unlock(&gopher_cache_lock);
+		return;
+	}
+
+	/* Get rid of the copy we're replacing. */
+	for (entry = gopher_cache_head; entry != NULL; entry = entry->next) {
+		if (strcmp(entry->key, key) == 0) {
+			gopher_cache_unlink(entry);
+			gopher_cache_entry_free(entry);
+			break;
+		}
+	}
+
+	/* Allocate the entry. */
+	entry = (gopher_cache_entry_t *)malloc(sizeof(gopher_cache_entry_t));
+	if (entry == NULL) {
+		log_errno(LOG_ERROR, "Failed to allocate memory for response cache "
+			"entry");
+		gopher_global_unlock(&gopher_cache_lock);
+		return;
+	}
+	entry->key = strdup(key);
+	entry->flight = NULL;
+	entry->text = NULL;
+	entry->len = len;
+	entry->bytes = bytes;
+	entry->stored_at = gopher_clock_ms();
+	entry->ttl = (addr->cache_ttl > 0) ? addr->cache_ttl :
+		gopher_cache_default_ttl;
+	entry->stale = gopher_cache_stale;
+	entry->refreshing = 0;
+	entry->prev = NULL;
+
+	/* Keep the response. */
+	if (flight == NULL) {
+		entry->text = (char *)malloc((len + 1) * sizeof(char));
+		if (entry->text != NULL)
+			memcpy(entry->text, text, len + 1);
+	}
+	if ((entry->key == NULL) || ((flight == NULL) && (entry->text == NULL))) {
+		gopher_cache_entry_free(entry);
+		gopher_global_unlock(&gopher_cache_lock);
+		return;
+	}
+	if (flight != NULL) {
+		gopher_global_lock(&gopher_flight_lock);
+		flight->refs++;
+		gopher_global_unlock(&gopher_flight_lock);
+		entry->flight = flight;
+	}
+
+	/* Make it the most recently used one and make room for it. */
+	entry->next = gopher_cache_head;
+	if (gopher_cache_head != NULL)
+		gopher_cache_head->prev = entry;
+	gopher_cache_head = entry;
+	if (gopher_cache_tail == NULL)
+		gopher_cache_tail = entry;
+	gopher_cache_counters.entries++;
+	gopher_cache_counters.bytes += bytes;
+	gopher_cache_trim(gopher_cache_max_bytes);
+	gopher_global_unlock(&gopher_cache_lock);
+}
+
+/**
+ * Refreshes a stale response on a background thread.
+ *
+ * @param addr Gopherspace address object of the response.
+ * @param key  Key of the response.
+ * @param type Type of the response.
+ */
+void gopher_cache_revalidate(const gopher_addr_t *addr, const char *key,
+							 gopher_type_t type) {
+	gopher_cache_refresh_t *job;
+
+	/* Package up the request as a low priority one nobody can cancel. */
+	job = (gopher_cache_refresh_t *)malloc(sizeof(gopher_cache_refresh_t));
+	if (job == NULL) {
+		gopher_cache_unmark(key);
+		return;
+	}
+	job->addr = gopher_fetch_addr(addr, type);
+	job->key = strdup(key);
+	if ((job->addr == NULL) || (job->key == NULL))
+		goto failed;
+	job->addr->flags |= GOPHER_FLAG_BACKGROUND;
+	job->addr->cancel = NULL;
+
+	/* Send it off. */
+	if (gopher_thread_spawn(gopher_cache_refresh, job) != 0)
+		goto failed;
+
+	gopher_global_lock(&gopher_cache_lock);
+	gopher_cache_counters.refreshes++;
+	gopher_global_unlock(&gopher_cache_lock);
+
+	return;
+
+failed:
+	log_printf(LOG_ERROR, "Failed to start refreshing a cached response\n");
+	gopher_cache_unmark(key);
+	if (job->addr != NULL)
+		gopher_addr_free(job->addr);
+	if (job->key != NULL)
+		free(job->key);
+	free(job);
+}
+
+/**
+ * Fetches a fresh copy of a stale response, which replaces it in the cache.
+ * Meant to be run on its own thread.
+ *
+ * @param arg Revalidation job.
+ */
+void gopher_cache_refresh(void *arg) {
+	gopher_cache_refresh_t *job;
+	gopher_dir_t *dir;
+	char *text;
+	int ret;
+
+	/* Fetch it without looking in the cache. */
+	job = (gopher_cache_refresh_t *)arg;
+	if (job->addr->type == GOPHER_TYPE_DIR) {
+		ret = gopher_dir_fetch_in(job->addr, &dir, 0);
+		if (ret == 0)
+			gopher_dir_release(dir);
+	} else {
+		ret = gopher_text_fetch_in(job->addr, &text, NULL, 0);
+		if (ret == 0)
+			free(text);
+	}
+
+	/* Let the stale entry be refreshed again later if we failed. */
+	if (ret != 0) {
+		log_printf(LOG_WARNING, "Failed to refresh cached response: %s\n",
+			gopher_strerror(ret));
+		gopher_cache_unmark(job->key);
+	}
+
+	gopher_addr_free(job->addr);
+	free(job->key);
+	free(job);
+}
+
+/**
+ * Clears the refreshing mark of a stale response.
+ *
+ * @param key Key of the response.
+ */
+void gopher_cache_unmark(const char *key) {
+	gopher_cache_entry_t *entry;
+
+	gopher_global_lock(&gopher_cache_lock);
+	for (entry = gopher_cache_head; entry != NULL; entry = entry->next) {
+		if (strcmp(entry->key, key) == 0) {
+			entry->refreshing = 0;
+			break;
+		}
+	}
+	gopher_global_unlock(&gopher_cache_lock);
+}
+
+/**
+ * Evicts the least recently used entries until the cache fits in a budget.
+ * Must be called with the response cache lock held.
+ *
+ * @param max_bytes Maximum number of bytes the entries may use.
+ */
+void gopher_cache_trim(size_t max_bytes) {
+	gopher_cache_entry_t *entry;
+
+	while ((gopher_cache_counters.bytes > max_bytes) &&
+			(gopher_cache_tail != NULL)) {
+		entry = gopher_cache_tail;
+		gopher_cache_unlink(entry);
+		gopher_cache_entry_free(entry);
+		gopher_cache_counters.evictions++;
+	}
+}
+
+/**
+ * Takes an entry out of the response cache. Must be called with the response
+ * cache lock held.
+ *
+ * @param entry Response cache entry to be unlinked.
+ */
+void gopher_cache_unlink(gopher_cache_entry_t *entry) {
+	if (entry->prev != NULL) {
+		entry->prev->next = entry->next;
+	} else {
+		gopher_cache_head = entry->next;
+	}
+	if (entry->next != NULL) {
+		entry->next->prev = entry->prev;
+	} else {
+		gopher_cache_tail = entry->prev;
+	}
+	entry->prev = NULL;
+	entry->next = NULL;
+
+	gopher_cache_counters.entries--;
+	gopher_cache_counters.bytes -= entry->bytes;
+}
+
+/**
+ * Frees a response cache entry that has already been unlinked.
+ *
+ * @param entry Response cache entry to be free'd.
+ */
+void gopher_cache_entry_free(gopher_cache_entry_t *entry) {
+	if (entry->flight != NULL)
+		gopher_flight_release(entry->flight);
+	if (entry->text != NULL)
+		free(entry->text);
+	if (entry->key != NULL)
+		free(entry->key);
+	free(entry);
+}
+
+/**
+ * Estimates how much memory a directory takes.
+ *
+ * @param dir Gopher directory object.
+ *
+ * @return Approximate number of bytes used by the directory.
+ */
+size_t gopher_cache_dir_size(const gopher_dir_t *dir) {
+	const gopher_item_t *item;
+	size_t bytes;
+
+	bytes = sizeof(gopher_dir_t) + sizeof(gopher_addr_t);
+	for (item = dir->items; item != NULL; item = item->next) {
+		bytes += sizeof(gopher_item_t);
+		if (item->label != NULL)
+			bytes += strlen(item->label) + 1;
+		if (item->addr != NULL) {
+			bytes += sizeof(gopher_addr_t) + strlen(item->addr->host) + 1;
+			if (item->addr->selector != NULL)
+				bytes += strlen(item->addr->selector) + 1;
+		}
+	}
+
+	return bytes;
+}
+
+/*
+ * +===========================================================================+
+ * |                                                                           |
+ * |                            Directory Handling                             |
+ * |                                                                           |
+ * +===========================================================================+
+ */
+
+/**
+ * Allocates and initializes a Gopher directory object.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param addr Gopherspace address object.
+ *
+ * @return Newly initialized Gopher directory object.
+ *
+ * @see gopher_dir_free
+ */
+gopher_dir_t *gopher_dir_new(gopher_addr_t *addr) {
+	gopher_dir_t *dir;
+
+	/* Allocate the object. */
+	dir = (gopher_dir_t *)malloc(sizeof(gopher_dir_t));
+	if (dir == NULL) {
+		log_errno(LOG_ERROR, "Failed to allocate memory for Gopher directory");
+		return NULL;
+	}
+
+	/* Initialize the object. */
+	dir->addr = addr;
+	dir->prev = NULL;
+	dir->next = NULL;
+	dir->items = NULL;
+	dir->items_len = 0;
+	dir->err_count = 0;
+	dir->arena = NULL;
+
+	return dir;
+}
+
+/**
+ * Requests a directory from a Gopher server. If the GOPHER_FLAG_FASTTERM flag is
+ * set in the address, the function returns as soon as the termination line is
+ * received instead of waiting for the server to close the connection. If the
+ * GOPHER_FLAG_ARENA flag is set, all of the directory items are allocated from
+ * a memory arena owned by the directory object.
+ *
+ * @warning Items of an arena-backed directory must not be free'd individually,
+ *          and their addresses should be duplicated before being connected.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param addr Gopherspace address object already connected to the server.
+ * @param dir  Pointer to where the results of the directory will be stored.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_dir_free
+ */
+int gopher_dir_request(gopher_addr_t *addr, gopher_dir_t **dir) {
+	int ret;
+
+	/* Send selector of our request. */
+	ret = gopher_send_line(addr, (addr->selector) ? addr->selector : "", NULL);
+	if (ret != 0) {
+		log_errno(LOG_ERROR, "Failed to send line during directory request");
+		return ret;
+	}
+
+	return gopher_dir_receive(addr, dir);
+}
+
+/**
+ * Sends a query to a search server and receives the directory of results. The
+ * same flags as gopher_dir_request() apply.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param addr  Gopherspace address object already connected to the server.
+ * @param query Search terms to be sent along with the selector.
+ * @param dir   Pointer to where the results of the search will be stored.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_dir_request
+ * @see gopher_dir_free
+ */
+int gopher_search_request(gopher_addr_t *addr, const char *query,
+						  gopher_dir_t **dir) {
+	int ret;
+
+	/* Send selector and query of our request. */
+	ret = gopher_send_request(addr, query, NULL, NULL);
+	if (ret != 0) {
+		log_errno(LOG_ERROR, "Failed to send line during search request");
+		return ret;
+	}
+
+	return gopher_dir_receive(addr, dir);
+}
+
+/**
+ * Receives the directory a server is sending in response to a request.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param addr Gopherspace address object whose request was already sent.
+ * @param dir  Pointer to where the directory will be stored.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_dir_receive(gopher_addr_t *addr, gopher_dir_t **dir) {
+	gopher_dir_builder_t db;
+	gopher_dir_t *pd;
+	int ret;
+
+	/* Initialize directory object. */
+	*dir = gopher_dir_new(addr);
+	pd = *dir;
+	if (*dir == NULL) {
+		log_errno(LOG_ERROR, "Failed to initialize directory object");
+		return -1;
+	}
+
+	/* Set up the memory arena for the items if requested. */
+	if (addr->flags & GOPHER_FLAG_ARENA) {
+		pd->arena = gopher_arena_new(ARENA_CHUNK_SIZE);
+		if (pd->arena == NULL)
+			return ENOMEM;
+	}
+
+	/* Build the directory as items arrive. */
+	db.dir = pd;
+	db.last = NULL;
+	db.err = 0;
+	ret = gopher_dir_parse(addr, gopher_dir_push, &db, &pd->err_count);
+	if (ret == 0)
+		ret = db.err;
+
+	return ret;
+}
+
+/**
+ * Requests a directory from a server handing each item over to a callback as
+ * soon as its line arrives, instead of waiting for the entire menu.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param addr      Gopherspace address object already connected to the server.
+ * @param func      Callback function that will receive each item. Ownership of
+ *                  the item is passed to it, so it must be free'd with
+ *                  gopher_item_free when no longer needed. Returning anything
+ *                  other than 0 stops the transfer.
+ * @param arg       Optional. Parameter to be passed to the callback function.
+ * @param err_count Optional. Returns the number of errors found in the menu.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_dir_request
+ */
+int gopher_dir_request_stream(gopher_addr_t *addr, gopher_dir_item_func func,
+							  void *arg, uint16_t *err_count) {
+	gopher_dir_streamer_t ds;
+	uint16_t errors;
+	int ret;
+
+	/* Send selector of our request. */
+	ret = gopher_send_line(addr, (addr->selector) ? addr->selector : "", NULL);
+	if (ret != 0) {
+		log_errno(LOG_ERROR, "Failed to send line during directory request");
+		return ret;
+	}
+
+	/* Hand the items over as they arrive. */
+	ds.item_cb = func;
+	ds.item_cb_arg = arg;
+	ds.err = 0;
+	errors = 0;
+	ret = gopher_dir_parse(addr, gopher_dir_stream, &ds, &errors);
+	if (err_count != NULL)
+		*err_count = errors;
+	if (ret == 0)
+		ret = ds.err;
+
+	return ret;
+}
+
+/**
+ * Parses a menu sent by the server as it arrives.
+ *
+ * @param addr      Gopherspace address object with the request already sent.
+ * @param func      Callback function that will receive each parsed item.
+ * @param arg       Optional. Parameter to be passed to the callback function.
+ * @param err_count Incremented by the number of errors found in the menu.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_dir_parse(gopher_addr_t *addr, gopher_menu_item_func func,
+					 void *arg, uint16_t *err_count) {
+	gopher_menu_parser_t *mp;
+	int ret;
+
+	/* Set up the parser. */
+	mp = gopher_menu_parser_new(func, arg);
+	if (mp == NULL)
+		return ENOMEM;
+
+	/* Feed everything that comes from the server to the parser. */
+	ret = gopher_menu_recv(addr, mp);
+	gopher_menu_parser_finish(mp);
+	*err_count += mp->err_count;
+	gopher_menu_parser_free(mp);
+
+	return ret;
+}
+
+/**
+ * Appends an item from the menu parser to the directory being built.
+ *
+ * @param view Parsed item.
+ * @param arg  Directory builder object.
+ *
+ * @return 0 to continue parsing or 1 if an error occurred.
+ */
+int gopher_dir_push(const gopher_item_view_t *view, void *arg) {
+	gopher_dir_builder_t *db;
+	gopher_item_t *item;
+
+	/* Build the item object. */
+	db = (gopher_dir_builder_t *)arg;
+	item = gopher_item_from_view(&db->dir->arena, view);
+	if (item == NULL) {
+		db->err = ENOMEM;
+		return 1;
+	}
+
+	/* Push the item into the directory item stack. */
+	if (db->dir->items == NULL)
+		db->dir->items = item;
+	if (db->last != NULL)
+		db->last->next = item;
+	db->last = item;
+	db->dir->items_len++;
+
+	return 0;
+}
+
+/**
+ * Hands an item from the menu parser over to a streaming request callback.
+ *
+ * @param view Parsed item.
+ * @param arg  Directory streamer object.
+ *
+ * @return 0 to continue parsing or 1 to stop.
+ */
+int gopher_dir_stream(const gopher_item_view_t *view, void *arg) {
+	gopher_dir_streamer_t *ds;
+	gopher_item_t *item;
+
+	/* Build the item object. */
+	ds = (gopher_dir_streamer_t *)arg;
+	item = gopher_item_from_view(NULL, view);
+	if (item == NULL) {
+		ds->err = ENOMEM;
+		return 1;
+	}
+
+	return ds->item_cb(item, ds->item_cb_arg) != 0;
+}
+
+/**
+ * Frees a Gopher directory object.
+ *
+ * @param dir       Gopher directory object to be free'd.
+ * @param recurse   Bitwise field to recursively free its history stack.
+ * @param inclusive Should we also free ourselves? If FALSE will only free
+ *                  history in specified recurse direction.
+ */
+void gopher_dir_free(gopher_dir_t *dir, gopher_recurse_dir_t recurse,
+		int inclusive) {
+	/* Is this even necessary? */
+	if (dir == NULL)
+		return;
+
+	/* Ensure we remove ourselves from other objects in the stack. */
+	if (inclusive) {
+		if (dir->next)
+			dir->next->prev = NULL;
+		if (dir->prev)
+			dir->prev->next = NULL;
+	}
+
+	/* Free history backwards. */
+	if (dir->prev && (recurse & RECURSE_BACKWARD)) {
+		gopher_dir_free(dir->prev, RECURSE_BACKWARD, 1);
+		dir->prev = NULL;
+	}
+
+	/* Free history forwards. */
+	if (dir->next && (recurse & RECURSE_FORWARD)) {
+		gopher_dir_free(dir->next, RECURSE_FORWARD, 1);
+		dir->next = NULL;
+	}
+
+	/* Free ourselves too. */
+	if (inclusive) {
+		/* Free the object's members. */
+		dir->items_len = 0;
+		if (dir->arena) {
+			gopher_arena_free(dir->arena);
+			dir->arena = NULL;
+		} else if (dir->items) {
+			gopher_item_free(dir->items, RECURSE_FORWARD);
+		}
+		dir->items = NULL;
+		if (dir->addr)
+			gopher_addr_free(dir->addr);
+
+		/* Free the object itself. */
+		free(dir);
+	}
+}
+
+/*
+ * +===========================================================================+
+ * |                                                                           |
+ * |                             File Downloading                              |
+ * |                                                                           |
+ * +===========================================================================+
+ */
+
+/**
+ * Allocates and initializes a Gopher file download object.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param addr Gopherspace address object already connected to the server.
+ * @param path Path to where to download the file to. NULL to download it to
+ *             memory.
+ * @param hint Hint at the type of file we may be dealing with.
+ *
+ * @return Newly initialized Gopher file download object.
+ *
+ * @see gopher_file_free
+ * @see gopher_file_download
+ * @see gopher_file_new_mem
+ */
+gopher_file_t *gopher_file_new(gopher_addr_t *addr, const char *path,
+							   gopher_type_t hint) {
+	gopher_file_t *gf;
+
+	/* Allocate the object. */
+	gf = (gopher_file_t *)malloc(sizeof(gopher_file_t));
+	if (gf == NULL) {
+		log_errno(LOG_ERROR, "Failed to allocate memory for Gopher file "
+			"download object");
+		return NULL;
+	}
+
+	/* Initialize the object. */
+	gf->addr = addr;
+	gf->fpath = (path) ? strdup(path) : NULL;
+	gf->fsize = 0;
+	gf->type = hint;
+	gf->transfer_cb = NULL;
+	gf->transfer_cb_arg = NULL;
+	gf->progress_cb = NULL;
+	gf->progress_cb_arg = NULL;
+	gf->progress_bytes = 0;
+	gf->progress_ms = 0;
+	gf->progress_size = 0;
+	gf->progress_at = 0;
+	gf->started_at = 0;
+	gf->chunks = NULL;
+	gf->chunks_tail = NULL;
+	gf->max_size = 0;
+	gf->size_hint = 0;
+
+	return gf;
+}
+
+/**
+ * Allocates and initializes a Gopher file download object that keeps the file
+ * in memory instead of writing it to disk. Meant for small documents that are
+ * only going to be viewed.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param addr     Gopherspace address object already connected to the server.
+ * @param max_size Maximum size of the file in bytes. 0 for no limit.
+ * @param hint     Hint at the type of file we may be dealing with.
+ *
+ * @return Newly initialized Gopher file download object.
+ *
+ * @see gopher_file_mem_iov
+ * @see gopher_file_mem_buf
+ */
+gopher_file_t *gopher_file_new_mem(gopher_addr_t *addr, size_t max_size,
+								   gopher_type_t hint) {
+	gopher_file_t *gf;
+
+	gf = gopher_file_new(addr, NULL, hint);
+	if (gf != NULL)
+		gf->max_size = max_size;
+
+	return gf;
+}
+
+/**
+ * Downloads a file from a Gopher server. On Linux the data is spliced straight
+ * from the socket into the file, falling back to copying it through a buffer
+ * if the file doesn't support it. If the GOPHER_FLAG_PIPELINE flag is set, the
+ * file is written to disk by a separate thread so that a slow disk doesn't
+ * hold up the network and vice versa. If the GOPHER_FLAG_MMAP flag is set, the
+ * file is preallocated on disk, using size_hint if it's known, and written to
+ * through a memory-mapped window. Files without a path are received straight
+ * into memory, failing with EFBIG if they're larger than allowed.
+ *
+ * @warning Ensure to connect to the address in the download object before
+ *          calling this function.
+ *
+ * @param gf Gopher file download object.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_file_new
+ * @see gopher_file_free
+ */
+int gopher_file_download(gopher_file_t *gf) {
+	int ret;
+
+	/* Send selector of our request. */
+	gopher_file_progress_start(gf);
+	ret = gopher_send_line(gf->addr, (gf->addr->selector) ?
+		gf->addr->selector : "", NULL);
+	if (ret != 0) {
+		log_errno(LOG_ERROR, "Failed to send line during download request");
+	} else {
+		ret = gopher_file_receive(gf);
+	}
+
+	/* Always let the progress callback know we're done. */
+	gopher_file_report(gf, 1);
+
+	return ret;
+}
+
+/**
+ * Receives the file a server is sending in response to a download request,
+ * getting it to its destination in the best way available.
+ *
+ * @param gf Gopher file download object with the request already sent.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_file_receive(gopher_file_t *gf) {
+	char buf[RECV_FILE_BUF];
+	size_t recv_len;
+	FILE *fh;
+	int ret;
+
+	/* Keep the file in memory if it has nowhere else to go. */
+	if (gf->fpath == NULL)
+		return gopher_file_recv_mem(gf);
+
+	/* Open file for writing. Mapping it into memory requires reading too. */
+	fh = fopen(gf->fpath, (gf->addr->flags & GOPHER_FLAG_MMAP) ? "w+b" : "wb");
+	if (fh == NULL) {
+		log_errno(LOG_ERROR, "Failed to open download file for writing");
+		return errno;
+	}
+
+#ifdef GOPHER_HAS_MMAP
+	/* Lay the file out on disk ahead of time. */
+	if (gf->addr->flags & GOPHER_FLAG_MMAP) {
+		ret = gopher_file_mmap(gf, fileno(fh));
+		if (ret != ENOSYS) {
+			fclose(fh);
+			return ret;
+		}
+	}
+#endif /* GOPHER_HAS_MMAP */
+
+	/* Keep the network and the disk busy at the same time. */
+	if (gf->addr->flags & GOPHER_FLAG_PIPELINE) {
+		ret = gopher_file_pipeline(gf, fh);
+		fclose(fh);
+		return ret;
+	}
+
+#ifdef GOPHER_HAS_SPLICE
+	/* Let the kernel move the data without it going through us. */
+	ret = gopher_file_splice(gf, fileno(fh));
+	if (ret != ENOSYS) {
+		fclose(fh);
+		return ret;
+	}
+#endif /* GOPHER_HAS_SPLICE */
+
+	/* Read everything that comes from the stream. */
+	while ((ret = gopher_recv_raw(gf->addr, buf, RECV_FILE_BUF, &recv_len, 0))
+			== 0) {
+		/* Check if the connection was terminated. */
+		if ((ret == 0) && (recv_len == 0))
+			break;
+
+		/* Increase the size counter and write stream to file. */
+		gf->fsize += recv_len;
+		fwrite(buf, sizeof(char), recv_len, fh);
+
+		/* Report downloaded size to callback function. */
+		gopher_file_report(gf, 0);
+	}
+	fclose(fh);
+	fh = NULL;
+
+	/* Check if something went wrong. */
+	if (ret != 0) {
+		log_errno(LOG_ERROR, "Failed to download file");
+		return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * Receives a file straight into the memory chunks of a download object.
+ *
+ * @param gf Gopher file download object with the request already sent.
+ *
+ * @return 0 if the operation was successful, EFBIG if the file is larger than
+ *         allowed. Check return against strerror() in case of failure.
+ */
+int gopher_file_recv_mem(gopher_file_t *gf) {
+	gopher_file_chunk_t *chunk;
+	size_t recv_len;
+	int ret;
+
+	/* Read everything that comes from the stream. */
+	for (;;) {
+		/* Get hold of a chunk with room left in it. */
+		chunk = gopher_file_mem_tail(gf);
+		if (chunk == NULL) {
+			ret = ENOMEM;
+			break;
+		}
+
+		/* Check if the connection was terminated. */
+		ret = gopher_recv_raw(gf->addr, chunk->data + chunk->len,
+			chunk->size - chunk->len, &recv_len, 0);
+		if ((ret != 0) || (recv_len == 0))
+			break;
+		chunk->len += recv_len;
+		gf->fsize += recv_len;
+
+		/* Make sure we don't go past the size limit. */
+		if (gf->max_size && (gf->fsize > gf->max_size)) {
+			chunk->len -= gf->fsize - gf->max_size;
+			gf->fsize = gf->max_size;
+			ret = EFBIG;
+			break;
+		}
+
+		/* Report downloaded size to callback function. */
+		gopher_file_report(gf, 0);
+	}
+
+	/* Check if something went wrong. */
+	if (ret != 0)
+		log_printf(LOG_ERROR, "Failed to download file to memory: %d\n", ret);
+
+	return ret;
+}
+
+/**
+ * Appends data to a file being downloaded to memory.
+ *
+ * @param gf  Gopher file download object without a path.
+ * @param buf Data to be appended.
+ * @param len Length of the data.
+ *
+ * @return 0 if the operation was successful, EFBIG if the file would get
+ *         larger than allowed. Check return against strerror() in case of
+ *         failure.
+ */
+int gopher_file_mem_append(gopher_file_t *gf, const char *buf, size_t len) {
+	gopher_file_chunk_t *chunk;
+	size_t n;
+
+	/* Make sure we don't go past the size limit. */
+	if (gf->max_size && ((gf->fsize + len) > gf->max_size))
+		return EFBIG;
+
+	/* Fill up the chunks. */
+	while (len > 0) {
+		chunk = gopher_file_mem_tail(gf);
+		if (chunk == NULL)
+			return ENOMEM;
+
+		n = chunk->size - chunk->len;
+		if (n > len)
+			n = len;
+		memcpy(chunk->data + chunk->len, buf, n);
+		chunk->len += n;
+		gf->fsize += n;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * Gets the last chunk of a file being downloaded to memory, adding a new one if
+ * it's already full.
+ *
+ * @param gf Gopher file download object without a path.
+ *
+ * @return Chunk with room left in it or NULL if one couldn't be allocated.
+ */
+gopher_file_chunk_t *gopher_file_mem_tail(gopher_file_t *gf) {
+	gopher_file_chunk_t *chunk;
+
+	/* Is there still some room in the one we have? */
+	chunk = gf->chunks_tail;
+	if ((chunk != NULL) && (chunk->len < chunk->size))
+		return chunk;
+
+	/* Append a new chunk to the chain. */
+	chunk = gopher_file_chunk_new(MEM_CHUNK_SIZE);
+	if (chunk == NULL)
+		return NULL;
+	if (gf->chunks_tail != NULL) {
+		gf->chunks_tail->next = chunk;
+	} else {
+		gf->chunks = chunk;
+	}
+	gf->chunks_tail = chunk;
+
+	return chunk;
+}
+
+/**
+ * Allocates a memory chunk with its data right after it.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param size Number of bytes the chunk can hold.
+ *
+ * @return Newly allocated empty chunk or NULL if an error occurred.
+ */
+gopher_file_chunk_t *gopher_file_chunk_new(size_t size) {
+	gopher_file_chunk_t *chunk;
+
+	chunk = (gopher_file_chunk_t *)malloc(sizeof(gopher_file_chunk_t) + size);
+	if (chunk == NULL) {
+		log_errno(LOG_ERROR, "Failed to allocate memory for downloaded file "
+			"chunk");
+		return NULL;
+	}
+	chunk->data = (char *)(chunk + 1);
+	chunk->len = 0;
+	chunk->size = size;
+	chunk->next = NULL;
+
+	return chunk;
+}
+
+/**
+ * Gets the pieces of a file downloaded to memory without copying them.
+ *
+ * @param gf    Gopher file download object without a path.
+ * @param iov   Optional. Array to be populated with the pieces of the file.
+ * @param count Number of elements in the array.
+ *
+ * @return Number of pieces the file is made up of, which may be larger than
+ *         the number of elements populated in the array.
+ *
+ * @see gopher_file_mem_buf
+ */
+size_t gopher_file_mem_iov(const gopher_file_t *gf, gopher_iovec_t *iov,
+						   size_t count) {
+	gopher_file_chunk_t *chunk;
+	size_t i;
+
+	i = 0;
+	for (chunk = gf->chunks; chunk != NULL; chunk = chunk->next) {
+		if (chunk->len == 0)
+			continue;
+		if ((iov != NULL) && (i < count)) {
+			iov[i].base = chunk->data;
+			iov[i].len = chunk->len;
+		}
+		i++;
+	}
+
+	return i;
+}
+
+/**
+ * Gets a file downloaded to memory as a single NULL-terminated buffer. Its
+ * chunks are merged together the first time this is called.
+ *
+ * @warning The returned buffer is owned by the download object and is only
+ *          valid until it's free'd.
+ *
+ * @param gf  Gopher file download object without a path.
+ * @param buf Pointer to the contents of the file.
+ * @param len Optional. Pointer to store the size of the file.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_file_mem_iov
+ */
+int gopher_file_mem_buf(gopher_file_t *gf, const char **buf, size_t *len) {
+	gopher_file_chunk_t *chunk;
+	gopher_file_chunk_t *next;
+	gopher_file_chunk_t *merged;
+
+	/* Merge the chunks unless there's a single one with room for the NULL. */
+	chunk = gf->chunks;
+	if ((chunk == NULL) || (chunk->next != NULL) ||
+			(chunk->len == chunk->size)) {
+		merged = gopher_file_chunk_new(gf->fsize + 1);
+		if (merged == NULL)
+			return ENOMEM;
+		while (chunk != NULL) {
+			next = chunk->next;
+			memcpy(merged->data + merged->len, chunk->data, chunk->len);
+			merged->len += chunk->len;
+			free(chunk);
+			chunk = next;
+		}
+		gf->chunks = merged;
+		gf->chunks_tail = merged;
+		chunk = merged;
+	}
+
+	/* Hand it over. */
+	chunk->data[chunk->len] = '\0';
+	*buf = chunk->data;
+	if (len != NULL)
+		*len = chunk->len;
+
+	return 0;
+}
+
+/**
+ * Downloads a file receiving it on the calling thread while a writer thread
+ * takes care of putting it on disk. Buffers are handed over to the writer in
+ * order through a bounded queue, and grow while the network keeps filling them
+ * up in a single read.
+ *
+ * @param gf Gopher file download object with the request already sent.
+ * @param fh File to write to.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_file_pipeline(gopher_file_t *gf, FILE *fh) {
+	gopher_pipeline_buf_t *pb;
+	gopher_pipeline_t *pl;
+	size_t recv_len;
+	size_t want;
+	int err;
+	int ret;
+
+	/* Start up the writer. */
+	pl = gopher_pipeline_new(fh);
+	if (pl == NULL)
+		return ENOMEM;
+	pl->refs++;
+	ret = gopher_thread_spawn(gopher_pipeline_work, pl);
+	if (ret != 0) {
+		log_printf(LOG_ERROR, "Failed to start the download writer thread\n");
+		pl->refs--;
+		gopher_pipeline_release(pl);
+		return ret;
+	}
+
+	/* Read everything that comes from the stream. */
+	want = PIPELINE_BUF_MIN;
+	pb = NULL;
+	for (;;) {
+		/* Get hold of a buffer the writer is done with. */
+		if (pb == NULL) {
+			pb = gopher_pipeline_take(pl, want, &ret);
+			if (pb == NULL)
+				break;
+		}
+
+		/* Check if the connection was terminated. */
+		ret = gopher_recv_raw(gf->addr, pb->data + pb->len,
+			pb->size - pb->len, &recv_len, 0);
+		if ((ret != 0) || (recv_len == 0))
+			break;
+
+		/* Grow the buffers while the network is outpacing them. */
+		if ((recv_len == (pb->size - pb->len)) && (want < PIPELINE_BUF_MAX))
+			want *= 2;
+
+		/* Increase the size counter and hand full buffers to the writer. */
+		pb->len += recv_len;
+		gf->fsize += recv_len;
+		if (pb->len == pb->size) {
+			gopher_pipeline_push(pl, pb);
+			pb = NULL;
+		}
+
+		/* Report downloaded size to callback function. */
+		gopher_file_report(gf, 0);
+	}
+
+	/* Wait for everything we've got to be written. */
+	if (pb != NULL)
+		gopher_pipeline_push(pl, pb);
+	err = gopher_pipeline_finish(pl);
+	if (ret == 0)
+		ret = err;
+
+	/* Check if something went wrong. */
+	if (ret != 0)
+		log_errno(LOG_ERROR, "Failed to download file");
+
+	return ret;
+}
+
+/**
+ * Allocates a pipelined download. Its buffers are only allocated once they are
+ * first taken.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param fh File to write to.
+ *
+ * @return Newly allocated pipelined download with a single reference or NULL if
+ *         an error occurred.
+ *
+ * @see gopher_pipeline_release
+ */
+gopher_pipeline_t *gopher_pipeline_new(FILE *fh) {
+	gopher_pipeline_t *pl;
+	int i;
+
+	/* Allocate the object. */
+	pl = (gopher_pipeline_t *)calloc(1, sizeof(gopher_pipeline_t));
+	if (pl == NULL) {
+		log_errno(LOG_ERROR, "Failed to allocate memory for download pipeline");
+		return NULL;
+	}
+
+	/* Set up the synchronization primitives. */
+	if (gopher_event_init(&pl->filled) != 0) {
+		free(pl);
+		return NULL;
+	}
+	if (gopher_event_init(&pl->drained) != 0) {
+		gopher_event_destroy(&pl->filled);
+		free(pl);
+		return NULL;
+	}
+	if (gopher_event_init(&pl->done) != 0) {
+		gopher_event_destroy(&pl->drained);
+		gopher_event_destroy(&pl->filled);
+		free(pl);
+		return NULL;
+	}
+	gopher_mutex_init(&pl->lock);
+
+	/* Every buffer starts out free. */
+	pl->fh = fh;
+	pl->queue = NULL;
+	pl->queue_tail = &pl->queue;
+	pl->free = NULL;
+	for (i = PIPELINE_BUFS - 1; i >= 0; i--) {
+		pl->bufs[i].next = pl->free;
+		pl->free = &pl->bufs[i];
+	}
+	pl->refs = 1;
+
+	return pl;
+}
+
+/**
+ * Takes a free buffer out of a pipelined download, waiting for the writer to
+ * be done with one if needed.
+ *
+ * @param pl   Pipelined download.
+ * @param want Size the buffer should be grown to.
+ * @param err  Returns the error that stopped the download.
+ *
+ * @return Empty buffer or NULL if the download can't go on.
+ */
+gopher_pipeline_buf_t *gopher_pipeline_take(gopher_pipeline_t *pl, size_t want,
+											int *err) {
+	gopher_pipeline_buf_t *pb;
+	char *data;
+
+	/* Wait for the writer to give a buffer back. */
+	gopher_mutex_lock(&pl->lock);
+	while ((pl->free == NULL) && (pl->err == 0)) {
+		gopher_event_reset(&pl->drained);
+		gopher_mutex_unlock(&pl->lock);
+		gopher_event_wait(&pl->drained, -1);
+		gopher_mutex_lock(&pl->lock);
+	}
+	if (pl->err != 0) {
+		*err = pl->err;
+		gopher_mutex_unlock(&pl->lock);
+		return NULL;
+	}
+	pb = pl->free;
+	pl->free = pb->next;
+	gopher_mutex_unlock(&pl->lock);
+	pb->next = NULL;
+	pb->len = 0;
+
+	/* Make it as large as we were asked to, if we can. */
+	if (pb->size < want) {
+		data = (char *)realloc(pb->data, want);
+		if (data != NULL) {
+			pb->data = data;
+			pb->size = want;
+		} else if (pb->size == 0) {
+			log_errno(LOG_ERROR, "Failed to allocate memory for download "
+				"pipeline buffer");
+			gopher_mutex_lock(&pl->lock);
+			pb->next = pl->free;
+			pl->free = pb;
+			gopher_mutex_unlock(&pl->lock);
+			*err = ENOMEM;
+			return NULL;
+		}
+	}
+
+	return pb;
+}
+
+/**
+ * Hands a buffer over to the writer of a pipelined download.
+ *
+ * @param pl Pipelined download.
+ * @param pb Buffer to be written to disk.
+ */
+void gopher_pipeline_push(gopher_pipeline_t *pl, gopher_pipeline_buf_t *pb) {
+	gopher_mutex_lock(&pl->lock);
+	pb->next = NULL;
+	*pl->queue_tail = pb;
+	pl->queue_tail = &pb->next;
+	gopher_event_set(&pl->filled);
+	gopher_mutex_unlock(&pl->lock);
+}
+
+/**
+ * Tells the writer of a pipelined download that there's nothing left to be
+ * queued, waits for it to finish, and releases our reference to it.
+ *
+ * @param pl Pipelined download.
+ *
+ * @return 0 if everything was written to disk. Check return against strerror()
+ *         in case of failure.
+ */
+int gopher_pipeline_finish(gopher_pipeline_t *pl) {
+	int err;
+
+	/* Let the writer go once it runs out of buffers. */
+	gopher_mutex_lock(&pl->lock);
+	pl->finished = 1;
+	gopher_event_set(&pl->filled);
+	gopher_mutex_unlock(&pl->lock);
+
+	/* Wait for it. */
+	gopher_event_wait(&pl->done, -1);
+	gopher_mutex_lock(&pl->lock);
+	err = pl->err;
+	gopher_mutex_unlock(&pl->lock);
+	gopher_pipeline_release(pl);
+
+	return err;
+}
+
+/**
+ * Writes the buffers queued up in a pipelined download to disk until it's
+ * finished. Meant to be run on its own thread.
+ *
+ * @param arg Pipelined download.
+ */
+void gopher_pipeline_work(void *arg) {
+	gopher_pipeline_buf_t *pb;
+	gopher_pipeline_t *pl;
+	int err;
+
+	pl = (gopher_pipeline_t *)arg;
+	gopher_mutex_lock(&pl->lock);
+	for (;;) {
+		/* Wait for something to do. */
+		pb = pl->queue;
+		if (pb == NULL) {
+			if (pl->finished)
+				break;
+			gopher_event_reset(&pl->filled);
+			gopher_mutex_unlock(&pl->lock);
+			gopher_event_wait(&pl->filled, -1);
+			gopher_mutex_lock(&pl->lock);
+			continue;
+		}
+
+		/* Take the buffer off the queue. */
+		pl->queue = pb->next;
+		if (pl->queue == NULL)
+			pl->queue_tail = &pl->queue;
+		err = pl->err;
+		gopher_mutex_unlock(&pl->lock);
+
+		/* Write it out, unless we've already failed to. */
+		errno = 0;
+		if ((err == 0) && (fwrite(pb->data, sizeof(char), pb->len, pl->fh) !=
+				pb->len)) {
+			err = (errno != 0) ? errno : EIO;
+			log_errno(LOG_ERROR, "Failed to write to download file");
+		}
+
+		/* Give the buffer back. */
+		gopher_mutex_lock(&pl->lock);
+		if (pl->err == 0)
+			pl->err = err;
+		pb->next = pl->free;
+		pl->free = pb;
+		gopher_event_set(&pl->drained);
+	}
+
+	/* Make sure nothing is left behind in the file buffer. */
+	if ((pl->err == 0) && (fflush(pl->fh) != 0)) {
+		pl->err = errno;
+		log_errno(LOG_ERROR, "Failed to flush download file");
+	}
+	gopher_mutex_unlock(&pl->lock);
+
+	gopher_event_set(&pl->done);
+	gopher_pipeline_release(pl);
+}
+
+/**
+ * Releases a reference to a pipelined download, freeing it if it was the last
+ * one.
+ *
+ * @param pl Pipelined download.
+ */
+void gopher_pipeline_release(gopher_pipeline_t *pl) {
+	int refs;
+	int i;
+
+	gopher_mutex_lock(&pl->lock);
+	refs = --pl->refs;
+	gopher_mutex_unlock(&pl->lock);
+	if (refs > 0)
+		return;
+
+	/* Free the object's members. */
+	for (i = 0; i < PIPELINE_BUFS; i++) {
+		if (pl->bufs[i].data)
+			free(pl->bufs[i].data);
+	}
+	gopher_event_destroy(&pl->done);
+	gopher_event_destroy(&pl->drained);
+	gopher_event_destroy(&pl->filled);
+	gopher_mutex_destroy(&pl->lock);
+
+	/* Free the object itself. */
+	free(pl);
+}
+
+#ifdef GOPHER_HAS_MMAP
+/**
+ * Receives a file through a memory-mapped window into space that's reserved on
+ * disk ahead of time, either as much as the size hint of the download object
+ * asks for or in large extents as the file grows. The file is truncated to its
+ * real size once it's done.
+ *
+ * @param gf Gopher file download object with the request already sent.
+ * @param fd File descriptor of the file to write to.
+ *
+ * @return 0 if the operation was successful, ENOSYS if the download should
+ *         carry on through another path, or an error code.
+ */
+int gopher_file_mmap(gopher_file_t *gf, int fd) {
+	size_t recv_len;
+	size_t win_off;
+	size_t alloc;
+	char *win;
+	int ret;
+
+	/* Reserve as much of the file as we expect to need. */
+	alloc = 0;
+	ret = gopher_file_extend(fd, &alloc,
+		(gf->size_hint) ? gf->size_hint : MMAP_EXTENT);
+	if (ret != 0)
+		return ENOSYS;
+
+	/* Read everything that comes from the stream. */
+	win = NULL;
+	win_off = 0;
+	for (;;) {
+		/* Move the window along once it's full. */
+		if ((win == NULL) || (gf->fsize == (win_off + MMAP_WINDOW))) {
+			if (win != NULL)
+				munmap(win, MMAP_WINDOW);
+			win = NULL;
+			win_off = gf->fsize;
+
+			/* Grow the file if the window would go past its end. */
+			if ((win_off + MMAP_WINDOW) > alloc) {
+				ret = gopher_file_extend(fd, &alloc, MMAP_EXTENT);
+				if (ret != 0) {
+					log_printf(LOG_ERROR, "Failed to reserve space for "
+						"download file: %d\n", ret);
+					break;
+				}
+			}
+
+			win = (char *)mmap(NULL, MMAP_WINDOW, PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, (off_t)win_off);
+			if (win == MAP_FAILED) {
+				win = NULL;
+				ret = (gf->fsize == 0) ? ENOSYS : errno;
+				break;
+			}
+		}
+
+		/* Check if the connection was terminated. */
+		ret = gopher_recv_raw(gf->addr, win + (gf->fsize - win_off),
+			MMAP_WINDOW - (gf->fsize - win_off), &recv_len, 0);
+		if ((ret != 0) || (recv_len == 0))
+			break;
+		gf->fsize += recv_len;
+
+		/* Report downloaded size to callback function. */
+		gopher_file_report(gf, 0);
+	}
+
+	/* Trim the file down to what we've actually received. */
+	if (win != NULL)
+		munmap(win, MMAP_WINDOW);
+	if ((ftruncate(fd, (off_t)gf->fsize) != 0) && (ret == 0))
+		ret = errno;
+
+	/* Check if something went wrong. */
+	if ((ret != 0) && (ret != ENOSYS))
+		log_errno(LOG_ERROR, "Failed to download file");
+
+	return ret;
+}
+
+/**
+ * Reserves more space on disk for a memory-mapped download file.
+ *
+ * @param fd    File descriptor of the file.
+ * @param alloc Number of bytes already reserved. Updated with the new total.
+ * @param len   Number of bytes to add, rounded up to a whole window.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_file_extend(int fd, size_t *alloc, size_t len) {
+	int ret;
+
+	len = ((len + MMAP_WINDOW - 1) / MMAP_WINDOW) * MMAP_WINDOW;
+	ret = posix_fallocate(fd, (off_t)*alloc, (off_t)len);
+	if (ret != 0)
+		return ret;
+	*alloc += len;
+
+	return 0;
+}
+#endif /* GOPHER_HAS_MMAP */
+
+#ifdef GOPHER_HAS_SPLICE
+/**
+ * Moves a file being downloaded straight from the socket into the file through
+ * a pipe, without the data ever having to be copied into our own buffers.
+ *
+ * @param gf Gopher file download object with the request already sent.
+ * @param fd File descriptor of the file to write to.
+ *
+ * @return 0 if the operation was successful, ENOSYS if the download should
+ *         carry on through the buffered path, or an error code.
+ */
+int gopher_file_splice(gopher_file_t *gf, int fd) {
+	gopher_addr_t *addr;
+	gopher_rbuf_t *rb;
+	size_t chunk;
+	size_t want;
+	size_t spliced;
+	ssize_t len;
+	ssize_t out;
+	char buf[RECV_FILE_BUF];
+	int pfd[2];
+	int ret;
+
+	/* Write out anything the line reader may have already buffered. */
+	addr = gf->addr;
+	rb = addr->rbuf;
+	if ((rb != NULL) && (rb->pos < rb->len)) {
+		ret = gopher_file_write(fd, rb->buf + rb->pos, rb->len - rb->pos);
+		if (ret != 0) {
+			log_errno(LOG_ERROR, "Failed to write to download file");
+			return ret;
+		}
+		gf->fsize += rb->len - rb->pos;
+		rb->pos = rb->len;
+
+		gopher_file_report(gf, 0);
+	}
+	if ((rb != NULL) && rb->eof)
+		return 0;
+
+	/* Set up the pipe that'll hold the data in between. */
+	if (pipe(pfd) != 0)
+		return ENOSYS;
+	len = fcntl(pfd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+	if (len <= 0)
+		len = fcntl(pfd[1], F_GETPIPE_SZ);
+	chunk = (len > 0) ? (size_t)len : RECV_FILE_BUF;
+
+	/* Move everything that comes from the stream. */
+	spliced = 0;
+	ret = 0;
+	for (;;) {
+		/* Stay within our bandwidth caps and deadlines. */
+		want = chunk;
+		ret = gopher_rate_wait(addr, &want);
+		if (ret != 0)
+			break;
+		ret = gopher_recv_wait(addr);
+		if (ret != 0)
+			break;
+
+		/* Move data from the socket into the pipe. */
+		len = syscall(__NR_splice, addr->sockfd, NULL, pfd[1], NULL, want,
+			SPLICE_F_MOVE);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = errno;
+			if ((spliced == 0) && ((ret == EINVAL) || (ret == ENOSYS)))
+				ret = ENOSYS;
+			break;
+		}
+
+		/* Check if the connection was terminated. */
+		if (len == 0) {
+			log_printf(LOG_INFO, "Connection closed gracefully by server\n");
+			if (rb != NULL)
+				rb->eof = 1;
+			break;
+		}
+
+		/* Keep track of activity for our deadlines and bandwidth caps. */
+		gopher_rate_charge(addr, len);
+		addr->recvd = 1;
+		if (gopher_timeouts_active(addr))
+			addr->last_io = gopher_clock_ms();
+
+		/* Drain the pipe into the file. */
+		while (len > 0) {
+			out = syscall(__NR_splice, pfd[0], NULL, fd, NULL, (size_t)len,
+				SPLICE_F_MOVE);
+			if (out < 0) {
+				if (errno == EINTR)
+					continue;
+				ret = errno;
+				if ((spliced > 0) || (ret != EINVAL))
+					break;
+
+				/* File doesn't take splices, so copy it out ourselves. */
+				while ((len > 0) &&
+						((out = read(pfd[0], buf, RECV_FILE_BUF)) > 0)) {
+					ret = gopher_file_write(fd, buf, out);
+					if (ret != 0)
+						break;
+					gf->fsize += out;
+					len -= out;
+				}
+				if (ret == 0) {
+					gopher_file_report(gf, 0);
+					ret = ENOSYS;
+				}
+				break;
+			}
+
+			spliced += out;
+			gf->fsize += out;
+			len -= out;
+		}
+		if (ret != 0)
+			break;
+
+		/* Report downloaded size to callback function. */
+		gopher_file_report(gf, 0);
+	}
+	close(pfd[0]);
+	close(pfd[1]);
+
+	/* Check if something went wrong. */
+	if ((ret != 0) && (ret != ENOSYS))
+		log_errno(LOG_ERROR, "Failed to download file");
+
+	return ret;
+}
+
+/**
+ * Writes an entire buffer to a file descriptor.
+ *
+ * @param fd  File descriptor to write to.
+ * @param buf Data to be written.
+ * @param len Length of the data.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_file_write(int fd, const char *buf, size_t len) {
+	ssize_t written;
+
+	while (len > 0) {
+		written = write(fd, buf, len);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+
+		buf += written;
+		len -= written;
+	}
+
+	return 0;
+}
+#endif /* GOPHER_HAS_SPLICE */
+
+/**
+ * Frees a Gopher file download object.
+ *
+ * @param gf Gopher file download object to be free'd.
+ */
+void gopher_file_free(gopher_file_t *gf) {
+	gopher_file_chunk_t *chunk;
+
+	/* Is this even necessary? */
+	if (gf == NULL)
+		return;
+
+	/* Free the object's members. */
+	if (gf->fpath)
+		free(gf->fpath);
+	while (gf->chunks != NULL) {
+		chunk = gf->chunks;
+		gf->chunks = chunk->next;
+		free(chunk);
+	}
+	gf->fsize = 0;
+
+	/* Free the object itself. */
+	free(gf);
+}
+
+/**
+ * Gets the basename of a supposed file from a gopherspace address object.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param addr Gopherspace address object to extract a filename from.
+ *
+ * @return A file name extrapolated from the gopherspace address object.
+ */
+char *gopher_file_basename(const gopher_addr_t *addr) {
+	char *fname;
+
+	/* Try to get a valid filename from the selector. */
+#ifdef _WIN32
+	LPTSTR szPath;
+	LPTSTR szBaseName;
+
+	/* Convert the path to UTF-16 and get its basename. */
+	szPath = win_mbstowcs(addr->selector);
+	szBaseName = PathFindFileName(szPath);  /* shlwapi.lib */
+
+	/* Convert the basename to UTF-8 and free our temporary string. */
+	fname = win_wcstombs(szBaseName);
+	free(szPath);
+#else
+	fname = basename(addr->selector);
+#endif /* _WIN32 */
+	if ((*fname != '.') && (*fname != '/') && (*fname != '\\'))
+		return fname;
+	free(fname);
+	fname = NULL;
+
+	/* Build a fallback filename from the server hostname. */
+	return strdup(addr->host);
+}
+
+/**
+ * Sets up a callback to listen for reports of transferred bytes while
+ * downloading.
+ *
+ * @param gf   Gopher file download object.
+ * @param func Callback function.
+ * @param arg  Optional. Parameter to be passed to the callback function.
+ */
+void gopher_file_set_transfer_cb(gopher_file_t *gf,
+								 gopher_file_transfer_func func, void *arg) {
+	gf->transfer_cb = func;
+	gf->transfer_cb_arg = arg;
+}
+
+/**
+ * Sets up a callback to receive throttled reports of the progress of a
+ * download. Reports are only made once both the minimum number of bytes and of
+ * milliseconds have gone by since the previous one, and a final report is
+ * always made once the download is over, whether it succeeded or not.
+ *
+ * @param gf        Gopher file download object.
+ * @param func      Callback function.
+ * @param arg       Optional. Parameter to be passed to the callback function.
+ * @param min_bytes Minimum number of bytes in between reports.
+ * @param min_ms    Minimum number of milliseconds in between reports.
+ */
+void gopher_file_set_progress_cb(gopher_file_t *gf,
+								 gopher_file_progress_func func, void *arg,
+								 size_t min_bytes, unsigned long min_ms) {
+	gf->progress_cb = func;
+	gf->progress_cb_arg = arg;
+	gf->progress_bytes = min_bytes;
+	gf->progress_ms = min_ms;
+}
+
+/**
+ * Marks the start of a download for progress reporting purposes.
+ *
+ * @param gf Gopher file download object.
+ */
+void gopher_file_progress_start(gopher_file_t *gf) {
+	gf->started_at = gopher_clock_ms();
+	gf->progress_at = gf->started_at;
+	gf->progress_size = gf->fsize;
+}
+
+/**
+ * Reports the number of bytes received so far to the transfer callback, and to
+ * the progress callback if enough has happened since its previous report.
+ *
+ * @param gf       Gopher file download object.
+ * @param finished Is this the final report of the download?
+ */
+void gopher_file_report(gopher_file_t *gf, int finished) {
+	gopher_file_progress_t prog;
+	unsigned long now;
+
+	/* The transfer callback hears about every single read. */
+	if (!finished && gf->transfer_cb)
+		gf->transfer_cb((const void *)gf, gf->transfer_cb_arg);
+
+	/* Check if it's time for a progress report. */
+	if (gf->progress_cb == NULL)
+		return;
+	now = gopher_clock_ms();
+	if (!finished && (((gf->fsize - gf->progress_size) < gf->progress_bytes) ||
+			((now - gf->progress_at) < gf->progress_ms))) {
+		return;
+	}
+
+	/* Work out how fast things are going. */
+	prog.fsize = gf->fsize;
+	prog.elapsed = now - gf->started_at;
+	prog.finished = finished;
+	prog.rate = 0;
+	if (now != gf->progress_at) {
+		prog.rate = (gf->fsize - gf->progress_size) * 1000.0 /
+			(now - gf->progress_at);
+	}
+	prog.avg_rate = 0;
+	if (prog.elapsed > 0)
+		prog.avg_rate = gf->fsize * 1000.0 / prog.elapsed;
+
+	/* Report it. */
+	gf->progress_size = gf->fsize;
+	gf->progress_at = now;
+	gf->progress_cb(gf, &prog, gf->progress_cb_arg);
+}
+
+/*
+ * +===========================================================================+
+ * |                                                                           |
+ * |                           Multi Request Engine                            |
+ * |                                                                           |
+ * +===========================================================================+
+ */
+
+/**
+ * Allocates and initializes a multi request engine that runs many directory
+ * requests and file downloads concurrently on the calling thread using
+ * non-blocking sockets.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param backend Notification mechanism to use. GOPHER_MULTI_AUTO picks the
+ *                best readiness based one available, falling back to select()
+ *                where nothing better is supported. GOPHER_MULTI_URING falls
+ *                back the same way if io_uring is unavailable.
+ *
+ * @return Newly initialized multi request engine or NULL if an error occurred.
+ *
+ * @see gopher_multi_free
+ */
+gopher_multi_t *gopher_multi_new(gopher_multi_backend_t backend) {
+	gopher_multi_t *multi;
+
+	/* Allocate the object. */
+	multi = (gopher_multi_t *)malloc(sizeof(gopher_multi_t));
+	if (multi == NULL) {
+		log_errno(LOG_ERROR, "Failed to allocate memory for multi engine");
+		return NULL;
+	}
+
+	/* Initialize the object. */
+	multi->backend = GOPHER_MULTI_SELECT;
+	multi->epfd = -1;
+	multi->resolver = NULL;
+	multi->resolver_armed = 0;
+	multi->xfers = NULL;
+	multi->running = 0;
+	multi->resolving = 0;
+	multi->closing = 0;
+
+#ifdef GOPHER_HAS_URING
+	/* Set up the io_uring instance. */
+	multi->ring = NULL;
+	if (backend == GOPHER_MULTI_URING) {
+		multi->ring = gopher_uring_new(URING_ENTRIES);
+		if (multi->ring != NULL) {
+			multi->backend = GOPHER_MULTI_URING;
+			return multi;
+		}
+		log_printf(LOG_WARNING, "io_uring unavailable, falling back to "
+			"epoll\n");
+	}
+#endif /* GOPHER_HAS_URING */
+
+#ifdef GOPHER_HAS_EPOLL
+	/* Set up the epoll instance. */
+	if (backend != GOPHER_MULTI_SELECT) {
+		multi->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (multi->epfd != -1) {
+			multi->backend = GOPHER_MULTI_EPOLL;
+		} else {
+			log_errno(LOG_WARNING, "Failed to create epoll instance, falling "
+				"back to select");
+		}
+	}
+#endif /* GOPHER_HAS_EPOLL */
+
+	return multi;
+}
+
+/**
+ * Gets the readiness notification mechanism used by a multi request engine.
+ *
+ * @param multi Multi request engine.
+ *
+ * @return Backend actually in use by the engine.
+ */
+gopher_multi_backend_t gopher_multi_backend(const gopher_multi_t *multi) {
+	return multi->backend;
+}
+
+/**
+ * Adds a directory request to a multi request engine. The connection is
+ * established by the engine itself, and so is the name resolution, which is
+ * handed over to a pool of resolver threads if it can't be answered right away.
+ *
+ * @param multi Multi request engine.
+ * @param addr  Gopherspace address object of the directory. Ownership is passed
+ *              to the resulting directory if this function succeeds.
+ * @param func  Callback function that will receive the directory.
+ * @param arg   Optional. Parameter to be passed to the callback function.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_multi_perform
+ */
+int gopher_multi_add_dir(gopher_multi_t *multi, gopher_addr_t *addr,
+						 gopher_multi_dir_func func, void *arg) {
+	gopher_menu_parser_t *mp;
+	gopher_xfer_t *xfer;
+	gopher_dir_t *pd;
+	int ret;
+
+	/* Initialize the directory object. */
+	pd = gopher_dir_new(addr);
+	if (pd == NULL)
+		return ENOMEM;
+	if (addr->flags & GOPHER_FLAG_ARENA) {
+		pd->arena = gopher_arena_new(ARENA_CHUNK_SIZE);
+		if (pd->arena == NULL) {
+			pd->addr = NULL;
+			gopher_dir_free(pd, RECURSE_NONE, 1);
+			return ENOMEM;
+		}
+	}
+
+	/* Set up the parser and the transfer. */
+	mp = gopher_menu_parser_new(gopher_dir_push, NULL);
+	xfer = (mp != NULL) ? gopher_multi_xfer_new(multi, addr, arg) : NULL;
+	if (xfer == NULL) {
+		ret = ((mp != NULL) && errno) ? errno : ENOMEM;
+		gopher_menu_parser_free(mp);
+		pd->addr = NULL;
+		gopher_dir_free(pd, RECURSE_NONE, 1);
+		return ret;
+	}
+	xfer->db.dir = pd;
+	xfer->dir_cb = func;
+	xfer->mp = mp;
+	mp->item_cb_arg = &xfer->db;
+
+	return 0;
+}
+
+/**
+ * Adds a file download to a multi request engine. The connection and name
+ * resolution are handled by the engine itself without blocking.
+ *
+ * @param multi Multi request engine.
+ * @param gf    Gopher file download object. Its address must not be connected.
+ * @param func  Callback function that will be called once the download is done.
+ * @param arg   Optional. Parameter to be passed to the callback function.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_multi_perform
+ */
+int gopher_multi_add_file(gopher_multi_t *multi, gopher_file_t *gf,
+						  gopher_multi_file_func func, void *arg) {
+	gopher_xfer_t *xfer;
+	FILE *fh;
+
+	/* Open file for writing, unless it's going to be kept in memory. */
+	fh = NULL;
+	if (gf->fpath != NULL) {
+		fh = fopen(gf->fpath, "wb");
+		if (fh == NULL) {
+			log_errno(LOG_ERROR, "Failed to open download file for writing");
+			return errno;
+		}
+	}
+
+	/* Set up the transfer. */
+	xfer = gopher_multi_xfer_new(multi, gf->addr, arg);
+	if (xfer == NULL) {
+		if (fh != NULL)
+			fclose(fh);
+		return (errno) ? errno : ENOMEM;
+	}
+	gopher_file_progress_start(gf);
+	xfer->gf = gf;
+	xfer->fh = fh;
+	xfer->file_cb = func;
+
+	return 0;
+}
+
+/**
+ * Waits for activity on the transfers of a multi request engine and moves them
+ * along, calling the completion callbacks of the ones that are done.
+ *
+ * @param multi   Multi request engine.
+ * @param timeout Maximum number of milliseconds to wait for activity. A
+ *                negative value waits indefinitely.
+ * @param running Optional. Returns the number of transfers still running.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_multi_run
+ */
+int gopher_multi_perform(gopher_multi_t *multi, int timeout, size_t *running) {
+	int ret;
+
+	/* Wait for something to happen if we have anything to wait for. */
+	ret = 0;
+	if (multi->running > 0)
+		ret = gopher_multi_wait(multi, timeout);
+
+	if (running != NULL)
+		*running = multi->running;
+
+	return ret;
+}
+
+/**
+ * Runs a multi request engine until all of its transfers are done.
+ *
+ * @param multi Multi request engine.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_multi_run(gopher_multi_t *multi) {
+	size_t running;
+	int ret;
+
+	do {
+		ret = gopher_multi_perform(multi, -1, &running);
+		if (ret != 0)
+			return ret;
+	} while (running > 0);
+
+	return 0;
+}
+
+/**
+ * Frees a multi request engine. Transfers still running are aborted and their
+ * callbacks called with ECANCELED.
+ *
+ * @param multi Multi request engine to be free'd.
+ */
+void gopher_multi_free(gopher_multi_t *multi) {
+	/* Is this even necessary? */
+	if (multi == NULL)
+		return;
+
+	/* Stop moving transfers along. */
+	multi->closing = 1;
+
+#ifdef GOPHER_HAS_URING
+	/* Ensure the kernel is no longer using any of our transfers. */
+	if (multi->ring != NULL) {
+		struct io_uring_sqe *sqe;
+		gopher_xfer_t *xfer;
+
+		for (xfer = multi->xfers; xfer != NULL; xfer = xfer->next) {
+			if (xfer->busy) {
+				sqe = gopher_uring_sqe(multi->ring, IORING_OP_ASYNC_CANCEL, -1,
+					NULL);
+				sqe->addr = (uint64_t)(uintptr_t)xfer;
+			}
+		}
+		if (multi->resolver_armed) {
+			sqe = gopher_uring_sqe(multi->ring, IORING_OP_ASYNC_CANCEL, -1,
+				NULL);
+			sqe->addr = (uint64_t)(uintptr_t)multi->resolver;
+		}
+		while ((multi->ring->inflight > 0) &&
+				(gopher_uring_wait(multi, -1) == 0)) {
+		}
+	}
+#endif /* GOPHER_HAS_URING */
+
+	/* Abort any transfers still running, starting with the ones resolving. */
+	gopher_resolver_free(multi->resolver);
+	while (multi->xfers != NULL)
+		gopher_multi_xfer_done(multi, multi->xfers, ECANCELED);
+
+	/* Free the object's members. */
+#ifdef GOPHER_HAS_URING
+	gopher_uring_free(multi->ring);
+#endif /* GOPHER_HAS_URING */
+#ifdef GOPHER_HAS_EPOLL
+	if (multi->epfd != -1)
+		close(multi->epfd);
+#endif /* GOPHER_HAS_EPOLL */
+
+	/* Free the object itself. */
+	free(multi);
+}
+
+/**
+ * Allocates a transfer, starts connecting it to the server, and adds it to a
+ * multi request engine.
+ *
+ * @param multi Multi request engine.
+ * @param addr  Gopherspace address object to connect to.
+ * @param arg   Optional. Parameter to be passed to the callback function.
+ *
+ * @return Newly initialized transfer or NULL if an error occurred, in which case
+ *         errno is set.
+ */
+gopher_xfer_t *gopher_multi_xfer_new(gopher_multi_t *multi,
+									 gopher_addr_t *addr, void *arg) {
+	gopher_xfer_t *xfer;
+	const char *sel;
+	int ret;
+
+	/* Allocate the object. */
+	xfer = (gopher_xfer_t *)calloc(1, sizeof(gopher_xfer_t));
+	if (xfer == NULL) {
+		log_errno(LOG_ERROR, "Failed to allocate memory for transfer");
+		return NULL;
+	}
+	xfer->multi = multi;
+	xfer->addr = addr;
+	xfer->state = XFER_CONNECTING;
+	xfer->cb_arg = arg;
+
+	/* Build the request line. */
+	sel = (addr->selector) ? addr->selector : "";
+	xfer->req_len = strlen(sel) + 2;
+	xfer->req = (char *)malloc((xfer->req_len + 1) * sizeof(char));
+	if (xfer->req == NULL) {
+		free(xfer);
+		errno = ENOMEM;
+		return NULL;
+	}
+	sprintf(xfer->req, "%s\r\n", sel);
+
+	/* Start connecting right away if we already know the server's address. */
+	ret = gopher_resolve(addr, 1);
+	if (ret == 0) {
+		ret = gopher_multi_xfer_connect(multi, xfer);
+	} else if (ret == EAGAIN) {
+		/* Leave the lookup to the resolver threads. */
+		ret = gopher_multi_resolver(multi);
+		if (ret == 0) {
+			xfer->state = XFER_RESOLVING;
+			ret = gopher_resolver_add(multi->resolver, addr,
+				gopher_multi_resolved, xfer);
+		}
+		if (ret == 0)
+			multi->resolving++;
+	}
+
+	/* Check if anything went wrong. */
+	if (ret != 0) {
+		if (addr->sockfd != INVALID_SOCKET)
+			gopher_disconnect(addr);
+		free(xfer->req);
+		free(xfer);
+		errno = ret;
+		return NULL;
+	}
+
+	/* Add the transfer to the list. */
+	xfer->next = multi->xfers;
+	if (multi->xfers != NULL)
+		multi->xfers->prev = xfer;
+	multi->xfers = xfer;
+	multi->running++;
+
+	return xfer;
+}
+
+/**
+ * Gets a socket for a transfer whose server has been resolved and starts
+ * connecting it.
+ *
+ * @param multi Multi request engine.
+ * @param xfer  Transfer with its server's IP address resolved.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_multi_xfer_connect(gopher_multi_t *multi, gopher_xfer_t *xfer) {
+	int ret;
+
+	xfer->state = XFER_CONNECTING;
+	ret = gopher_socket_open(xfer->addr);
+	if (ret == 0)
+		ret = gopher_socket_nonblock(xfer->addr->sockfd, 1);
+	if (ret == 0)
+		ret = gopher_multi_xfer_start(multi, xfer);
+
+	return ret;
+}
+
+/**
+ * Sets up the name resolver of a multi request engine if it doesn't have one
+ * yet, and makes sure its backend is watching it.
+ *
+ * @param multi Multi request engine.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_multi_resolver(gopher_multi_t *multi) {
+	/* Start up the resolver threads. */
+	if (multi->resolver == NULL) {
+		multi->resolver = gopher_resolver_new(RESOLVER_THREADS);
+		if (multi->resolver == NULL)
+			return ENOMEM;
+
+#ifdef GOPHER_HAS_EPOLL
+		/* Watch its notifications alongside the sockets. */
+		if (multi->epfd != -1) {
+			struct epoll_event ev;
+
+			ev.events = EPOLLIN;
+			ev.data.ptr = NULL;
+			if (epoll_ctl(multi->epfd, EPOLL_CTL_ADD,
+					gopher_resolver_fd(multi->resolver), &ev) != 0) {
+				log_errno(LOG_ERROR, "Failed to watch resolver events");
+				return errno;
+			}
+		}
+#endif /* GOPHER_HAS_EPOLL */
+	}
+
+#ifdef GOPHER_HAS_URING
+	/* Poll its notifications with a one-shot operation. */
+	if ((multi->ring != NULL) && !multi->resolver_armed) {
+		struct io_uring_sqe *sqe;
+
+		sqe = gopher_uring_sqe(multi->ring, IORING_OP_POLL_ADD,
+			gopher_resolver_fd(multi->resolver), multi->resolver);
+		sqe->poll_events = POLLIN;
+		multi->resolver_armed = 1;
+	}
+#endif /* GOPHER_HAS_URING */
+
+	return 0;
+}
+
+/**
+ * Picks up a transfer once the name of its server has been resolved.
+ *
+ * @param addr Gopherspace address object of the transfer.
+ * @param err  Error code of the name resolution.
+ * @param arg  Transfer that was waiting on the resolution.
+ */
+void gopher_multi_resolved(gopher_addr_t *addr, int err, void *arg) {
+	gopher_multi_t *multi;
+	gopher_xfer_t *xfer;
+
+	xfer = (gopher_xfer_t *)arg;
+	multi = xfer->multi;
+	multi->resolving--;
+
+	/* Start connecting unless the engine is going away. */
+	if ((err == 0) && multi->closing)
+		err = ECANCELED;
+	if (err == 0)
+		err = gopher_multi_xfer_connect(multi, xfer);
+	if (err != 0) {
+		log_printf(LOG_ERROR, "Failed to resolve %s: %s\n", addr->host,
+			gopher_strerror(err));
+		gopher_multi_xfer_done(multi, xfer, err);
+	}
+}
+
+/**
+ * Starts connecting a transfer to its server using the engine's backend.
+ *
+ * @param multi Multi request engine.
+ * @param xfer  Transfer with an open non-blocking socket.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_multi_xfer_start(gopher_multi_t *multi, gopher_xfer_t *xfer) {
+	gopher_addr_t *addr;
+
+	addr = xfer->addr;
+
+#ifdef GOPHER_HAS_URING
+	/* Let the kernel do the connecting for us. */
+	if (multi->ring != NULL)
+		return gopher_uring_queue(multi, xfer);
+#endif /* GOPHER_HAS_URING */
+
+	/* Start connecting. */
+	if ((connect(addr->sockfd, (struct sockaddr *)addr->ipaddr,
+			addr->ipaddr_len) == SOCKET_ERROR) &&
+			!SOCK_INPROGRESS(sockerrno)) {
+		log_sockerrno(LOG_ERROR, "Couldn't connect to server", sockerrno);
+		return sockerrno;
+	}
+
+#ifndef _WIN32
+	/* Ensure the socket fits in a select set. */
+	if ((multi->backend == GOPHER_MULTI_SELECT) &&
+			(addr->sockfd >= FD_SETSIZE)) {
+		log_printf(LOG_ERROR, "Socket doesn't fit in a select set\n");
+		return EMFILE;
+	}
+#endif /* !_WIN32 */
+
+#ifdef GOPHER_HAS_EPOLL
+	/* Start watching the socket. */
+	if (multi->epfd != -1) {
+		struct epoll_event ev;
+
+		ev.events = EPOLLOUT;
+		ev.data.ptr = xfer;
+		if (epoll_ctl(multi->epfd, EPOLL_CTL_ADD, addr->sockfd, &ev) != 0) {
+			log_errno(LOG_ERROR, "Failed to watch socket events");
+			return errno;
+		}
+	}
+#endif /* GOPHER_HAS_EPOLL */
+
+	return 0;
+}
+
+/**
+ * Changes the events watched for a transfer socket. Only relevant for backends
+ * that keep track of the events themselves.
+ *
+ * @param multi Multi request engine.
+ * @param xfer  Transfer to be changed.
+ * @param op    Watch for reading if 1 or stop watching entirely if 0.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_multi_watch(gopher_multi_t *multi, gopher_xfer_t *xfer, int op) {
+#ifdef GOPHER_HAS_EPOLL
+	struct epoll_event ev;
+
+	/* Nothing to do for other backends. */
+	if (multi->epfd == -1)
+		return 0;
+
+	/* Change the events for the socket. */
+	ev.events = EPOLLIN;
+	ev.data.ptr = xfer;
+	if (epoll_ctl(multi->epfd, (op) ? EPOLL_CTL_MOD : EPOLL_CTL_DEL,
+			xfer->addr->sockfd, &ev) != 0) {
+		log_errno(LOG_ERROR, "Failed to change watched socket events");
+		return errno;
+	}
+#endif /* GOPHER_HAS_EPOLL */
+
+	return 0;
+}
+
+/**
+ * Waits for activity on the sockets of a multi request engine and handles it.
+ *
+ * @param multi   Multi request engine.
+ * @param timeout Maximum number of milliseconds to wait. Negative waits forever.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_multi_wait(gopher_multi_t *multi, int timeout) {
+	gopher_xfer_t *xfer;
+	gopher_xfer_t *next;
+	struct timeval tv;
+	fd_set rfds;
+	fd_set wfds;
+	int resolved;
+	int resfd;
+	int maxfd;
+	int nfds;
+	int ret;
+
+#ifdef GOPHER_HAS_URING
+	/* Submit and reap operations on the io_uring instance. */
+	if (multi->ring != NULL)
+		return gopher_uring_wait(multi, timeout);
+#endif /* GOPHER_HAS_URING */
+
+#ifdef GOPHER_HAS_EPOLL
+	/* Wait for events on the epoll instance. */
+	if (multi->epfd != -1) {
+		struct epoll_event evs[MULTI_EVENTS];
+		int i;
+
+		ret = epoll_wait(multi->epfd, evs, MULTI_EVENTS, timeout);
+		if (ret == -1) {
+			if (errno == EINTR)
+				return 0;
+			log_errno(LOG_ERROR, "Failed to wait for socket events");
+			return errno;
+		}
+		for (i = 0; i < ret; i++) {
+			if (evs[i].data.ptr == NULL) {
+				gopher_resolver_poll(multi->resolver);
+			} else {
+				gopher_multi_event(multi, (gopher_xfer_t *)evs[i].data.ptr);
+			}
+		}
+
+		return 0;
+	}
+#endif /* GOPHER_HAS_EPOLL */
+
+	/* Build up the sets of sockets to watch. */
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	maxfd = 0;
+	nfds = 0;
+	for (xfer = multi->xfers; xfer != NULL; xfer = xfer->next) {
+		if (xfer->state == XFER_RESOLVING)
+			continue;
+		if (xfer->state == XFER_RECEIVING) {
+			FD_SET(xfer->addr->sockfd, &rfds);
+		} else {
+			FD_SET(xfer->addr->sockfd, &wfds);
+		}
+		if (xfer->addr->sockfd > maxfd)
+			maxfd = xfer->addr->sockfd;
+		nfds++;
+	}
+
+	/* Watch for finished name resolutions. */
+	resfd = -1;
+	if (multi->resolving > 0) {
+		resfd = gopher_resolver_fd(multi->resolver);
+		if (resfd != -1) {
+			FD_SET(resfd, &rfds);
+			if (resfd > maxfd)
+				maxfd = resfd;
+			nfds++;
+		} else if ((timeout < 0) || (timeout > RESOLVER_POLL_INTERVAL)) {
+			/* Nothing will wake us up, so check back on the resolver soon. */
+			timeout = RESOLVER_POLL_INTERVAL;
+		}
+	}
+
+#ifdef _WIN32
+	/* Winsock refuses to wait on empty sets. */
+	if (nfds == 0) {
+		Sleep((DWORD)timeout);
+		gopher_resolver_poll(multi->resolver);
+		return 0;
+	}
+#endif /* _WIN32 */
+
+	/* Wait for some activity. */
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	ret = select(maxfd + 1, &rfds, &wfds, NULL, (timeout < 0) ? NULL : &tv);
+	if (ret == SOCKET_ERROR) {
+		if (sockerrno == EINTR)
+			return 0;
+		log_sockerrno(LOG_ERROR, "Failed to wait for socket events", sockerrno);
+		return sockerrno;
+	}
+
+	/* Check if any name resolutions have finished. */
+	resolved = (multi->resolving > 0) && (resfd == -1);
+	if ((resfd != -1) && FD_ISSET(resfd, &rfds)) {
+		resolved = 1;
+		ret--;
+	}
+
+	/* Handle the sockets with activity. */
+	for (xfer = multi->xfers; (xfer != NULL) && (ret > 0); xfer = next) {
+		next = xfer->next;
+		if (xfer->state == XFER_RESOLVING)
+			continue;
+		if (FD_ISSET(xfer->addr->sockfd, &rfds) ||
+				FD_ISSET(xfer->addr->sockfd, &wfds)) {
+			ret--;
+			gopher_multi_event(multi, xfer);
+		}
+	}
+
+	/* Start connecting the transfers that are done resolving. */
+	if (resolved)
+		gopher_resolver_poll(multi->resolver);
+
+	return 0;
+}
+
+/**
+ * Moves a transfer along after there was activity on its socket.
+ *
+ * @param multi Multi request engine.
+ * @param xfer  Transfer with activity.
+ */
+void gopher_multi_event(gopher_multi_t *multi, gopher_xfer_t *xfer) {
+	socklen_t len;
+	int finished;
+	int ret;
+
+	switch (xfer->state) {
+	case XFER_CONNECTING:
+		/* Check if the connection was established. */
+		len = sizeof(ret);
+		if (getsockopt(xfer->addr->sockfd, SOL_SOCKET, SO_ERROR, (char *)&ret,
+				&len) == SOCKET_ERROR) {
+			ret = sockerrno;
+		}
+		if (ret != 0) {
+			log_sockerrno(LOG_ERROR, "Couldn't connect to server", ret);
+			gopher_multi_xfer_done(multi, xfer, ret);
+			return;
+		}
+		gopher_socket_tune_connected(xfer->addr->sockfd, xfer->addr->profile);
+		xfer->state = XFER_SENDING;
+		/* Fall through. */
+	case XFER_SENDING:
+		ret = gopher_multi_xfer_send(multi, xfer);
+		if (ret != 0)
+			gopher_multi_xfer_done(multi, xfer, ret);
+		break;
+	case XFER_RECEIVING:
+		finished = 0;
+		ret = gopher_multi_xfer_recv(xfer, &finished);
+		if ((ret != 0) || finished)
+			gopher_multi_xfer_done(multi, xfer, ret);
+		break;
+	case XFER_RESOLVING:
+	case XFER_WRITING:
+		break;
+	}
+}
+
+/**
+ * Sends as much of the request of a transfer as the socket will take.
+ *
+ * @param multi Multi request engine.
+ * @param xfer  Transfer to send the request of.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_multi_xfer_send(gopher_multi_t *multi, gopher_xfer_t *xfer) {
+	ssize_t len;
+
+	/* Send whatever is left of the request. */
+	len = send(xfer->addr->sockfd, xfer->req + xfer->req_sent,
+		xfer->req_len - xfer->req_sent, 0);
+	if (len == SOCKET_ERROR) {
+		if (SOCK_WOULDBLOCK(sockerrno))
+			return 0;
+		log_sockerrno(LOG_ERROR, "Failed to send data over socket", sockerrno);
+		return sockerrno;
+	}
+	xfer->req_sent += len;
+
+	/* Start receiving once the request is out. */
+	if (xfer->req_sent == xfer->req_len) {
+		xfer->state = XFER_RECEIVING;
+		return gopher_multi_watch(multi, xfer, 1);
+	}
+
+	return 0;
+}
+
+/**
+ * Receives whatever data is available for a transfer and handles it.
+ *
+ * @param xfer     Transfer to receive data for.
+ * @param finished Set to TRUE if the transfer has finished.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_multi_xfer_recv(gopher_xfer_t *xfer, int *finished) {
+	gopher_rbuf_t *rb;
+	ssize_t len;
+	int ret;
+
+	/* Ensure we have a receive buffer attached to the connection. */
+	rb = gopher_rbuf_attach(xfer->addr);
+	if (rb == NULL)
+		return ENOMEM;
+
+	/* Read as much as the socket is willing to give us. */
+	len = recv(xfer->addr->sockfd, rb->buf, rb->size, 0);
+	if (len == SOCKET_ERROR) {
+		if (SOCK_WOULDBLOCK(sockerrno))
+			return 0;
+		log_sockerrno(LOG_ERROR, "Failed to receive data from socket",
+			sockerrno);
+		return sockerrno;
+	}
+	rb->pos = 0;
+	rb->len = len;
+	if (len == 0) {
+		rb->eof = 1;
+		*finished = 1;
+		return 0;
+	}
+
+	/* Handle directory data. */
+	if (xfer->mp != NULL)
+		return gopher_multi_xfer_menu(xfer, finished);
+
+	/* Handle file data. */
+	if (xfer->fh == NULL) {
+		ret = gopher_file_mem_append(xfer->gf, rb->buf, rb->len);
+		if (ret != 0)
+			return ret;
+	} else {
+		if (fwrite(rb->buf, sizeof(char), rb->len, xfer->fh) != rb->len) {
+			log_errno(LOG_ERROR, "Failed to write downloaded data to file");
+			return errno;
+		}
+		xfer->gf->fsize += rb->len;
+	}
+	rb->pos = rb->len;
+	gopher_file_report(xfer->gf, 0);
+
+	return 0;
+}
+
+/**
+ * Feeds the data in the receive buffer of a directory transfer to its parser.
+ *
+ * @param xfer     Directory transfer with data in its receive buffer.
+ * @param finished Set to TRUE if the transfer has finished.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_multi_xfer_menu(gopher_xfer_t *xfer, int *finished) {
+	gopher_rbuf_t *rb;
+	int ret;
+
+	/* Parse whatever we have received. */
+	rb = xfer->addr->rbuf;
+	ret = gopher_menu_parser_feed(xfer->mp, rb->buf + rb->pos,
+		rb->len - rb->pos);
+	rb->pos = rb->len;
+
+	/* Check if we are done here. */
+	if (gopher_menu_parser_done(xfer->mp) &&
+			((xfer->addr->flags & GOPHER_FLAG_FASTTERM) || xfer->mp->stopped)) {
+		*finished = 1;
+	}
+
+	return ret;
+}
+
+/**
+ * Finishes a transfer, removing it from the multi request engine, and hands
+ * its results over to its callback.
+ *
+ * @param multi Multi request engine.
+ * @param xfer  Transfer that has finished. Will be free'd by this function.
+ * @param err   Error that finished the transfer or 0 if it was successful.
+ */
+void gopher_multi_xfer_done(gopher_multi_t *multi, gopher_xfer_t *xfer,
+							int err) {
+	gopher_dir_t *pd;
+
+	/* Stop watching and close the connection. */
+	if (xfer->addr->sockfd != INVALID_SOCKET) {
+		gopher_multi_watch(multi, xfer, 0);
+		gopher_disconnect(xfer->addr);
+	}
+
+	/* Remove the transfer from the list. */
+	if (xfer->prev != NULL)
+		xfer->prev->next = xfer->next;
+	if (xfer->next != NULL)
+		xfer->next->prev = xfer->prev;
+	if (multi->xfers == xfer)
+		multi->xfers = xfer->next;
+	multi->running--;
+
+	/* Finish up a directory. */
+	pd = xfer->db.dir;
+	if (xfer->mp != NULL) {
+		gopher_menu_parser_finish(xfer->mp);
+		pd->err_count += xfer->mp->err_count;
+		gopher_menu_parser_free(xfer->mp);
+		if (err == 0)
+			err = xfer->db.err;
+	}
+	if (pd != NULL) {
+		if (xfer->dir_cb != NULL) {
+			xfer->dir_cb(pd, err, xfer->cb_arg);
+		} else {
+			gopher_dir_free(pd, RECURSE_NONE, 1);
+		}
+	}
+
+	/* Finish up a file download. */
+	if (xfer->gf != NULL) {
+		if (xfer->fh != NULL)
+			fclose(xfer->fh);
+		gopher_file_report(xfer->gf, 1);
+		if (xfer->file_cb != NULL)
+			xfer->file_cb(xfer->gf, err, xfer->cb_arg);
+	}
+
+	/* Free the transfer. */
+	free(xfer->req);
+	free(xfer);
+}
+
+#ifdef GOPHER_HAS_URING
+/**
+ * Sets up an io_uring instance using raw system calls.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param entries Number of submission queue entries.
+ *
+ * @return Newly initialized io_uring instance or NULL if io_uring isn't
+ *         available or lacks the operations we need.
+ *
+ * @see gopher_uring_free
+ */
+gopher_uring_t *gopher_uring_new(unsigned int entries) {
+	struct io_uring_params params;
+	gopher_uring_t *ring;
+	unsigned int *array;
+	unsigned int i;
+
+	/* Allocate the object. */
+	ring = (gopher_uring_t *)calloc(1, sizeof(gopher_uring_t));
+	if (ring == NULL)
+		return NULL;
+
+	/* Set up the instance. Fast poll (5.7) implies send, recv, and connect. */
+	memset(&params, 0, sizeof(params));
+	ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) {
+		log_errno(LOG_WARNING, "Failed to set up io_uring");
+		free(ring);
+		return NULL;
+	}
+	if (!(params.features & IORING_FEAT_FAST_POLL)) {
+		log_printf(LOG_WARNING, "io_uring is too old to be used\n");
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+
+	/* Map the submission and completion rings. */
+	ring->sq_len = params.sq_off.array + (params.sq_entries *
+		sizeof(unsigned int));
+	ring->cq_len = params.cq_off.cqes + (params.cq_entries *
+		sizeof(struct io_uring_cqe));
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->cq_len = 0;
+	}
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ptr = ring->sq_ptr;
+	if ((ring->sq_ptr != MAP_FAILED) && (ring->cq_len > 0)) {
+		ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	}
+	ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_len,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+		IORING_OFF_SQES);
+	if ((ring->sq_ptr == MAP_FAILED) || (ring->cq_ptr == MAP_FAILED) ||
+			(ring->sqes == MAP_FAILED)) {
+		log_errno(LOG_ERROR, "Failed to map io_uring rings");
+		gopher_uring_free(ring);
+		return NULL;
+	}
+
+	/* Get the ring pointers. */
+	ring->sq_head = (unsigned int *)((char *)ring->sq_ptr + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)((char *)ring->sq_ptr + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)((char *)ring->sq_ptr +
+		params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->cq_head = (unsigned int *)((char *)ring->cq_ptr + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)ring->cq_ptr + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)((char *)ring->cq_ptr +
+		params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr +
+		params.cq_off.cqes);
+
+	/* Submission queue entries are always used in order. */
+	array = (unsigned int *)((char *)ring->sq_ptr + params.sq_off.array);
+	for (i = 0; i < ring->sq_entries; i++)
+		array[i] = i;
+
+	return ring;
+}
+
+/**
+ * Tears down an io_uring instance.
+ *
+ * @param ring io_uring instance to be free'd.
+ */
+void gopher_uring_free(gopher_uring_t *ring) {
+	/* Is this even necessary? */
+	if (ring == NULL)
+		return;
+
+	/* Unmap the rings. */
+	if ((ring->sqes != NULL) && (ring->sqes != MAP_FAILED))
+		munmap(ring->sqes, ring->sqes_len);
+	if ((ring->cq_len > 0) && (ring->cq_ptr != NULL) &&
+			(ring->cq_ptr != MAP_FAILED)) {
+		munmap(ring->cq_ptr, ring->cq_len);
+	}
+	if ((ring->sq_ptr != NULL) && (ring->sq_ptr != MAP_FAILED))
+		munmap(ring->sq_ptr, ring->sq_len);
+
+	/* Free the object itself. */
+	close(ring->fd);
+	free(ring);
+}
+
+/**
+ * Gets a submission queue entry, submitting the queued ones if the ring is
+ * full. The entry is only handed to the kernel on the next wait.
+ *
+ * @param ring io_uring instance.
+ * @param op   Operation to be performed.
+ * @param fd   File descriptor of the operation.
+ * @param data Transfer that will receive the completion or NULL if the
+ *             operation is internal to the engine.
+ *
+ * @return Submission queue entry to be filled in with the operation arguments.
+ */
+struct io_uring_sqe *gopher_uring_sqe(gopher_uring_t *ring, int op, int fd,
+									  void *data) {
+	struct io_uring_sqe *sqe;
+	unsigned int tail;
+	int ret;
+
+	/* Make room if the submission queue is full. */
+	tail = *ring->sq_tail;
+	while ((tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) >=
+			ring->sq_entries) {
+		ret = (int)syscall(__NR_io_uring_enter, ring->fd, ring->pending, 0, 0,
+			NULL, 0);
+		if (ret > 0)
+			ring->pending -= ret;
+	}
+
+	/* Fill in the common parts of the entry. */
+	sqe = &ring->sqes[tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = (uint8_t)op;
+	sqe->fd = fd;
+	sqe->user_data = (uint64_t)(uintptr_t)data;
+
+	/* Queue it up. */
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->pending++;
+	if (data != NULL)
+		ring->inflight++;
+
+	return sqe;
+}
+
+/**
+ * Queues the next operation of a transfer according to its state.
+ *
+ * @param multi Multi request engine.
+ * @param xfer  Transfer to be moved along.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_uring_queue(gopher_multi_t *multi, gopher_xfer_t *xfer) {
+	struct io_uring_sqe *sqe;
+	gopher_rbuf_t *rb;
+	int fd;
+
+	fd = xfer->addr->sockfd;
+	switch (xfer->state) {
+	case XFER_RESOLVING:
+		/* Waiting on the resolver threads. */
+		return 0;
+	case XFER_CONNECTING:
+		sqe = gopher_uring_sqe(multi->ring, IORING_OP_CONNECT, fd, xfer);
+		sqe->addr = (uint64_t)(uintptr_t)xfer->addr->ipaddr;
+		sqe->off = xfer->addr->ipaddr_len;
+		break;
+	case XFER_SENDING:
+		sqe = gopher_uring_sqe(multi->ring, IORING_OP_SEND, fd, xfer);
+		sqe->addr = (uint64_t)(uintptr_t)(xfer->req + xfer->req_sent);
+		sqe->len = (uint32_t)(xfer->req_len - xfer->req_sent);
+		break;
+	case XFER_RECEIVING:
+		rb = gopher_rbuf_attach(xfer->addr);
+		if (rb == NULL)
+			return ENOMEM;
+		sqe = gopher_uring_sqe(multi->ring, IORING_OP_RECV, fd, xfer);
+		sqe->addr = (uint64_t)(uintptr_t)rb->buf;
+		sqe->len = (uint32_t)rb->size;
+		break;
+	case XFER_WRITING:
+		rb = xfer->addr->rbuf;
+		sqe = gopher_uring_sqe(multi->ring, IORING_OP_WRITE, fileno(xfer->fh),
+			xfer);
+		sqe->addr = (uint64_t)(uintptr_t)(rb->buf + rb->pos);
+		sqe->len = (uint32_t)(rb->len - rb->pos);
+		sqe->off = xfer->gf->fsize;
+		break;
+	}
+	xfer->busy = 1;
+
+	return 0;
+}
+
+/**
+ * Submits all of the queued operations and reaps the completed ones in a
+ * single system call.
+ *
+ * @param multi   Multi request engine using io_uring.
+ * @param timeout Maximum number of milliseconds to wait. Negative waits forever.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_uring_wait(gopher_multi_t *multi, int timeout) {
+	struct __kernel_timespec ts;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	gopher_uring_t *ring;
+	gopher_xfer_t *xfer;
+	unsigned int head;
+	int ret;
+	int res;
+
+	/* Limit the wait with a timeout that fires on the first completion. */
+	ring = multi->ring;
+	if (timeout > 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		sqe = gopher_uring_sqe(ring, IORING_OP_TIMEOUT, -1, NULL);
+		sqe->addr = (uint64_t)(uintptr_t)&ts;
+		sqe->len = 1;
+		sqe->off = 1;
+	}
+
+	/* Submit everything and wait for something to complete. */
+	ret = (int)syscall(__NR_io_uring_enter, ring->fd, ring->pending,
+		(timeout == 0) ? 0 : 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	if (ret < 0) {
+		if ((errno == EINTR) || (errno == EBUSY) || (errno == EAGAIN))
+			return 0;
+		log_errno(LOG_ERROR, "Failed to submit io_uring operations");
+		return errno;
+	}
+	ring->pending -= ret;
+
+	/* Reap the completions. */
+	head = *ring->cq_head;
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		xfer = (gopher_xfer_t *)(uintptr_t)cqe->user_data;
+		res = cqe->res;
+		head++;
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		/* Pick up finished name resolutions. */
+		if ((xfer != NULL) &&
+				((void *)xfer == (void *)multi->resolver)) {
+			ring->inflight--;
+			multi->resolver_armed = 0;
+			if (!multi->closing) {
+				gopher_resolver_poll(multi->resolver);
+				if (multi->resolving > 0)
+					gopher_multi_resolver(multi);
+			}
+			continue;
+		}
+
+		/* Hand the result over to the transfer. */
+		if (xfer != NULL) {
+			ring->inflight--;
+			xfer->busy = 0;
+			gopher_uring_complete(multi, xfer, res);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Moves a transfer along after one of its operations has completed.
+ *
+ * @param multi Multi request engine using io_uring.
+ * @param xfer  Transfer that owns the operation.
+ * @param res   Result of the operation.
+ */
+void gopher_uring_complete(gopher_multi_t *multi, gopher_xfer_t *xfer,
+						   int res) {
+	gopher_rbuf_t *rb;
+	int finished;
+	int ret;
+
+	/* Is the engine going away? */
+	if (multi->closing)
+		return;
+
+	/* Check if something went wrong. */
+	if (res < 0) {
+		log_sockerrno(LOG_ERROR, "io_uring operation failed", -res);
+		gopher_multi_xfer_done(multi, xfer, -res);
+		return;
+	}
+
+	ret = 0;
+	finished = 0;
+	rb = xfer->addr->rbuf;
+	switch (xfer->state) {
+	case XFER_RESOLVING:
+		break;
+	case XFER_CONNECTING:
+		gopher_socket_tune_connected(xfer->addr->sockfd, xfer->addr->profile);
+		xfer->state = XFER_SENDING;
+		break;
+	case XFER_SENDING:
+		xfer->req_sent += res;
+		if (xfer->req_sent == xfer->req_len)
+			xfer->state = XFER_RECEIVING;
+		break;
+	case XFER_RECEIVING:
+		/* Check if the connection was closed by the server. */
+		rb->pos = 0;
+		rb->len = res;
+		if (res == 0) {
+			rb->eof = 1;
+			finished = 1;
+			break;
+		}
+
+		/* Handle the data. */
+		if (xfer->mp != NULL) {
+			ret = gopher_multi_xfer_menu(xfer, &finished);
+		} else if (xfer->fh == NULL) {
+			ret = gopher_file_mem_append(xfer->gf, rb->buf, rb->len);
+			rb->pos = rb->len;
+			if (ret == 0)
+				gopher_file_report(xfer->gf, 0);
+		} else {
+			xfer->state = XFER_WRITING;
+		}
+		break;
+	case XFER_WRITING:
+		rb->pos += res;
+		xfer->gf->fsize += res;
+		if (rb->pos == rb->len) {
+			xfer->state = XFER_RECEIVING;
+			gopher_file_report(xfer->gf, 0);
+		}
+		break;
+	}
+
+	/* Queue up the next operation. */
+	if ((ret == 0) && !finished)
+		ret = gopher_uring_queue(multi, xfer);
+	if ((ret != 0) || finished)
+		gopher_multi_xfer_done(multi, xfer, ret);
+}
+#endif /* GOPHER_HAS_URING */
+
+/*
+ * +===========================================================================+
+ * |                                                                           |
+ * |                             Item Line Parsing                             |
+ * |                                                                           |
+ * +===========================================================================+
+ */
+
+/**
+ * Allocates and initializes a Gopher line item object.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param label Optional. Label of the item.
+ * @param addr  Optional. Gopherspace address object that will be owned by the
+ *              newly initialized object.
+ *
+ * @return Newly initialized Gopher line item object.
+ *
+ * @see gopher_item_free
+ */
+gopher_item_t *gopher_item_new(const char *label, gopher_addr_t *addr) {
+	return gopher_item_new_in(NULL, label, (label) ? strlen(label) : 0, addr);
+}
+
+/**
+ * Allocates and initializes a Gopher line item object inside a memory arena.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param arena     Optional. Memory arena to allocate the object from. The heap
+ *                  is used if NULL or pointing to NULL.
+ * @param label     Optional. Label of the item.
+ * @param label_len Length of the label string.
+ * @param addr      Optional. Gopherspace address object that will be owned by
+ *                  the newly initialized object.
+ *
+ * @return Newly initialized Gopher line item object.
+ *
+ * @see gopher_item_new
+ */
+gopher_item_t *gopher_item_new_in(gopher_arena_t **arena, const char *label,
+								  size_t label_len, gopher_addr_t *addr) {
+	gopher_item_t *item;
+
+	/* Allocate the object. */
+	item = (gopher_item_t *)gopher_arena_alloc(arena, sizeof(gopher_item_t));
+	if (item == NULL) {
+		log_errno(LOG_ERROR, "Failed to allocate memory for Gopher item");
+		return NULL;
+	}
+
+	/* Initialize the object. */
+	item->label = NULL;
+	if (label)
+		item->label = gopher_arena_strndup(arena, label, label_len);
+	item->addr = addr;
+	item->next = NULL;
+
+	return item;
+}
+
+/**
+ * Gets the URL which points to a respective item object.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param item Gopher item object.
+ *
+ * @return Standardized URL representation of the item's location.
+ *
+ * @see gopher_addr_str
+ * @see gopher_item_print
+ */
+char *gopher_item_url(const gopher_item_t *item) {
+	return gopher_addr_str(item->addr);
+}
+
+/**
+ * Parses a line received from a server into an item object.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param item Pointer to location where the parsed line will be stored.
+ * @param line Line as received from the server.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_recv_line
+ * @see gopher_item_free
+ */
+int gopher_item_parse(gopher_item_t **item, const char *line) {
+	return gopher_item_parse_in(NULL, item, line);
+}
+
+/**
+ * Parses a line received from a server into an item object allocated inside a
+ * memory arena. Fields are copied straight from the line without any temporary
+ * allocations.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param arena Optional. Memory arena to allocate the item from. The heap is
+ *              used if NULL or pointing to NULL.
+ * @param item  Pointer to location where the parsed line will be stored.
+ * @param line  Line as received from the server.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_item_parse
+ */
+int gopher_item_parse_in(gopher_arena_t **arena, gopher_item_t **item,
+						 const char *line) {
+	gopher_item_t *it;
+	gopher_type_t type;
+	gopher_strview_t fields[4];
+	gopher_tok_t tok;
+	int nfields;
+	int heap;
+
+	/* Am I a joke to you? */
+	if ((item == NULL) || (line == NULL)) {
+		log_printf(LOG_ERROR, "Item or line for parsing are NULL\n");
+		return -1;
+	}
+
+	/* I can't parse a dot. */
+	if (gopher_is_termline(line)) {
+		log_printf(LOG_ERROR, "Tried to parse the termination line\n");
+		return -1;
+	}
+
+	/* Check if a monstrosity of a server just sent a blank line. */
+	if (line[0] == '\r') {
+		log_printf(LOG_ERROR, "Tried parsing an empty line\n");
+		return -1;
+	}
+
+	/* Split the label, selector, host, and port fields. */
+	type = (gopher_type_t)line[0];
+	gopher_tok_init(&tok, line, strlen(line));
+	gopher_line_split(&tok, line, fields, &nfields);
+
+	/* Initialize the item object. */
+	heap = (arena == NULL) || (*arena == NULL);
+	*item = gopher_item_new_in(arena, fields[0].ptr, fields[0].len, NULL);
+	it = *item;
+	if ((it == NULL) || (it->label == NULL)) {
+		log_errno(LOG_ERROR, "Failed to allocate memory for parsed line item");
+		if (heap)
+			gopher_item_free(it, RECURSE_NONE);
+		*item = NULL;
+		return ENOMEM;
+	}
+
+	/* Check if idiotic server just sent line without the rest of the fields. */
+	if (nfields == 1) {
+		log_printf(LOG_WARNING, "Parsed incomplete line\n");
+		it->addr = NULL;
+		return 0;
+	}
+
+	/* Finally create the address object. */
+	it->addr = gopher_addr_new_in(arena, fields[2].ptr, fields[2].len,
+		gopher_port_parse(&fields[3]), fields[1].ptr, fields[1].len, type);
+	if ((it->addr == NULL) || (it->addr->host == NULL) ||
+			(it->addr->selector == NULL)) {
+		log_errno(LOG_ERROR, "Failed to create address object for parsed line");
+		if (heap)
+			gopher_item_free(it, RECURSE_NONE);
+		*item = NULL;
+		return ENOMEM;
+	}
+
+	return 0;
+}
+
+/**
+ * Splits a menu line into its label, selector, host, and port fields using the
+ * delimiters found by a tokenizer. Fields omitted by the server are returned as
+ * empty views at the end of the line, and anything after the port (Gopher+) is
+ * skipped.
+ *
+ * @param tok     Delimiter tokenizer of the buffer holding the line.
+ * @param line    Start of the line, pointing to the item type character.
+ * @param fields  Array of 4 views to store the fields.
+ * @param nfields Pointer to store the number of fields actually present.
+ *
+ * @return Pointer to the start of the next line or to the end of the buffer.
+ */
+const char *gopher_line_split(gopher_tok_t *tok, const char *line,
+							  gopher_strview_t *fields, int *nfields) {
+	const char *p;
+	size_t q;
+	int i;
+
+	/* Go through the fields after the type character. */
+	p = line + 1;
+	q = p - tok->buf;
+	for (i = 0; i < 4; i++) {
+		q = gopher_tok_next(tok, q);
+		fields[i].ptr = p;
+		fields[i].len = (tok->buf + q) - p;
+		p = tok->buf + q;
+
+		/* Stop at the end of the line or after the port. */
+		if ((q == tok->len) || (*p != '\t') || (i == 3)) {
+			i++;
+			break;
+		}
+		p++;
+		q++;
+	}
+	*nfields = i;
+
+	/* Fields omitted by the server are empty. */
+	for (; i < 4; i++) {
+		fields[i].ptr = p;
+		fields[i].len = 0;
+	}
+
+	/* Skip to the beginning of the next line. */
+	q = gopher_tok_eol(tok, q);
+	if (q < tok->len)
+		q++;
+
+	return tok->buf + q;
+}
+
+/**
+ * Builds an item object from a parsed item view.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param arena Optional. Memory arena to allocate the item from. The heap is
+ *              used if NULL or pointing to NULL.
+ * @param view  Parsed item view.
+ *
+ * @return Newly allocated item object or NULL if an error occurred.
+ */
+gopher_item_t *gopher_item_from_view(gopher_arena_t **arena,
+									 const gopher_item_view_t *view) {
+	gopher_item_t *item;
+
+	/* Create the item and its address. */
+	item = gopher_item_new_in(arena, view->label.ptr, view->label.len, NULL);
+	if ((item == NULL) || (item->label == NULL))
+		goto failure;
+	item->addr = gopher_addr_new_in(arena, view->host.ptr, view->host.len,
+		view->port_num, view->selector.ptr, view->selector.len, view->type);
+	if ((item->addr == NULL) || (item->addr->host == NULL) ||
+			(item->addr->selector == NULL)) {
+		goto failure;
+	}
+
+	return item;
+
+failure:
+	log_errno(LOG_ERROR, "Failed to allocate memory for parsed item");
+	if ((arena == NULL) || (*arena == NULL))
+		gopher_item_free(item, RECURSE_NONE);
+	return NULL;
+}
+
+/**
+ * Parses the port number of an item without relying on a NUL terminator.
+ *
+ * @param port View of the port field.
+ *
+ * @return Port number or 0 if the field is empty or invalid.
+ */
+uint16_t gopher_port_parse(const gopher_strview_t *port) {
+	unsigned long num;
+	size_t i;
+
+	/* Convert the leading digits just like atoi would. */
+	num = 0;
+	for (i = 0; (i < port->len) && (port->ptr[i] >= '0') &&
+			(port->ptr[i] <= '9'); i++) {
+		num = (num * 10) + (port->ptr[i] - '0');
+		if (num > 65535)
+			return 0;
+	}
+
+	return (uint16_t)num;
+}
+
+/**
+ * Prints debugging information about a Gopher item type.
+ *
+ * @param item Gopher item to have its type printed out.
+ */
+void gopher_item_print_type(const gopher_item_t *item) {
+	if (item->addr == NULL) {
+		printf("(null)");
+		return;
+	}
+
+	/* Regex to get this from gopher_type_t definition: */
+	/* s/\s+GOPHER_TYPE_([^\s]+)\s+= '([^'])'(,?)/
+	   case GOPHER_TYPE_$1:\n\tprintf("[$1]");\n\tbreak;\n/g */
+	switch (item->addr->type) {
+		case GOPHER_TYPE_INTERNAL:
+			printf("<[INTERNAL]>");
+			break;
+		case GOPHER_TYPE_TEXT:
+			printf("[TEXT]");
+			break;
+		case GOPHER_TYPE_DIR:
+			printf("[DIR]");
+			break;
+		case GOPHER_TYPE_CSO:
+			printf("[CSO]");
+			break;
+		case GOPHER_TYPE_ERROR:
+			printf("[ERROR]");
+			break;
+		case GOPHER_TYPE_BINHEX:
+			printf("[BINHEX]");
+			break;
+		case GOPHER_TYPE_DOS:
+			printf("[DOS]");
+			break;
+		case GOPHER_TYPE_UNIX:
+			printf("[UNIX]");
+			break;
+		case GOPHER_TYPE_SEARCH:
+			printf("[SEARCH]");
+			break;
+		case GOPHER_TYPE_TELNET:
+			printf("[TELNET]");
+			break;
+		case GOPHER_TYPE_BINARY:
+			printf("[BINARY]");
+			break;
+		case GOPHER_TYPE_MIRROR:
+			printf("[MIRROR]");
+			break;
+		case GOPHER_TYPE_TN3270:
+			printf("[TN3270]");
+			break;
+		case GOPHER_TYPE_GIF:
+			printf("[GIF]");
+			break;
+		case GOPHER_TYPE_IMAGE:
+			printf("[IMAGE]");
+			break;
+		case GOPHER_TYPE_BITMAP:
+			printf("[BITMAP]");
+			break;
+		case GOPHER_TYPE_MOVIE:
+			printf("[MOVIE]");
+			break;
+		case GOPHER_TYPE_AUDIO:
+			printf("[AUDIO]");
+			break;
+		case GOPHER_TYPE_DOC:
+			printf("[DOC]");
+			break;
+		case GOPHER_TYPE_HTML:
+			printf("[HTML]");
+			break;
+		case GOPHER_TYPE_INFO:
+			printf("[INFO]");
+			break;
+		case GOPHER_TYPE_PNG:
+			printf("[PNG]");
+			break;
+		case GOPHER_TYPE_WAV:
+			printf("[WAV]");
+			break;
+		case GOPHER_TYPE_PDF:
+			printf("[PDF]");
+			break;
+		case GOPHER_TYPE_XML:
+			printf("[XML]");
+			break;
+		default:
+			printf("<[UNKNOWN]>");
+			break;
+	}
+}
+
+/**
+ * Prints debugging information about a Gopher item object.
+ *
+ * @param item Gopher item to have its information printed out.
+ */
+void gopher_item_print(const gopher_item_t *item) {
+	/* Is this a valid object? */
+	if (item == NULL) {
+		printf("(null)\n");
+		return;
+	}
+
+	/* Print out the object data. */
+	gopher_item_print_type(item);
+	printf("\t'%s'\t'%s'\t%s:%u", item->label, item->addr->selector,
+		item->addr->host, item->addr->port);
+	if (item->next != NULL) {
+		printf("\t->%p\n", item->next);
+	} else {
+		printf("\n");
+	}
+}
+
+/**
+ * Frees a Gopher item object.
+ *
+ * @warning Items allocated from a memory arena are free'd with their directory.
+ *
+ * @param item    Gopher item object to be free'd.
+ * @param recurse Recursively free next items as well?
+ */
+void gopher_item_free(gopher_item_t *item, gopher_recurse_dir_t recurse) {
+	gopher_item_t *next;
+
+	/* Go through the list without recursing to keep the stack shallow. */
+	while (item != NULL) {
+		next = (recurse == RECURSE_FORWARD) ? item->next : NULL;
+
+		/* Free the object's members. */
+		if (item->label)
+			free(item->label);
+		if (item->addr)
+			gopher_addr_free(item->addr);
+
+		/* Free the object itself. */
+		free(item);
+		item = next;
+	}
+}
+
+/**
+ * Checks if a received line is in fact the termination one with a single dot.
+ *
+ * @param line Received line to be checked.
+ *
+ * @return TRUE if the line is the last one to be transmitted before closing the
+ *         connection.
+ */
+int gopher_is_termline(const char *line) {
+	return (line != NULL) && (line[0] == '.') && (line[1] == '\r') &&
+		(line[2] == '\n');
+}
+
+/*
+ * +===========================================================================+
+ * |                                                                           |
+ * |                            Menu Buffer Parsing                            |
+ * |                                                                           |
+ * +===========================================================================+
+ */
+
+/**
+ * Parses an entire menu that is already in memory. Items are returned as views
+ * into the buffer, so no fields are copied and the buffer must outlive the
+ * menu object. Delimiters are located in blocks using the fastest instruction
+ * set available. Quirks from non-compliant servers are handled the same way as in
+ * gopher_dir_request: LF line endings, blank lines, incomplete lines, and a
+ * missing termination line are all accepted and counted as errors.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param buf  Buffer containing the menu as sent by the server.
+ * @param len  Length of the buffer.
+ * @param menu Pointer to where the parsed menu object will be stored.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_menu_free
+ * @see gopher_dir_request
+ */
+int gopher_menu_parse(const char *buf, size_t len, gopher_menu_t **menu) {
+	gopher_menu_parser_t mp;
+	gopher_menu_t *pm;
+
+	/* Allocate the menu object. */
+	*menu = (gopher_menu_t *)malloc(sizeof(gopher_menu_t));
+	pm = *menu;
+	if (pm == NULL) {
+		log_errno(LOG_ERROR, "Failed to allocate memory for Gopher menu");
+		return ENOMEM;
+	}
+	pm->items_len = 0;
+	pm->items_size = MENU_ITEMS_INIT;
+	pm->err_count = 0;
+	pm->termlined = 0;
+	pm->items = (gopher_item_view_t *)malloc(pm->items_size *
+		sizeof(gopher_item_view_t));
+	if (pm->items == NULL) {
+		log_errno(LOG_ERROR, "Failed to allocate memory for Gopher menu items");
+		gopher_menu_free(pm);
+		*menu = NULL;
+		return ENOMEM;
+	}
+
+	/* Go through the entire buffer in one go. */
+	gopher_menu_parser_init(&mp, gopher_menu_push, pm);
+	gopher_menu_lines(&mp, buf, len, 1);
+	if (mp.stopped) {
+		gopher_menu_free(pm);
+		*menu = NULL;
+		return ENOMEM;
+	}
+	gopher_menu_parser_finish(&mp);
+	pm->err_count = mp.err_count;
+	pm->termlined = mp.termlined;
+
+	return 0;
+}
+
+/**
+ * Appends an item from the menu parser to a parsed menu object.
+ *
+ * @param view Parsed item.
+ * @param arg  Parsed menu object.
+ *
+ * @return 0 to continue parsing or 1 if an error occurred.
+ */
+int gopher_menu_push(const gopher_item_view_t *view, void *arg) {
+	gopher_menu_t *pm;
+
+	/* Ensure we have space for another item. */
+	pm = (gopher_menu_t *)arg;
+	if (pm->items_len == pm->items_size) {
+		gopher_item_view_t *tmp;
+
+		tmp = (gopher_item_view_t *)realloc(pm->items,
+			pm->items_size * 2 * sizeof(gopher_item_view_t));
+		if (tmp == NULL) {
+			log_errno(LOG_ERROR, "Failed to grow Gopher menu items");
+			return 1;
+		}
+		pm->items = tmp;
+		pm->items_size *= 2;
+	}
+
+	/* Copy the view over. */
+	pm->items[pm->items_len++] = *view;
+
+	return 0;
+}
+
+/**
+ * Frees a parsed menu object. The buffer it was parsed from is left untouched.
+ *
+ * @param menu Parsed menu object to be free'd.
+ */
+void gopher_menu_free(gopher_menu_t *menu) {
+	/* Is this even necessary? */
+	if (menu == NULL)
+		return;
+
+	/* Free the object's members. */
+	if (menu->items)
+		free(menu->items);
+	menu->items_len = 0;
+
+	/* Free the object itself. */
+	free(menu);
+}
+
+/*
+ * +===========================================================================+
+ * |                                                                           |
+ * |                         Incremental Menu Parsing                          |
+ * |                                                                           |
+ * +===========================================================================+
+ */
+
+/**
+ * Allocates and initializes an incremental menu parser.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param func Callback function that will receive each parsed item.
+ * @param arg  Optional. Parameter to be passed to the callback function.
+ *
+ * @return Newly initialized menu parser or NULL if an error occurred.
+ *
+ * @see gopher_menu_parser_feed
+ * @see gopher_menu_parser_free
+ */
+gopher_menu_parser_t *gopher_menu_parser_new(gopher_menu_item_func func,
+											 void *arg) {
+	gopher_menu_parser_t *mp;
+
+	/* Allocate the object. */
+	mp = (gopher_menu_parser_t *)malloc(sizeof(gopher_menu_parser_t));
+	if (mp == NULL) {
+		log_errno(LOG_ERROR, "Failed to allocate memory for menu parser");
+		return NULL;
+	}
+
+	/* Initialize the object. */
+	gopher_menu_parser_init(mp, func, arg);
+
+	return mp;
+}
+
+/**
+ * Initializes the state of a menu parser object.
+ *
+ * @param mp   Menu parser object.
+ * @param func Callback function that will receive each parsed item.
+ * @param arg  Optional. Parameter to be passed to the callback function.
+ */
+void gopher_menu_parser_init(gopher_menu_parser_t *mp,
+							 gopher_menu_item_func func, void *arg) {
+	mp->item_cb = func;
+	mp->item_cb_arg = arg;
+	mp->partial = NULL;
+	mp->partial_len = 0;
+	mp->partial_size = 0;
+	mp->items_len = 0;
+	mp->err_count = 0;
+	mp->termlined = 0;
+	mp->stopped = 0;
+	mp->finished = 0;
+}
+
+/**
+ * Feeds a chunk of menu data to the parser. Every line completed by the chunk
+ * is parsed and sent to the item callback right away, while an incomplete line
+ * at the end is kept until more data arrives.
+ *
+ * @param mp  Menu parser object.
+ * @param buf Chunk of data received from the server.
+ * @param len Length of the chunk.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_menu_parser_finish
+ */
+int gopher_menu_parser_feed(gopher_menu_parser_t *mp, const char *buf,
+							size_t len) {
+	const char *eol;
+	size_t used;
+	int ret;
+
+	/* Are we still interested in data? */
+	if (gopher_menu_parser_done(mp) || (len == 0))
+		return 0;
+
+	/* Complete a line left over from a previous chunk. */
+	if (mp->partial_len > 0) {
+		eol = (const char *)memchr(buf, '\n', len);
+		used = (eol != NULL) ? (size_t)(eol - buf + 1) : len;
+		ret = gopher_menu_parser_keep(mp, buf, used);
+		if ((ret != 0) || (eol == NULL))
+			return ret;
+		buf += used;
+		len -= used;
+
+		/* Parse the line that is now complete. */
+		gopher_menu_lines(mp, mp->partial, mp->partial_len, 0);
+		mp->partial_len = 0;
+		if (gopher_menu_parser_done(mp))
+			return 0;
+	}
+
+	/* Parse the complete lines straight from the chunk and keep the rest. */
+	used = gopher_menu_lines(mp, buf, len, 0);
+	if (!gopher_menu_parser_done(mp) && (used < len))
+		return gopher_menu_parser_keep(mp, buf + used, len - used);
+
+	return 0;
+}
+
+/**
+ * Signals the parser that no more data will arrive. Any incomplete line left
+ * over is parsed and a missing termination line is counted as an error.
+ *
+ * @param mp Menu parser object.
+ *
+ * @return 0 if the operation was successful.
+ */
+int gopher_menu_parser_finish(gopher_menu_parser_t *mp) {
+	/* Have we been here before? */
+	if (mp->finished)
+		return 0;
+
+	/* Parse whatever was left over without a line ending. */
+	if (!gopher_menu_parser_done(mp) && (mp->partial_len > 0))
+		gopher_menu_lines(mp, mp->partial, mp->partial_len, 1);
+	mp->partial_len = 0;
+
+	/* Check if server never sent the termination dot. */
+	if (!mp->termlined && !mp->stopped) {
+		log_printf(LOG_WARNING, "Server never sent termination dot\n");
+		mp->err_count++;
+	}
+	mp->finished = 1;
+
+	return 0;
+}
+
+/**
+ * Checks if the parser is done and won't take any more data, either because
+ * the termination line was parsed, the item callback asked to stop, or the
+ * parser was finished.
+ *
+ * @param mp Menu parser object.
+ *
+ * @return TRUE if the parser is done.
+ */
+int gopher_menu_parser_done(const gopher_menu_parser_t *mp) {
+	return mp->termlined || mp->stopped || mp->finished;
+}
+
+/**
+ * Frees a menu parser object.
+ *
+ * @param mp Menu parser object to be free'd.
+ */
+void gopher_menu_parser_free(gopher_menu_parser_t *mp) {
+	/* Is this even necessary? */
+	if (mp == NULL)
+		return;
+
+	/* Free the object's members. */
+	if (mp->partial)
+		free(mp->partial);
+
+	/* Free the object itself. */
+	free(mp);
+}
+
+/**
+ * Appends data to the incomplete line kept by the parser.
+ *
+ * @param mp  Menu parser object.
+ * @param buf Data to be appended.
+ * @param len Length of the data.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_menu_parser_keep(gopher_menu_parser_t *mp, const char *buf,
+							size_t len) {
+	/* Ensure the buffer is big enough. */
+	if ((mp->partial_len + len) > mp->partial_size) {
+		char *tmp;
+		size_t size;
+
+		size = (mp->partial_size) ? mp->partial_size : RECV_LINE_BUF;
+		while ((mp->partial_len + len) > size)
+			size *= 2;
+		tmp = (char *)realloc(mp->partial, size * sizeof(char));
+		if (tmp == NULL) {
+			log_errno(LOG_ERROR, "Failed to grow menu parser line buffer");
+			return ENOMEM;
+		}
+		mp->partial = tmp;
+		mp->partial_size = size;
+	}
+
+	/* Append the data. */
+	memcpy(mp->partial + mp->partial_len, buf, len);
+	mp->partial_len += len;
+
+	return 0;
+}
+
+/**
+ * Parses the complete lines in a buffer sending the items to the callback.
+ * Quirks from non-compliant servers are handled along the way: LF line endings,
+ * blank lines, and incomplete lines are accepted, with the last two counted as
+ * errors.
+ *
+ * @param mp    Menu parser object.
+ * @param buf   Buffer with the lines to be parsed.
+ * @param len   Length of the buffer.
+ * @param final Is this the end of the data? If FALSE a line without a line
+ *              ending at the end of the buffer is left untouched.
+ *
+ * @return Number of bytes consumed from the buffer.
+ */
+size_t gopher_menu_lines(gopher_menu_parser_t *mp, const char *buf, size_t len,
+						 int final) {
+	gopher_item_view_t view;
+	gopher_strview_t fields[4];
+	gopher_tok_t tok;
+	const char *line;
+	const char *end;
+	const char *p;
+	int nfields;
+
+	/* Go through the lines in the buffer. */
+	gopher_tok_init(&tok, buf, len);
+	p = buf;
+	end = buf + len;
+	while ((p < end) && !gopher_menu_parser_done(mp)) {
+		line = p;
+
+		/* Check if we have reached the termination line. */
+		if (*p == '.') {
+			const char *q;
+
+			q = p + 1;
+			if ((q < end) && (*q == '\r'))
+				q++;
+			if ((q == end) && !final)
+				break;
+			if ((q == end) || (*q == '\n')) {
+				mp->termlined = 1;
+				p = (q < end) ? (q + 1) : end;
+				break;
+			}
+		}
+
+		/* Check if a monstrosity of a server just sent a blank line. */
+		if ((*p == '\r') || (*p == '\n')) {
+			size_t q;
+
+			q = gopher_tok_eol(&tok, p - buf);
+			if ((q == len) && !final)
+				break;
+			mp->err_count++;
+			p = (q < len) ? (buf + q + 1) : end;
+			continue;
+		}
+
+		/* Split the line into its fields. */
+		view.type = (gopher_type_t)*p;
+		p = gopher_line_split(&tok, line, fields, &nfields);
+		if ((p == end) && (*(end - 1) != '\n') && !final) {
+			p = line;
+			break;
+		}
+		view.label = fields[0];
+		view.selector = fields[1];
+		view.host = fields[2];
+		view.port = fields[3];
+		view.port_num = gopher_port_parse(&fields[3]);
+
+		/* Check if a monstrosity of a server just sent an incomplete item. */
+		if (nfields == 1) {
+			view.type = GOPHER_TYPE_INFO;
+			view.selector.ptr = "INCOMPLETE_LINE";
+			view.selector.len = 15;
+			view.host.ptr = "_server.fail";
+			view.host.len = 12;
+			mp->err_count++;
+		}
+
+		/* Hand the item over. */
+		mp->items_len++;
+		if (mp->item_cb(&view, mp->item_cb_arg) != 0)
+			mp->stopped = 1;
+	}
+
+	return p - buf;
+}
+
+/**
+ * Receives a menu from a server feeding it to a parser as it arrives. If the
+ * GOPHER_FLAG_FASTTERM flag is set, or the parser was stopped by its callback,
+ * this returns as soon as the parser is done instead of waiting for the server
+ * to close the connection.
+ *
+ * @param addr Gopherspace address object already connected to the server.
+ * @param mp   Menu parser object.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_menu_recv(gopher_addr_t *addr, gopher_menu_parser_t *mp) {
+	gopher_rbuf_t *rb;
+	int ret;
+
+	/* Ensure we have a receive buffer attached to the connection. */
+	rb = gopher_rbuf_attach(addr);
+	if (rb == NULL)
+		return ENOMEM;
+
+	while (1) {
+		/* Feed whatever we have buffered to the parser. */
+		if (rb->pos < rb->len) {
+			ret = gopher_menu_parser_feed(mp, rb->buf + rb->pos,
+				rb->len - rb->pos);
+			if (ret != 0)
+				return ret;
+			rb->pos = rb->len;
+		}
+
+		/* Check if we are done here. */
+		if (gopher_menu_parser_done(mp) &&
+				((addr->flags & GOPHER_FLAG_FASTTERM) || mp->stopped)) {
+			break;
+		}
+		if (rb->eof)
+			break;
+
+		/* Get more data from the server. */
+		ret = gopher_rbuf_fill(addr);
+		if (ret != 0) {
+			log_printf(LOG_ERROR, "Failed to receive menu data\n");
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * +===========================================================================+
+ * |                                                                           |
+ * |                            Delimiter Scanning                             |
  * |                                                                           |
  * +===========================================================================+
  */
 
+/* Delimiter scanner currently in use. */
+static uint64_t (*gopher_delims)(const char *block) = NULL;
+
 /**
- * Allocates and initializes a Gopher directory object.
+ * Selects the instruction set used to scan menu data for delimiters.
  *
- * @warning This function dinamically allocates memory.
+ * @param level Desired instruction set. GOPHER_SIMD_AUTO picks the fastest one
+ *              supported by the CPU.
  *
- * @param addr Gopherspace address object.
+ * @return Instruction set actually in use. May be lower than the one requested
+ *         if the CPU doesn't support it.
+ */
+gopher_simd_t gopher_simd_select(gopher_simd_t level) {
+#ifdef GOPHER_SIMD_X86
+	/* Detect what the CPU supports. */
+	__builtin_cpu_init();
+	if (((level == GOPHER_SIMD_AUTO) || (level == GOPHER_SIMD_AVX2)) &&
+			__builtin_cpu_supports("avx2")) {
+		gopher_delims = gopher_delims_avx2;
+		return GOPHER_SIMD_AVX2;
+	}
+	if ((level != GOPHER_SIMD_SCALAR) && __builtin_cpu_supports("sse2")) {
+		gopher_delims = gopher_delims_sse2;
+		return GOPHER_SIMD_SSE2;
+	}
+#else
+	(void)level;
+#endif /* GOPHER_SIMD_X86 */
+
+	gopher_delims = gopher_delims_scalar;
+	return GOPHER_SIMD_SCALAR;
+}
+
+/**
+ * Initializes a delimiter tokenizer over a buffer.
  *
- * @return Newly initialized Gopher directory object.
+ * @param tok Delimiter tokenizer state.
+ * @param buf Buffer to be tokenized.
+ * @param len Length of the buffer.
+ */
+void gopher_tok_init(gopher_tok_t *tok, const char *buf, size_t len) {
+	/* Pick a scanner if nobody did it yet. */
+	if (gopher_delims == NULL)
+		gopher_simd_select(GOPHER_SIMD_AUTO);
+
+	/* Initialize the state without any block loaded. */
+	tok->buf = buf;
+	tok->len = len;
+	tok->base = (size_t)-1;
+	tok->mask = 0;
+}
+
+/**
+ * Finds the next tab, CR, or LF character in a tokenized buffer.
  *
- * @see gopher_dir_free
+ * @param tok  Delimiter tokenizer state.
+ * @param from Offset in the buffer to start looking from.
+ *
+ * @return Offset of the delimiter or the length of the buffer if there are no
+ *         more delimiters.
  */
-gopher_dir_t *gopher_dir_new(gopher_addr_t *addr) {
-	gopher_dir_t *dir;
+size_t gopher_tok_next(gopher_tok_t *tok, size_t from) {
+	char tail[DELIM_BLOCK];
+	size_t block;
+
+	/* Are we already past the end? */
+	if (from >= tok->len)
+		return tok->len;
+
+	/* Go through the blocks until we find a delimiter. */
+	block = from - (from % DELIM_BLOCK);
+	while (1) {
+		/* Scan the block if it's not already loaded. */
+		if (block != tok->base) {
+			if ((block + DELIM_BLOCK) <= tok->len) {
+				tok->mask = gopher_delims(tok->buf + block);
+			} else {
+				/* Pad the last block so we never read past the buffer. */
+				memset(tail, 0, DELIM_BLOCK);
+				memcpy(tail, tok->buf + block, tok->len - block);
+				tok->mask = gopher_delims(tail);
+			}
+			tok->base = block;
+		}
 
-	/* Allocate the object. */
-	dir = (gopher_dir_t *)malloc(sizeof(gopher_dir_t));
-	if (dir == NULL) {
-		log_errno(LOG_ERROR, "Failed to allocate memory for Gopher directory");
-		return NULL;
+		/* Ignore the delimiters before our starting point. */
+		if (from > block)
+			tok->mask &= ~(uint64_t)0 << (from - block);
+		if (tok->mask != 0)
+			return block + gopher_ctz64(tok->mask);
+
+		/* Move on to the next block. */
+		block += DELIM_BLOCK;
+		if (block >= tok->len)
+			return tok->len;
 	}
+}
 
-	/* Initialize the object. */
-	dir->addr = addr;
-	dir->prev = NULL;
-	dir->next = NULL;
-	dir->items = NULL;
-	dir->items_len = 0;
-	dir->err_count = 0;
+/**
+ * Finds the next LF character in a tokenized buffer.
+ *
+ * @param tok  Delimiter tokenizer state.
+ * @param from Offset in the buffer to start looking from.
+ *
+ * @return Offset of the LF character or the length of the buffer if there are
+ *         no more line endings.
+ */
+size_t gopher_tok_eol(gopher_tok_t *tok, size_t from) {
+	size_t q;
+
+	q = from;
+	while (1) {
+		q = gopher_tok_next(tok, q);
+		if ((q >= tok->len) || (tok->buf[q] == '\n'))
+			return q;
+		q++;
+	}
+}
+
+/**
+ * Builds a bitmask of the tab, CR, and LF characters in a block of data one
+ * byte at a time.
+ *
+ * @param block Block of DELIM_BLOCK bytes to be scanned.
+ *
+ * @return Bitmask with the bits set where a delimiter was found.
+ */
+uint64_t gopher_delims_scalar(const char *block) {
+	uint64_t mask;
+	int i;
+
+	mask = 0;
+	for (i = 0; i < DELIM_BLOCK; i++) {
+		if ((block[i] == '\t') || (block[i] == '\r') || (block[i] == '\n'))
+			mask |= (uint64_t)1 << i;
+	}
+
+	return mask;
+}
+
+#ifdef GOPHER_SIMD_X86
+/**
+ * Builds a bitmask of the tab, CR, and LF characters in a block of data using
+ * SSE2 instructions.
+ *
+ * @param block Block of DELIM_BLOCK bytes to be scanned.
+ *
+ * @return Bitmask with the bits set where a delimiter was found.
+ */
+__attribute__((target("sse2")))
+uint64_t gopher_delims_sse2(const char *block) {
+	__m128i tab;
+	__m128i cr;
+	__m128i lf;
+	uint64_t mask;
+	int i;
+
+	tab = _mm_set1_epi8('\t');
+	cr = _mm_set1_epi8('\r');
+	lf = _mm_set1_epi8('\n');
+	mask = 0;
+	for (i = 0; i < DELIM_BLOCK; i += 16) {
+		__m128i v;
+		__m128i m;
+
+		v = _mm_loadu_si128((const __m128i *)(block + i));
+		m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, tab),
+			_mm_cmpeq_epi8(v, cr)), _mm_cmpeq_epi8(v, lf));
+		mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(m) << i;
+	}
+
+	return mask;
+}
+
+/**
+ * Builds a bitmask of the tab, CR, and LF characters in a block of data using
+ * AVX2 instructions.
+ *
+ * @param block Block of DELIM_BLOCK bytes to be scanned.
+ *
+ * @return Bitmask with the bits set where a delimiter was found.
+ */
+__attribute__((target("avx2")))
+uint64_t gopher_delims_avx2(const char *block) {
+	__m256i tab;
+	__m256i cr;
+	__m256i lf;
+	uint64_t mask;
+	int i;
+
+	tab = _mm256_set1_epi8('\t');
+	cr = _mm256_set1_epi8('\r');
+	lf = _mm256_set1_epi8('\n');
+	mask = 0;
+	for (i = 0; i < DELIM_BLOCK; i += 32) {
+		__m256i v;
+		__m256i m;
+
+		v = _mm256_loadu_si256((const __m256i *)(block + i));
+		m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, tab),
+			_mm256_cmpeq_epi8(v, cr)), _mm256_cmpeq_epi8(v, lf));
+		mask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(m) << i;
+	}
+
+	return mask;
+}
+#endif /* GOPHER_SIMD_X86 */
+
+/**
+ * Counts the number of trailing zero bits in a 64-bit value.
+ *
+ * @param x Value to be checked. Must not be 0.
+ *
+ * @return Index of the lowest bit set.
+ */
+int gopher_ctz64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_ctzll(x);
+#else
+	int n;
+
+	n = 0;
+	while (!(x & 1)) {
+		x >>= 1;
+		n++;
+	}
+
+	return n;
+#endif /* __GNUC__ || __clang__ */
+}
+
+/*
+ * +===========================================================================+
+ * |                                                                           |
+ * |                     Socket and Networking Abstrations                     |
+ * |                                                                           |
+ * +===========================================================================+
+ */
+
+/**
+ * Sends a raw data buffer to a gopher server, carrying on after short writes
+ * until all of it was sent.
+ *
+ * @param addr     Gopherspace address object.
+ * @param buf      Data to be sent.
+ * @param len      Length of the data to be sent.
+ * @param sent_len Pointer to store the number of bytes actually sent. Ignored
+ *                 if NULL is passed.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see send
+ */
+int gopher_send_raw(const gopher_addr_t *addr, const void *buf, size_t len,
+					size_t *sent_len) {
+	sockiov_t iov;
+
+	sockiov_set(iov, buf, len);
+	return gopher_send_iov(addr, &iov, 1, sent_len);
+}
+
+/**
+ * Sends a string to a gopher server.
+ *
+ * @param addr     Gopherspace address object.
+ * @param buf      String to be sent.
+ * @param sent_len Pointer to store the number of bytes actually sent. Ignored
+ *                 if NULL is passed.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_send_raw
+ */
+int gopher_send(const gopher_addr_t *addr, const char *buf, size_t *sent_len) {
+	return gopher_send_raw(addr, (const void *)buf, strlen(buf), sent_len);
+}
+
+/**
+ * Sends a string to a gopher server automatically appending a CRLF.
+ *
+ * @param addr     Gopherspace address object.
+ * @param buf      String to be sent.
+ * @param sent_len Pointer to store the number of bytes actually sent. Ignored
+ *                 if NULL is passed.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_send_fields
+ */
+int gopher_send_line(const gopher_addr_t *addr, const char *buf,
+					 size_t *sent_len) {
+	return gopher_send_fields(addr, &buf, 1, sent_len);
+}
+
+/**
+ * Sends a request line made up of TAB separated fields to a gopher server,
+ * automatically appending a CRLF. The fields are handed to the socket as they
+ * are, without being copied into a single buffer.
+ *
+ * @param addr     Gopherspace address object.
+ * @param fields   Fields of the request line.
+ * @param count    Number of fields, up to REQ_MAX_FIELDS.
+ * @param sent_len Pointer to store the number of bytes actually sent. Ignored
+ *                 if NULL is passed.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_send_request
+ */
+int gopher_send_fields(const gopher_addr_t *addr, const char *const *fields,
+					   size_t count, size_t *sent_len) {
+	sockiov_t iov[REQ_MAX_FIELDS * 2];
+	size_t n;
+	size_t i;
+
+	/* Make sure the line fits in our buffers. */
+	if (count > REQ_MAX_FIELDS) {
+		log_printf(LOG_ERROR, "Too many fields in request line\n");
+		return EINVAL;
+	}
+
+	/* Point the buffers at the fields and their separators. */
+	n = 0;
+	for (i = 0; i < count; i++) {
+		if (i > 0) {
+			sockiov_set(iov[n], "\t", 1);
+			n++;
+		}
+		sockiov_set(iov[n], fields[i], strlen(fields[i]));
+		n++;
+
+#ifdef DEBUG
+		log_printf(LOG_INFO, "Sent field: \"%s\"\n", fields[i]);
+#endif /* DEBUG */
+	}
+	sockiov_set(iov[n], "\r\n", 2);
+	n++;
+
+	return gopher_send_iov(addr, iov, n, sent_len);
+}
+
+/**
+ * Sends the request line of a gopherspace address object to a gopher server.
+ *
+ * @param addr     Gopherspace address object.
+ * @param query    Optional. Search terms for a search server.
+ * @param plus     Optional. Gopher+ field, such as "+" for the item itself or
+ *                 "!" for its attributes.
+ * @param sent_len Pointer to store the number of bytes actually sent. Ignored
+ *                 if NULL is passed.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see gopher_send_fields
+ */
+int gopher_send_request(const gopher_addr_t *addr, const char *query,
+						const char *plus, size_t *sent_len) {
+	const char *fields[3];
+	size_t count;
+
+	count = 0;
+	fields[count++] = (addr->selector) ? addr->selector : "";
+	if (query != NULL)
+		fields[count++] = query;
+	if (plus != NULL)
+		fields[count++] = plus;
+
+	return gopher_send_fields(addr, fields, count, sent_len);
+}
+
+/**
+ * Sends a list of buffers to a gopher server in as few system calls as
+ * possible, carrying on after short writes until all of them were sent.
+ *
+ * @param addr     Gopherspace address object.
+ * @param iov      Buffers to be sent. Gets modified as data is sent.
+ * @param count    Number of buffers.
+ * @param sent_len Pointer to store the number of bytes actually sent. Ignored
+ *                 if NULL is passed.
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_send_iov(const gopher_addr_t *addr, sockiov_t *iov, size_t count,
+					size_t *sent_len) {
+#ifdef _WIN32
+	DWORD bytes;
+#else
+	struct msghdr msg;
+#endif /* _WIN32 */
+	size_t total;
+	size_t len;
+	ssize_t sent;
+	int ret;
+
+	/* Don't bother if we've been cancelled. */
+	if (gopher_cancel_triggered(addr->cancel))
+		return GOPHER_ERR_CANCELLED;
+
+	total = 0;
+	ret = 0;
+	while (count > 0) {
+		/* Skip over the buffers that are done with. */
+		if (sockiov_len(*iov) == 0) {
+			iov++;
+			count--;
+			continue;
+		}
+
+		/* Send as much as the socket will take. */
+#ifdef _WIN32
+		if (WSASend(addr->sockfd, iov, (DWORD)count, &bytes, 0, NULL,
+				NULL) == SOCKET_ERROR) {
+			ret = sockerrno;
+			break;
+		}
+		sent = (ssize_t)bytes;
+#else
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		sent = sendmsg(addr->sockfd, &msg, 0);
+		if (sent == SOCKET_ERROR) {
+			if (errno == EINTR)
+				continue;
+			ret = errno;
+			break;
+		}
+#endif /* _WIN32 */
+		total += sent;
+
+		/* Move past what was sent, a short write may leave us mid buffer. */
+		while ((sent > 0) && (count > 0)) {
+			len = sockiov_len(*iov);
+			if ((size_t)sent < len) {
+				sockiov_set(*iov, (char *)sockiov_base(*iov) + sent,
+					len - sent);
+				sent = 0;
+			} else {
+				sent -= len;
+				iov++;
+				count--;
+			}
+		}
+	}
+
+	/* Return the number of bytes sent. */
+	if (sent_len != NULL)
+		*sent_len = total;
+	if (ret != 0)
+		log_sockerrno(LOG_ERROR, "Failed to send data over socket", ret);
+
+	return ret;
+}
+
+/**
+ * Receive raw data from a gopher server. Any data already held by the
+ * connection receive buffer is handed out before reading from the socket.
+ *
+ * @param addr     Gopherspace address object.
+ * @param buf      Buffer to store the received data.
+ * @param buf_len  Length of the buffer to store the data.
+ * @param recv_len Optional. Pointer to store the number of bytes actually
+ *                 received.
+ * @param flags    Flags to be passed to recv().
+ *
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ *
+ * @see recv
+ */
+int gopher_recv_raw(gopher_addr_t *addr, void *buf, size_t buf_len,
+					size_t *recv_len, int flags) {
+	gopher_rbuf_t *rb;
+	size_t bytes_recv;
+	ssize_t len;
+	int ret;
+
+	/* Check if we have a valid file descriptor. */
+	if (addr->sockfd == INVALID_SOCKET)
+		return EBADF;
+
+	/* Hand out anything that was already buffered by the line reader. */
+	rb = addr->rbuf;
+	if ((rb != NULL) && (rb->pos < rb->len)) {
+		bytes_recv = rb->len - rb->pos;
+		if (bytes_recv > buf_len)
+			bytes_recv = buf_len;
+		memcpy(buf, rb->buf + rb->pos, bytes_recv);
+		if (!(flags & MSG_PEEK))
+			rb->pos += bytes_recv;
+
+		if (recv_len != NULL)
+			*recv_len = bytes_recv;
+		return 0;
+	}
+
+	/* Stay within our bandwidth caps and deadlines. */
+	if (!(flags & MSG_PEEK)) {
+		ret = gopher_rate_wait(addr, &buf_len);
+		if (ret != 0)
+			return ret;
+		ret = gopher_recv_wait(addr);
+		if (ret != 0)
+			return ret;
+	}
+
+	/* Receive data from the socket. */
+	len = recv(addr->sockfd, buf, buf_len, flags);
+	if (len == SOCKET_ERROR) {
+		log_sockerrno(LOG_ERROR, "Failed to receive data from socket",
+			sockerrno);
+		return sockerrno;
+	}
+	bytes_recv = len;
+
+	/* Keep track of activity for our deadlines and bandwidth caps. */
+	if ((bytes_recv > 0) && !(flags & MSG_PEEK)) {
+		gopher_rate_charge(addr, bytes_recv);
+		addr->recvd = 1;
+		if (gopher_timeouts_active(addr))
+			addr->last_io = gopher_clock_ms();
+	}
+
+	/* Return the number of bytes received. */
+	if (recv_len != NULL)
+		*recv_len = bytes_recv;
 
-	return dir;
+	/* Check if the connection was closed gracefully by the server. */
+	if ((bytes_recv == 0) && !(flags & MSG_PEEK)) {
+		log_printf(LOG_INFO, "Connection closed gracefully by server\n");
+		if (rb != NULL)
+			rb->eof = 1;
+	}
+
+	return 0;
 }
 
 /**
- * Requests a directory from a Gopher server.
+ * Receive an entire line from a gopher server.
  *
  * @warning This function dinamically allocates memory.
  *
- * @param addr Gopherspace address object already connected to the server.
- * @param dir  Pointer to where the results of the directory will be stored.
+ * @param addr Gopherspace address object.
+ * @param line Pointer to location where the received line including the CRLF
+ *             characters will be stored. NULL if the connection was closed.
+ * @param len  Optional. Pointer to store the number of bytes actually received.
  *
  * @return 0 if the operation was successful. Check return against strerror() in
  *         case of failure.
  *
- * @see gopher_dir_free
+ * @see gopher_recv_raw
  */
-int gopher_dir_request(gopher_addr_t *addr, gopher_dir_t **dir) {
-	gopher_dir_t *pd;
-	gopher_item_t *prev;
-	char *line;
-	size_t len;
+int gopher_recv_line(gopher_addr_t *addr, char **line, size_t *len) {
+	char *buf;
+	size_t line_len;
 	int ret;
-	int termlined;
 
-	/* Send selector of our request. */
-	ret = gopher_send_line(addr, (addr->selector) ? addr->selector : "", NULL);
-	if (ret != 0) {
-		log_errno(LOG_ERROR, "Failed to send line during directory request");
+	/* Get the line from the connection reader. */
+	*line = NULL;
+	ret = gopher_rbuf_getline(addr, &buf, &line_len);
+	if (len != NULL)
+		*len = line_len;
+	if ((ret != 0) || (buf == NULL))
 		return ret;
-	}
-
-	/* Initialize directory object. */
-	*dir = gopher_dir_new(addr);
-	pd = *dir;
-	if (*dir == NULL) {
-		log_errno(LOG_ERROR, "Failed to initialize directory object");
-		return -1;
-	}
-
-	/* Go through lines received from the server. */
-	termlined = 0;
-	prev = NULL;
-	line = NULL;
-	len = 0;
-	while (gopher_recv_line(addr, &line, &len) == 0) {
-		gopher_item_t *item;
-
-		/* Check if we have reached the termination line. */
-		if (gopher_is_termline(line)) {
-			termlined = 1;
-			goto nextline;
-		}
-
-		/* Check if we have terminated the connection. */
-		if (line == NULL)
-			break;
-
-		/* Check if a monstrosity of a server just sent a blank line. */
-		if ((line[0] == '\r') && (line[1] == '\n')) {
-			pd->err_count++;
-			goto nextline;
-		}
-
-		/* Parse line item. */
-		ret = gopher_item_parse(&item, line);
-		if (ret != 0) {
-			char *msg;
-			size_t msg_len;
-
-			log_printf(LOG_WARNING, "Failed to parse line item during "
-				"directory request: \"%s\"\n", line);
-			pd->err_count++;
-
-			/* Build string to warn user of the parsing issue. */
-			msg_len = strlen("PARSING FAILED: \"\"") + strlen(line);
-			msg = (char *)malloc((msg_len + 1) * sizeof(char));
-			snprintf(msg, msg_len, "PARSING FAILED: \"%s\"", line);
-			msg[msg_len] = '\0';
-			item = gopher_item_new(msg, gopher_addr_new("_server.fail", 0,
-				"PARSING_FAILED", GOPHER_TYPE_ERROR));
-			free(msg);
-
-#ifdef DEBUG
-			free(line);
-			break;
-#endif
-		}
-
-		/* Check if a monstrosity of a server just sent an incomplete item. */
-		if (item->addr == NULL) {
-			/* Fix this idiotic problem. */
-			item->addr = gopher_addr_new("_server.fail", 0, "INCOMPLETE_LINE",
-				GOPHER_TYPE_INFO);
-			pd->err_count++;
-		}
 
-		/* Push the item into the directory item stack. */
-		if (pd->items == NULL)
-			pd->items = item;
-		if (prev != NULL)
-			prev->next = item;
-		prev = item;
-		pd->items_len++;
-
-nextline:
-		/* Clean up any temporary resources. */
-		free(line);
-		line = NULL;
-	}
-
-	/* Check if server never sent the termination dot. */
-	if (!termlined) {
-		log_printf(LOG_WARNING, "Server never sent termination dot\n");
-		pd->err_count++;
+	/* Give the caller a copy it can own. */
+	*line = (char *)malloc((line_len + 1) * sizeof(char));
+	if (*line == NULL) {
+		log_errno(LOG_ERROR, "Failed to allocate memory for received line");
+		return ENOMEM;
 	}
+	memcpy(*line, buf, line_len + 1);
 
-	return ret;
+	return 0;
 }
 
 /**
- * Frees a Gopher directory object.
+ * Waits for data to arrive on a connection within the limits of its deadlines,
+ * unless the connection gets cancelled first.
  *
- * @param dir       Gopher directory object to be free'd.
- * @param recurse   Bitwise field to recursively free its history stack.
- * @param inclusive Should we also free ourselves? If FALSE will only free
- *                  history in specified recurse direction.
+ * @param addr Gopherspace address object.
+ *
+ * @return 0 if there's data to be received, a GOPHER_ERR_*_TIMEOUT code if a
+ *         deadline was reached, GOPHER_ERR_CANCELLED if the connection was
+ *         cancelled, or an error code.
  */
-void gopher_dir_free(gopher_dir_t *dir, gopher_recurse_dir_t recurse,
-		int inclusive) {
-	/* Is this even necessary? */
-	if (dir == NULL)
-		return;
+int gopher_recv_wait(gopher_addr_t *addr) {
+	long left;
+	int err;
+	int ret;
 
-	/* Ensure we remove ourselves from other objects in the stack. */
-	if (inclusive) {
-		if (dir->next)
-			dir->next->prev = NULL;
-		if (dir->prev)
-			dir->prev->next = NULL;
+	/* Do we even have deadlines to meet or a way to be cancelled? */
+	if (!addr->timeouts.first_byte && !addr->timeouts.idle &&
+			!addr->timeouts.total && (addr->cancel == NULL)) {
+		return 0;
 	}
 
-	/* Free history backwards. */
-	if (dir->prev && (recurse & RECURSE_BACKWARD)) {
-		gopher_dir_free(dir->prev, RECURSE_BACKWARD, 1);
-		dir->prev = NULL;
+	/* Figure out which deadline comes first. */
+	err = 0;
+	if (addr->recvd) {
+		left = gopher_deadline(addr, addr->timeouts.idle, addr->last_io,
+			GOPHER_ERR_IDLE_TIMEOUT, &err);
+	} else {
+		left = gopher_deadline(addr, addr->timeouts.first_byte, addr->last_io,
+			GOPHER_ERR_FIRSTBYTE_TIMEOUT, &err);
 	}
+	if ((left < 0) && (addr->cancel == NULL))
+		return 0;
 
-	/* Free history forwards. */
-	if (dir->next && (recurse & RECURSE_FORWARD)) {
-		gopher_dir_free(dir->next, RECURSE_FORWARD, 1);
-		dir->next = NULL;
+	/* Wait for it. */
+	ret = gopher_socket_wait(addr, 0, left);
+	if (gopher_cancel_triggered(addr->cancel)) {
+		log_printf(LOG_ERROR, "%s\n", gopher_strerror(GOPHER_ERR_CANCELLED));
+		return GOPHER_ERR_CANCELLED;
+	} else if (ret == 0) {
+		log_printf(LOG_ERROR, "%s\n", gopher_strerror(err));
+		return err;
+	} else if (ret < 0) {
+		log_sockerrno(LOG_ERROR, "Failed to wait for data", sockerrno);
+		return sockerrno;
 	}
 
-	/* Free ourselves too. */
-	if (inclusive) {
-		/* Free the object's members. */
-		dir->items_len = 0;
-		if (dir->items)
-			gopher_item_free(dir->items, RECURSE_FORWARD);
-		if (dir->addr)
-			gopher_addr_free(dir->addr);
-
-		/* Free the object itself. */
-		free(dir);
-	}
+	return 0;
 }
 
-/*
- * +===========================================================================+
- * |                                                                           |
- * |                             File Downloading                              |
- * |                                                                           |
- * +===========================================================================+
- */
-
 /**
- * Allocates and initializes a Gopher file download object.
- *
- * @warning This function dinamically allocates memory.
- *
- * @param addr Gopherspace address object already connected to the server.
- * @param path Path to where to download the file to.
- * @param hint Hint at the type of file we may be dealing with.
+ * Waits for a socket to become ready or for its connection to be cancelled.
  *
- * @return Newly initialized Gopher file download object.
+ * @param addr    Gopherspace address object with an open socket.
+ * @param write   Wait for it to be writable instead of readable?
+ * @param timeout Maximum number of milliseconds to wait. Negative waits forever.
  *
- * @see gopher_file_free
- * @see gopher_file_download
+ * @return 1 if the socket is ready or the connection was cancelled, 0 if the
+ *         timeout was reached, or -1 if an error occurred.
  */
-gopher_file_t *gopher_file_new(gopher_addr_t *addr, const char *path,
-							   gopher_type_t hint) {
-	gopher_file_t *gf;
-
-	/* Allocate the object. */
-	gf = (gopher_file_t *)malloc(sizeof(gopher_file_t));
-	if (gf == NULL) {
-		log_errno(LOG_ERROR, "Failed to allocate memory for Gopher file "
-			"download object");
-		return NULL;
-	}
-
-	/* Initialize the object. */
-	gf->addr = addr;
-	gf->fpath = strdup(path);
-	gf->fsize = 0;
-	gf->type = hint;
-	gf->transfer_cb = NULL;
-	gf->transfer_cb_arg = NULL;
+int gopher_socket_wait(gopher_addr_t *addr, int write, long timeout) {
+	int ready;
 
-	return gf;
+	return gopher_socket_poll(&addr->sockfd, &ready, 1, write, timeout,
+		addr->cancel);
 }
 
 /**
- * Downloads a file from a Gopher server.
- *
- * @warning Ensure to connect to the address in the download object before
- *          calling this function.
- *
- * @param gf Gopher file download object.
+ * Waits for any of a set of sockets to become ready. A failed connection
+ * attempt counts as ready for writing.
  *
- * @return 0 if the operation was successful. Check return against strerror() in
- *         case of failure.
+ * @param fds     Socket file descriptors to wait on.
+ * @param ready   Array to be populated with which of the sockets are ready.
+ * @param count   Number of sockets. No more than HE_MAX_ATTEMPTS.
+ * @param write   Wait for them to be writable instead of readable?
+ * @param timeout Maximum number of milliseconds to wait. Negative waits forever.
+ * @param cancel  Optional. Cancellation token that cuts the wait short.
  *
- * @see gopher_file_new
- * @see gopher_file_free
+ * @return 1 if any of the sockets are ready or the wait was cancelled, 0 if the
+ *         timeout was reached, or -1 if an error occurred.
  */
-int gopher_file_download(gopher_file_t *gf) {
-	char buf[RECV_FILE_BUF];
-	size_t recv_len;
-	FILE *fh;
+int gopher_socket_poll(const int *fds, int *ready, size_t count, int write,
+					   long timeout, const gopher_cancel_t *cancel) {
+#ifdef _WIN32
+	struct timeval tv;
+	fd_set rwfds;
+	fd_set exfds;
+	size_t i;
+	long wait;
 	int ret;
 
-	/* Send selector of our request. */
-	ret = gopher_send_line(gf->addr, (gf->addr->selector) ?
-		gf->addr->selector : "", NULL);
-	if (ret != 0) {
-		log_errno(LOG_ERROR, "Failed to send line during download request");
-		return ret;
-	}
-
-	/* Open file for writing. */
-	fh = fopen(gf->fpath, "wb");
-	if (fh == NULL) {
-		log_errno(LOG_ERROR, "Failed to open download file for writing");
-		return errno;
-	}
+	/* Older versions of Windows don't have WSAPoll, and select() only takes
+	 * sockets, so keep checking back on the cancellation token instead. */
+	for (;;) {
+		FD_ZERO(&rwfds);
+		FD_ZERO(&exfds);
+		for (i = 0; i < count; i++) {
+			FD_SET(fds[i], &rwfds);
+			FD_SET(fds[i], &exfds);
+		}
+		wait = timeout;
+		if ((cancel != NULL) && ((wait < 0) || (wait > CANCEL_POLL_SLICE)))
+			wait = CANCEL_POLL_SLICE;
+		tv.tv_sec = wait / 1000;
+		tv.tv_usec = (wait % 1000) * 1000;
+		ret = select(0, (write) ? NULL : &rwfds, (write) ? &rwfds : NULL,
+			&exfds, (wait < 0) ? NULL : &tv);
+		if ((ret != 0) || (cancel == NULL))
+			break;
 
-	/* Read everything that comes from the stream. */
-	while ((ret = gopher_recv_raw(gf->addr, buf, RECV_FILE_BUF, &recv_len, 0))
-			== 0) {
-		/* Check if the connection was terminated. */
-		if ((ret == 0) && (recv_len == 0))
+		/* Check if we've been cancelled or ran out of time. */
+		if (gopher_cancel_triggered(cancel)) {
+			ret = 1;
 			break;
+		}
+		if (timeout >= 0) {
+			timeout -= wait;
+			if (timeout <= 0)
+				break;
+		}
+	}
 
-		/* Increase the size counter and write stream to file. */
-		gf->fsize += recv_len;
-		fwrite(buf, sizeof(char), recv_len, fh);
+	/* Windows reports failed connections as exceptions. */
+	for (i = 0; i < count; i++) {
+		ready[i] = (ret > 0) && (FD_ISSET(fds[i], &rwfds) ||
+			FD_ISSET(fds[i], &exfds));
+	}
+#else
+	struct pollfd pfds[HE_MAX_ATTEMPTS + 1];
+	size_t nfds;
+	size_t i;
+	int ret;
 
-		/* Report downloaded size to callback function. */
-		if (gf->transfer_cb)
-			gf->transfer_cb((const void *)gf, gf->transfer_cb_arg);
+	for (i = 0; i < count; i++) {
+		pfds[i].fd = fds[i];
+		pfds[i].events = (write) ? POLLOUT : POLLIN;
+		pfds[i].revents = 0;
 	}
-	fclose(fh);
-	fh = NULL;
 
-	/* Check if something went wrong. */
-	if (ret != 0) {
-		log_errno(LOG_ERROR, "Failed to download file");
-		return ret;
+	/* Get woken up by the cancellation token's pipe. */
+	nfds = count;
+	if (cancel != NULL) {
+		pfds[nfds].fd = cancel->fds[0];
+		pfds[nfds].events = POLLIN;
+		pfds[nfds].revents = 0;
+		nfds++;
 	}
 
-	return 0;
+	do {
+		ret = poll(pfds, nfds, (timeout > INT_MAX) ? INT_MAX : (int)timeout);
+	} while ((ret == -1) && (errno == EINTR));
+	for (i = 0; i < count; i++)
+		ready[i] = (ret > 0) && (pfds[i].revents != 0);
+#endif /* _WIN32 */
+
+	return (ret > 0) ? 1 : ret;
 }
 
 /**
- * Frees a Gopher file download object.
+ * Checks if a connection has any deadlines set.
  *
- * @param gf Gopher file download object to be free'd.
+ * @param addr Gopherspace address object.
+ *
+ * @return TRUE if any of the deadlines are enabled.
  */
-void gopher_file_free(gopher_file_t *gf) {
-	/* Is this even necessary? */
-	if (gf == NULL)
-		return;
-
-	/* Free the object's members. */
-	if (gf->fpath)
-		free(gf->fpath);
-	gf->fsize = 0;
-
-	/* Free the object itself. */
-	free(gf);
+int gopher_timeouts_active(const gopher_addr_t *addr) {
+	return addr->timeouts.dns || addr->timeouts.connect ||
+		addr->timeouts.first_byte || addr->timeouts.idle ||
+		addr->timeouts.total;
 }
 
 /**
- * Gets the basename of a supposed file from a gopherspace address object.
- *
- * @warning This function dinamically allocates memory.
+ * Calculates how long we can still wait in a phase of a connection, taking the
+ * total deadline into account.
  *
- * @param addr Gopherspace address object to extract a filename from.
+ * @param addr      Gopherspace address object.
+ * @param phase     Deadline of the current phase in milliseconds, 0 if none.
+ * @param since     Clock reading of when the phase started.
+ * @param phase_err Error code for when the phase deadline is reached.
+ * @param err       Error code of the deadline that comes first.
  *
- * @return A file name extrapolated from the gopherspace address object.
+ * @return Number of milliseconds left or -1 if there are no deadlines.
  */
-char *gopher_file_basename(const gopher_addr_t *addr) {
-	char *fname;
+long gopher_deadline(const gopher_addr_t *addr, unsigned long phase,
+					 unsigned long since, int phase_err, int *err) {
+	unsigned long elapsed;
+	unsigned long now;
+	long total;
+	long left;
+
+	now = gopher_clock_ms();
+	left = -1;
+
+	/* Deadline of the phase. */
+	if (phase > 0) {
+		elapsed = now - since;
+		left = (elapsed < phase) ? (long)(phase - elapsed) : 0;
+		*err = phase_err;
+	}
 
-	/* Try to get a valid filename from the selector. */
-#ifdef _WIN32
-	LPTSTR szPath;
-	LPTSTR szBaseName;
+	/* Deadline of the entire request. */
+	if (addr->timeouts.total > 0) {
+		elapsed = now - addr->started;
+		total = (elapsed < addr->timeouts.total) ?
+			(long)(addr->timeouts.total - elapsed) : 0;
+		if ((left < 0) || (total < left)) {
+			left = total;
+			*err = GOPHER_ERR_TOTAL_TIMEOUT;
+		}
+	}
 
-	/* Convert the path to UTF-16 and get its basename. */
-	szPath = win_mbstowcs(addr->selector);
-	szBaseName = PathFindFileName(szPath);  /* shlwapi.lib */
+	return left;
+}
 
-	/* Convert the basename to UTF-8 and free our temporary string. */
-	fname = win_wcstombs(szBaseName);
-	free(szPath);
+/**
+ * Gets a reading of a monotonic clock.
+ *
+ * @return Number of milliseconds since an arbitrary point in time.
+ */
+unsigned long gopher_clock_ms(void) {
+#ifdef _WIN32
+	return GetTickCount();
 #else
-	fname = basename(addr->selector);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long)ts.tv_sec * 1000UL) +
+		(unsigned long)(ts.tv_nsec / 1000000L);
 #endif /* _WIN32 */
-	if ((*fname != '.') && (*fname != '/') && (*fname != '\\'))
-		return fname;
-	free(fname);
-	fname = NULL;
+}
 
-	/* Build a fallback filename from the server hostname. */
-	return strdup(addr->host);
+/**
+ * Suspends the calling thread for a while.
+ *
+ * @param ms Number of milliseconds to sleep for.
+ */
+void gopher_sleep_ms(unsigned long ms) {
+#ifdef _WIN32
+	Sleep((DWORD)ms);
+#else
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+	while ((nanosleep(&ts, &ts) == -1) && (errno == EINTR))
+		;
+#endif /* _WIN32 */
 }
 
 /**
- * Sets up a callback to listen for reports of transferred bytes while
- * downloading.
+ * Gets a human readable description of an error code returned by the library.
  *
- * @param gf   Gopher file download object.
- * @param func Callback function.
- * @param arg  Optional. Parameter to be passed to the callback function.
+ * @param err Error code returned by one of our functions.
+ *
+ * @return Description of the error.
+ *
+ * @see strerror
  */
-void gopher_file_set_transfer_cb(gopher_file_t *gf,
-								 gopher_file_transfer_func func, void *arg) {
-	gf->transfer_cb = func;
-	gf->transfer_cb_arg = arg;
+const char *gopher_strerror(int err) {
+	switch (err) {
+		case GOPHER_ERR_DNS_TIMEOUT:
+			return "Timed out resolving the server address";
+		case GOPHER_ERR_CONNECT_TIMEOUT:
+			return "Timed out connecting to the server";
+		case GOPHER_ERR_FIRSTBYTE_TIMEOUT:
+			return "Timed out waiting for the server to respond";
+		case GOPHER_ERR_IDLE_TIMEOUT:
+			return "Timed out waiting for more data from the server";
+		case GOPHER_ERR_TOTAL_TIMEOUT:
+			return "Request took longer than allowed";
+		case GOPHER_ERR_CANCELLED:
+			return "Request was cancelled";
+		default:
+			return strerror(err);
+	}
 }
 
 /*
  * +===========================================================================+
  * |                                                                           |
- * |                             Item Line Parsing                             |
+ * |                         Connection Receive Buffer                         |
  * |                                                                           |
  * +===========================================================================+
  */
 
 /**
- * Allocates and initializes a Gopher line item object.
+ * Allocates and initializes a connection receive buffer.
  *
  * @warning This function dinamically allocates memory.
  *
- * @param label Optional. Label of the item.
- * @param addr  Optional. Gopherspace address object that will be owned by the
- *              newly initialized object.
- *
- * @return Newly initialized Gopher line item object.
+ * @return Newly initialized connection receive buffer or NULL if an error
+ *         occurred.
  *
- * @see gopher_item_free
+ * @see gopher_rbuf_free
  */
-gopher_item_t *gopher_item_new(const char *label, gopher_addr_t *addr) {
-	gopher_item_t *item;
+gopher_rbuf_t *gopher_rbuf_new(void) {
+	gopher_rbuf_t *rb;
 
 	/* Allocate the object. */
-	item = (gopher_item_t *)malloc(sizeof(gopher_item_t));
-	if (item == NULL) {
-		log_errno(LOG_ERROR, "Failed to allocate memory for Gopher item");
+	rb = (gopher_rbuf_t *)malloc(sizeof(gopher_rbuf_t));
+	if (rb == NULL) {
+		log_errno(LOG_ERROR, "Failed to allocate memory for receive buffer");
+		return NULL;
+	}
+
+	/* Allocate the data and line buffers. */
+	rb->size = RECV_CONN_BUF;
+	rb->buf = (char *)malloc(rb->size * sizeof(char));
+	rb->line_size = RECV_LINE_BUF;
+	rb->line = (char *)malloc(rb->line_size * sizeof(char));
+	if ((rb->buf == NULL) || (rb->line == NULL)) {
+		log_errno(LOG_ERROR, "Failed to allocate memory for receive buffer "
+			"data");
+		gopher_rbuf_free(rb);
 		return NULL;
 	}
 
 	/* Initialize the object. */
-	item->label = NULL;
-	if (label)
-		item->label = strdup(label);
-	item->addr = addr;
-	item->next = NULL;
+	gopher_rbuf_reset(rb);
 
-	return item;
+	return rb;
 }
 
 /**
- * Gets the URL which points to a respective item object.
+ * Gets the receive buffer of a connection, allocating one if needed.
  *
- * @warning This function dinamically allocates memory.
+ * @param addr Gopherspace address object.
  *
- * @param item Gopher item object.
+ * @return Receive buffer of the connection or NULL if an error occurred.
+ */
+gopher_rbuf_t *gopher_rbuf_attach(gopher_addr_t *addr) {
+	if (addr->rbuf == NULL)
+		addr->rbuf = gopher_rbuf_new();
+
+	return addr->rbuf;
+}
+
+/**
+ * Discards any data held by a connection receive buffer so that it can be
+ * reused for another connection.
  *
- * @return Standardized URL representation of the item's location.
+ * @param rb Connection receive buffer.
+ */
+void gopher_rbuf_reset(gopher_rbuf_t *rb) {
+	rb->pos = 0;
+	rb->len = 0;
+	rb->eof = 0;
+}
+
+/**
+ * Frees a connection receive buffer.
  *
- * @see gopher_addr_str
- * @see gopher_item_print
+ * @param rb Connection receive buffer to be free'd.
  */
-char *gopher_item_url(const gopher_item_t *item) {
-	return gopher_addr_str(item->addr);
+void gopher_rbuf_free(gopher_rbuf_t *rb) {
+	/* Is this even necessary? */
+	if (rb == NULL)
+		return;
+
+	/* Free the object's members. */
+	if (rb->buf)
+		free(rb->buf);
+	if (rb->line)
+		free(rb->line);
+
+	/* Free the object itself. */
+	free(rb);
 }
 
 /**
- * Parses a line received from a server into an item object.
+ * Refills an empty connection receive buffer with a single read from the
+ * socket.
  *
- * @warning This function dinamically allocates memory.
+ * @param addr Gopherspace address object with an allocated receive buffer.
  *
- * @param item Pointer to location where the parsed line will be stored.
- * @param line Line as received from the server.
+ * @return 0 if the operation was successful. Check return against strerror() in
+ *         case of failure.
+ */
+int gopher_rbuf_fill(gopher_addr_t *addr) {
+	gopher_rbuf_t *rb;
+	size_t recv_len;
+	int ret;
+
+	/* Read as much as the socket is willing to give us. */
+	rb = addr->rbuf;
+	rb->pos = 0;
+	rb->len = 0;
+	ret = gopher_recv_raw(addr, rb->buf, rb->size, &recv_len, 0);
+	if (ret != 0)
+		return ret;
+	rb->len = recv_len;
+
+	return 0;
+}
+
+/**
+ * Gets the next line from the connection receive buffer, refilling it from the
+ * socket only when it runs out of data. Non-compliant LF line endings are
+ * converted into CRLF ones.
+ *
+ * @warning The returned line is owned by the receive buffer and is only valid
+ *          until the next call to this function.
+ *
+ * @param addr Gopherspace address object.
+ * @param line Pointer to the received line including the CRLF characters. NULL
+ *             if the connection was closed.
+ * @param len  Optional. Pointer to store the length of the line.
  *
  * @return 0 if the operation was successful. Check return against strerror() in
  *         case of failure.
  *
  * @see gopher_recv_line
- * @see gopher_item_free
  */
-int gopher_item_parse(gopher_item_t **item, const char *line) {
-	gopher_item_t *it;
-	gopher_type_t type;
-	const char *p;
-	char *selector;
-	char *host;
-	char *port;
-
-	/* Am I a joke to you? */
-	if ((item == NULL) || (line == NULL)) {
-		log_printf(LOG_ERROR, "Item or line for parsing are NULL\n");
-		return -1;
-	}
+int gopher_rbuf_getline(gopher_addr_t *addr, char **line, size_t *len) {
+	gopher_rbuf_t *rb;
+	size_t line_len;
+	int found;
+	int ret;
 
-	/* I can't parse a dot. */
-	if (gopher_is_termline(line)) {
-		log_printf(LOG_ERROR, "Tried to parse the termination line\n");
-		return -1;
-	}
+	/* Set sane defaults for the return values. */
+	*line = NULL;
+	if (len != NULL)
+		*len = 0;
 
-	/* Check if a monstrosity of a server just sent a blank line. */
-	if (line[0] == '\r') {
-		log_printf(LOG_ERROR, "Tried parsing an empty line\n");
-		return -1;
-	}
+	/* Ensure we have a receive buffer attached to the connection. */
+	rb = gopher_rbuf_attach(addr);
+	if (rb == NULL)
+		return ENOMEM;
 
-	/* Initialize the item object. */
-	p = line;
-	type = (gopher_type_t)*p++;
-	*item = gopher_item_new(NULL, NULL);
-	it = *item;
-	if (it == NULL) {
-		log_errno(LOG_ERROR, "Failed to allocate memory for parsed line item");
-		return errno;
-	}
+	/* Gather data until we find the end of the line. */
+	found = 0;
+	line_len = 0;
+	while (!found) {
+		const char *start;
+		const char *end;
+		size_t chunk;
+
+		/* Refill the buffer if we have exhausted it. */
+		if (rb->pos == rb->len) {
+			if (rb->eof)
+				break;
+
+			ret = gopher_rbuf_fill(addr);
+			if (ret != 0) {
+				log_printf(LOG_ERROR, "Failed to read received line\n");
+				return ret;
+			}
 
-	/* Initialize some parsed properties with sane defaults. */
-	selector = NULL;
-	host = NULL;
-	port = NULL;
+			continue;
+		}
 
-	/* Start parsing the line with the type and label. */
-	p = strdupsep(&it->label, p, '\t');
-	if (p == NULL) {
-		log_errno(LOG_ERROR, "Failed to duplicate label string");
-		gopher_item_free(it, 1);
-		it = NULL;
-		goto cleanup;
-	}
+		/* Look for the end of the line in the buffered data. */
+		start = rb->buf + rb->pos;
+		end = (const char *)memchr(start, '\n', rb->len - rb->pos);
+		if (end != NULL) {
+			chunk = end - start + 1;
+			found = 1;
+		} else {
+			chunk = rb->len - rb->pos;
+		}
 
-	/* Check if idiotic server just sent line without the rest of the fields. */
-	if (*p == '\0') {
-		log_printf(LOG_WARNING, "Parsed incomplete line\n");
-		it->label[strlen(it->label) - 2] = '\0';
-		it->addr = NULL;
-		return errno;
-	}
+		/* Ensure the line buffer can hold the chunk, CRLF, and NUL. */
+		if ((line_len + chunk + 2) > rb->line_size) {
+			char *tmp;
+			size_t size;
+
+			size = rb->line_size;
+			while ((line_len + chunk + 2) > size)
+				size *= 2;
+			tmp = (char *)realloc(rb->line, size * sizeof(char));
+			if (tmp == NULL) {
+				log_printf(LOG_ERROR, "Failed to reallocate line buffer\n");
+				return ENOMEM;
+			}
+			rb->line = tmp;
+			rb->line_size = size;
+		}
 
-	/* Parse the selector. */
-	p++;
-	p = strdupsep(&selector, p, '\t');
-	if (p == NULL) {
-		log_errno(LOG_ERROR, "Failed to duplicate selector string");
-		gopher_item_free(it, 1);
-		it = NULL;
-		goto cleanup;
+		/* Move the chunk over to the line buffer. */
+		memcpy(rb->line + line_len, start, chunk);
+		line_len += chunk;
+		rb->pos += chunk;
 	}
 
-	/* Parse the host. */
-	p++;
-	p = strdupsep(&host, p, '\t');
-	if (p == NULL) {
-		log_errno(LOG_ERROR, "Failed to duplicate host string");
-		gopher_item_free(it, 1);
-		it = NULL;
-		goto cleanup;
-	}
+	/* Check if the connection was closed before anything was received. */
+	if (line_len == 0)
+		return 0;
 
-	/* Parse the port. */
-	p++;
-	p = strdupsep(&port, p, '\r');
-	if (p == NULL) {
-		log_errno(LOG_ERROR, "Failed to duplicate port string");
-		gopher_item_free(it, 1);
-		it = NULL;
-		goto cleanup;
+	/* Ensure we convert a non-compliant server into a compliant one. */
+	if (!found) {
+		log_printf(LOG_INFO, "Connection closed before line ending\n");
+		rb->line[line_len++] = '\r';
+		rb->line[line_len++] = '\n';
+	} else if ((line_len < 2) || (rb->line[line_len - 2] != '\r')) {
+		log_printf(LOG_INFO, "Non-compliant LF line ending received\n");
+		rb->line[line_len - 1] = '\r';
+		rb->line[line_len++] = '\n';
 	}
+	rb->line[line_len] = '\0';
 
-	/* Finally create the address object. */
-	it->addr = gopher_addr_new(host, (uint16_t)atoi(port), selector, type);
-	if (it->addr == NULL) {
-		log_errno(LOG_ERROR, "Failed to create address object for parsed line");
-		gopher_item_free(it, 1);
-		it = NULL;
-		goto cleanup;
-	}
-
-cleanup:
-	/* Free up resources. */
-	if (selector)
-		free(selector);
-	if (host)
-		free(host);
-	if (port)
-		free(port);
+	/* Return the received line and length with the CRLF characters. */
+	*line = rb->line;
+	if (len != NULL)
+		*len = line_len;
 
 	return 0;
 }
 
+/*
+ * +===========================================================================+
+ * |                                                                           |
+ * |                          Threading Abstractions                           |
+ * |                                                                           |
+ * +===========================================================================+
+ */
+
 /**
- * Prints debugging information about a Gopher item type.
+ * Initializes a mutex.
  *
- * @param item Gopher item to have its type printed out.
+ * @param mutex Mutex to be initialized.
  */
-void gopher_item_print_type(const gopher_item_t *item) {
-	if (item->addr == NULL) {
-		printf("(null)");
-		return;
-	}
-
-	/* Regex to get this from gopher_type_t definition: */
-	/* s/\s+GOPHER_TYPE_([^\s]+)\s+= '([^'])'(,?)/
-	   case GOPHER_TYPE_$1:\n\tprintf("[$1]");\n\tbreak;\n/g */
-	switch (item->addr->type) {
-		case GOPHER_TYPE_INTERNAL:
-			printf("<[INTERNAL]>");
-			break;
-		case GOPHER_TYPE_TEXT:
-			printf("[TEXT]");
-			break;
-		case GOPHER_TYPE_DIR:
-			printf("[DIR]");
-			break;
-		case GOPHER_TYPE_CSO:
-			printf("[CSO]");
-			break;
-		case GOPHER_TYPE_ERROR:
-			printf("[ERROR]");
-			break;
-		case GOPHER_TYPE_BINHEX:
-			printf("[BINHEX]");
-			break;
-		case GOPHER_TYPE_DOS:
-			printf("[DOS]");
-			break;
-		case GOPHER_TYPE_UNIX:
-			printf("[UNIX]");
-			break;
-		case GOPHER_TYPE_SEARCH:
-			printf("[SEARCH]");
-			break;
-		case GOPHER_TYPE_TELNET:
-			printf("[TELNET]");
-			break;
-		case GOPHER_TYPE_BINARY:
-			printf("[BINARY]");
-			break;
-		case GOPHER_TYPE_MIRROR:
-			printf("[MIRROR]");
-			break;
-		case GOPHER_TYPE_TN3270:
-			printf("[TN3270]");
-			break;
-		case GOPHER_TYPE_GIF:
-			printf("[GIF]");
-			break;
-		case GOPHER_TYPE_IMAGE:
-			printf("[IMAGE]");
-			break;
-		case GOPHER_TYPE_BITMAP:
-			printf("[BITMAP]");
-			break;
-		case GOPHER_TYPE_MOVIE:
-			printf("[MOVIE]");
-			break;
-		case GOPHER_TYPE_AUDIO:
-			printf("[AUDIO]");
-			break;
-		case GOPHER_TYPE_DOC:
-			printf("[DOC]");
-			break;
-		case GOPHER_TYPE_HTML:
-			printf("[HTML]");
-			break;
-		case GOPHER_TYPE_INFO:
-			printf("[INFO]");
-			break;
-		case GOPHER_TYPE_PNG:
-			printf("[PNG]");
-			break;
-		case GOPHER_TYPE_WAV:
-			printf("[WAV]");
-			break;
-		case GOPHER_TYPE_PDF:
-			printf("[PDF]");
-			break;
-		case GOPHER_TYPE_XML:
-			printf("[XML]");
-			break;
-		default:
-			printf("<[UNKNOWN]>");
-			break;
-	}
+void gopher_mutex_init(gopher_mutex_t *mutex) {
+#ifdef _WIN32
+	InitializeCriticalSection(mutex);
+#else
+	pthread_mutex_init(mutex, NULL);
+#endif /* _WIN32 */
 }
 
 /**
- * Prints debugging information about a Gopher item object.
+ * Locks a mutex.
  *
- * @param item Gopher item to have its information printed out.
+ * @param mutex Mutex to be locked.
  */
-void gopher_item_print(const gopher_item_t *item) {
-	/* Is this a valid object? */
-	if (item == NULL) {
-		printf("(null)\n");
-		return;
-	}
+void gopher_mutex_lock(gopher_mutex_t *mutex) {
+#ifdef _WIN32
+	EnterCriticalSection(mutex);
+#else
+	pthread_mutex_lock(mutex);
+#endif /* _WIN32 */
+}
 
-	/* Print out the object data. */
-	gopher_item_print_type(item);
-	printf("\t'%s'\t'%s'\t%s:%u", item->label, item->addr->selector,
-		item->addr->host, item->addr->port);
-	if (item->next != NULL) {
-		printf("\t->%p\n", item->next);
-	} else {
-		printf("\n");
-	}
+/**
+ * Unlocks a mutex.
+ *
+ * @param mutex Mutex to be unlocked.
+ */
+void gopher_mutex_unlock(gopher_mutex_t *mutex) {
+#ifdef _WIN32
+	LeaveCriticalSection(mutex);
+#else
+	pthread_mutex_unlock(mutex);
+#endif /* _WIN32 */
 }
 
 /**
- * Frees a Gopher item object.
+ * Frees up any resources allocated by a mutex.
  *
- * @param item    Gopher item object to be free'd.
- * @param recurse Recursively free next items as well?
+ * @param mutex Mutex to be destroyed.
  */
-void gopher_item_free(gopher_item_t *item, gopher_recurse_dir_t recurse) {
-	/* Is this even necessary? */
-	if (item == NULL)
-		return;
-
-	/* Free the object's members. */
-	if (item->label)
-		free(item->label);
-	if (item->addr)
-		gopher_addr_free(item->addr);
-	if (item->next && (recurse == RECURSE_FORWARD))
-		gopher_item_free(item->next, recurse);
-
-	/* Free the object itself. */
-	free(item);
+void gopher_mutex_destroy(gopher_mutex_t *mutex) {
+#ifdef _WIN32
+	DeleteCriticalSection(mutex);
+#else
+	pthread_mutex_destroy(mutex);
+#endif /* _WIN32 */
 }
 
 /**
- * Checks if a received line is in fact the termination one with a single dot.
+ * Locks a mutex guarding global state, initializing it on first use.
  *
- * @param line Received line to be checked.
- *
- * @return TRUE if the line is the last one to be transmitted before closing the
- *         connection.
+ * @param lock Statically initialized global lock.
  */
-int gopher_is_termline(const char *line) {
-	return (line != NULL) && (line[0] == '.') && (line[1] == '\r') &&
-		(line[2] == '\n');
+void gopher_global_lock(gopher_global_lock_t *lock) {
+#ifdef _WIN32
+	/* Critical sections can't be initialized statically. */
+	if (!lock->ready) {
+		if (InterlockedIncrement((LPLONG)&lock->users) == 1) {
+			InitializeCriticalSection(&lock->mutex);
+			lock->ready = 1;
+		} else {
+			while (!lock->ready)
+				Sleep(0);
+		}
+	}
+#endif /* _WIN32 */
+
+	gopher_mutex_lock(&lock->mutex);
 }
 
-/*
- * +===========================================================================+
- * |                                                                           |
- * |                     Socket and Networking Abstrations                     |
- * |                                                                           |
- * +===========================================================================+
+/**
+ * Unlocks a mutex guarding global state.
+ *
+ * @param lock Global lock.
  */
+void gopher_global_unlock(gopher_global_lock_t *lock) {
+	gopher_mutex_unlock(&lock->mutex);
+}
 
 /**
- * Sends a raw data buffer to a gopher server.
+ * Initializes a manual reset event that starts out unset.
  *
- * @param addr     Gopherspace address object.
- * @param buf      Data to be sent.
- * @param len      Length of the data to be sent.
- * @param sent_len Pointer to store the number of bytes actually sent. Ignored
- *                 if NULL is passed.
+ * @param ev Event to be initialized.
  *
  * @return 0 if the operation was successful. Check return against strerror() in
  *         case of failure.
- *
- * @see send
  */
-int gopher_send_raw(const gopher_addr_t *addr, const void *buf, size_t len,
-					size_t *sent_len) {
-	ssize_t bytes_sent;
+int gopher_event_init(gopher_event_t *ev) {
+#ifdef _WIN32
+	ev->handle = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (ev->handle == NULL)
+		return ENOMEM;
+#else
+	int ret;
 
-	/* Try to send some information through a socket. */
-	bytes_sent = send(addr->sockfd, buf, len, 0);
-	if (bytes_sent == SOCKET_ERROR) {
-		log_sockerrno(LOG_ERROR, "Failed to send data over socket", sockerrno);
-		return sockerrno;
+	ev->set = 0;
+	ret = pthread_mutex_init(&ev->lock, NULL);
+	if (ret != 0)
+		return ret;
+	ret = pthread_cond_init(&ev->cond, NULL);
+	if (ret != 0) {
+		pthread_mutex_destroy(&ev->lock);
+		return ret;
 	}
-
-	/* Return the number of bytes sent. */
-	if (sent_len != NULL)
-		*sent_len = bytes_sent;
+#endif /* _WIN32 */
 
 	return 0;
 }
 
 /**
- * Sends a string to a gopher server.
- *
- * @param addr     Gopherspace address object.
- * @param buf      String to be sent.
- * @param sent_len Pointer to store the number of bytes actually sent. Ignored
- *                 if NULL is passed.
- *
- * @return 0 if the operation was successful. Check return against strerror() in
- *         case of failure.
+ * Sets an event, waking up anyone waiting on it.
  *
- * @see gopher_send_raw
+ * @param ev Event to be set.
  */
-int gopher_send(const gopher_addr_t *addr, const char *buf, size_t *sent_len) {
-	return gopher_send_raw(addr, (const void *)buf, strlen(buf), sent_len);
+void gopher_event_set(gopher_event_t *ev) {
+#ifdef _WIN32
+	SetEvent(ev->handle);
+#else
+	pthread_mutex_lock(&ev->lock);
+	ev->set = 1;
+	pthread_cond_broadcast(&ev->cond);
+	pthread_mutex_unlock(&ev->lock);
+#endif /* _WIN32 */
 }
 
 /**
- * Sends a string to a gopher server automatically appending a CRLF.
+ * Resets an event, so that waiting on it blocks again.
  *
- * @param addr     Gopherspace address object.
- * @param buf      String to be sent.
- * @param sent_len Pointer to store the number of bytes actually sent. Ignored
- *                 if NULL is passed.
+ * @param ev Event to be reset.
+ */
+void gopher_event_reset(gopher_event_t *ev) {
+#ifdef _WIN32
+	ResetEvent(ev->handle);
+#else
+	pthread_mutex_lock(&ev->lock);
+	ev->set = 0;
+	pthread_mutex_unlock(&ev->lock);
+#endif /* _WIN32 */
+}
+
+/**
+ * Waits for an event to be set.
  *
- * @return 0 if the operation was successful. Check return against strerror() in
- *         case of failure.
+ * @param ev      Event to wait on.
+ * @param timeout Maximum number of milliseconds to wait. Negative waits forever.
  *
- * @see gopher_send
+ * @return TRUE if the event was set, FALSE if the timeout was reached.
  */
-int gopher_send_line(const gopher_addr_t *addr, const char *buf,
-					 size_t *sent_len) {
-	size_t len;
-	char *nbuf;
-	char *n;
-	const char *b;
-	int ret;
-
-	/* Get string length and allocate a buffer big enough for it plus CRLF. */
-	len = strlen(buf) + 2;
-	nbuf = (char *)malloc((len + 1) * sizeof(char));
-
-	/* Copy the string over and append CRLF very fast. */
-	b = buf;
-	n = nbuf;
-	while (*b != '\0') {
-		*n = *b;
-		n++;
-		b++;
+int gopher_event_wait(gopher_event_t *ev, long timeout) {
+#ifdef _WIN32
+	return WaitForSingleObject(ev->handle,
+		(timeout < 0) ? INFINITE : (DWORD)timeout) == WAIT_OBJECT_0;
+#else
+	struct timespec ts;
+	int set;
+
+	/* Calculate the absolute deadline. */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	if (timeout >= 0) {
+		ts.tv_sec += timeout / 1000;
+		ts.tv_nsec += (timeout % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
 	}
-	*n = '\r';
-	n++;
-	*n = '\n';
-	n++;
-	*n = '\0';
-
-#ifdef DEBUG
-	log_printf(LOG_INFO, "Sent: \"%s\"\n", nbuf);
-#endif /* DEBUG */
 
-	/* Send the line over the network. */
-	ret = gopher_send_raw(addr, (void *)nbuf, len, sent_len);
-
-	/* Free temporary resources. */
-	free(nbuf);
+	/* Wait for the event. */
+	pthread_mutex_lock(&ev->lock);
+	while (!ev->set) {
+		if (timeout < 0) {
+			pthread_cond_wait(&ev->cond, &ev->lock);
+		} else if (pthread_cond_timedwait(&ev->cond, &ev->lock, &ts) ==
+				ETIMEDOUT) {
+			break;
+		}
+	}
+	set = ev->set;
+	pthread_mutex_unlock(&ev->lock);
 
-	return ret;
+	return set;
+#endif /* _WIN32 */
 }
 
 /**
- * Receive raw data from a gopher server.
+ * Frees up any resources allocated by an event.
  *
- * @param addr     Gopherspace address object.
- * @param buf      Buffer to store the received data.
- * @param buf_len  Length of the buffer to store the data.
- * @param recv_len Optional. Pointer to store the number of bytes actually
- *                 received.
- * @param flags    Flags to be passed to recv().
+ * @param ev Event to be destroyed.
+ */
+void gopher_event_destroy(gopher_event_t *ev) {
+#ifdef _WIN32
+	CloseHandle(ev->handle);
+#else
+	pthread_cond_destroy(&ev->cond);
+	pthread_mutex_destroy(&ev->lock);
+#endif /* _WIN32 */
+}
+
+/**
+ * Trampoline for running our thread functions with the native threading API.
  *
- * @return 0 if the operation was successful. Check return against strerror() in
- *         case of failure.
+ * @param param Thread function and its argument.
  *
- * @see recv
+ * @return Always 0.
  */
-int gopher_recv_raw(const gopher_addr_t *addr, void *buf, size_t buf_len,
-					size_t *recv_len, int flags) {
-	size_t bytes_recv;
-	ssize_t len;
-
-	/* Check if we have a valid file descriptor. */
-	if (addr->sockfd == INVALID_SOCKET)
-		return EBADF;
-
-	/* Receive data from the socket. */
-	len = recv(addr->sockfd, buf, buf_len, flags);
-	if (len == SOCKET_ERROR) {
-		log_sockerrno(LOG_ERROR, "Failed to receive data from socket",
-			sockerrno);
-		return sockerrno;
-	}
-	bytes_recv = len;
-
-	/* Return the number of bytes received. */
-	if (recv_len != NULL)
-		*recv_len = bytes_recv;
+#ifdef _WIN32
+static DWORD WINAPI gopher_thread_start(LPVOID param) {
+#else
+static void *gopher_thread_start(void *param) {
+#endif /* _WIN32 */
+	gopher_thread_t thread;
 
-	/* Check if the connection was closed gracefully by the server. */
-	if ((bytes_recv == 0) && !(flags | MSG_PEEK))
-		log_printf(LOG_INFO, "Connection closed gracefully by server\n");
+	thread = *(gopher_thread_t *)param;
+	free(param);
+	thread.func(thread.arg);
 
 	return 0;
 }
 
 /**
- * Receive an entire line from a gopher server.
+ * Spawns a detached thread.
  *
- * @warning This function dinamically allocates memory.
- *
- * @param addr Gopherspace address object.
- * @param line Pointer to location where the received line including the CRLF
- *             characters will be stored.
- * @param len  Optional. Pointer to store the number of bytes actually received.
+ * @param func Function to be run on the new thread.
+ * @param arg  Argument to be passed to the function.
  *
  * @return 0 if the operation was successful. Check return against strerror() in
  *         case of failure.
- *
- * @see gopher_recv_raw
  */
-int gopher_recv_line(const gopher_addr_t *addr, char **line, size_t *len) {
-	char peek[RECV_LINE_BUF];
-	char *buf;
-	size_t prev_line_len;
-	size_t line_len;
-	size_t recv_len;
+int gopher_thread_spawn(gopher_thread_func func, void *arg) {
+	gopher_thread_t *thread;
+#ifdef _WIN32
+	HANDLE handle;
+#else
+	pthread_attr_t attr;
+	pthread_t handle;
 	int ret;
+#endif /* _WIN32 */
 
-	/* Ensure we read an entire line. */
-	ret = 0;
-	prev_line_len = 0;
-	line_len = 0;
-	*line = NULL;
-	buf = NULL;
-	while (ret == 0) {
-		int found;
-		size_t i;
-		char *pb;
-
-		/* Read incoming data. */
-		prev_line_len = line_len;
-		found = 0;
-		ret = gopher_recv_raw(addr, peek, RECV_LINE_BUF - 1, &recv_len,
-			MSG_PEEK);
-		if ((ret == 0) && (recv_len == 0)) {
-			*line = NULL;
-			free(buf);
-			return 0;
-		}
-		if ((ret != 0) || (recv_len == 0)) {
-			log_printf(LOG_ERROR, "Failed to read received line\n");
-			*line = NULL;
-			if (len != NULL)
-				*len = 0;
-			free(buf);
-
-			return ret;
-		}
-		peek[recv_len] = '\0';
-
-		/* Go through the received data looking for the end of the line. */
-		for (i = 0; i < recv_len; i++) {
-			/* Handle LF (non-standard) and CRLF line endings. */
-			if ((peek[i] == '\n') || ((peek[i] == '\r') &&
-					((i + 1) < recv_len) && (peek[i + 1] == '\n'))) {
-				line_len += 2;
-				found = '\r';
-
-				/* Handle monstrosities that send LF instead of CRLF. */
-				if (peek[i] == '\n') {
-					log_printf(LOG_INFO, "Non-compliant line in peek'd buffer "
-						"\"%s\"\n", peek);
-					found = '\n';
-				}
-
-				goto concatrecv;
-			}
-
-			line_len++;
-		}
-
-concatrecv:
-		/* Reallocate the buffer. */
-		pb = buf;
-		buf = realloc(pb, (line_len + 1) * sizeof(char));
-		if (buf == NULL) {
-			log_printf(LOG_ERROR, "Failed to reallocate line buffer\n");
-			free(pb);
-			*line = NULL;
-
-			return errno;
-		}
-
-		/* Read previously peek'd data into buffer. */
-		pb = buf + prev_line_len;
-		ret = gopher_recv_raw(addr, pb, line_len - prev_line_len -
-			(found == '\n'), &recv_len, 0);
-		if (ret != 0) {
-			log_printf(LOG_ERROR, "Failed to read received line\n");
-			free(*line);
-			*line = NULL;
-
-			return ret;
-		}
-		buf[line_len] = '\0';
-
-		/* Ensure we convert a non-compliant server into a compliant one. */
-		if (found == '\n') {
-			buf[line_len - 2] = '\r';
-			buf[line_len - 1] = '\n';
-		}
+	/* Package up the function and its argument. */
+	thread = (gopher_thread_t *)malloc(sizeof(gopher_thread_t));
+	if (thread == NULL)
+		return ENOMEM;
+	thread->func = func;
+	thread->arg = arg;
 
-		/* Are we finished here? */
-		if (found)
-			ret = 1;
+	/* Start the thread without having to join it later. */
+#ifdef _WIN32
+	handle = CreateThread(NULL, 0, gopher_thread_start, thread, 0, NULL);
+	if (handle == NULL) {
+		free(thread);
+		return ENOMEM;
 	}
-
-	/* Return the received line and length with the CRLF characters. */
-	*line = buf;
-	if (len != NULL)
-		*len = line_len;
+	CloseHandle(handle);
+#else
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&handle, &attr, gopher_thread_start, thread);
+	pthread_attr_destroy(&attr);
+	if (ret != 0) {
+		free(thread);
+		return ret;
+	}
+#endif /* _WIN32 */
 
 	return 0;
 }
@@ -1808,6 +9795,126 @@ void log_printf(log_level_t level, const char *format, ...) {
 
 #endif /* DEBUG */
 
+/*
+ * +===========================================================================+
+ * |                                                                           |
+ * |                               Memory Arenas                               |
+ * |                                                                           |
+ * +===========================================================================+
+ */
+
+/**
+ * Allocates a memory arena chunk.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param size Number of usable bytes in the chunk.
+ *
+ * @return Newly allocated arena chunk or NULL if an error occurred.
+ *
+ * @see gopher_arena_free
+ */
+gopher_arena_t *gopher_arena_new(size_t size) {
+	gopher_arena_t *arena;
+
+	/* Allocate the chunk with its header. */
+	arena = (gopher_arena_t *)malloc(ARENA_HEADER_SIZE + size);
+	if (arena == NULL) {
+		log_errno(LOG_ERROR, "Failed to allocate memory arena chunk");
+		return NULL;
+	}
+
+	/* Initialize the object. */
+	arena->next = NULL;
+	arena->size = size;
+	arena->used = 0;
+
+	return arena;
+}
+
+/**
+ * Bump allocates memory from an arena, growing it with a new chunk whenever the
+ * current one is exhausted.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param arena Pointer to the arena's current chunk. If NULL or pointing to
+ *              NULL the memory will be allocated from the heap instead.
+ * @param size  Number of bytes to allocate.
+ *
+ * @return Pointer to the allocated memory or NULL if an error occurred.
+ */
+void *gopher_arena_alloc(gopher_arena_t **arena, size_t size) {
+	gopher_arena_t *chunk;
+	void *ptr;
+
+	/* Fall back to the heap if there's no arena. */
+	if ((arena == NULL) || (*arena == NULL))
+		return malloc(size);
+
+	/* Keep everything aligned. */
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	/* Grow the arena if the current chunk can't fit the allocation. */
+	chunk = *arena;
+	if ((chunk->size - chunk->used) < size) {
+		chunk = gopher_arena_new((size > ARENA_CHUNK_SIZE) ?
+			size : ARENA_CHUNK_SIZE);
+		if (chunk == NULL)
+			return NULL;
+		chunk->next = *arena;
+		*arena = chunk;
+	}
+
+	/* Bump the allocation pointer. */
+	ptr = (char *)chunk + ARENA_HEADER_SIZE + chunk->used;
+	chunk->used += size;
+
+	return ptr;
+}
+
+/**
+ * Duplicates a string of known length into a memory arena.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param arena Pointer to the arena's current chunk. If NULL or pointing to
+ *              NULL the memory will be allocated from the heap instead.
+ * @param str   String to be duplicated. Doesn't need to be NUL terminated.
+ * @param len   Length of the string.
+ *
+ * @return NUL terminated copy of the string or NULL if an error occurred.
+ */
+char *gopher_arena_strndup(gopher_arena_t **arena, const char *str,
+						   size_t len) {
+	char *buf;
+
+	/* Allocate and copy the string over. */
+	buf = (char *)gopher_arena_alloc(arena, (len + 1) * sizeof(char));
+	if (buf == NULL)
+		return NULL;
+	memcpy(buf, str, len);
+	buf[len] = '\0';
+
+	return buf;
+}
+
+/**
+ * Frees a memory arena along with everything that was allocated from it.
+ *
+ * @param arena Memory arena's current chunk.
+ */
+void gopher_arena_free(gopher_arena_t *arena) {
+	gopher_arena_t *next;
+
+	/* Go through the chunks freeing them. */
+	while (arena != NULL) {
+		next = arena->next;
+		free(arena);
+		arena = next;
+	}
+}
+
 /*
  * +===========================================================================+
  * |                                                                           |
@@ -40,6 +40,68 @@ typedef enum {
 	RECURSE_BACKWARD = 0x02
 } gopher_recurse_dir_t;
 
+/**
+ * Connection and request behaviour flags.
+ */
+typedef enum {
+	GOPHER_FLAG_NONE       = 0x00,
+	GOPHER_FLAG_FASTTERM   = 0x01,
+	GOPHER_FLAG_ARENA      = 0x02,
+	GOPHER_FLAG_INARENA    = 0x04,
+	GOPHER_FLAG_NOPOOL     = 0x08,
+	GOPHER_FLAG_NOTFO      = 0x10,
+	GOPHER_FLAG_PIPELINE   = 0x20,
+	GOPHER_FLAG_MMAP       = 0x40,
+	GOPHER_FLAG_BACKGROUND = 0x80,
+	GOPHER_FLAG_NOCACHE    = 0x100
+} gopher_flags_t;
+
+/**
+ * Socket tuning profiles. The latency profile is meant for menus and other
+ * small requests, it carries the request in the SYN with TCP Fast Open once the
+ * server has handed us a cookie, and turns off Nagle and delayed ACKs. The bulk
+ * profile is meant for large downloads, it asks for a large receive buffer and
+ * only wakes up the reader once there's a good chunk of data waiting.
+ */
+typedef enum {
+	GOPHER_SOCKPROF_DEFAULT = 0,
+	GOPHER_SOCKPROF_LATENCY,
+	GOPHER_SOCKPROF_BULK
+} gopher_sockprof_t;
+
+/**
+ * Instruction set used to scan menu data for delimiters.
+ */
+typedef enum {
+	GOPHER_SIMD_AUTO = 0,
+	GOPHER_SIMD_SCALAR,
+	GOPHER_SIMD_SSE2,
+	GOPHER_SIMD_AVX2
+} gopher_simd_t;
+
+/**
+ * Notification mechanism used by the multi request engine.
+ */
+typedef enum {
+	GOPHER_MULTI_AUTO = 0,
+	GOPHER_MULTI_SELECT,
+	GOPHER_MULTI_EPOLL,
+	GOPHER_MULTI_URING
+} gopher_multi_backend_t;
+
+/**
+ * Library specific error codes. These are kept out of the range of errno values
+ * and can be turned into messages with gopher_strerror().
+ */
+typedef enum {
+	GOPHER_ERR_DNS_TIMEOUT = 10000,
+	GOPHER_ERR_CONNECT_TIMEOUT,
+	GOPHER_ERR_FIRSTBYTE_TIMEOUT,
+	GOPHER_ERR_IDLE_TIMEOUT,
+	GOPHER_ERR_TOTAL_TIMEOUT,
+	GOPHER_ERR_CANCELLED
+} gopher_err_t;
+
 /**
  * Gopher data types.
  */
@@ -72,6 +134,98 @@ typedef enum {
 	GOPHER_TYPE_XML    = 'X'
 } gopher_type_t;
 
+/**
+ * Connection receive buffer. Holds data read in large chunks from the socket
+ * in order to hand it out line by line without further system calls.
+ */
+typedef struct gopher_rbuf_s {
+	char *buf;
+	size_t size;
+	size_t pos;
+	size_t len;
+	int eof;
+
+	char *line;
+	size_t line_size;
+} gopher_rbuf_t;
+
+/**
+ * Memory arena chunk used to bump allocate objects that share a lifetime.
+ */
+typedef struct gopher_arena_s {
+	struct gopher_arena_s *next;
+	size_t size;
+	size_t used;
+} gopher_arena_t;
+
+/**
+ * Per-phase connection deadlines in milliseconds. A deadline of 0 is disabled.
+ * The first byte deadline counts from the moment the connection is established
+ * and the total one from the moment we start connecting.
+ */
+typedef struct gopher_timeouts_s {
+	unsigned long dns;
+	unsigned long connect;
+	unsigned long first_byte;
+	unsigned long idle;
+	unsigned long total;
+} gopher_timeouts_t;
+
+/**
+ * Name resolution cache counters. Lookups of pinned hosts are counted as
+ * overrides and never touch the cache.
+ */
+typedef struct gopher_dns_stats_s {
+	unsigned long hits;
+	unsigned long negative_hits;
+	unsigned long misses;
+	unsigned long overrides;
+	size_t entries;
+} gopher_dns_stats_t;
+
+/**
+ * Warm connection pool counters. Connections that went stale are the ones that
+ * were closed by the server or sat idle for too long before being used.
+ */
+typedef struct gopher_pool_stats_s {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long opened;
+	unsigned long stale;
+	size_t idle;
+} gopher_pool_stats_t;
+
+/**
+ * Request coalescing counters. Joined fetches are the ones that shared the
+ * result of an identical fetch that was already under way.
+ */
+typedef struct gopher_fetch_stats_s {
+	unsigned long fetches;
+	unsigned long joined;
+	size_t shared;
+} gopher_fetch_stats_t;
+
+/**
+ * Response cache counters. Stale hits are the ones served from an expired entry
+ * while it was being refreshed in the background.
+ */
+typedef struct gopher_cache_stats_s {
+	unsigned long hits;
+	unsigned long stale_hits;
+	unsigned long misses;
+	unsigned long refreshes;
+	unsigned long evictions;
+	size_t entries;
+	size_t bytes;
+	size_t max_bytes;
+} gopher_cache_stats_t;
+
+/**
+ * Cancellation token that interrupts the blocking operations of every
+ * connection it's attached to. Its contents are private.
+ */
+typedef struct gopher_cancel_s gopher_cancel_t;
+
 /**
  * Gopherspace address including host, port, and selector, also includes the
  * connection information.
@@ -83,8 +237,24 @@ typedef struct gopher_addr_s {
 	gopher_type_t type;
 
 	int sockfd;
-	struct sockaddr_in *ipaddr;
+	struct sockaddr *ipaddr;
 	socklen_t ipaddr_len;
+	gopher_rbuf_t *rbuf;
+	int flags;
+	gopher_sockprof_t profile;
+
+	gopher_timeouts_t timeouts;
+	unsigned long started;
+	unsigned long last_io;
+	int recvd;
+
+	unsigned long rate_limit;
+	double rate_tokens;
+	unsigned long rate_at;
+
+	unsigned long cache_ttl;
+
+	gopher_cancel_t *cancel;
 } gopher_addr_t;
 
 /**
@@ -106,8 +276,81 @@ typedef struct gopher_dir_s {
 	struct gopher_dir_s *next;
 	size_t items_len;
 	uint16_t err_count;
+	gopher_arena_t *arena;
 } gopher_dir_t;
 
+/**
+ * Non-owning view of a string inside a larger buffer.
+ */
+typedef struct gopher_strview_s {
+	const char *ptr;
+	size_t len;
+} gopher_strview_t;
+
+/**
+ * Gopher line item as a set of views into the buffer it was parsed from.
+ */
+typedef struct gopher_item_view_s {
+	gopher_type_t type;
+	gopher_strview_t label;
+	gopher_strview_t selector;
+	gopher_strview_t host;
+	gopher_strview_t port;
+	uint16_t port_num;
+} gopher_item_view_t;
+
+/**
+ * Gopher menu parsed from a contiguous buffer without copying any fields.
+ */
+typedef struct gopher_menu_s {
+	gopher_item_view_t *items;
+	size_t items_len;
+	size_t items_size;
+	uint16_t err_count;
+	int termlined;
+} gopher_menu_t;
+
+/**
+ * Menu parser item callback function.
+ *
+ * @param item Parsed item. Its views are only valid during the call.
+ * @param arg  Optional data set by the parser setup.
+ *
+ * @return 0 to continue parsing or anything else to stop.
+ */
+typedef int (*gopher_menu_item_func)(const gopher_item_view_t *item,
+									 void *arg);
+
+/**
+ * Incremental menu parser that doesn't perform any I/O by itself. Data is fed
+ * to it in chunks of any size and items are emitted as soon as their lines are
+ * complete.
+ */
+typedef struct gopher_menu_parser_s {
+	gopher_menu_item_func item_cb;
+	void *item_cb_arg;
+
+	char *partial;
+	size_t partial_len;
+	size_t partial_size;
+
+	size_t items_len;
+	uint16_t err_count;
+	int termlined;
+	int stopped;
+	int finished;
+} gopher_menu_parser_t;
+
+/**
+ * Directory item streaming callback function.
+ *
+ * @param item Item that has just arrived. Ownership is passed to the callback.
+ * @param arg  Optional data set by the request.
+ *
+ * @return 0 to continue receiving or anything else to stop the transfer.
+ */
+typedef int (*gopher_dir_item_func)(gopher_item_t *item, void *arg);
+
 /**
  * File download bytes transferred reporting callback function.
  *
@@ -117,7 +360,49 @@ typedef struct gopher_dir_s {
 typedef void (*gopher_file_transfer_func)(const void *gf, void *arg);
 
 /**
- * Gopher downloaded file object.
+ * Snapshot of the progress of a file download. Rates are in bytes per second,
+ * the instantaneous one covering the time since the previous report and the
+ * average one the time since the download started.
+ */
+typedef struct {
+	size_t fsize;
+	unsigned long elapsed;
+	double rate;
+	double avg_rate;
+	int finished;
+} gopher_file_progress_t;
+
+/* Gopher downloaded file object, which is defined further down. */
+struct gopher_file_s;
+
+/**
+ * File download progress reporting callback function.
+ *
+ * @param gf   Gopher downloaded file object.
+ * @param prog Progress of the download.
+ * @param arg  Optional data set by the event handler setup.
+ */
+typedef void (*gopher_file_progress_func)(const struct gopher_file_s *gf,
+										  const gopher_file_progress_t *prog,
+										  void *arg);
+
+/**
+ * Fixed-size chunk of a file downloaded to memory. Its contents are private.
+ */
+typedef struct gopher_file_chunk_s gopher_file_chunk_t;
+
+/**
+ * Contiguous piece of a file downloaded to memory.
+ */
+typedef struct {
+	void *base;
+	size_t len;
+} gopher_iovec_t;
+
+/**
+ * Gopher downloaded file object. Files downloaded to memory have no path and
+ * are kept in a chain of chunks instead. The size hint is the expected size of
+ * the file, if known, used to preallocate it on disk.
  */
 typedef struct gopher_file_s {
 	gopher_addr_t *addr;
@@ -125,11 +410,68 @@ typedef struct gopher_file_s {
 	gopher_file_transfer_func transfer_cb;
 	void *transfer_cb_arg;
 
+	gopher_file_progress_func progress_cb;
+	void *progress_cb_arg;
+	size_t progress_bytes;
+	unsigned long progress_ms;
+	size_t progress_size;
+	unsigned long progress_at;
+	unsigned long started_at;
+
 	char *fpath;
 	size_t fsize;
+	size_t size_hint;
 	gopher_type_t type;
+
+	gopher_file_chunk_t *chunks;
+	gopher_file_chunk_t *chunks_tail;
+	size_t max_size;
 } gopher_file_t;
 
+/**
+ * Multi request engine that runs many transfers concurrently on a single
+ * thread. Its contents are private.
+ */
+typedef struct gopher_multi_s gopher_multi_t;
+
+/**
+ * Multi request engine directory completion callback function.
+ *
+ * @param dir Directory that was requested. Ownership is passed to the callback.
+ *            May be NULL if it couldn't be allocated.
+ * @param err 0 if the request was successful or an error code that can be
+ *            checked against strerror().
+ * @param arg Optional data set when the request was added.
+ */
+typedef void (*gopher_multi_dir_func)(gopher_dir_t *dir, int err, void *arg);
+
+/**
+ * Multi request engine file download completion callback function.
+ *
+ * @param gf  Gopher file download object that was added to the engine.
+ * @param err 0 if the download was successful or an error code that can be
+ *            checked against strerror().
+ * @param arg Optional data set when the download was added.
+ */
+typedef void (*gopher_multi_file_func)(gopher_file_t *gf, int err, void *arg);
+
+/**
+ * Pool of threads that resolve server names in the background. Its contents
+ * are private.
+ */
+typedef struct gopher_resolver_s gopher_resolver_t;
+
+/**
+ * Asynchronous name resolution completion callback function.
+ *
+ * @param addr Gopherspace address object that was resolved. Its IP address is
+ *             populated if the resolution was successful.
+ * @param err  0 if the resolution was successful or an error code that can be
+ *             checked against gopher_strerror().
+ * @param arg  Optional data set when the resolution was requested.
+ */
+typedef void (*gopher_resolver_func)(gopher_addr_t *addr, int err, void *arg);
+
 /* Gopherspace address handling. */
 gopher_addr_t *gopher_addr_new(const char *host, uint16_t port,
 							   const char *selector, gopher_type_t type);
@@ -145,17 +487,52 @@ int gopher_disconnect(gopher_addr_t *addr);
 
 /* Directory handling. */
 int gopher_dir_request(gopher_addr_t *addr, gopher_dir_t **dir);
+int gopher_search_request(gopher_addr_t *addr, const char *query,
+						  gopher_dir_t **dir);
+int gopher_dir_request_stream(gopher_addr_t *addr, gopher_dir_item_func func,
+							  void *arg, uint16_t *err_count);
 void gopher_dir_free(gopher_dir_t *dir, gopher_recurse_dir_t recurse,
 					 int inclusive);
 
+/* Request coalescing. */
+int gopher_dir_fetch(const gopher_addr_t *addr, gopher_dir_t **dir);
+void gopher_dir_release(gopher_dir_t *dir);
+void gopher_dir_fetch_stats(gopher_fetch_stats_t *stats);
+
+/* Response cache. */
+int gopher_text_fetch(const gopher_addr_t *addr, char **text, size_t *len);
+void gopher_cache_limits(size_t max_bytes, size_t max_entry);
+void gopher_cache_ttl(unsigned long ttl, unsigned long stale);
+void gopher_cache_flush(void);
+void gopher_cache_stats(gopher_cache_stats_t *stats);
+
 /* File download handling. */
 gopher_file_t *gopher_file_new(gopher_addr_t *addr, const char *path,
 							   gopher_type_t hint);
+gopher_file_t *gopher_file_new_mem(gopher_addr_t *addr, size_t max_size,
+								   gopher_type_t hint);
 int gopher_file_download(gopher_file_t *gf);
+size_t gopher_file_mem_iov(const gopher_file_t *gf, gopher_iovec_t *iov,
+						   size_t count);
+int gopher_file_mem_buf(gopher_file_t *gf, const char **buf, size_t *len);
 void gopher_file_free(gopher_file_t *gf);
 char *gopher_file_basename(const gopher_addr_t *addr);
 void gopher_file_set_transfer_cb(gopher_file_t *gf,
 								 gopher_file_transfer_func func, void *arg);
+void gopher_file_set_progress_cb(gopher_file_t *gf,
+								 gopher_file_progress_func func, void *arg,
+								 size_t min_bytes, unsigned long min_ms);
+
+/* Multi request engine. */
+gopher_multi_t *gopher_multi_new(gopher_multi_backend_t backend);
+gopher_multi_backend_t gopher_multi_backend(const gopher_multi_t *multi);
+int gopher_multi_add_dir(gopher_multi_t *multi, gopher_addr_t *addr,
+						 gopher_multi_dir_func func, void *arg);
+int gopher_multi_add_file(gopher_multi_t *multi, gopher_file_t *gf,
+						  gopher_multi_file_func func, void *arg);
+int gopher_multi_perform(gopher_multi_t *multi, int timeout, size_t *running);
+int gopher_multi_run(gopher_multi_t *multi);
+void gopher_multi_free(gopher_multi_t *multi);
 
 /* Item line parsing */
 int gopher_item_parse(gopher_item_t **item, const char *line);
@@ -163,15 +540,69 @@ void gopher_item_free(gopher_item_t *item, gopher_recurse_dir_t recurse);
 int gopher_is_termline(const char *line);
 char *gopher_item_url(const gopher_item_t *item);
 
+/* Menu buffer parsing. */
+int gopher_menu_parse(const char *buf, size_t len, gopher_menu_t **menu);
+void gopher_menu_free(gopher_menu_t *menu);
+gopher_simd_t gopher_simd_select(gopher_simd_t level);
+
+/* Incremental menu parsing. */
+gopher_menu_parser_t *gopher_menu_parser_new(gopher_menu_item_func func,
+											 void *arg);
+int gopher_menu_parser_feed(gopher_menu_parser_t *mp, const char *buf,
+							size_t len);
+int gopher_menu_parser_finish(gopher_menu_parser_t *mp);
+int gopher_menu_parser_done(const gopher_menu_parser_t *mp);
+void gopher_menu_parser_free(gopher_menu_parser_t *mp);
+
+/* Error handling. */
+const char *gopher_strerror(int err);
+
+/* Name resolution cache. */
+void gopher_dns_cache_ttl(unsigned long ttl, unsigned long negative_ttl);
+void gopher_dns_cache_flush(void);
+void gopher_dns_cache_stats(gopher_dns_stats_t *stats);
+int gopher_dns_override(const char *host, const char *ip);
+
+/* Connection warm pool. */
+void gopher_pool_config(size_t per_host, unsigned long max_idle,
+						unsigned long host_ttl);
+int gopher_pool_warm(const char *host, uint16_t port,
+					 gopher_sockprof_t profile);
+void gopher_pool_flush(void);
+void gopher_pool_stats(gopher_pool_stats_t *stats);
+
+/* Bandwidth limiting. */
+void gopher_rate_limit(unsigned long rate, unsigned long burst);
+
+/* Cancellation. */
+gopher_cancel_t *gopher_cancel_new(void);
+void gopher_cancel_trigger(gopher_cancel_t *cancel);
+int gopher_cancel_triggered(const gopher_cancel_t *cancel);
+void gopher_cancel_reset(gopher_cancel_t *cancel);
+void gopher_cancel_free(gopher_cancel_t *cancel);
+
+/* Asynchronous name resolution. */
+gopher_resolver_t *gopher_resolver_new(unsigned int threads);
+int gopher_resolver_fd(const gopher_resolver_t *res);
+int gopher_resolver_add(gopher_resolver_t *res, gopher_addr_t *addr,
+						gopher_resolver_func func, void *arg);
+size_t gopher_resolver_pending(const gopher_resolver_t *res);
+size_t gopher_resolver_poll(gopher_resolver_t *res);
+void gopher_resolver_free(gopher_resolver_t *res);
+
 /* Networking operations. */
 int gopher_send_raw(const gopher_addr_t *addr, const void *buf, size_t len,
 					size_t *sent_len);
 int gopher_send(const gopher_addr_t *addr, const char *buf, size_t *sent_len);
 int gopher_send_line(const gopher_addr_t *addr, const char *buf,
 					 size_t *sent_len);
-int gopher_recv_raw(const gopher_addr_t *addr, void *buf, size_t buf_len,
+int gopher_send_fields(const gopher_addr_t *addr, const char *const *fields,
+					   size_t count, size_t *sent_len);
+int gopher_send_request(const gopher_addr_t *addr, const char *query,
+						const char *plus, size_t *sent_len);
+int gopher_recv_raw(gopher_addr_t *addr, void *buf, size_t buf_len,
 					size_t *recv_len, int flags);
-int gopher_recv_line(const gopher_addr_t *addr, char **line, size_t *len);
+int gopher_recv_line(gopher_addr_t *addr, char **line, size_t *len);
 
 /* Debugging */
 void gopher_addr_print(const gopher_addr_t *addr);
@@ -0,0 +1,327 @@
+/**
+ * 03_syscall.c
+ * Counts the system calls made while fetching a directory from a local server
+ * and checks that requests survive short writes.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <tap.h>
+#include <unistd.h>
+
+#include "gopher.h"
+#include "server.h"
+
+/* Private definitions. */
+#define MENU_LINES   1000
+#define SERVER_HOLD  3
+#define SHORT_WRITE  3
+static int test_fetch(int flags, int hold);
+static void test_send(void);
+static int peer_read(int fd, char *buf, size_t len);
+static double elapsed_since(const struct timeval *start);
+
+/* System call counters. */
+static int count_recv;
+static int count_send;
+static int count_shutdown;
+static int count_close;
+
+/* Maximum number of bytes each sendmsg call takes, 0 for no limit. */
+static size_t short_write;
+
+/**
+ * Gets the number of planned tests.
+ *
+ * @return Number of planned tests.
+ */
+int t_syscall_plan(void) {
+	return 22;
+}
+
+/**
+ * Runs unit tests.
+ */
+void t_syscall_run(void) {
+	/* Fast completion with a server that holds the connection open. */
+	printf("#\n# Fast completion against a server slow to close\n");
+	test_fetch(GOPHER_FLAG_FASTTERM, 1);
+
+	/* Regular completion with a server that closes right away. */
+	printf("#\n# Regular completion against a well behaved server\n");
+	test_fetch(GOPHER_FLAG_NONE, 0);
+
+	/* Requests that only go through a few bytes at a time. */
+	printf("#\n# Requests sent through short writes\n");
+	test_send();
+}
+
+/**
+ * Fetches a directory from a local test server checking the number of system
+ * calls performed.
+ *
+ * @param flags Connection flags to be used for the request.
+ * @param hold  Should the server hold the connection open after sending?
+ *
+ * @return 0 if the fetch was performed.
+ */
+static int test_fetch(int flags, int hold) {
+	gopher_addr_t *addr;
+	gopher_dir_t *dir;
+	struct timeval start;
+	uint16_t port;
+	size_t len;
+	char *menu;
+	pid_t pid;
+	int ret;
+
+	/* Start up our local server. */
+	menu = tserver_menu(MENU_LINES, 1, &len);
+	pid = tserver_start(&port, menu, len, (hold) ? SERVER_HOLD : 0);
+	free(menu);
+	if (pid < 0) {
+		bail_out(0, "Failed to start the test server");
+		return -1;
+	}
+
+	/* Connect to the server. */
+	dir = NULL;
+	addr = gopher_addr_new("127.0.0.1", port, "/", GOPHER_TYPE_DIR);
+	addr->flags = flags;
+	ret = gopher_connect(addr);
+	if (ret != 0) {
+		bail_out(0, "Failed to connect to the test server");
+		return -1;
+	}
+
+	/* Fetch the directory. */
+	count_recv = 0;
+	count_send = 0;
+	gettimeofday(&start, NULL);
+	ret = gopher_dir_request(addr, &dir);
+	ok(ret == 0, "directory request succeeded");
+	ok(dir->items_len == MENU_LINES, "received %u items", MENU_LINES);
+	ok(dir->err_count == 0, "no parsing errors");
+	if (hold) {
+		ok(elapsed_since(&start) < (SERVER_HOLD / 2.0),
+		   "returned before the server closed the connection");
+	}
+	diag("%d recv and %d send calls for %u lines", count_recv, count_send,
+		 MENU_LINES);
+	ok(count_recv < (MENU_LINES / 10), "receive calls don't grow with lines");
+	cmp_ok(count_send, "==", 1, "selector sent in a single call");
+
+	/* Disconnect from the server. */
+	count_recv = 0;
+	count_shutdown = 0;
+	count_close = 0;
+	gopher_disconnect(addr);
+	ok((count_recv + count_shutdown + count_close) == 1,
+	   "disconnected with a single system call");
+
+	/* Free up any resources. */
+	gopher_dir_free(dir, RECURSE_NONE, 1);
+	tserver_stop(pid);
+
+	return 0;
+}
+
+/**
+ * Sends requests through a socket that only takes a few bytes per call,
+ * checking that they arrive intact on the other end, and a search request to a
+ * local server.
+ */
+static void test_send(void) {
+	gopher_addr_t *addr;
+	gopher_dir_t *dir;
+	const char *fields[9];
+	char buf[256];
+	uint16_t port;
+	size_t sent;
+	size_t len;
+	char *menu;
+	pid_t pid;
+	int sv[2];
+	int ret;
+	int i;
+
+	/* Talk to ourselves. */
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		bail_out(0, "Failed to create a socket pair");
+		return;
+	}
+	addr = gopher_addr_new("localhost", 70, "/search", GOPHER_TYPE_SEARCH);
+	addr->sockfd = sv[0];
+	short_write = SHORT_WRITE;
+
+	/* Search request. */
+	count_send = 0;
+	ret = gopher_send_request(addr, "vintage computers", NULL, &sent);
+	peer_read(sv[1], buf, sent);
+	ok((ret == 0) && (sent == 27), "search request sent");
+	is(buf, "/search\tvintage computers\r\n", "search request arrived intact");
+	ok(count_send > 1, "carried on after short writes");
+
+	/* Gopher+ request. */
+	ret = gopher_send_request(addr, "vintage computers", "+", &sent);
+	peer_read(sv[1], buf, sent);
+	is(buf, "/search\tvintage computers\t+\r\n",
+	   "Gopher+ request arrived intact");
+
+	/* Plain lines and raw data. */
+	gopher_send_line(addr, "/about", &sent);
+	peer_read(sv[1], buf, sent);
+	is(buf, "/about\r\n", "line arrived intact");
+	gopher_send_raw(addr, "raw data", 8, &sent);
+	peer_read(sv[1], buf, sent);
+	is(buf, "raw data", "raw data arrived intact");
+
+	/* Lines that won't fit. */
+	for (i = 0; i < 9; i++)
+		fields[i] = "x";
+	cmp_ok(gopher_send_fields(addr, fields, 9, NULL), "==", EINVAL,
+		   "request line with too many fields refused");
+
+	/* Clean up. */
+	short_write = 0;
+	close(sv[0]);
+	close(sv[1]);
+	addr->sockfd = -1;
+	gopher_addr_free(addr);
+
+	/* Search request to a server. */
+	menu = tserver_menu(MENU_LINES, 1, &len);
+	pid = tserver_start(&port, menu, len, 0);
+	free(menu);
+	dir = NULL;
+	addr = gopher_addr_new("127.0.0.1", port, "/search", GOPHER_TYPE_SEARCH);
+	gopher_connect(addr);
+	count_send = 0;
+	ret = gopher_search_request(addr, "vintage computers", &dir);
+	ok((ret == 0) && (dir->items_len == MENU_LINES), "search results received");
+	cmp_ok(count_send, "==", 1, "search request sent in a single call");
+	gopher_disconnect(addr);
+	if (dir)
+		gopher_dir_free(dir, RECURSE_NONE, 1);
+	else
+		gopher_addr_free(addr);
+	tserver_stop(pid);
+}
+
+/**
+ * Reads an exact number of bytes from a socket as a string.
+ *
+ * @param fd  Socket file descriptor to read from.
+ * @param buf Buffer to store the string.
+ * @param len Number of bytes to read, must be less than the buffer size.
+ *
+ * @return 0 if everything was read.
+ */
+static int peer_read(int fd, char *buf, size_t len) {
+	size_t total;
+	ssize_t n;
+
+	for (total = 0; total < len; total += n) {
+		n = read(fd, buf + total, len - total);
+		if (n <= 0)
+			break;
+	}
+	buf[total] = '\0';
+
+	return (total == len) ? 0 : -1;
+}
+
+/**
+ * Calculates the time elapsed since a reference point.
+ *
+ * @param start Reference point in time.
+ *
+ * @return Number of seconds elapsed.
+ */
+static double elapsed_since(const struct timeval *start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+		((now.tv_usec - start->tv_usec) / 1000000.0);
+}
+
+/*
+ * +===========================================================================+
+ * |                                                                           |
+ * |                       System Call Counting Wrappers                       |
+ * |                                                                           |
+ * +===========================================================================+
+ */
+
+ssize_t recv(int fd, void *buf, size_t len, int flags) {
+	static ssize_t (*real)(int, void *, size_t, int) = NULL;
+	if (real == NULL)
+		*(void **)&real = dlsym(RTLD_NEXT, "recv");
+
+	count_recv++;
+	return real(fd, buf, len, flags);
+}
+
+ssize_t send(int fd, const void *buf, size_t len, int flags) {
+	static ssize_t (*real)(int, const void *, size_t, int) = NULL;
+	if (real == NULL)
+		*(void **)&real = dlsym(RTLD_NEXT, "send");
+
+	count_send++;
+	return real(fd, buf, len, flags);
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+	static ssize_t (*real)(int, const struct msghdr *, int) = NULL;
+	struct msghdr partial;
+	struct iovec iov[16];
+	size_t left;
+	size_t i;
+	if (real == NULL)
+		*(void **)&real = dlsym(RTLD_NEXT, "sendmsg");
+
+	count_send++;
+	if (short_write == 0)
+		return real(fd, msg, flags);
+
+	/* Only let the first few bytes through. */
+	partial = *msg;
+	partial.msg_iov = iov;
+	partial.msg_iovlen = 0;
+	left = short_write;
+	for (i = 0; (i < msg->msg_iovlen) && (i < 16) && (left > 0); i++) {
+		iov[i] = msg->msg_iov[i];
+		if (iov[i].iov_len > left)
+			iov[i].iov_len = left;
+		left -= iov[i].iov_len;
+		partial.msg_iovlen++;
+	}
+	return real(fd, &partial, flags);
+}
+
+int shutdown(int fd, int how) {
+	static int (*real)(int, int) = NULL;
+	if (real == NULL)
+		*(void **)&real = dlsym(RTLD_NEXT, "shutdown");
+
+	count_shutdown++;
+	return real(fd, how);
+}
+
+int close(int fd) {
+	static int (*real)(int) = NULL;
+	if (real == NULL)
+		*(void **)&real = dlsym(RTLD_NEXT, "close");
+
+	count_close++;
+	return real(fd);
+}
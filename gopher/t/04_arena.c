@@ -0,0 +1,111 @@
+/**
+ * 04_arena.c
+ * Tests directory requests with and without arena allocation.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <string.h>
+#include <tap.h>
+
+#include "gopher.h"
+#include "server.h"
+
+/* Private definitions. */
+static void test_dir(int flags);
+
+/* Menu full of quirks from non-compliant servers without a termination line. */
+static const char *quirky_menu =
+	"1Directory\t/dir\tg.test.com\t70\r\n"
+	"0Text file\t/file.txt\tg.test.com\t7070\n"
+	"\r\n"
+	"iInformation only\r\n"
+	"1Partial\t/partial\r\n";
+
+/**
+ * Gets the number of planned tests.
+ *
+ * @return Number of planned tests.
+ */
+int t_arena_plan(void) {
+	return 2 * 16;
+}
+
+/**
+ * Runs unit tests.
+ */
+void t_arena_run(void) {
+	printf("#\n# Directory allocated from the heap\n");
+	test_dir(GOPHER_FLAG_NONE);
+
+	printf("#\n# Directory allocated from an arena\n");
+	test_dir(GOPHER_FLAG_ARENA);
+}
+
+/**
+ * Requests a quirky directory from a local server and checks its contents.
+ *
+ * @param flags Connection flags to be used for the request.
+ */
+static void test_dir(int flags) {
+	gopher_addr_t *addr;
+	gopher_item_t *item;
+	gopher_dir_t *dir;
+	uint16_t port;
+	pid_t pid;
+	int ret;
+
+	/* Start up our local server and connect to it. */
+	pid = tserver_start(&port, quirky_menu, strlen(quirky_menu), 0);
+	addr = gopher_addr_new("127.0.0.1", port, NULL, GOPHER_TYPE_DIR);
+	addr->flags = flags;
+	dir = NULL;
+	ret = gopher_connect(addr);
+	if (ret == 0)
+		ret = gopher_dir_request(addr, &dir);
+	ok(ret == 0, "directory request succeeded");
+	if (dir == NULL) {
+		bail_out(0, "Failed to request the directory");
+		return;
+	}
+
+	/* Check the directory object. */
+	ok(dir->items_len == 4, "directory has 4 items");
+	ok(dir->err_count == 3, "blank line, incomplete line, and missing "
+	   "termination counted as errors");
+	if (flags & GOPHER_FLAG_ARENA) {
+		ok(dir->arena != NULL, "directory owns an arena");
+	} else {
+		ok(dir->arena == NULL, "directory doesn't own an arena");
+	}
+
+	/* Regular CRLF item. */
+	item = dir->items;
+	is(item->label, "Directory", "label of a CRLF line");
+	is(item->addr->selector, "/dir", "selector of a CRLF line");
+	is(item->addr->host, "g.test.com", "host of a CRLF line");
+	ok(item->addr->port == 70, "port of a CRLF line");
+
+	/* Non-compliant LF item. */
+	item = item->next;
+	is(item->label, "Text file", "label of an LF line");
+	is(item->addr->selector, "/file.txt", "selector of an LF line");
+	is(item->addr->host, "g.test.com", "host of an LF line");
+	ok(item->addr->port == 7070, "port of an LF line");
+
+	/* Incomplete item. */
+	item = item->next;
+	is(item->label, "Information only", "label of an incomplete line");
+	cmp_ok(item->addr->type, "==", GOPHER_TYPE_INFO, "incomplete line has a "
+		   "placeholder address");
+
+	/* Item with missing fields. */
+	item = item->next;
+	is(item->label, "Partial", "label of a line with missing fields");
+	is(item->addr->host, "", "missing host of a line is empty");
+
+	/* Free up any resources. */
+	gopher_disconnect(addr);
+	gopher_dir_free(dir, RECURSE_NONE, 1);
+	tserver_stop(pid);
+}
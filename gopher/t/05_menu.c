@@ -0,0 +1,180 @@
+/**
+ * 05_menu.c
+ * Tests the zero-copy menu buffer parser.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <tap.h>
+
+#include "gopher.h"
+#include "server.h"
+
+/* Private definitions. */
+#define BIG_MENU_LINES 100000
+static void test_view(const gopher_strview_t *view, const char *ref,
+					  const char *desc);
+static void test_simd(const char *buf, size_t len, gopher_simd_t level);
+static int views_equal(const gopher_strview_t *a, const gopher_strview_t *b);
+
+/* Menu full of quirks from non-compliant servers. */
+static const char *quirky_menu =
+	"1Directory\t/dir\tg.test.com\t70\r\n"
+	"0Text file\t/file.txt\tg.test.com\t7070\n"
+	"\r\n"
+	"iInformation only\r\n"
+	"1Gopher+\t/plus\tg.test.com\t70\t+\r\n"
+	"1Partial\t/partial\r\n"
+	"iNo line ending";
+
+/* Menu with content after the termination line. */
+static const char *termed_menu =
+	"1Directory\t/dir\tg.test.com\t70\r\n"
+	".\r\n"
+	"1After\t/after\tg.test.com\t70\r\n";
+
+/**
+ * Gets the number of planned tests.
+ *
+ * @return Number of planned tests.
+ */
+int t_menu_plan(void) {
+	return 26;
+}
+
+/**
+ * Runs unit tests.
+ */
+void t_menu_run(void) {
+	gopher_menu_t *menu;
+	size_t len;
+	char *buf;
+	int ret;
+
+	/* Quirky menu. */
+	printf("#\n# Menu with non-compliant lines\n");
+	ret = gopher_menu_parse(quirky_menu, strlen(quirky_menu), &menu);
+	ok(ret == 0, "menu parsed");
+	cmp_ok(menu->items_len, "==", 6, "menu has 6 items");
+	cmp_ok(menu->err_count, "==", 4, "blank line, incomplete lines, and "
+		   "missing termination counted as errors");
+	ok(!menu->termlined, "menu without termination line");
+	test_view(&menu->items[0].label, "Directory", "label of a CRLF line");
+	test_view(&menu->items[0].selector, "/dir", "selector of a CRLF line");
+	test_view(&menu->items[0].host, "g.test.com", "host of a CRLF line");
+	test_view(&menu->items[0].port, "70", "port of a CRLF line");
+	test_view(&menu->items[1].label, "Text file", "label of an LF line");
+	cmp_ok(menu->items[1].port_num, "==", 7070, "port of an LF line");
+	test_view(&menu->items[2].label, "Information only",
+			  "label of an incomplete line");
+	test_view(&menu->items[2].host, "_server.fail",
+			  "placeholder host of an incomplete line");
+	cmp_ok(menu->items[3].port_num, "==", 70, "port of a Gopher+ line");
+	test_view(&menu->items[4].host, "", "missing host of a line is empty");
+	test_view(&menu->items[5].label, "No line ending",
+			  "label of a line without ending");
+	ok(menu->items[0].label.ptr == (quirky_menu + 1),
+	   "fields point into the buffer");
+	gopher_menu_free(menu);
+
+	/* Terminated menu. */
+	printf("#\n# Menu with data after the termination line\n");
+	ret = gopher_menu_parse(termed_menu, strlen(termed_menu), &menu);
+	cmp_ok(menu->items_len, "==", 1, "parsing stops at the termination line");
+	cmp_ok(menu->err_count, "==", 0, "no errors in a compliant menu");
+	ok(menu->termlined, "menu with termination line");
+	gopher_menu_free(menu);
+
+	/* Huge menu. */
+	printf("#\n# Menu with %u lines\n", BIG_MENU_LINES);
+	buf = tserver_menu(BIG_MENU_LINES, 1, &len);
+	ret = gopher_menu_parse(buf, len, &menu);
+	ok(ret == 0, "menu parsed");
+	cmp_ok(menu->items_len, "==", BIG_MENU_LINES, "menu has all the items");
+	cmp_ok(menu->err_count, "==", 0, "no errors in a compliant menu");
+	test_view(&menu->items[BIG_MENU_LINES - 1].selector, "/sel/99999",
+			  "selector of the last line");
+	gopher_menu_free(menu);
+	free(buf);
+
+	/* Compare the delimiter scanners against each other. */
+	printf("#\n# Delimiter scanners\n");
+	len = strlen(quirky_menu);
+	buf = (char *)malloc((len + 1) * 100);
+	for (ret = 0; ret < 100; ret++) {
+		memcpy(buf + ((len + 1) * ret), quirky_menu, len);
+		buf[((len + 1) * (ret + 1)) - 1] = '\n';
+	}
+	test_simd(buf, (len + 1) * 100, GOPHER_SIMD_SCALAR);
+	test_simd(buf, (len + 1) * 100, GOPHER_SIMD_SSE2);
+	test_simd(buf, (len + 1) * 100, GOPHER_SIMD_AVX2);
+	gopher_simd_select(GOPHER_SIMD_AUTO);
+	free(buf);
+}
+
+/**
+ * Checks that parsing a menu with a specific delimiter scanner gives the same
+ * results as the scalar one.
+ *
+ * @param buf   Menu buffer to be parsed.
+ * @param len   Length of the menu buffer.
+ * @param level Instruction set to be tested.
+ */
+static void test_simd(const char *buf, size_t len, gopher_simd_t level) {
+	gopher_menu_t *ref;
+	gopher_menu_t *menu;
+	gopher_simd_t used;
+	size_t i;
+	int same;
+
+	/* Parse the menu with both scanners. */
+	gopher_simd_select(GOPHER_SIMD_SCALAR);
+	gopher_menu_parse(buf, len, &ref);
+	used = gopher_simd_select(level);
+	gopher_menu_parse(buf, len, &menu);
+
+	/* Compare every single item. */
+	same = (menu->items_len == ref->items_len) &&
+		(menu->err_count == ref->err_count);
+	for (i = 0; same && (i < menu->items_len); i++) {
+		same = (menu->items[i].type == ref->items[i].type) &&
+			views_equal(&menu->items[i].label, &ref->items[i].label) &&
+			views_equal(&menu->items[i].selector, &ref->items[i].selector) &&
+			views_equal(&menu->items[i].host, &ref->items[i].host) &&
+			(menu->items[i].port_num == ref->items[i].port_num);
+	}
+	ok(same, "scanner %d (requested %d) matches the scalar one", used, level);
+
+	gopher_menu_free(menu);
+	gopher_menu_free(ref);
+}
+
+/**
+ * Checks if two string views point to the same string.
+ *
+ * @param a String view.
+ * @param b Another string view.
+ *
+ * @return TRUE if both views point to the same location and length.
+ */
+static int views_equal(const gopher_strview_t *a, const gopher_strview_t *b) {
+	return (a->ptr == b->ptr) && (a->len == b->len);
+}
+
+/**
+ * Tests a string view against a reference string.
+ *
+ * @param view String view to be tested.
+ * @param ref  Expected string.
+ * @param desc Description of the test.
+ */
+static void test_view(const gopher_strview_t *view, const char *ref,
+					  const char *desc) {
+	char buf[256];
+
+	memcpy(buf, view->ptr, view->len);
+	buf[view->len] = '\0';
+	is(buf, ref, "%s is %s", desc, ref);
+}
@@ -0,0 +1,212 @@
+/**
+ * 06_parser.c
+ * Tests the incremental menu parser against the buffer one.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tap.h>
+
+#include "gopher.h"
+#include "server.h"
+
+/* Private definitions. */
+#define BIG_MENU_LINES 5000
+#define STOP_AFTER     3
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t size;
+	size_t items;
+	size_t stop;
+} digest_t;
+static void test_chunks(const char *menu, size_t len, size_t chunk,
+						const char *desc);
+static void digest_init(digest_t *dg);
+static int digest_item(const gopher_item_view_t *item, void *arg);
+static void digest_menu(digest_t *dg, const char *menu, size_t len);
+
+/* Menu full of quirks from non-compliant servers. */
+static const char *quirky_menu =
+	"1Directory\t/dir\tg.test.com\t70\r\n"
+	"0Text file\t/file.txt\tg.test.com\t7070\n"
+	"\r\n"
+	"iInformation only\r\n"
+	"1Gopher+\t/plus\tg.test.com\t70\t+\r\n"
+	"1Partial\t/partial\r\n"
+	"iNo line ending";
+
+/* Menu with content after the termination line. */
+static const char *termed_menu =
+	"1Directory\t/dir\tg.test.com\t70\r\n"
+	"\n"
+	".\r\n"
+	"1After\t/after\tg.test.com\t70\r\n";
+
+/**
+ * Gets the number of planned tests.
+ *
+ * @return Number of planned tests.
+ */
+int t_parser_plan(void) {
+	return 11;
+}
+
+/**
+ * Runs unit tests.
+ */
+void t_parser_run(void) {
+	gopher_menu_parser_t *mp;
+	digest_t dg;
+	size_t len;
+	char *buf;
+
+	/* Quirky menu. */
+	printf("#\n# Incremental parsing of a menu with non-compliant lines\n");
+	len = strlen(quirky_menu);
+	test_chunks(quirky_menu, len, 1, "quirky menu fed byte by byte");
+	test_chunks(quirky_menu, len, 7, "quirky menu fed in 7 byte chunks");
+	test_chunks(quirky_menu, len, len, "quirky menu fed in one go");
+
+	/* Terminated menu. */
+	printf("#\n# Incremental parsing of a menu with a termination line\n");
+	len = strlen(termed_menu);
+	test_chunks(termed_menu, len, 1, "terminated menu fed byte by byte");
+	test_chunks(termed_menu, len, 5, "terminated menu fed in 5 byte chunks");
+
+	/* Big menu. */
+	printf("#\n# Incremental parsing of a menu with %u lines\n",
+		   BIG_MENU_LINES);
+	buf = tserver_menu(BIG_MENU_LINES, 1, &len);
+	test_chunks(buf, len, 1, "big menu fed byte by byte");
+	test_chunks(buf, len, 1000, "big menu fed in 1000 byte chunks");
+	test_chunks(buf, len, 4093, "big menu fed in 4093 byte chunks");
+
+	/* Stop from the callback. */
+	printf("#\n# Stopping the parser from the item callback\n");
+	digest_init(&dg);
+	dg.stop = STOP_AFTER;
+	mp = gopher_menu_parser_new(digest_item, &dg);
+	gopher_menu_parser_feed(mp, buf, len / 2);
+	ok(gopher_menu_parser_done(mp), "parser done after the callback stopped");
+	gopher_menu_parser_feed(mp, buf + (len / 2), len - (len / 2));
+	cmp_ok(dg.items, "==", STOP_AFTER, "no items after the callback stopped");
+	gopher_menu_parser_finish(mp);
+	cmp_ok(mp->err_count, "==", 0, "stopping early is not an error");
+	gopher_menu_parser_free(mp);
+	free(dg.buf);
+	free(buf);
+}
+
+/**
+ * Feeds a menu to the incremental parser in chunks and checks that the results
+ * are the same as parsing the whole buffer at once.
+ *
+ * @param menu  Menu buffer to be parsed.
+ * @param len   Length of the menu buffer.
+ * @param chunk Size of the chunks to be fed to the parser.
+ * @param desc  Description of the test.
+ */
+static void test_chunks(const char *menu, size_t len, size_t chunk,
+						const char *desc) {
+	gopher_menu_parser_t *mp;
+	gopher_menu_t *ref;
+	digest_t expected;
+	digest_t dg;
+	size_t pos;
+	size_t n;
+
+	/* Parse the whole buffer. */
+	gopher_menu_parse(menu, len, &ref);
+	digest_menu(&expected, menu, len);
+
+	/* Feed the menu in chunks. */
+	digest_init(&dg);
+	mp = gopher_menu_parser_new(digest_item, &dg);
+	for (pos = 0; pos < len; pos += n) {
+		n = ((len - pos) < chunk) ? (len - pos) : chunk;
+		gopher_menu_parser_feed(mp, menu + pos, n);
+	}
+	gopher_menu_parser_finish(mp);
+
+	ok((dg.len == expected.len) &&
+	   (memcmp(dg.buf, expected.buf, dg.len) == 0) &&
+	   (mp->err_count == ref->err_count) && (mp->termlined == ref->termlined),
+	   "%s", desc);
+
+	gopher_menu_parser_free(mp);
+	gopher_menu_free(ref);
+	free(expected.buf);
+	free(dg.buf);
+}
+
+/**
+ * Initializes an item digest.
+ *
+ * @param dg Item digest to be initialized.
+ */
+static void digest_init(digest_t *dg) {
+	dg->buf = NULL;
+	dg->len = 0;
+	dg->size = 0;
+	dg->items = 0;
+	dg->stop = 0;
+}
+
+/**
+ * Appends a parsed item to a digest. Views only live for the duration of the
+ * callback, so everything is copied over.
+ *
+ * @param item Parsed item.
+ * @param arg  Item digest.
+ *
+ * @return 1 to stop the parser if the requested number of items was reached.
+ */
+static int digest_item(const gopher_item_view_t *item, void *arg) {
+	digest_t *dg;
+	size_t need;
+
+	/* Ensure we have enough space. */
+	dg = (digest_t *)arg;
+	need = dg->len + item->label.len + item->selector.len + item->host.len + 16;
+	if (need > dg->size) {
+		dg->size = need * 2;
+		dg->buf = (char *)realloc(dg->buf, dg->size);
+	}
+
+	/* Append the item. */
+	dg->buf[dg->len++] = (char)item->type;
+	memcpy(dg->buf + dg->len, item->label.ptr, item->label.len);
+	dg->len += item->label.len;
+	dg->buf[dg->len++] = '|';
+	memcpy(dg->buf + dg->len, item->selector.ptr, item->selector.len);
+	dg->len += item->selector.len;
+	dg->buf[dg->len++] = '|';
+	memcpy(dg->buf + dg->len, item->host.ptr, item->host.len);
+	dg->len += item->host.len;
+	dg->len += sprintf(dg->buf + dg->len, "|%u\n", item->port_num);
+	dg->items++;
+
+	return (dg->stop > 0) && (dg->items >= dg->stop);
+}
+
+/**
+ * Builds a digest of a menu parsed in one go.
+ *
+ * @param dg   Item digest to be populated.
+ * @param menu Menu buffer to be parsed.
+ * @param len  Length of the menu buffer.
+ */
+static void digest_menu(digest_t *dg, const char *menu, size_t len) {
+	gopher_menu_t *pm;
+	size_t i;
+
+	digest_init(dg);
+	gopher_menu_parse(menu, len, &pm);
+	for (i = 0; i < pm->items_len; i++)
+		digest_item(&pm->items[i], dg);
+	gopher_menu_free(pm);
+}
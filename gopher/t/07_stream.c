@@ -0,0 +1,136 @@
+/**
+ * 07_stream.c
+ * Tests streaming directory requests.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <tap.h>
+
+#include "gopher.h"
+#include "server.h"
+
+/* Private definitions. */
+#define MENU_LINES  1000
+#define STOP_AFTER  10
+#define SERVER_HOLD 3
+typedef struct {
+	unsigned int items;
+	unsigned int stop;
+	char last[64];
+} stream_t;
+static void test_stream(int flags, unsigned int stop);
+static int stream_item(gopher_item_t *item, void *arg);
+static double elapsed_since(const struct timeval *start);
+
+/**
+ * Gets the number of planned tests.
+ *
+ * @return Number of planned tests.
+ */
+int t_stream_plan(void) {
+	return 2 * 5;
+}
+
+/**
+ * Runs unit tests.
+ */
+void t_stream_run(void) {
+	printf("#\n# Streaming an entire directory\n");
+	test_stream(GOPHER_FLAG_FASTTERM, 0);
+
+	printf("#\n# Stopping a directory stream early\n");
+	test_stream(GOPHER_FLAG_NONE, STOP_AFTER);
+}
+
+/**
+ * Streams a directory from a local server that holds the connection open after
+ * sending the menu.
+ *
+ * @param flags Connection flags to be used for the request.
+ * @param stop  Number of items to stop after or 0 to receive everything.
+ */
+static void test_stream(int flags, unsigned int stop) {
+	gopher_addr_t *addr;
+	struct timeval start;
+	uint16_t errors;
+	stream_t st;
+	uint16_t port;
+	size_t len;
+	char *menu;
+	char sel[64];
+	pid_t pid;
+	int ret;
+
+	/* Start up our local server and connect to it. */
+	menu = tserver_menu(MENU_LINES, 1, &len);
+	pid = tserver_start(&port, menu, len, SERVER_HOLD);
+	free(menu);
+	addr = gopher_addr_new("127.0.0.1", port, "/", GOPHER_TYPE_DIR);
+	addr->flags = flags;
+	ret = gopher_connect(addr);
+	if (ret != 0) {
+		bail_out(0, "Failed to connect to the test server");
+		return;
+	}
+
+	/* Stream the directory. */
+	st.items = 0;
+	st.stop = stop;
+	st.last[0] = '\0';
+	errors = 0xFFFF;
+	gettimeofday(&start, NULL);
+	ret = gopher_dir_request_stream(addr, stream_item, &st, &errors);
+	ok(ret == 0, "streaming request succeeded");
+	ok(elapsed_since(&start) < (SERVER_HOLD / 2.0),
+	   "returned before the server closed the connection");
+	cmp_ok(st.items, "==", (stop) ? stop : MENU_LINES, "callback got %u items",
+		   (stop) ? stop : MENU_LINES);
+	cmp_ok(errors, "==", 0, "no parsing errors");
+	sprintf(sel, "/sel/%u", ((stop) ? stop : MENU_LINES) - 1);
+	is(st.last, sel, "selector of the last item received");
+
+	/* Free up any resources. */
+	gopher_disconnect(addr);
+	gopher_addr_free(addr);
+	tserver_stop(pid);
+}
+
+/**
+ * Receives a streamed item.
+ *
+ * @param item Item that has just arrived.
+ * @param arg  Stream state.
+ *
+ * @return 1 to stop the transfer once the requested number of items arrived.
+ */
+static int stream_item(gopher_item_t *item, void *arg) {
+	stream_t *st;
+
+	st = (stream_t *)arg;
+	st->items++;
+	strncpy(st->last, item->addr->selector, sizeof(st->last) - 1);
+	st->last[sizeof(st->last) - 1] = '\0';
+	gopher_item_free(item, RECURSE_NONE);
+
+	return (st->stop > 0) && (st->items >= st->stop);
+}
+
+/**
+ * Calculates the time elapsed since a reference point.
+ *
+ * @param start Reference point in time.
+ *
+ * @return Number of seconds elapsed.
+ */
+static double elapsed_since(const struct timeval *start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+		((now.tv_usec - start->tv_usec) / 1000000.0);
+}
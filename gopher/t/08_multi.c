@@ -0,0 +1,243 @@
+/**
+ * 08_multi.c
+ * Tests the multi request engine with many concurrent transfers.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <tap.h>
+#include <unistd.h>
+
+#include "gopher.h"
+#include "server.h"
+
+/* Private definitions. */
+#define MULTI_DIRS  24
+#define MULTI_FILES 8
+#define MENU_LINES  500
+#define FILE_SIZE   100000
+#define SERVER_HOLD 3
+typedef struct {
+	unsigned int dirs;
+	unsigned int dirs_ok;
+	unsigned int dirs_errors;
+	unsigned int files;
+	unsigned int files_ok;
+	unsigned int cancelled;
+} results_t;
+static void test_multi(gopher_multi_backend_t backend);
+static void dir_done(gopher_dir_t *dir, int err, void *arg);
+static void file_done(gopher_file_t *gf, int err, void *arg);
+static int file_matches(const char *path, const char *ref, size_t len);
+static double elapsed_since(const struct timeval *start);
+
+/* Contents of the downloaded files. */
+static char file_data[FILE_SIZE];
+
+/**
+ * Gets the number of planned tests.
+ *
+ * @return Number of planned tests.
+ */
+int t_multi_plan(void) {
+	return 3 * 8;
+}
+
+/**
+ * Runs unit tests.
+ */
+void t_multi_run(void) {
+	size_t i;
+
+	/* Build up the file contents. */
+	for (i = 0; i < FILE_SIZE; i++)
+		file_data[i] = (char)(i * 7);
+
+	printf("#\n# Multi request engine using select\n");
+	test_multi(GOPHER_MULTI_SELECT);
+
+	printf("#\n# Multi request engine using the best backend available\n");
+	test_multi(GOPHER_MULTI_AUTO);
+
+	printf("#\n# Multi request engine using io_uring\n");
+	test_multi(GOPHER_MULTI_URING);
+}
+
+/**
+ * Runs a bunch of concurrent directory requests and file downloads against
+ * local servers. Half of the directory servers hold their connections open
+ * after sending the menu, so the engine must handle them concurrently for
+ * everything to finish in time.
+ *
+ * @param backend Readiness notification mechanism to be tested.
+ */
+static void test_multi(gopher_multi_backend_t backend) {
+	gopher_file_t *files[MULTI_FILES];
+	pid_t pids[MULTI_DIRS + MULTI_FILES];
+	char paths[MULTI_FILES][64];
+	gopher_multi_t *multi;
+	gopher_addr_t *addr;
+	struct timeval start;
+	results_t res;
+	uint16_t port;
+	size_t len;
+	char *menu;
+	int added;
+	int ret;
+	int i;
+
+	/* Set up the engine. */
+	multi = gopher_multi_new(backend);
+	if (backend != GOPHER_MULTI_SELECT) {
+		ok(gopher_multi_backend(multi) != GOPHER_MULTI_AUTO,
+		   "engine picked backend %d", gopher_multi_backend(multi));
+	} else {
+		cmp_ok(gopher_multi_backend(multi), "==", backend,
+			   "engine uses the requested backend");
+	}
+	memset(&res, 0, sizeof(res));
+
+	/* Add the directory requests. */
+	added = 0;
+	menu = tserver_menu(MENU_LINES, 1, &len);
+	for (i = 0; i < MULTI_DIRS; i++) {
+		pids[i] = tserver_start(&port, menu, len, (i % 2) ? SERVER_HOLD : 0);
+		addr = gopher_addr_new("127.0.0.1", port, "/", GOPHER_TYPE_DIR);
+		addr->flags = (i % 2) ? GOPHER_FLAG_FASTTERM : GOPHER_FLAG_NONE;
+		if (gopher_multi_add_dir(multi, addr, dir_done, &res) == 0)
+			added++;
+	}
+	free(menu);
+
+	/* Add the file downloads. */
+	for (i = 0; i < MULTI_FILES; i++) {
+		pids[MULTI_DIRS + i] = tserver_start(&port, file_data, FILE_SIZE, 0);
+		sprintf(paths[i], "/tmp/gopher_multi_%d_%d", (int)getpid(), i);
+		addr = gopher_addr_new("127.0.0.1", port, "/file", GOPHER_TYPE_BINARY);
+		files[i] = gopher_file_new(addr, paths[i], GOPHER_TYPE_BINARY);
+		if (gopher_multi_add_file(multi, files[i], file_done, &res) == 0)
+			added++;
+	}
+
+	/* Run everything. */
+	gettimeofday(&start, NULL);
+	ret = gopher_multi_run(multi);
+	ok((ret == 0) && (added == (MULTI_DIRS + MULTI_FILES)),
+	   "ran all %d transfers", MULTI_DIRS + MULTI_FILES);
+	ok(elapsed_since(&start) < (SERVER_HOLD / 2.0),
+	   "finished before the slow servers closed their connections");
+	cmp_ok(res.dirs_ok, "==", MULTI_DIRS, "all directories complete");
+	cmp_ok(res.dirs_errors, "==", 0, "no parsing errors");
+	cmp_ok(res.files_ok, "==", MULTI_FILES, "all files downloaded");
+
+	/* Check the downloaded files. */
+	ret = 1;
+	for (i = 0; i < MULTI_FILES; i++) {
+		ret = ret && file_matches(paths[i], file_data, FILE_SIZE);
+		unlink(paths[i]);
+		gopher_addr_free(files[i]->addr);
+		gopher_file_free(files[i]);
+	}
+	ok(ret, "downloaded files match");
+	for (i = 0; i < (MULTI_DIRS + MULTI_FILES); i++)
+		tserver_stop(pids[i]);
+
+	/* Abort transfers stuck on slow servers. */
+	menu = tserver_menu(MENU_LINES, 0, &len);
+	for (i = 0; i < MULTI_FILES; i++) {
+		pids[i] = tserver_start(&port, menu, len, SERVER_HOLD);
+		addr = gopher_addr_new("127.0.0.1", port, "/", GOPHER_TYPE_DIR);
+		gopher_multi_add_dir(multi, addr, dir_done, &res);
+	}
+	free(menu);
+	gopher_multi_perform(multi, 100, NULL);
+	gopher_multi_free(multi);
+	cmp_ok(res.cancelled, "==", MULTI_FILES, "running transfers cancelled");
+
+	/* Free up any resources. */
+	for (i = 0; i < MULTI_FILES; i++)
+		tserver_stop(pids[i]);
+}
+
+/**
+ * Receives a finished directory request.
+ *
+ * @param dir Directory that was requested.
+ * @param err Error code of the request.
+ * @param arg Test results.
+ */
+static void dir_done(gopher_dir_t *dir, int err, void *arg) {
+	results_t *res;
+
+	res = (results_t *)arg;
+	res->dirs++;
+	if ((err == 0) && (dir->items_len == MENU_LINES))
+		res->dirs_ok++;
+	if (err == ECANCELED)
+		res->cancelled++;
+	res->dirs_errors += dir->err_count;
+	gopher_dir_free(dir, RECURSE_NONE, 1);
+}
+
+/**
+ * Receives a finished file download.
+ *
+ * @param gf  Gopher file download object.
+ * @param err Error code of the download.
+ * @param arg Test results.
+ */
+static void file_done(gopher_file_t *gf, int err, void *arg) {
+	results_t *res;
+
+	res = (results_t *)arg;
+	res->files++;
+	if ((err == 0) && (gf->fsize == FILE_SIZE))
+		res->files_ok++;
+}
+
+/**
+ * Checks if the contents of a file match a reference buffer.
+ *
+ * @param path Path to the file.
+ * @param ref  Reference contents.
+ * @param len  Length of the reference contents.
+ *
+ * @return TRUE if the file has exactly the same contents.
+ */
+static int file_matches(const char *path, const char *ref, size_t len) {
+	FILE *fh;
+	char *buf;
+	size_t n;
+	int same;
+
+	fh = fopen(path, "rb");
+	if (fh == NULL)
+		return 0;
+	buf = (char *)malloc(len + 1);
+	n = fread(buf, 1, len + 1, fh);
+	same = (n == len) && (memcmp(buf, ref, len) == 0);
+	free(buf);
+	fclose(fh);
+
+	return same;
+}
+
+/**
+ * Calculates the time elapsed since a reference point.
+ *
+ * @param start Reference point in time.
+ *
+ * @return Number of seconds elapsed.
+ */
+static double elapsed_since(const struct timeval *start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+		((now.tv_usec - start->tv_usec) / 1000000.0);
+}
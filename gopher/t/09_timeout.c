@@ -0,0 +1,234 @@
+/**
+ * 09_timeout.c
+ * Tests the per-phase deadlines of a connection against misbehaving servers.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <tap.h>
+#include <unistd.h>
+
+#include "gopher.h"
+#include "server.h"
+
+/* Private definitions. */
+#define SERVER_HOLD 3
+#define DEADLINE    200
+#define BACKLOG_MAX 16
+static void test_recv(const char *resp, size_t len, unsigned long first_byte,
+					  unsigned long idle, unsigned long total, int expected,
+					  const char *desc);
+static void test_connect(void);
+static double elapsed_since(const struct timeval *start);
+
+/* Partial menu sent by a server that then stalls. */
+static const char *partial_menu =
+	"1Directory\t/dir\tg.test.com\t70\r\n"
+	"0Text file\t/file.txt\tg.test.com\t70\r\n";
+
+/**
+ * Gets the number of planned tests.
+ *
+ * @return Number of planned tests.
+ */
+int t_timeout_plan(void) {
+	return 12;
+}
+
+/**
+ * Runs unit tests.
+ */
+void t_timeout_run(void) {
+	gopher_addr_t *addr;
+	uint16_t port;
+	size_t len;
+	char *menu;
+	pid_t pid;
+	int ret;
+
+	/* Server that never responds. */
+	printf("#\n# First byte deadline against a silent server\n");
+	test_recv("", 0, DEADLINE, 0, 0, GOPHER_ERR_FIRSTBYTE_TIMEOUT,
+		"first byte deadline reached");
+
+	/* Server that stalls halfway through. */
+	printf("#\n# Idle deadline against a server that stalls\n");
+	len = strlen(partial_menu);
+	test_recv(partial_menu, len, DEADLINE, DEADLINE, 0, GOPHER_ERR_IDLE_TIMEOUT,
+		"idle deadline reached");
+	test_recv(partial_menu, len, 0, 0, DEADLINE, GOPHER_ERR_TOTAL_TIMEOUT,
+		"total deadline reached");
+
+	/* Server that can't accept any more connections. */
+	printf("#\n# Connection deadline against a full listen queue\n");
+	test_connect();
+
+	/* Deadlines that are never reached. */
+	printf("#\n# Deadlines against a well behaved server\n");
+	menu = tserver_menu(100, 1, &len);
+	pid = tserver_start(&port, menu, len, 0);
+	free(menu);
+	addr = gopher_addr_new("127.0.0.1", port, "/", GOPHER_TYPE_DIR);
+	addr->timeouts.dns = DEADLINE;
+	addr->timeouts.connect = DEADLINE;
+	addr->timeouts.first_byte = DEADLINE;
+	addr->timeouts.idle = DEADLINE;
+	addr->timeouts.total = DEADLINE * 10;
+	ret = gopher_connect(addr);
+	ok(ret == 0, "connected with all deadlines set");
+	if (ret == 0) {
+		gopher_dir_t *dir;
+
+		dir = NULL;
+		ret = gopher_dir_request(addr, &dir);
+		ok((ret == 0) && (dir->items_len == 100),
+		   "directory received within the deadlines");
+		gopher_disconnect(addr);
+		if (dir)
+			gopher_dir_free(dir, RECURSE_NONE, 1);
+		else
+			gopher_addr_free(addr);
+	} else {
+		fail("directory received within the deadlines");
+		gopher_addr_free(addr);
+	}
+	tserver_stop(pid);
+
+	/* Error descriptions. */
+	printf("#\n# Descriptions of deadline errors\n");
+	ok(strcmp(gopher_strerror(GOPHER_ERR_DNS_TIMEOUT),
+			  gopher_strerror(GOPHER_ERR_CONNECT_TIMEOUT)) != 0,
+	   "deadline errors have distinct descriptions");
+	ok(strcmp(gopher_strerror(ENOENT), strerror(ENOENT)) == 0,
+	   "system errors are described by strerror");
+}
+
+/**
+ * Requests a directory from a misbehaving local server checking that the
+ * expected deadline was reached well before the server gave up.
+ *
+ * @param resp       Response sent by the server before it stalls.
+ * @param len        Length of the response.
+ * @param first_byte First byte deadline in milliseconds.
+ * @param idle       Idle deadline in milliseconds.
+ * @param total      Total deadline in milliseconds.
+ * @param expected   Expected error code.
+ * @param desc       Description of the test.
+ */
+static void test_recv(const char *resp, size_t len, unsigned long first_byte,
+					  unsigned long idle, unsigned long total, int expected,
+					  const char *desc) {
+	gopher_addr_t *addr;
+	gopher_dir_t *dir;
+	struct timeval start;
+	uint16_t port;
+	pid_t pid;
+	int ret;
+
+	/* Start up our misbehaving server. */
+	pid = tserver_start(&port, resp, len, SERVER_HOLD);
+	if (pid < 0) {
+		bail_out(0, "Failed to start the test server");
+		return;
+	}
+
+	/* Request the directory. */
+	dir = NULL;
+	addr = gopher_addr_new("127.0.0.1", port, "/", GOPHER_TYPE_DIR);
+	addr->timeouts.first_byte = first_byte;
+	addr->timeouts.idle = idle;
+	addr->timeouts.total = total;
+	gettimeofday(&start, NULL);
+	ret = gopher_connect(addr);
+	if (ret == 0)
+		ret = gopher_dir_request(addr, &dir);
+	cmp_ok(ret, "==", expected, "%s", desc);
+	ok(elapsed_since(&start) < (SERVER_HOLD / 2.0),
+	   "gave up before the server closed the connection");
+
+	/* Free up any resources. */
+	gopher_disconnect(addr);
+	if (dir)
+		gopher_dir_free(dir, RECURSE_NONE, 1);
+	else
+		gopher_addr_free(addr);
+	tserver_stop(pid);
+}
+
+/**
+ * Connects to a listener whose queue is full, so that our connection attempt
+ * is left hanging, checking that the connection deadline is honored.
+ */
+static void test_connect(void) {
+	struct sockaddr_in sin;
+	socklen_t sin_len;
+	gopher_addr_t *addr;
+	struct timeval start;
+	int fill[BACKLOG_MAX];
+	int nfill;
+	int sockfd;
+	int ret;
+	int i;
+
+	/* Listen on a random loopback port without ever accepting. */
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = 0;
+	sin_len = sizeof(sin);
+	if ((bind(sockfd, (struct sockaddr *)&sin, sin_len) != 0) ||
+			(listen(sockfd, 0) != 0) ||
+			(getsockname(sockfd, (struct sockaddr *)&sin, &sin_len) != 0)) {
+		bail_out(0, "Failed to start the stalled listener");
+		return;
+	}
+
+	/* Fill up its queue. */
+	for (nfill = 0; nfill < BACKLOG_MAX; nfill++) {
+		fill[nfill] = socket(AF_INET, SOCK_STREAM, 0);
+		fcntl(fill[nfill], F_SETFL, O_NONBLOCK);
+		connect(fill[nfill], (struct sockaddr *)&sin, sin_len);
+	}
+
+	/* Try to connect. */
+	addr = gopher_addr_new("127.0.0.1", ntohs(sin.sin_port), "/",
+		GOPHER_TYPE_DIR);
+	addr->timeouts.connect = DEADLINE;
+	gettimeofday(&start, NULL);
+	ret = gopher_connect(addr);
+	cmp_ok(ret, "==", GOPHER_ERR_CONNECT_TIMEOUT, "connection deadline reached");
+	ok(elapsed_since(&start) < (SERVER_HOLD / 2.0),
+	   "gave up on the connection quickly");
+
+	/* Free up any resources. */
+	gopher_disconnect(addr);
+	gopher_addr_free(addr);
+	for (i = 0; i < nfill; i++)
+		close(fill[i]);
+	close(sockfd);
+}
+
+/**
+ * Calculates the time elapsed since a reference point.
+ *
+ * @param start Reference point in time.
+ *
+ * @return Number of seconds elapsed.
+ */
+static double elapsed_since(const struct timeval *start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+		((now.tv_usec - start->tv_usec) / 1000000.0);
+}
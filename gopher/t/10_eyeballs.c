@@ -0,0 +1,237 @@
+/**
+ * 10_eyeballs.c
+ * Tests racing connections to servers with multiple addresses.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <tap.h>
+#include <unistd.h>
+
+#include "gopher.h"
+#include "server.h"
+
+/* Private definitions. */
+#define FAKE_HOST   "eyeballs.test"
+#define BACKLOG_MAX 16
+#define DEADLINE    300
+typedef struct {
+	int sockfd;
+	int fill[BACKLOG_MAX];
+	uint16_t port;
+} stalled_t;
+static int test_connect(unsigned long timeout, double *secs, int *family);
+static uint16_t closed_port(int family);
+static int stalled_start(stalled_t *st, int family);
+static void stalled_stop(stalled_t *st);
+static double elapsed_since(const struct timeval *start);
+
+/* Addresses our fake host resolves to. */
+static tresolver_addr_t fakes[2];
+
+/**
+ * Gets the number of planned tests.
+ *
+ * @return Number of planned tests.
+ */
+int t_eyeballs_plan(void) {
+	return 9;
+}
+
+/**
+ * Runs unit tests.
+ */
+void t_eyeballs_run(void) {
+	stalled_t st;
+	uint16_t port;
+	double secs;
+	pid_t pid;
+	int family;
+	int ret;
+
+	/* IPv6 address refuses the connection. */
+	printf("#\n# Falling back when the first address refuses connections\n");
+	pid = tserver_start(&port, "", 0, 0);
+	fakes[0].ip = "::1";
+	fakes[0].port = closed_port(AF_INET6);
+	fakes[1].ip = "127.0.0.1";
+	fakes[1].port = port;
+	ret = test_connect(0, &secs, &family);
+	ok(ret == 0, "connected after a refused address");
+	cmp_ok(family, "==", AF_INET, "connected to the IPv4 address");
+	ok(secs < 0.2, "next address tried right after the refusal");
+	tserver_stop(pid);
+
+	/* IPv6 address never answers. */
+	printf("#\n# Racing past an address that never answers\n");
+	pid = tserver_start(&port, "", 0, 0);
+	stalled_start(&st, AF_INET6);
+	fakes[0].ip = "::1";
+	fakes[0].port = st.port;
+	fakes[1].ip = "127.0.0.1";
+	fakes[1].port = port;
+	ret = test_connect(0, &secs, &family);
+	ok(ret == 0, "connected while the first address hangs");
+	cmp_ok(family, "==", AF_INET, "connected to the IPv4 address");
+	ok(secs < 1.0, "connection time bounded by the working address");
+	stalled_stop(&st);
+	tserver_stop(pid);
+
+	/* Every address refuses the connection. */
+	printf("#\n# Every address refusing connections\n");
+	fakes[0].ip = "::1";
+	fakes[0].port = closed_port(AF_INET6);
+	fakes[1].ip = "127.0.0.1";
+	fakes[1].port = closed_port(AF_INET);
+	ret = test_connect(0, &secs, &family);
+	cmp_ok(ret, "==", ECONNREFUSED, "connection refused by every address");
+
+	/* Every address hangs. */
+	printf("#\n# Every address hanging\n");
+	stalled_start(&st, AF_INET);
+	fakes[0].ip = "127.0.0.1";
+	fakes[0].port = st.port;
+	fakes[1].ip = "127.0.0.1";
+	fakes[1].port = st.port;
+	ret = test_connect(DEADLINE, &secs, &family);
+	cmp_ok(ret, "==", GOPHER_ERR_CONNECT_TIMEOUT, "connection deadline reached");
+	ok(secs < 1.0, "gave up on all attempts at the deadline");
+	stalled_stop(&st);
+}
+
+/**
+ * Connects to our fake host.
+ *
+ * @param timeout Connection deadline in milliseconds or 0 for none.
+ * @param secs    Number of seconds it took to connect.
+ * @param family  Address family of the established connection.
+ *
+ * @return Return value of gopher_connect().
+ */
+static int test_connect(unsigned long timeout, double *secs, int *family) {
+	gopher_addr_t *addr;
+	struct timeval start;
+	int ret;
+
+	tresolver_fake(FAKE_HOST, fakes, 2);
+	gopher_dns_cache_flush();
+	addr = gopher_addr_new(FAKE_HOST, 70, "/", GOPHER_TYPE_DIR);
+	addr->flags = GOPHER_FLAG_FASTTERM;
+	addr->timeouts.connect = timeout;
+	gettimeofday(&start, NULL);
+	ret = gopher_connect(addr);
+	*secs = elapsed_since(&start);
+	*family = (ret == 0) ? addr->ipaddr->sa_family : AF_UNSPEC;
+
+	gopher_disconnect(addr);
+	gopher_addr_free(addr);
+	tresolver_fake(NULL, NULL, 0);
+
+	return ret;
+}
+
+/**
+ * Gets a loopback port that nobody is listening on.
+ *
+ * @param family Address family of the loopback interface.
+ *
+ * @return Port number.
+ */
+static uint16_t closed_port(int family) {
+	stalled_t st;
+	uint16_t port;
+
+	/* Grab a port and let it go right away. */
+	stalled_start(&st, family);
+	port = st.port;
+	stalled_stop(&st);
+
+	return port;
+}
+
+/**
+ * Starts a loopback listener whose queue is full, so that connections to it
+ * are left hanging.
+ *
+ * @param st     Stalled listener to be populated.
+ * @param family Address family of the loopback interface.
+ *
+ * @return 0 if the listener was started.
+ */
+static int stalled_start(stalled_t *st, int family) {
+	struct sockaddr_storage ss;
+	struct sockaddr_in *sin;
+	struct sockaddr_in6 *sin6;
+	socklen_t len;
+	int i;
+
+	/* Listen on a random loopback port without ever accepting. */
+	memset(&ss, 0, sizeof(ss));
+	if (family == AF_INET6) {
+		sin6 = (struct sockaddr_in6 *)&ss;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr = in6addr_loopback;
+		len = sizeof(struct sockaddr_in6);
+	} else {
+		sin = (struct sockaddr_in *)&ss;
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		len = sizeof(struct sockaddr_in);
+	}
+	st->sockfd = socket(family, SOCK_STREAM, 0);
+	if ((bind(st->sockfd, (struct sockaddr *)&ss, len) != 0) ||
+			(listen(st->sockfd, 0) != 0) ||
+			(getsockname(st->sockfd, (struct sockaddr *)&ss, &len) != 0)) {
+		bail_out(0, "Failed to start the stalled listener");
+		return -1;
+	}
+	st->port = ntohs((family == AF_INET6) ?
+		((struct sockaddr_in6 *)&ss)->sin6_port :
+		((struct sockaddr_in *)&ss)->sin_port);
+
+	/* Fill up its queue. */
+	for (i = 0; i < BACKLOG_MAX; i++) {
+		st->fill[i] = socket(family, SOCK_STREAM, 0);
+		fcntl(st->fill[i], F_SETFL, O_NONBLOCK);
+		connect(st->fill[i], (struct sockaddr *)&ss, len);
+	}
+
+	return 0;
+}
+
+/**
+ * Stops a stalled listener.
+ *
+ * @param st Stalled listener.
+ */
+static void stalled_stop(stalled_t *st) {
+	int i;
+
+	for (i = 0; i < BACKLOG_MAX; i++)
+		close(st->fill[i]);
+	close(st->sockfd);
+}
+
+/**
+ * Calculates the time elapsed since a reference point.
+ *
+ * @param start Reference point in time.
+ *
+ * @return Number of seconds elapsed.
+ */
+static double elapsed_since(const struct timeval *start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+		((now.tv_usec - start->tv_usec) / 1000000.0);
+}
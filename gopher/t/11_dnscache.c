@@ -0,0 +1,176 @@
+/**
+ * 11_dnscache.c
+ * Tests the name resolution cache and pinned hosts.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <tap.h>
+#include <unistd.h>
+
+#include "gopher.h"
+#include "server.h"
+
+/* Private definitions. */
+#define FAKE_HOST   "cache.test"
+#define PINNED_HOST "pinned.test"
+#define SHORT_TTL   100
+static int test_connect(const char *host, uint16_t port);
+static int listener_start(uint16_t *port);
+
+/**
+ * Gets the number of planned tests.
+ *
+ * @return Number of planned tests.
+ */
+int t_dnscache_plan(void) {
+	return 14;
+}
+
+/**
+ * Runs unit tests.
+ */
+void t_dnscache_run(void) {
+	gopher_dns_stats_t before;
+	gopher_dns_stats_t after;
+	tresolver_addr_t fake;
+	uint16_t port;
+	int sockfd;
+	int ret;
+
+	/* Start a listener that never accepts, its queue is good enough for us. */
+	sockfd = listener_start(&port);
+	if (sockfd < 0) {
+		bail_out(0, "Failed to start the listener");
+		return;
+	}
+	fake.ip = "127.0.0.1";
+	fake.port = port;
+
+	/* Repeated lookups of the same host. */
+	printf("#\n# Repeated connections to the same host\n");
+	gopher_dns_cache_flush();
+	tresolver_fake(FAKE_HOST, &fake, 1);
+	gopher_dns_cache_stats(&before);
+	ret = test_connect(FAKE_HOST, port);
+	ret |= test_connect(FAKE_HOST, port);
+	ret |= test_connect(FAKE_HOST, port);
+	gopher_dns_cache_stats(&after);
+	ok(ret == 0, "connected three times");
+	cmp_ok(tresolver_lookups(), "==", 1, "host resolved only once");
+	cmp_ok(after.hits - before.hits, "==", 2, "two cache hits");
+	cmp_ok(after.misses - before.misses, "==", 1, "one cache miss");
+
+	/* Entries expire. */
+	printf("#\n# Cached entries expiring\n");
+	gopher_dns_cache_ttl(SHORT_TTL, SHORT_TTL);
+	tresolver_fake(FAKE_HOST, &fake, 1);
+	test_connect(FAKE_HOST, port);
+	usleep((SHORT_TTL * 3 / 2) * 1000);
+	test_connect(FAKE_HOST, port);
+	cmp_ok(tresolver_lookups(), "==", 2, "host resolved again after the TTL");
+
+	/* Hosts that don't exist. */
+	printf("#\n# Negative caching of hosts that don't exist\n");
+	gopher_dns_cache_flush();
+	tresolver_fake(FAKE_HOST, NULL, 0);
+	gopher_dns_cache_stats(&before);
+	ret = test_connect(FAKE_HOST, port);
+	ok((ret == EAI_NONAME) && (test_connect(FAKE_HOST, port) == EAI_NONAME),
+	   "host not found twice");
+	cmp_ok(tresolver_lookups(), "==", 1, "missing host resolved only once");
+	gopher_dns_cache_stats(&after);
+	cmp_ok(after.negative_hits - before.negative_hits, "==", 1,
+		   "one negative cache hit");
+	gopher_dns_cache_ttl(SHORT_TTL, 0);
+	tresolver_fake(FAKE_HOST, NULL, 0);
+	test_connect(FAKE_HOST, port);
+	test_connect(FAKE_HOST, port);
+	cmp_ok(tresolver_lookups(), "==", 2,
+		   "missing host resolved every time without negative caching");
+
+	/* Pinned hosts. */
+	printf("#\n# Hosts pinned to an address\n");
+	gopher_dns_override(PINNED_HOST, "127.0.0.1");
+	gopher_dns_cache_stats(&before);
+	ok(test_connect(PINNED_HOST, port) == 0, "connected to a pinned host");
+	gopher_dns_cache_stats(&after);
+	cmp_ok(after.overrides - before.overrides, "==", 1,
+		   "lookup counted as an override");
+	gopher_dns_override(PINNED_HOST, NULL);
+	tresolver_fake(PINNED_HOST, NULL, 0);
+	cmp_ok(test_connect(PINNED_HOST, port), "==", EAI_NONAME,
+		   "unpinned host goes back to the resolver");
+
+	/* Cache disabled. */
+	printf("#\n# Resolver cache disabled\n");
+	gopher_dns_cache_ttl(0, 0);
+	tresolver_fake(FAKE_HOST, &fake, 1);
+	test_connect(FAKE_HOST, port);
+	test_connect(FAKE_HOST, port);
+	cmp_ok(tresolver_lookups(), "==", 2, "host resolved every time");
+	gopher_dns_cache_stats(&after);
+	cmp_ok(after.entries, "==", 0, "nothing was cached");
+
+	/* Go back to the defaults. */
+	gopher_dns_cache_ttl(60000, 5000);
+	tresolver_fake(NULL, NULL, 0);
+	close(sockfd);
+}
+
+/**
+ * Connects to a host and disconnects right away.
+ *
+ * @param host Host name to connect to.
+ * @param port Port to connect to.
+ *
+ * @return Return value of gopher_connect().
+ */
+static int test_connect(const char *host, uint16_t port) {
+	gopher_addr_t *addr;
+	int ret;
+
+	addr = gopher_addr_new(host, port, "/", GOPHER_TYPE_DIR);
+	addr->flags = GOPHER_FLAG_FASTTERM;
+	ret = gopher_connect(addr);
+	gopher_disconnect(addr);
+	gopher_addr_free(addr);
+
+	return ret;
+}
+
+/**
+ * Starts a loopback listener that never accepts any connections.
+ *
+ * @param port Pointer to store the port the listener is on.
+ *
+ * @return Socket file descriptor of the listener or -1 in case of failure.
+ */
+static int listener_start(uint16_t *port) {
+	struct sockaddr_in sin;
+	socklen_t sin_len;
+	int sockfd;
+
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = 0;
+	sin_len = sizeof(sin);
+	if ((bind(sockfd, (struct sockaddr *)&sin, sin_len) != 0) ||
+			(listen(sockfd, 16) != 0) ||
+			(getsockname(sockfd, (struct sockaddr *)&sin, &sin_len) != 0)) {
+		close(sockfd);
+		return -1;
+	}
+	*port = ntohs(sin.sin_port);
+
+	return sockfd;
+}
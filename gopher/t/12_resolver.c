@@ -0,0 +1,285 @@
+/**
+ * 12_resolver.c
+ * Tests the asynchronous name resolver and its use by the multi engine.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <tap.h>
+#include <unistd.h>
+
+#include "gopher.h"
+#include "server.h"
+
+/* Private definitions. */
+#define FAKE_HOST    "resolver.test"
+#define FAKE_PORT    7070
+#define REQUESTS     50
+#define LOOKUP_DELAY 200
+#define WAIT_MAX     2.0
+#define MENU_LINES   100
+typedef struct {
+	unsigned int calls;
+	unsigned int ok;
+	unsigned int cancelled;
+	int err;
+} results_t;
+static void test_multi(gopher_multi_backend_t backend);
+static size_t resolver_wait(gopher_resolver_t *res, size_t count);
+static void resolved(gopher_addr_t *addr, int err, void *arg);
+static void dir_done(gopher_dir_t *dir, int err, void *arg);
+static double elapsed_since(const struct timeval *start);
+
+/* Address our fake host resolves to. */
+static tresolver_addr_t fake;
+
+/**
+ * Gets the number of planned tests.
+ *
+ * @return Number of planned tests.
+ */
+int t_resolver_plan(void) {
+	return 18;
+}
+
+/**
+ * Runs unit tests.
+ */
+void t_resolver_run(void) {
+	gopher_addr_t *addrs[REQUESTS];
+	gopher_resolver_t *res;
+	gopher_multi_t *multi;
+	struct timeval start;
+	results_t rs;
+	int ports_ok;
+	int i;
+
+	/* Make sure every lookup goes through the resolver. */
+	gopher_dns_cache_ttl(0, 0);
+	fake.ip = "127.0.0.1";
+	fake.port = FAKE_PORT;
+
+	/* Many requests for the same host. */
+	printf("#\n# Coalescing requests for the same host\n");
+	tresolver_fake(FAKE_HOST, &fake, 1);
+	tresolver_delay(LOOKUP_DELAY);
+	memset(&rs, 0, sizeof(rs));
+	res = gopher_resolver_new(0);
+	ok(res != NULL, "resolver started");
+	gettimeofday(&start, NULL);
+	for (i = 0; i < REQUESTS; i++) {
+		addrs[i] = gopher_addr_new(FAKE_HOST, 70, "/", GOPHER_TYPE_DIR);
+		gopher_resolver_add(res, addrs[i], resolved, &rs);
+	}
+	ok(elapsed_since(&start) < (LOOKUP_DELAY / 2000.0),
+	   "requests queued without waiting on the lookup");
+	cmp_ok(gopher_resolver_pending(res), "==", REQUESTS,
+		   "every request is pending");
+	resolver_wait(res, REQUESTS);
+	cmp_ok(rs.ok, "==", REQUESTS, "every request resolved");
+	cmp_ok(tresolver_lookups(), "==", 1, "host looked up only once");
+	ports_ok = 1;
+	for (i = 0; i < REQUESTS; i++) {
+		ports_ok = ports_ok && (addrs[i]->ipaddr != NULL) &&
+			(ntohs(((struct sockaddr_in *)addrs[i]->ipaddr)->sin_port) ==
+			 FAKE_PORT);
+		gopher_addr_free(addrs[i]);
+	}
+	ok(ports_ok, "addresses populated with the lookup result");
+
+	/* Host that doesn't exist. */
+	printf("#\n# Coalescing requests for a host that doesn't exist\n");
+	tresolver_fake(FAKE_HOST, NULL, 0);
+	memset(&rs, 0, sizeof(rs));
+	for (i = 0; i < 5; i++) {
+		addrs[i] = gopher_addr_new(FAKE_HOST, 70, "/", GOPHER_TYPE_DIR);
+		gopher_resolver_add(res, addrs[i], resolved, &rs);
+	}
+	resolver_wait(res, 5);
+	ok((rs.calls == 5) && (rs.ok == 0) && (rs.err == EAI_NONAME),
+	   "every request failed");
+	cmp_ok(tresolver_lookups(), "==", 1, "missing host looked up only once");
+	for (i = 0; i < 5; i++)
+		gopher_addr_free(addrs[i]);
+
+	/* Freeing the resolver with lookups under way. */
+	printf("#\n# Freeing the resolver with pending requests\n");
+	tresolver_fake(FAKE_HOST, &fake, 1);
+	memset(&rs, 0, sizeof(rs));
+	for (i = 0; i < 5; i++) {
+		addrs[i] = gopher_addr_new(FAKE_HOST, 70, "/", GOPHER_TYPE_DIR);
+		gopher_resolver_add(res, addrs[i], resolved, &rs);
+	}
+	gettimeofday(&start, NULL);
+	gopher_resolver_free(res);
+	cmp_ok(rs.cancelled, "==", 5, "pending requests cancelled");
+	ok(elapsed_since(&start) < (LOOKUP_DELAY / 2000.0),
+	   "freed without waiting on the lookup");
+	for (i = 0; i < 5; i++)
+		gopher_addr_free(addrs[i]);
+	usleep(LOOKUP_DELAY * 2 * 1000);
+
+	/* Multi request engine. */
+	printf("#\n# Multi request engine using select\n");
+	test_multi(GOPHER_MULTI_SELECT);
+	printf("#\n# Multi request engine using the best backend available\n");
+	test_multi(GOPHER_MULTI_AUTO);
+	printf("#\n# Multi request engine using io_uring\n");
+	test_multi(GOPHER_MULTI_URING);
+
+	/* Multi request engine freed while resolving. */
+	printf("#\n# Multi request engine freed while resolving\n");
+	memset(&rs, 0, sizeof(rs));
+	multi = gopher_multi_new(GOPHER_MULTI_AUTO);
+	gopher_multi_add_dir(multi,
+		gopher_addr_new(FAKE_HOST, 70, "/", GOPHER_TYPE_DIR), dir_done, &rs);
+	gopher_multi_free(multi);
+	cmp_ok(rs.cancelled, "==", 1, "resolving transfer cancelled");
+	usleep(LOOKUP_DELAY * 2 * 1000);
+
+	/* Multi request engine with a host that doesn't exist. */
+	printf("#\n# Multi request engine with a host that doesn't exist\n");
+	tresolver_fake(FAKE_HOST, NULL, 0);
+	memset(&rs, 0, sizeof(rs));
+	multi = gopher_multi_new(GOPHER_MULTI_AUTO);
+	gopher_multi_add_dir(multi,
+		gopher_addr_new(FAKE_HOST, 70, "/", GOPHER_TYPE_DIR), dir_done, &rs);
+	gopher_multi_run(multi);
+	gopher_multi_free(multi);
+	ok((rs.calls == 1) && (rs.err == EAI_NONAME),
+	   "resolution failure handed to the callback");
+
+	/* Go back to the defaults. */
+	tresolver_delay(0);
+	tresolver_fake(NULL, NULL, 0);
+	gopher_dns_cache_ttl(60000, 5000);
+}
+
+/**
+ * Requests a directory from a server whose name takes a while to resolve,
+ * checking that the engine doesn't block on the lookup.
+ *
+ * @param backend Readiness notification mechanism to be tested.
+ */
+static void test_multi(gopher_multi_backend_t backend) {
+	gopher_multi_t *multi;
+	gopher_addr_t *addr;
+	struct timeval start;
+	results_t rs;
+	uint16_t port;
+	size_t len;
+	char *menu;
+	pid_t pid;
+
+	/* Start up the server and point our fake host at it. */
+	menu = tserver_menu(MENU_LINES, 1, &len);
+	pid = tserver_start(&port, menu, len, 0);
+	free(menu);
+	fake.port = port;
+	tresolver_fake(FAKE_HOST, &fake, 1);
+
+	/* Request the directory. */
+	memset(&rs, 0, sizeof(rs));
+	multi = gopher_multi_new(backend);
+	addr = gopher_addr_new(FAKE_HOST, 70, "/", GOPHER_TYPE_DIR);
+	gettimeofday(&start, NULL);
+	gopher_multi_add_dir(multi, addr, dir_done, &rs);
+	ok(elapsed_since(&start) < (LOOKUP_DELAY / 2000.0),
+	   "transfer added without waiting on the lookup");
+	gopher_multi_run(multi);
+	cmp_ok(rs.ok, "==", 1, "directory received after the lookup");
+
+	/* Free up any resources. */
+	gopher_multi_free(multi);
+	tserver_stop(pid);
+	fake.port = FAKE_PORT;
+}
+
+/**
+ * Waits for a number of requests to be resolved.
+ *
+ * @param res   Name resolver.
+ * @param count Number of callbacks to wait for.
+ *
+ * @return Number of callbacks that were called.
+ */
+static size_t resolver_wait(gopher_resolver_t *res, size_t count) {
+	struct timeval start;
+	struct pollfd pfd;
+	size_t done;
+
+	done = 0;
+	gettimeofday(&start, NULL);
+	while ((done < count) && (elapsed_since(&start) < WAIT_MAX)) {
+		pfd.fd = gopher_resolver_fd(res);
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 100) > 0)
+			done += gopher_resolver_poll(res);
+	}
+
+	return done;
+}
+
+/**
+ * Receives a finished name resolution.
+ *
+ * @param addr Gopherspace address object that was resolved.
+ * @param err  Error code of the resolution.
+ * @param arg  Test results.
+ */
+static void resolved(gopher_addr_t *addr, int err, void *arg) {
+	results_t *rs;
+
+	rs = (results_t *)arg;
+	rs->calls++;
+	rs->err = err;
+	if (err == 0)
+		rs->ok++;
+	if (err == ECANCELED)
+		rs->cancelled++;
+}
+
+/**
+ * Receives a finished directory request.
+ *
+ * @param dir Directory that was requested.
+ * @param err Error code of the request.
+ * @param arg Test results.
+ */
+static void dir_done(gopher_dir_t *dir, int err, void *arg) {
+	results_t *rs;
+
+	rs = (results_t *)arg;
+	rs->calls++;
+	rs->err = err;
+	if ((err == 0) && (dir->items_len == MENU_LINES))
+		rs->ok++;
+	if (err == ECANCELED)
+		rs->cancelled++;
+	gopher_dir_free(dir, RECURSE_NONE, 1);
+}
+
+/**
+ * Calculates the time elapsed since a reference point.
+ *
+ * @param start Reference point in time.
+ *
+ * @return Number of seconds elapsed.
+ */
+static double elapsed_since(const struct timeval *start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+		((now.tv_usec - start->tv_usec) / 1000000.0);
+}
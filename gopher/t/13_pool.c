@@ -0,0 +1,249 @@
+/**
+ * 13_pool.c
+ * Tests the pool of warm connections kept open to recently used servers.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <tap.h>
+#include <unistd.h>
+
+#include "gopher.h"
+#include "server.h"
+
+/* Private definitions. */
+#define HOST     "127.0.0.1"
+#define PER_HOST 2
+#define MAX_IDLE 1000
+#define HOST_TTL 300
+#define WAIT_MAX 2.0
+static int test_connect(uint16_t port, int flags, uint16_t *peer);
+static int wait_idle(size_t idle);
+static int listener_start(uint16_t *port);
+static void listener_drain(int sockfd);
+static double elapsed_since(const struct timeval *start);
+
+/**
+ * Gets the number of planned tests.
+ *
+ * @return Number of planned tests.
+ */
+int t_pool_plan(void) {
+	return 16;
+}
+
+/**
+ * Runs unit tests.
+ */
+void t_pool_run(void) {
+	gopher_pool_stats_t before;
+	gopher_pool_stats_t after;
+	uint16_t peer;
+	uint16_t port;
+	int sockfd;
+	int ret;
+
+	/* Start a listener that only accepts when we tell it to. */
+	sockfd = listener_start(&port);
+	if (sockfd < 0) {
+		bail_out(0, "Failed to start the listener");
+		return;
+	}
+
+	/* Pool disabled. */
+	printf("#\n# Connecting with the pool disabled\n");
+	gopher_pool_stats(&before);
+	ok(test_connect(port, GOPHER_FLAG_NONE, NULL) == 0, "connected");
+	gopher_pool_stats(&after);
+	ok((after.misses == before.misses) && (after.idle == 0),
+	   "pool left alone when disabled");
+
+	/* Warming up a server after it was used. */
+	printf("#\n# Warming up a server after connecting to it\n");
+	gopher_pool_config(PER_HOST, MAX_IDLE, 0);
+	gopher_pool_stats(&before);
+	ok(test_connect(port, GOPHER_FLAG_NONE, NULL) == 0,
+	   "connected without a warm connection");
+	gopher_pool_stats(&after);
+	cmp_ok(after.misses - before.misses, "==", 1, "counted as a miss");
+	ok(wait_idle(PER_HOST), "pool warmed up in the background");
+
+	/* Using a warm connection. */
+	printf("#\n# Connecting with a warm connection\n");
+	gopher_pool_stats(&before);
+	ret = test_connect(port, GOPHER_FLAG_NONE, &peer);
+	gopher_pool_stats(&after);
+	ok((ret == 0) && (after.hits - before.hits == 1),
+	   "warm connection taken");
+	cmp_ok(peer, "==", port, "warm connection goes to the right server");
+	ok(wait_idle(PER_HOST), "pool refilled after a connection was taken");
+
+	/* Connections the server has hung up on. */
+	printf("#\n# Discarding connections the server closed\n");
+	gopher_pool_stats(&before);
+	listener_drain(sockfd);
+	usleep(50000);
+	ret = test_connect(port, GOPHER_FLAG_NONE, NULL);
+	gopher_pool_stats(&after);
+	ok(ret == 0, "connected after the server closed the warm connections");
+	cmp_ok(after.stale - before.stale, ">=", PER_HOST,
+		   "closed connections discarded");
+
+	/* Connections left idle for too long. */
+	printf("#\n# Expiring idle connections\n");
+	wait_idle(PER_HOST);
+	gopher_pool_stats(&before);
+	usleep(MAX_IDLE * 2 * 1000);
+	gopher_pool_stats(&after);
+	cmp_ok(after.stale - before.stale, ">=", PER_HOST,
+		   "idle connections replaced once they expired");
+
+	/* Servers nobody uses anymore. */
+	printf("#\n# Forgetting servers that aren't used anymore\n");
+	gopher_pool_config(PER_HOST, MAX_IDLE, HOST_TTL);
+	test_connect(port, GOPHER_FLAG_NONE, NULL);
+	usleep(HOST_TTL * 4 * 1000);
+	gopher_pool_stats(&after);
+	cmp_ok(after.idle, "==", 0, "unused server forgotten");
+
+	/* Warming up a server explicitly. */
+	printf("#\n# Warming up a server explicitly\n");
+	gopher_pool_config(PER_HOST, MAX_IDLE, 0);
+	gopher_pool_warm(HOST, port, GOPHER_SOCKPROF_DEFAULT);
+	ok(wait_idle(PER_HOST), "server warmed up before being used");
+
+	/* Opting out of the pool. */
+	printf("#\n# Opting out of the pool\n");
+	gopher_pool_stats(&before);
+	test_connect(port, GOPHER_FLAG_NOPOOL, NULL);
+	gopher_pool_stats(&after);
+	ok((after.hits == before.hits) && (after.misses == before.misses),
+	   "pool bypassed with GOPHER_FLAG_NOPOOL");
+
+	/* Flushing and disabling the pool. */
+	printf("#\n# Flushing and disabling the pool\n");
+	gopher_pool_flush();
+	gopher_pool_stats(&after);
+	cmp_ok(after.idle, "==", 0, "every idle connection closed on flush");
+	gopher_pool_config(0, MAX_IDLE, 0);
+	gopher_pool_stats(&before);
+	test_connect(port, GOPHER_FLAG_NONE, NULL);
+	gopher_pool_stats(&after);
+	ok((after.idle == 0) && (after.misses == before.misses),
+	   "pool disabled again");
+
+	listener_drain(sockfd);
+	close(sockfd);
+}
+
+/**
+ * Connects to the listener and disconnects right away.
+ *
+ * @param port  Port of the listener.
+ * @param flags Connection flags to use on top of GOPHER_FLAG_FASTTERM.
+ * @param peer  Optional. Returns the port we were connected to.
+ *
+ * @return Return value of gopher_connect().
+ */
+static int test_connect(uint16_t port, int flags, uint16_t *peer) {
+	gopher_addr_t *addr;
+	int ret;
+
+	addr = gopher_addr_new(HOST, port, "/", GOPHER_TYPE_DIR);
+	addr->flags = GOPHER_FLAG_FASTTERM | flags;
+	ret = gopher_connect(addr);
+	if ((ret == 0) && (peer != NULL))
+		*peer = ntohs(((struct sockaddr_in *)addr->ipaddr)->sin_port);
+	gopher_disconnect(addr);
+	gopher_addr_free(addr);
+
+	return ret;
+}
+
+/**
+ * Waits for the pool to have a number of idle connections.
+ *
+ * @param idle Number of idle connections to wait for.
+ *
+ * @return TRUE if the pool got there in time.
+ */
+static int wait_idle(size_t idle) {
+	gopher_pool_stats_t stats;
+	struct timeval start;
+
+	gettimeofday(&start, NULL);
+	do {
+		gopher_pool_stats(&stats);
+		if (stats.idle == idle)
+			return 1;
+		usleep(10000);
+	} while (elapsed_since(&start) < WAIT_MAX);
+
+	return 0;
+}
+
+/**
+ * Starts a non-blocking loopback listener.
+ *
+ * @param port Pointer to store the port the listener is on.
+ *
+ * @return Socket file descriptor of the listener or -1 in case of failure.
+ */
+static int listener_start(uint16_t *port) {
+	struct sockaddr_in sin;
+	socklen_t sin_len;
+	int sockfd;
+
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = 0;
+	sin_len = sizeof(sin);
+	if ((bind(sockfd, (struct sockaddr *)&sin, sin_len) != 0) ||
+			(listen(sockfd, 64) != 0) ||
+			(getsockname(sockfd, (struct sockaddr *)&sin, &sin_len) != 0)) {
+		close(sockfd);
+		return -1;
+	}
+	fcntl(sockfd, F_SETFL, O_NONBLOCK);
+	*port = ntohs(sin.sin_port);
+
+	return sockfd;
+}
+
+/**
+ * Accepts every connection waiting on the listener and hangs up on it.
+ *
+ * @param sockfd Socket file descriptor of the listener.
+ */
+static void listener_drain(int sockfd) {
+	int fd;
+
+	while ((fd = accept(sockfd, NULL, NULL)) >= 0)
+		close(fd);
+}
+
+/**
+ * Calculates the time elapsed since a reference point.
+ *
+ * @param start Reference point in time.
+ *
+ * @return Number of seconds elapsed.
+ */
+static double elapsed_since(const struct timeval *start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+		((now.tv_usec - start->tv_usec) / 1000000.0);
+}
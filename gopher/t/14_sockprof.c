@@ -0,0 +1,166 @@
+/**
+ * 14_sockprof.c
+ * Tests the socket tuning profiles used when connecting to a server.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <tap.h>
+#include <unistd.h>
+
+#include "gopher.h"
+#include "server.h"
+
+/* Private definitions. */
+#define MENU_LINES 100
+#define BULK_SIZE  (4 * 1024 * 1024)
+typedef struct {
+	int nodelay;
+	int rcvbuf;
+	int rcvlowat;
+} sockopts_t;
+static gopher_addr_t *test_connect(uint16_t port, gopher_sockprof_t profile,
+								   gopher_type_t type, sockopts_t *opts);
+static void multi_done(gopher_dir_t *dir, int err, void *arg);
+
+/**
+ * Gets the number of planned tests.
+ *
+ * @return Number of planned tests.
+ */
+int t_sockprof_plan(void) {
+	return 10;
+}
+
+/**
+ * Runs unit tests.
+ */
+void t_sockprof_run(void) {
+	gopher_multi_t *multi;
+	gopher_addr_t *addr;
+	gopher_file_t *gf;
+	gopher_dir_t *dir;
+	sockopts_t defopts;
+	sockopts_t opts;
+	struct stat st;
+	uint16_t port;
+	char path[64];
+	size_t len;
+	char *menu;
+	char *data;
+	pid_t pid;
+	int ret;
+
+	menu = tserver_menu(MENU_LINES, 1, &len);
+
+	/* Default profile. */
+	printf("#\n# Default socket profile\n");
+	pid = tserver_start(&port, menu, len, 0);
+	addr = test_connect(port, GOPHER_SOCKPROF_DEFAULT, GOPHER_TYPE_DIR,
+		&defopts);
+	ok(!defopts.nodelay && (defopts.rcvlowat <= 1),
+	   "socket options left alone");
+	ret = gopher_dir_request(addr, &dir);
+	ok((ret == 0) && (dir->items_len == MENU_LINES), "directory received");
+	gopher_disconnect(addr);
+	gopher_dir_free(dir, RECURSE_NONE, 1);
+	tserver_stop(pid);
+
+	/* Latency profile. */
+	printf("#\n# Latency socket profile\n");
+	pid = tserver_start(&port, menu, len, 0);
+	addr = test_connect(port, GOPHER_SOCKPROF_LATENCY, GOPHER_TYPE_DIR, &opts);
+	ok(opts.nodelay, "Nagle's algorithm disabled");
+	ret = gopher_dir_request(addr, &dir);
+	ok((ret == 0) && (dir->items_len == MENU_LINES), "directory received");
+	gopher_disconnect(addr);
+	gopher_dir_free(dir, RECURSE_NONE, 1);
+	tserver_stop(pid);
+
+	/* Bulk profile. */
+	printf("#\n# Bulk socket profile\n");
+	data = (char *)malloc(BULK_SIZE);
+	memset(data, 'x', BULK_SIZE);
+	pid = tserver_start(&port, data, BULK_SIZE, 0);
+	free(data);
+	addr = test_connect(port, GOPHER_SOCKPROF_BULK, GOPHER_TYPE_BINARY, &opts);
+	ok(opts.rcvbuf > defopts.rcvbuf, "larger receive buffer");
+	ok(opts.rcvlowat > 1, "receive low water mark raised");
+	sprintf(path, "/tmp/gopher_sockprof_%d", (int)getpid());
+	gf = gopher_file_new(addr, path, GOPHER_TYPE_BINARY);
+	ret = gopher_file_download(gf);
+	ok((ret == 0) && (gf->fsize == BULK_SIZE), "file downloaded");
+	ok((stat(path, &st) == 0) && (st.st_size == BULK_SIZE),
+	   "every byte written to disk");
+	gopher_disconnect(addr);
+	gopher_file_free(gf);
+	gopher_addr_free(addr);
+	unlink(path);
+	tserver_stop(pid);
+
+	/* Multi request engine. */
+	printf("#\n# Socket profiles in the multi request engine\n");
+	pid = tserver_start(&port, menu, len, 0);
+	ret = -1;
+	multi = gopher_multi_new(GOPHER_MULTI_AUTO);
+	addr = gopher_addr_new("127.0.0.1", port, "/", GOPHER_TYPE_DIR);
+	addr->profile = GOPHER_SOCKPROF_LATENCY;
+	ok(gopher_multi_add_dir(multi, addr, multi_done, &ret) == 0,
+	   "transfer added");
+	gopher_multi_run(multi);
+	cmp_ok(ret, "==", MENU_LINES, "directory received");
+	gopher_multi_free(multi);
+	tserver_stop(pid);
+
+	free(menu);
+}
+
+/**
+ * Connects to the test server with a socket profile.
+ *
+ * @param port    Port of the test server.
+ * @param profile Socket profile to connect with.
+ * @param type    Type of the request that will be made.
+ * @param opts    Returns the socket options after connecting.
+ *
+ * @return Connected gopherspace address object.
+ */
+static gopher_addr_t *test_connect(uint16_t port, gopher_sockprof_t profile,
+								   gopher_type_t type, sockopts_t *opts) {
+	gopher_addr_t *addr;
+	socklen_t len;
+
+	addr = gopher_addr_new("127.0.0.1", port, "/", type);
+	addr->profile = profile;
+	memset(opts, 0, sizeof(sockopts_t));
+	if (gopher_connect(addr) != 0)
+		return addr;
+
+	len = sizeof(int);
+	getsockopt(addr->sockfd, IPPROTO_TCP, TCP_NODELAY, &opts->nodelay, &len);
+	len = sizeof(int);
+	getsockopt(addr->sockfd, SOL_SOCKET, SO_RCVBUF, &opts->rcvbuf, &len);
+	len = sizeof(int);
+	getsockopt(addr->sockfd, SOL_SOCKET, SO_RCVLOWAT, &opts->rcvlowat, &len);
+
+	return addr;
+}
+
+/**
+ * Receives a finished directory request from the multi request engine.
+ *
+ * @param dir Directory that was requested.
+ * @param err Error code of the request.
+ * @param arg Returns the number of items in the directory or -1 on failure.
+ */
+static void multi_done(gopher_dir_t *dir, int err, void *arg) {
+	*((int *)arg) = (err == 0) ? (int)dir->items_len : -1;
+	gopher_dir_free(dir, RECURSE_NONE, 1);
+}
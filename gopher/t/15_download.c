@@ -0,0 +1,413 @@
+/**
+ * 15_download.c
+ * Tests downloading files straight into the filesystem.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <tap.h>
+#include <unistd.h>
+
+#include "gopher.h"
+#include "server.h"
+
+/* Private definitions. */
+#define FILE_SIZE   (4 * 1024 * 1024)
+#define SERVER_HOLD 3
+#define IDLE        200
+#define DISK_FULL   "/dev/full"
+#define MEM_CHUNK   (32 * 1024)
+#define MEM_MAX     (FILE_SIZE / 2)
+#define SMALL_HINT  (1024 * 1024)
+#define NO_PREALLOC "/dev/null"
+typedef struct {
+	size_t calls;
+	size_t last;
+	off_t on_disk;
+	int monotonic;
+} progress_t;
+static int test_download(uint16_t port, const char *path, int flags,
+						 size_t hint, long idle, size_t *fsize,
+						 progress_t *prog);
+static gopher_file_t *test_download_mem(uint16_t port, size_t max_size,
+										int *ret);
+static void test_multi_mem(gopher_multi_backend_t backend, const char *data);
+static int file_matches(const char *path, const char *data, size_t len);
+static int iov_matches(const gopher_file_t *gf, const char *data, size_t len);
+static void progress_cb(const void *gf, void *arg);
+static void multi_done(gopher_file_t *gf, int err, void *arg);
+
+/**
+ * Gets the number of planned tests.
+ *
+ * @return Number of planned tests.
+ */
+int t_download_plan(void) {
+	return 36;
+}
+
+/**
+ * Runs unit tests.
+ */
+void t_download_run(void) {
+	progress_t prog;
+	uint16_t port;
+	char path[64];
+	size_t fsize;
+	char *data;
+	pid_t pid;
+	size_t i;
+	gopher_file_t *gf;
+	const char *buf;
+	int ret;
+
+	/* Build a file that'll show any bytes out of place. */
+	data = (char *)malloc(FILE_SIZE);
+	for (i = 0; i < FILE_SIZE; i++)
+		data[i] = (char)((i * 7) ^ (i >> 12));
+	sprintf(path, "/tmp/gopher_download_%d", (int)getpid());
+
+	/* Regular download. */
+	printf("#\n# Downloading a file\n");
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	ret = test_download(port, path, GOPHER_FLAG_NONE, 0, 0, &fsize, &prog);
+	ok((ret == 0) && (fsize == FILE_SIZE), "file downloaded");
+	ok(file_matches(path, data, FILE_SIZE), "file contents match");
+	ok((prog.calls > 0) && prog.monotonic, "progress reported as it went");
+	cmp_ok(prog.last, "==", FILE_SIZE, "progress reported the entire file");
+	tserver_stop(pid);
+	unlink(path);
+
+	/* Server that stalls after sending everything. */
+	printf("#\n# Downloading from a server that stalls\n");
+	pid = tserver_start(&port, data, FILE_SIZE, SERVER_HOLD);
+	ret = test_download(port, path, GOPHER_FLAG_NONE, 0, IDLE, &fsize, &prog);
+	cmp_ok(ret, "==", GOPHER_ERR_IDLE_TIMEOUT, "idle deadline honored");
+	ok(fsize == FILE_SIZE, "everything received before the stall");
+	ok(file_matches(path, data, FILE_SIZE), "file contents match");
+	tserver_stop(pid);
+	unlink(path);
+
+	/* Pipelined download. */
+	printf("#\n# Downloading a file with a writer thread\n");
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	ret = test_download(port, path, GOPHER_FLAG_PIPELINE, 0, 0, &fsize, &prog);
+	ok((ret == 0) && (fsize == FILE_SIZE), "file downloaded");
+	ok(file_matches(path, data, FILE_SIZE), "file contents match");
+	ok((prog.calls > 0) && prog.monotonic, "progress reported as it went");
+	cmp_ok(prog.last, "==", FILE_SIZE, "progress reported the entire file");
+	tserver_stop(pid);
+	unlink(path);
+
+	/* Pipelined download from a server that stalls. */
+	printf("#\n# Downloading with a writer thread from a stalling server\n");
+	pid = tserver_start(&port, data, FILE_SIZE, SERVER_HOLD);
+	ret = test_download(port, path, GOPHER_FLAG_PIPELINE, 0, IDLE, &fsize,
+		&prog);
+	cmp_ok(ret, "==", GOPHER_ERR_IDLE_TIMEOUT, "idle deadline honored");
+	ok(file_matches(path, data, FILE_SIZE),
+	   "everything received before the stall written");
+	tserver_stop(pid);
+	unlink(path);
+
+	/* Pipelined download to a disk that's full. */
+	printf("#\n# Downloading with a writer thread to a full disk\n");
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	ret = test_download(port, DISK_FULL, GOPHER_FLAG_PIPELINE, 0, 0, &fsize,
+		&prog);
+	cmp_ok(ret, "==", ENOSPC, "write error reported");
+	ok(fsize < FILE_SIZE, "download stopped early");
+	ok(prog.monotonic, "progress reported until it stopped");
+	tserver_stop(pid);
+
+	/* Preallocated and memory-mapped download. */
+	printf("#\n# Downloading a file through a memory-mapped window\n");
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	ret = test_download(port, path, GOPHER_FLAG_MMAP, 0, 0, &fsize, &prog);
+	ok((ret == 0) && (fsize == FILE_SIZE), "file downloaded");
+	ok(file_matches(path, data, FILE_SIZE),
+	   "file contents match and preallocation trimmed");
+	cmp_ok(prog.last, "==", FILE_SIZE, "progress reported the entire file");
+	ok(prog.on_disk > FILE_SIZE, "space reserved on disk ahead of time");
+	tserver_stop(pid);
+	unlink(path);
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	ret = test_download(port, path, GOPHER_FLAG_MMAP, FILE_SIZE, 0, &fsize,
+		&prog);
+	ok((ret == 0) && file_matches(path, data, FILE_SIZE),
+	   "file downloaded with an exact size hint");
+	tserver_stop(pid);
+	unlink(path);
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	ret = test_download(port, path, GOPHER_FLAG_MMAP, SMALL_HINT, 0, &fsize,
+		&prog);
+	ok((ret == 0) && file_matches(path, data, FILE_SIZE),
+	   "file grown past a size hint that was too small");
+	tserver_stop(pid);
+	unlink(path);
+
+	/* Memory-mapped download from a server that stalls. */
+	printf("#\n# Downloading through a memory-mapped window from a stalling "
+		"server\n");
+	pid = tserver_start(&port, data, FILE_SIZE, SERVER_HOLD);
+	ret = test_download(port, path, GOPHER_FLAG_MMAP, 0, IDLE, &fsize, &prog);
+	cmp_ok(ret, "==", GOPHER_ERR_IDLE_TIMEOUT, "idle deadline honored");
+	ok(file_matches(path, data, FILE_SIZE),
+	   "file trimmed to what was received before the stall");
+	tserver_stop(pid);
+	unlink(path);
+
+	/* Memory-mapped download to a file that can't be preallocated. */
+	printf("#\n# Downloading a file that can't be preallocated\n");
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	ret = test_download(port, NO_PREALLOC, GOPHER_FLAG_MMAP, 0, 0, &fsize,
+		&prog);
+	ok((ret == 0) && (fsize == FILE_SIZE), "fell back to writing it out");
+	tserver_stop(pid);
+
+	/* Download to memory. */
+	printf("#\n# Downloading a file to memory\n");
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	gf = test_download_mem(port, 0, &ret);
+	ok((ret == 0) && (gf->fsize == FILE_SIZE), "file downloaded");
+	cmp_ok(gopher_file_mem_iov(gf, NULL, 0), "==", FILE_SIZE / MEM_CHUNK,
+		   "file kept in fixed-size chunks");
+	ok(iov_matches(gf, data, FILE_SIZE), "chunk contents match");
+	ret = gopher_file_mem_buf(gf, &buf, &fsize);
+	ok((ret == 0) && (fsize == FILE_SIZE) &&
+	   (memcmp(buf, data, FILE_SIZE) == 0) && (buf[fsize] == '\0'),
+	   "contiguous buffer matches");
+	cmp_ok(gopher_file_mem_iov(gf, NULL, 0), "==", 1,
+		   "chunks merged into the contiguous buffer");
+	gopher_file_free(gf);
+	tserver_stop(pid);
+
+	/* Download to memory past the size limit. */
+	printf("#\n# Downloading a file larger than allowed to memory\n");
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	gf = test_download_mem(port, MEM_MAX, &ret);
+	cmp_ok(ret, "==", EFBIG, "size limit enforced");
+	ok((gf->fsize == MEM_MAX) && iov_matches(gf, data, MEM_MAX),
+	   "kept everything up to the limit");
+	gopher_file_free(gf);
+	tserver_stop(pid);
+
+	/* Download to memory with the multi request engine. */
+	printf("#\n# Downloading a file to memory with the multi engine\n");
+	test_multi_mem(GOPHER_MULTI_AUTO, data);
+	printf("#\n# Downloading a file to memory with io_uring\n");
+	test_multi_mem(GOPHER_MULTI_URING, data);
+
+	free(data);
+}
+
+/**
+ * Downloads a file from the test server.
+ *
+ * @param port  Port of the test server.
+ * @param path  Path to download the file to.
+ * @param flags Connection flags to use.
+ * @param hint  Expected size of the file. 0 if unknown.
+ * @param idle  Idle deadline in milliseconds. 0 to disable it.
+ * @param fsize Returns the number of bytes downloaded.
+ * @param prog  Returns the progress reported while downloading.
+ *
+ * @return Return value of gopher_file_download().
+ */
+static int test_download(uint16_t port, const char *path, int flags,
+						 size_t hint, long idle, size_t *fsize,
+						 progress_t *prog) {
+	gopher_addr_t *addr;
+	gopher_file_t *gf;
+	int ret;
+
+	memset(prog, 0, sizeof(progress_t));
+	prog->monotonic = 1;
+	*fsize = 0;
+
+	addr = gopher_addr_new("127.0.0.1", port, "/file", GOPHER_TYPE_BINARY);
+	addr->flags = flags;
+	addr->timeouts.idle = idle;
+	ret = gopher_connect(addr);
+	if (ret != 0) {
+		gopher_addr_free(addr);
+		return ret;
+	}
+
+	gf = gopher_file_new(addr, path, GOPHER_TYPE_BINARY);
+	gf->size_hint = hint;
+	gopher_file_set_transfer_cb(gf, progress_cb, prog);
+	ret = gopher_file_download(gf);
+	*fsize = gf->fsize;
+	gopher_disconnect(addr);
+	gopher_file_free(gf);
+	gopher_addr_free(addr);
+
+	return ret;
+}
+
+/**
+ * Downloads a file from the test server to memory.
+ *
+ * @param port     Port of the test server.
+ * @param max_size Maximum size of the file. 0 for no limit.
+ * @param ret      Returns the return value of gopher_file_download().
+ *
+ * @return Download object holding the file in memory.
+ */
+static gopher_file_t *test_download_mem(uint16_t port, size_t max_size,
+										int *ret) {
+	gopher_addr_t *addr;
+	gopher_file_t *gf;
+
+	addr = gopher_addr_new("127.0.0.1", port, "/file", GOPHER_TYPE_TEXT);
+	gf = gopher_file_new_mem(addr, max_size, GOPHER_TYPE_TEXT);
+	*ret = gopher_connect(addr);
+	if (*ret == 0)
+		*ret = gopher_file_download(gf);
+	gopher_disconnect(addr);
+	gopher_addr_free(addr);
+	gf->addr = NULL;
+
+	return gf;
+}
+
+/**
+ * Downloads a file to memory with the multi request engine.
+ *
+ * @param backend Readiness notification mechanism to be used.
+ * @param data    Expected contents of the file.
+ */
+static void test_multi_mem(gopher_multi_backend_t backend, const char *data) {
+	gopher_multi_t *multi;
+	gopher_addr_t *addr;
+	gopher_file_t *gf;
+	uint16_t port;
+	pid_t pid;
+	int ret;
+
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	multi = gopher_multi_new(backend);
+	addr = gopher_addr_new("127.0.0.1", port, "/file", GOPHER_TYPE_BINARY);
+	gf = gopher_file_new_mem(addr, 0, GOPHER_TYPE_BINARY);
+	ret = -1;
+	ok(gopher_multi_add_file(multi, gf, multi_done, &ret) == 0,
+	   "transfer added");
+	gopher_multi_run(multi);
+	ok((ret == 0) && (gf->fsize == FILE_SIZE) &&
+	   iov_matches(gf, data, FILE_SIZE), "file received into memory");
+	gopher_multi_free(multi);
+	gopher_file_free(gf);
+	gopher_addr_free(addr);
+	tserver_stop(pid);
+}
+
+/**
+ * Checks if a downloaded file has the expected contents.
+ *
+ * @param path Path to the downloaded file.
+ * @param data Expected contents.
+ * @param len  Length of the expected contents.
+ *
+ * @return TRUE if the file matches exactly.
+ */
+static int file_matches(const char *path, const char *data, size_t len) {
+	char buf[4096];
+	size_t off;
+	size_t n;
+	FILE *fh;
+	int match;
+
+	fh = fopen(path, "rb");
+	if (fh == NULL)
+		return 0;
+
+	match = 1;
+	off = 0;
+	while (match && ((n = fread(buf, 1, sizeof(buf), fh)) > 0)) {
+		if ((off + n > len) || (memcmp(buf, data + off, n) != 0))
+			match = 0;
+		off += n;
+	}
+	fclose(fh);
+
+	return match && (off == len);
+}
+
+/**
+ * Checks if a file downloaded to memory has the expected contents.
+ *
+ * @param gf   Gopher file download object without a path.
+ * @param data Expected contents.
+ * @param len  Length of the expected contents.
+ *
+ * @return TRUE if the file matches exactly.
+ */
+static int iov_matches(const gopher_file_t *gf, const char *data, size_t len) {
+	gopher_iovec_t *iov;
+	size_t count;
+	size_t off;
+	size_t i;
+	int match;
+
+	count = gopher_file_mem_iov(gf, NULL, 0);
+	iov = (gopher_iovec_t *)malloc((count + 1) * sizeof(gopher_iovec_t));
+	gopher_file_mem_iov(gf, iov, count);
+
+	match = 1;
+	off = 0;
+	for (i = 0; match && (i < count); i++) {
+		if ((off + iov[i].len > len) ||
+				(memcmp(iov[i].base, data + off, iov[i].len) != 0)) {
+			match = 0;
+		}
+		off += iov[i].len;
+	}
+	free(iov);
+
+	return match && (off == len);
+}
+
+/**
+ * Keeps track of the progress reported by a download.
+ *
+ * @param gf  Gopher file download object.
+ * @param arg Progress tracking structure.
+ */
+static void progress_cb(const void *gf, void *arg) {
+	const char *path;
+	progress_t *prog;
+	struct stat st;
+	size_t fsize;
+
+	/* Keep track of how large the file has gotten on disk. */
+	prog = (progress_t *)arg;
+	path = ((const gopher_file_t *)gf)->fpath;
+	if ((path != NULL) && (stat(path, &st) == 0) &&
+			(st.st_size > prog->on_disk)) {
+		prog->on_disk = st.st_size;
+	}
+
+	/* Check that the progress only goes forward. */
+	fsize = ((const gopher_file_t *)gf)->fsize;
+	if (fsize < prog->last)
+		prog->monotonic = 0;
+	prog->last = fsize;
+	prog->calls++;
+}
+
+/**
+ * Receives a finished download from the multi request engine.
+ *
+ * @param gf  Gopher file download object.
+ * @param err Error code of the download.
+ * @param arg Returns the error code.
+ */
+static void multi_done(gopher_file_t *gf, int err, void *arg) {
+	*((int *)arg) = err;
+}
@@ -0,0 +1,205 @@
+/**
+ * 16_progress.c
+ * Tests the throttled progress reports of file downloads.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tap.h>
+#include <unistd.h>
+
+#include "gopher.h"
+#include "server.h"
+
+/* Private definitions. */
+#define FILE_SIZE   (4 * 1024 * 1024)
+#define MIN_BYTES   (2 * 1024 * 1024)
+#define MIN_MS      100
+#define SERVER_HOLD 1
+#define IDLE        200
+typedef struct {
+	size_t reports;
+	size_t finals;
+	size_t transfers;
+	size_t last_fsize;
+	unsigned long last_elapsed;
+	int bytes_spaced;
+	int time_spaced;
+	int final_last;
+	double avg_rate;
+} reports_t;
+static int test_download(uint16_t port, const char *path, size_t min_bytes,
+						 unsigned long min_ms, long idle, reports_t *rep);
+static void progress_cb(const gopher_file_t *gf,
+						const gopher_file_progress_t *prog, void *arg);
+static void transfer_cb(const void *gf, void *arg);
+static void multi_done(gopher_file_t *gf, int err, void *arg);
+
+/**
+ * Gets the number of planned tests.
+ *
+ * @return Number of planned tests.
+ */
+int t_progress_plan(void) {
+	return 13;
+}
+
+/**
+ * Runs unit tests.
+ */
+void t_progress_run(void) {
+	gopher_multi_t *multi;
+	gopher_addr_t *addr;
+	gopher_file_t *gf;
+	reports_t rep;
+	uint16_t port;
+	char path[64];
+	char *data;
+	pid_t pid;
+	int ret;
+
+	data = (char *)malloc(FILE_SIZE);
+	memset(data, 'x', FILE_SIZE);
+	sprintf(path, "/tmp/gopher_progress_%d", (int)getpid());
+
+	/* Reports throttled by the number of bytes. */
+	printf("#\n# Progress reports throttled by bytes\n");
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	ret = test_download(port, path, MIN_BYTES, 0, 0, &rep);
+	ok(ret == 0, "file downloaded");
+	ok(rep.bytes_spaced, "reports at least %d bytes apart", MIN_BYTES);
+	cmp_ok(rep.reports, "<=", (FILE_SIZE / MIN_BYTES) + 1,
+		   "callback called only a handful of times");
+	ok((rep.finals == 1) && rep.final_last, "single final report at the end");
+	cmp_ok(rep.last_fsize, "==", FILE_SIZE, "final report has the entire file");
+	cmp_ok(rep.transfers, ">", rep.reports,
+		   "transfer callback still hears about every read");
+	tserver_stop(pid);
+
+	/* Reports throttled by time. */
+	printf("#\n# Progress reports throttled by time\n");
+	pid = tserver_start(&port, data, FILE_SIZE, SERVER_HOLD);
+	ret = test_download(port, path, 0, MIN_MS, IDLE, &rep);
+	cmp_ok(ret, "==", GOPHER_ERR_IDLE_TIMEOUT, "download failed on purpose");
+	ok(rep.time_spaced, "reports at least %d ms apart", MIN_MS);
+	ok((rep.finals == 1) && rep.final_last,
+	   "final report made even though the download failed");
+	ok((rep.avg_rate > 0) && (rep.avg_rate < (FILE_SIZE * 1000.0 / IDLE)),
+	   "average rate accounts for the whole download");
+	tserver_stop(pid);
+
+	/* Final report from the multi request engine. */
+	printf("#\n# Progress reports from the multi request engine\n");
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	memset(&rep, 0, sizeof(reports_t));
+	multi = gopher_multi_new(GOPHER_MULTI_AUTO);
+	addr = gopher_addr_new("127.0.0.1", port, "/file", GOPHER_TYPE_BINARY);
+	gf = gopher_file_new(addr, path, GOPHER_TYPE_BINARY);
+	gopher_file_set_progress_cb(gf, progress_cb, &rep, MIN_BYTES, 0);
+	ret = -1;
+	ok(gopher_multi_add_file(multi, gf, multi_done, &ret) == 0,
+	   "transfer added");
+	gopher_multi_run(multi);
+	ok((ret == 0) && (rep.finals == 1) && rep.final_last,
+	   "single final report at the end");
+	cmp_ok(rep.last_fsize, "==", FILE_SIZE, "final report has the entire file");
+	gopher_multi_free(multi);
+	gopher_file_free(gf);
+	gopher_addr_free(addr);
+	tserver_stop(pid);
+
+	unlink(path);
+	free(data);
+}
+
+/**
+ * Downloads a file from the test server keeping track of its reports.
+ *
+ * @param port      Port of the test server.
+ * @param path      Path to download the file to.
+ * @param min_bytes Minimum number of bytes in between progress reports.
+ * @param min_ms    Minimum number of milliseconds in between progress reports.
+ * @param idle      Idle deadline in milliseconds. 0 to disable it.
+ * @param rep       Returns the reports that were made.
+ *
+ * @return Return value of gopher_file_download().
+ */
+static int test_download(uint16_t port, const char *path, size_t min_bytes,
+						 unsigned long min_ms, long idle, reports_t *rep) {
+	gopher_addr_t *addr;
+	gopher_file_t *gf;
+	int ret;
+
+	memset(rep, 0, sizeof(reports_t));
+	rep->bytes_spaced = 1;
+	rep->time_spaced = 1;
+
+	addr = gopher_addr_new("127.0.0.1", port, "/file", GOPHER_TYPE_BINARY);
+	addr->timeouts.idle = idle;
+	ret = gopher_connect(addr);
+	if (ret != 0) {
+		gopher_addr_free(addr);
+		return ret;
+	}
+
+	gf = gopher_file_new(addr, path, GOPHER_TYPE_BINARY);
+	gopher_file_set_transfer_cb(gf, transfer_cb, rep);
+	gopher_file_set_progress_cb(gf, progress_cb, rep, min_bytes, min_ms);
+	ret = gopher_file_download(gf);
+	gopher_disconnect(addr);
+	gopher_file_free(gf);
+	gopher_addr_free(addr);
+
+	return ret;
+}
+
+/**
+ * Keeps track of the progress reports of a download.
+ *
+ * @param gf   Gopher file download object.
+ * @param prog Progress of the download.
+ * @param arg  Reports tracking structure.
+ */
+static void progress_cb(const gopher_file_t *gf,
+						const gopher_file_progress_t *prog, void *arg) {
+	reports_t *rep;
+
+	rep = (reports_t *)arg;
+	rep->reports++;
+	rep->final_last = prog->finished;
+	if (prog->finished) {
+		rep->finals++;
+	} else {
+		if ((prog->fsize - rep->last_fsize) < MIN_BYTES)
+			rep->bytes_spaced = 0;
+		if ((prog->elapsed - rep->last_elapsed) < MIN_MS)
+			rep->time_spaced = 0;
+	}
+	rep->last_fsize = prog->fsize;
+	rep->last_elapsed = prog->elapsed;
+	rep->avg_rate = prog->avg_rate;
+}
+
+/**
+ * Counts the calls to the transfer callback of a download.
+ *
+ * @param gf  Gopher file download object.
+ * @param arg Reports tracking structure.
+ */
+static void transfer_cb(const void *gf, void *arg) {
+	((reports_t *)arg)->transfers++;
+}
+
+/**
+ * Receives a finished download from the multi request engine.
+ *
+ * @param gf  Gopher file download object.
+ * @param err Error code of the download.
+ * @param arg Returns the error code.
+ */
+static void multi_done(gopher_file_t *gf, int err, void *arg) {
+	*((int *)arg) = err;
+}
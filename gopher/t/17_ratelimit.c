@@ -0,0 +1,190 @@
+/**
+ * 17_ratelimit.c
+ * Tests the bandwidth caps of transfers.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <tap.h>
+#include <unistd.h>
+
+#include "gopher.h"
+#include "server.h"
+
+/* Private definitions. */
+#define FILE_SIZE  (512 * 1024)
+#define RATE       (1024 * 1024)
+#define SLOW_RATE  (32 * 1024)
+#define PACED_TIME 0.2
+#define FAST_TIME  2.0
+#define IDLE       150
+#define TOTAL      300
+static int test_download(uint16_t port, const char *path, int flags,
+						 unsigned long rate, long idle, long total,
+						 gopher_file_transfer_func func, size_t *fsize,
+						 double *elapsed);
+static void lift_cap(const void *gf, void *arg);
+
+/**
+ * Gets the number of planned tests.
+ *
+ * @return Number of planned tests.
+ */
+int t_ratelimit_plan(void) {
+	return 10;
+}
+
+/**
+ * Runs unit tests.
+ */
+void t_ratelimit_run(void) {
+	double elapsed;
+	uint16_t port;
+	char path[64];
+	size_t fsize;
+	char *data;
+	pid_t pid;
+	int ret;
+
+	data = (char *)malloc(FILE_SIZE);
+	memset(data, 'x', FILE_SIZE);
+	sprintf(path, "/tmp/gopher_ratelimit_%d", (int)getpid());
+
+	/* Cap of a single transfer. */
+	printf("#\n# Bandwidth cap of a single transfer\n");
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	ret = test_download(port, path, GOPHER_FLAG_NONE, RATE, 0, 0, NULL,
+		&fsize, &elapsed);
+	ok((ret == 0) && (fsize == FILE_SIZE), "file downloaded");
+	ok(elapsed >= PACED_TIME, "download paced to its cap (%.3fs)", elapsed);
+	tserver_stop(pid);
+
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	ret = test_download(port, NULL, GOPHER_FLAG_NONE, RATE, 0, 0, NULL,
+		&fsize, &elapsed);
+	ok((ret == 0) && (fsize == FILE_SIZE), "file downloaded to memory");
+	ok(elapsed >= PACED_TIME, "download to memory paced to its cap (%.3fs)",
+	   elapsed);
+	tserver_stop(pid);
+
+	/* Cap shared by background transfers. */
+	printf("#\n# Bandwidth cap shared by background transfers\n");
+	gopher_rate_limit(RATE, 0);
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	ret = test_download(port, path, GOPHER_FLAG_BACKGROUND, 0, 0, 0, NULL,
+		&fsize, &elapsed);
+	ok((ret == 0) && (elapsed >= PACED_TIME),
+	   "background download paced to the shared cap (%.3fs)", elapsed);
+	tserver_stop(pid);
+
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	ret = test_download(port, path, GOPHER_FLAG_NONE, 0, 0, 0, NULL,
+		&fsize, &elapsed);
+	ok((ret == 0) && (elapsed < PACED_TIME),
+	   "interactive download left alone (%.3fs)", elapsed);
+	tserver_stop(pid);
+	gopher_rate_limit(0, 0);
+
+	/* Changing the cap while the transfer is under way. */
+	printf("#\n# Bandwidth cap changed during a transfer\n");
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	ret = test_download(port, path, GOPHER_FLAG_NONE, SLOW_RATE, 0, 0,
+		lift_cap, &fsize, &elapsed);
+	ok((ret == 0) && (fsize == FILE_SIZE), "file downloaded");
+	ok(elapsed < FAST_TIME, "lifting the cap sped it up (%.3fs)", elapsed);
+	tserver_stop(pid);
+
+	/* Deadlines while being held back. */
+	printf("#\n# Deadlines of a paced transfer\n");
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	ret = test_download(port, path, GOPHER_FLAG_NONE, RATE / 2, IDLE, 0, NULL,
+		&fsize, &elapsed);
+	ok((ret == 0) && (fsize == FILE_SIZE),
+	   "holding back doesn't trip the idle deadline");
+	tserver_stop(pid);
+
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	ret = test_download(port, path, GOPHER_FLAG_NONE, SLOW_RATE, 0, TOTAL,
+		NULL, &fsize, &elapsed);
+	ok((ret == GOPHER_ERR_TOTAL_TIMEOUT) && (elapsed < FAST_TIME),
+	   "total deadline honored while holding back (%.3fs)", elapsed);
+	tserver_stop(pid);
+
+	unlink(path);
+	free(data);
+}
+
+/**
+ * Downloads a file from the test server timing how long it took.
+ *
+ * @param port    Port of the test server.
+ * @param path    Path to download the file to, or NULL to keep it in memory.
+ * @param flags   Connection flags to use.
+ * @param rate    Bandwidth cap of the transfer, 0 to disable it.
+ * @param idle    Idle deadline in milliseconds. 0 to disable it.
+ * @param total   Total deadline in milliseconds. 0 to disable it.
+ * @param func    Optional. Transfer callback that gets the address object.
+ * @param fsize   Returns the number of bytes downloaded.
+ * @param elapsed Returns the number of seconds the download took.
+ *
+ * @return Return value of gopher_file_download().
+ */
+static int test_download(uint16_t port, const char *path, int flags,
+						 unsigned long rate, long idle, long total,
+						 gopher_file_transfer_func func, size_t *fsize,
+						 double *elapsed) {
+	struct timeval start;
+	struct timeval now;
+	gopher_addr_t *addr;
+	gopher_file_t *gf;
+	int ret;
+
+	*fsize = 0;
+	*elapsed = 0;
+	gettimeofday(&start, NULL);
+
+	addr = gopher_addr_new("127.0.0.1", port, "/file", GOPHER_TYPE_BINARY);
+	addr->flags = flags;
+	addr->rate_limit = rate;
+	addr->timeouts.idle = idle;
+	addr->timeouts.total = total;
+	ret = gopher_connect(addr);
+	if (ret != 0) {
+		gopher_addr_free(addr);
+		return ret;
+	}
+
+	if (path == NULL) {
+		gf = gopher_file_new_mem(addr, 0, FILE_SIZE);
+	} else {
+		gf = gopher_file_new(addr, path, GOPHER_TYPE_BINARY);
+	}
+	if (func != NULL)
+		gopher_file_set_transfer_cb(gf, func, addr);
+	ret = gopher_file_download(gf);
+	*fsize = gf->fsize;
+
+	gettimeofday(&now, NULL);
+	*elapsed = (now.tv_sec - start.tv_sec) +
+		((now.tv_usec - start.tv_usec) / 1000000.0);
+
+	gopher_disconnect(addr);
+	gopher_file_free(gf);
+	gopher_addr_free(addr);
+
+	return ret;
+}
+
+/**
+ * Lifts the bandwidth cap of a transfer as soon as it gets going.
+ *
+ * @param gf  Gopher file download object.
+ * @param arg Gopherspace address object of the transfer.
+ */
+static void lift_cap(const void *gf, void *arg) {
+	((gopher_addr_t *)arg)->rate_limit = 0;
+}
@@ -0,0 +1,289 @@
+/**
+ * 18_cancel.c
+ * Tests the cancellation of requests that are under way.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <tap.h>
+#include <unistd.h>
+
+#include "gopher.h"
+#include "server.h"
+
+/* Private definitions. */
+#define FAKE_HOST    "cancel.test"
+#define FILE_SIZE    (4 * 1024 * 1024)
+#define SERVER_HOLD  3
+#define CANCEL_AFTER 100
+#define PROMPT_TIME  1.0
+#define SLOW_RATE    (64 * 1024)
+typedef struct {
+	gopher_cancel_t *cancel;
+	unsigned int msecs;
+	pthread_t thread;
+} canceller_t;
+static void canceller_start(canceller_t *c, gopher_cancel_t *cancel,
+							unsigned int msecs);
+static void *canceller_run(void *arg);
+static int test_download(uint16_t port, gopher_cancel_t *cancel,
+						 unsigned long rate, gopher_file_transfer_func func,
+						 size_t *fsize, double *elapsed);
+static void cancel_cb(const void *gf, void *arg);
+static double elapsed_since(const struct timeval *start);
+
+/**
+ * Gets the number of planned tests.
+ *
+ * @return Number of planned tests.
+ */
+int t_cancel_plan(void) {
+	return 13;
+}
+
+/**
+ * Runs unit tests.
+ */
+void t_cancel_run(void) {
+	gopher_cancel_t *cancel;
+	struct timeval start;
+	tresolver_addr_t fake;
+	gopher_addr_t *addr;
+	gopher_dir_t *dir;
+	canceller_t c;
+	double elapsed;
+	uint16_t port;
+	size_t fsize;
+	size_t len;
+	char *menu;
+	char *data;
+	pid_t pid;
+	int ret;
+
+	data = (char *)malloc(FILE_SIZE);
+	memset(data, 'x', FILE_SIZE);
+
+	/* Token itself. */
+	printf("#\n# Cancellation tokens\n");
+	cancel = gopher_cancel_new();
+	ok((cancel != NULL) && !gopher_cancel_triggered(cancel),
+	   "token starts out untriggered");
+	gopher_cancel_trigger(cancel);
+	gopher_cancel_trigger(cancel);
+	ok(gopher_cancel_triggered(cancel), "token triggered");
+	gopher_cancel_reset(cancel);
+	ok(!gopher_cancel_triggered(cancel), "token rearmed");
+	ok(strcmp(gopher_strerror(GOPHER_ERR_CANCELLED),
+			  gopher_strerror(GOPHER_ERR_TOTAL_TIMEOUT)) != 0,
+	   "cancellation has its own status");
+
+	/* Connecting with a token that was already triggered. */
+	printf("#\n# Connecting after being cancelled\n");
+	gopher_cancel_trigger(cancel);
+	addr = gopher_addr_new("127.0.0.1", 70, "/", GOPHER_TYPE_DIR);
+	addr->cancel = cancel;
+	cmp_ok(gopher_connect(addr), "==", GOPHER_ERR_CANCELLED,
+		   "connection never attempted");
+	gopher_addr_free(addr);
+	gopher_cancel_reset(cancel);
+
+	/* Name resolution that takes forever. */
+	printf("#\n# Cancelling a slow name resolution\n");
+	fake.ip = "127.0.0.1";
+	fake.port = 70;
+	gopher_dns_cache_flush();
+	tresolver_fake(FAKE_HOST, &fake, 1);
+	tresolver_delay(SERVER_HOLD * 1000);
+	addr = gopher_addr_new(FAKE_HOST, 70, "/", GOPHER_TYPE_DIR);
+	addr->flags = GOPHER_FLAG_NOPOOL;
+	addr->cancel = cancel;
+	gettimeofday(&start, NULL);
+	canceller_start(&c, cancel, CANCEL_AFTER);
+	ret = gopher_connect(addr);
+	elapsed = elapsed_since(&start);
+	pthread_join(c.thread, NULL);
+	ok((ret == GOPHER_ERR_CANCELLED) && (elapsed < PROMPT_TIME),
+	   "lookup given up on promptly (%.3fs)", elapsed);
+	gopher_addr_free(addr);
+	gopher_cancel_reset(cancel);
+	tresolver_delay(0);
+	tresolver_fake(NULL, NULL, 0);
+
+	/* Directory request from a server that stalls mid-menu. */
+	printf("#\n# Cancelling a stalled directory request\n");
+	menu = tserver_menu(10, 0, &len);
+	pid = tserver_start(&port, menu, len, SERVER_HOLD);
+	addr = gopher_addr_new("127.0.0.1", port, "/", GOPHER_TYPE_DIR);
+	addr->cancel = cancel;
+	dir = NULL;
+	ret = gopher_connect(addr);
+	gettimeofday(&start, NULL);
+	canceller_start(&c, cancel, CANCEL_AFTER);
+	if (ret == 0)
+		ret = gopher_dir_request(addr, &dir);
+	elapsed = elapsed_since(&start);
+	pthread_join(c.thread, NULL);
+	cmp_ok(ret, "==", GOPHER_ERR_CANCELLED, "request cancelled");
+	ok(elapsed < PROMPT_TIME, "blocked receive interrupted promptly (%.3fs)",
+	   elapsed);
+	gopher_disconnect(addr);
+	if (dir) {
+		gopher_dir_free(dir, RECURSE_NONE, 1);
+	} else {
+		gopher_addr_free(addr);
+	}
+	gopher_cancel_reset(cancel);
+	tserver_stop(pid);
+	free(menu);
+
+	/* Download from a server that stalls. */
+	printf("#\n# Cancelling a stalled download\n");
+	pid = tserver_start(&port, data, FILE_SIZE / 4, SERVER_HOLD);
+	canceller_start(&c, cancel, CANCEL_AFTER);
+	ret = test_download(port, cancel, 0, NULL, &fsize, &elapsed);
+	pthread_join(c.thread, NULL);
+	ok((ret == GOPHER_ERR_CANCELLED) && (elapsed < PROMPT_TIME),
+	   "download cancelled promptly (%.3fs)", elapsed);
+	cmp_ok(fsize, "==", FILE_SIZE / 4, "kept what arrived before stalling");
+	gopher_cancel_reset(cancel);
+	tserver_stop(pid);
+
+	/* Download cancelled by its own progress callback. */
+	printf("#\n# Cancelling a download from its callback\n");
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	ret = test_download(port, cancel, 0, cancel_cb, &fsize, &elapsed);
+	ok((ret == GOPHER_ERR_CANCELLED) && (fsize < FILE_SIZE),
+	   "download stopped early");
+	gopher_cancel_reset(cancel);
+	tserver_stop(pid);
+
+	/* Download being held back by its bandwidth cap. */
+	printf("#\n# Cancelling a paced download\n");
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	canceller_start(&c, cancel, CANCEL_AFTER);
+	ret = test_download(port, cancel, SLOW_RATE, NULL, &fsize, &elapsed);
+	pthread_join(c.thread, NULL);
+	ok((ret == GOPHER_ERR_CANCELLED) && (elapsed < PROMPT_TIME),
+	   "paced download cancelled promptly (%.3fs)", elapsed);
+	gopher_cancel_reset(cancel);
+	tserver_stop(pid);
+
+	/* Reusing a token that was rearmed. */
+	printf("#\n# Reusing a rearmed token\n");
+	pid = tserver_start(&port, data, FILE_SIZE, 0);
+	ret = test_download(port, cancel, 0, NULL, &fsize, &elapsed);
+	ok((ret == 0) && (fsize == FILE_SIZE), "download completed");
+	tserver_stop(pid);
+
+	gopher_cancel_free(cancel);
+	free(data);
+}
+
+/**
+ * Starts a thread that triggers a cancellation token after a while.
+ *
+ * @param c      Canceller to be populated. Join its thread when done.
+ * @param cancel Cancellation token to be triggered.
+ * @param msecs  Number of milliseconds to wait before triggering it.
+ */
+static void canceller_start(canceller_t *c, gopher_cancel_t *cancel,
+							unsigned int msecs) {
+	c->cancel = cancel;
+	c->msecs = msecs;
+	pthread_create(&c->thread, NULL, canceller_run, c);
+}
+
+/**
+ * Triggers a cancellation token after a while. Meant to be run on its own
+ * thread.
+ *
+ * @param arg Canceller.
+ *
+ * @return Always NULL.
+ */
+static void *canceller_run(void *arg) {
+	canceller_t *c;
+
+	c = (canceller_t *)arg;
+	usleep(c->msecs * 1000);
+	gopher_cancel_trigger(c->cancel);
+
+	return NULL;
+}
+
+/**
+ * Downloads a file from the test server to memory timing how long it took.
+ *
+ * @param port    Port of the test server.
+ * @param cancel  Cancellation token of the transfer.
+ * @param rate    Bandwidth cap of the transfer, 0 to disable it.
+ * @param func    Optional. Transfer callback that gets the cancellation token.
+ * @param fsize   Returns the number of bytes downloaded.
+ * @param elapsed Returns the number of seconds the download took.
+ *
+ * @return Return value of gopher_file_download().
+ */
+static int test_download(uint16_t port, gopher_cancel_t *cancel,
+						 unsigned long rate, gopher_file_transfer_func func,
+						 size_t *fsize, double *elapsed) {
+	struct timeval start;
+	gopher_addr_t *addr;
+	gopher_file_t *gf;
+	int ret;
+
+	*fsize = 0;
+	*elapsed = 0;
+	gettimeofday(&start, NULL);
+
+	addr = gopher_addr_new("127.0.0.1", port, "/file", GOPHER_TYPE_BINARY);
+	addr->cancel = cancel;
+	addr->rate_limit = rate;
+	ret = gopher_connect(addr);
+	if (ret != 0) {
+		gopher_addr_free(addr);
+		return ret;
+	}
+
+	gf = gopher_file_new_mem(addr, 0, FILE_SIZE);
+	if (func != NULL)
+		gopher_file_set_transfer_cb(gf, func, cancel);
+	ret = gopher_file_download(gf);
+	*fsize = gf->fsize;
+	*elapsed = elapsed_since(&start);
+
+	gopher_disconnect(addr);
+	gopher_file_free(gf);
+	gopher_addr_free(addr);
+
+	return ret;
+}
+
+/**
+ * Cancels a transfer as soon as it gets going.
+ *
+ * @param gf  Gopher file download object.
+ * @param arg Cancellation token of the transfer.
+ */
+static void cancel_cb(const void *gf, void *arg) {
+	gopher_cancel_trigger((gopher_cancel_t *)arg);
+}
+
+/**
+ * Calculates the time elapsed since a reference point.
+ *
+ * @param start Reference point in time.
+ *
+ * @return Number of seconds elapsed.
+ */
+static double elapsed_since(const struct timeval *start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+		((now.tv_usec - start->tv_usec) / 1000000.0);
+}
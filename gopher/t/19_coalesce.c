@@ -0,0 +1,242 @@
+/**
+ * 19_coalesce.c
+ * Tests the coalescing of identical directory fetches.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <tap.h>
+#include <unistd.h>
+
+#include "gopher.h"
+#include "server.h"
+
+/* Private definitions. */
+#define FETCHERS     4
+#define MENU_LINES   10
+#define SERVER_HOLD  1
+#define STAGGER      50
+#define TOTAL        3000
+#define CANCEL_AFTER 100
+#define PROMPT_TIME  0.5
+typedef struct {
+	const char *host;
+	uint16_t port;
+	gopher_type_t type;
+	gopher_cancel_t *cancel;
+	unsigned int delay;
+
+	gopher_dir_t *dir;
+	int ret;
+	double elapsed;
+	pthread_t thread;
+} fetcher_t;
+static void fetcher_start(fetcher_t *f, const char *host, uint16_t port,
+						  gopher_type_t type, gopher_cancel_t *cancel,
+						  unsigned int delay);
+static void *fetcher_run(void *arg);
+static double elapsed_since(const struct timeval *start);
+
+/**
+ * Gets the number of planned tests.
+ *
+ * @return Number of planned tests.
+ */
+int t_coalesce_plan(void) {
+	return 11;
+}
+
+/**
+ * Runs unit tests.
+ */
+void t_coalesce_run(void) {
+	gopher_fetch_stats_t before;
+	gopher_fetch_stats_t after;
+	fetcher_t f[FETCHERS];
+	gopher_cancel_t *cancel;
+	gopher_addr_t *addr;
+	gopher_dir_t *dir;
+	uint16_t port;
+	size_t len;
+	char *menu;
+	pid_t pid;
+	int same;
+	int ret;
+	int i;
+
+	menu = tserver_menu(MENU_LINES, 0, &len);
+
+	/* Identical fetches at the same time. The server only answers once. */
+	printf("#\n# Identical fetches at the same time\n");
+	pid = tserver_start(&port, menu, len, SERVER_HOLD);
+	gopher_dir_fetch_stats(&before);
+	for (i = 0; i < FETCHERS; i++) {
+		fetcher_start(&f[i], "127.0.0.1", port, GOPHER_TYPE_DIR, NULL,
+			i * STAGGER);
+	}
+	for (i = 0; i < FETCHERS; i++)
+		pthread_join(f[i].thread, NULL);
+	gopher_dir_fetch_stats(&after);
+	same = 1;
+	for (i = 0; i < FETCHERS; i++) {
+		if ((f[i].ret != 0) || (f[i].dir != f[0].dir))
+			same = 0;
+	}
+	ok(same, "everyone got the same directory");
+	ok((f[0].dir != NULL) && (f[0].dir->items_len == MENU_LINES),
+	   "directory has every item");
+	cmp_ok(after.fetches - before.fetches, "==", 1, "fetched only once");
+	cmp_ok(after.joined - before.joined, "==", FETCHERS - 1,
+		   "others joined the fetch");
+	for (i = 0; i < FETCHERS - 1; i++)
+		gopher_dir_release(f[i].dir);
+	gopher_dir_fetch_stats(&after);
+	ok((after.shared == 1) && (f[FETCHERS - 1].dir->items_len == MENU_LINES),
+	   "directory kept alive until its last release");
+	gopher_dir_release(f[FETCHERS - 1].dir);
+	gopher_dir_fetch_stats(&after);
+	cmp_ok(after.shared, "==", 0, "directory free'd after its last release");
+	tserver_stop(pid);
+
+	/* URLs that only differ in ways that don't matter. */
+	printf("#\n# Equivalent URLs\n");
+	gopher_dns_override("coalesce.test", "127.0.0.1");
+	gopher_dns_override("Coalesce.TEST", "127.0.0.1");
+	pid = tserver_start(&port, menu, len, SERVER_HOLD);
+	gopher_dir_fetch_stats(&before);
+	fetcher_start(&f[0], "coalesce.test", port, GOPHER_TYPE_DIR, NULL, 0);
+	fetcher_start(&f[1], "Coalesce.TEST", port, GOPHER_TYPE_TEXT, NULL,
+		STAGGER);
+	pthread_join(f[0].thread, NULL);
+	pthread_join(f[1].thread, NULL);
+	gopher_dir_fetch_stats(&after);
+	ok((f[0].ret == 0) && (f[1].ret == 0) && (f[0].dir == f[1].dir) &&
+	   (after.fetches - before.fetches == 1),
+	   "host case and item type don't matter");
+	gopher_dir_release(f[0].dir);
+	gopher_dir_release(f[1].dir);
+	tserver_stop(pid);
+	gopher_dns_override("coalesce.test", NULL);
+	gopher_dns_override("Coalesce.TEST", NULL);
+
+	/* Fetches that don't overlap aren't coalesced. */
+	printf("#\n# Fetches one after the other\n");
+	pid = tserver_start(&port, menu, len, 0);
+	gopher_dir_fetch_stats(&before);
+	fetcher_start(&f[0], "127.0.0.1", port, GOPHER_TYPE_DIR, NULL, 0);
+	pthread_join(f[0].thread, NULL);
+	gopher_dir_release(f[0].dir);
+	tserver_stop(pid);
+	pid = tserver_start(&port, menu, len, 0);
+	fetcher_start(&f[1], "127.0.0.1", port, GOPHER_TYPE_DIR, NULL, 0);
+	pthread_join(f[1].thread, NULL);
+	gopher_dir_release(f[1].dir);
+	gopher_dir_fetch_stats(&after);
+	ok((f[0].ret == 0) && (f[1].ret == 0) &&
+	   (after.fetches - before.fetches == 2) && (after.joined == before.joined),
+	   "each fetch went to the server");
+	tserver_stop(pid);
+
+	/* Fetch that fails. */
+	printf("#\n# Failed fetches\n");
+	pid = tserver_start(&port, menu, len, 0);
+	tserver_stop(pid);
+	addr = gopher_addr_new("127.0.0.1", port, "/", GOPHER_TYPE_DIR);
+	ret = gopher_dir_fetch(addr, &dir);
+	gopher_addr_free(addr);
+	gopher_dir_fetch_stats(&after);
+	ok((ret != 0) && (dir == NULL) && (after.shared == 0),
+	   "failed fetch leaves nothing behind");
+
+	/* Giving up on a fetch somebody else is doing. */
+	printf("#\n# Cancelling a joined fetch\n");
+	cancel = gopher_cancel_new();
+	pid = tserver_start(&port, menu, len, SERVER_HOLD);
+	fetcher_start(&f[0], "127.0.0.1", port, GOPHER_TYPE_DIR, NULL, 0);
+	fetcher_start(&f[1], "127.0.0.1", port, GOPHER_TYPE_DIR, cancel, STAGGER);
+	usleep((STAGGER + CANCEL_AFTER) * 1000);
+	gopher_cancel_trigger(cancel);
+	pthread_join(f[1].thread, NULL);
+	ok((f[1].ret == GOPHER_ERR_CANCELLED) && (f[1].elapsed < PROMPT_TIME),
+	   "gave up on waiting promptly (%.3fs)", f[1].elapsed);
+	pthread_join(f[0].thread, NULL);
+	ok((f[0].ret == 0) && (f[0].dir->items_len == MENU_LINES),
+	   "fetch carried on for everyone else");
+	gopher_dir_release(f[0].dir);
+	tserver_stop(pid);
+	gopher_cancel_free(cancel);
+
+	free(menu);
+}
+
+/**
+ * Starts a thread that fetches a directory from the test server.
+ *
+ * @param f      Fetcher to be populated. Join its thread when done.
+ * @param host   Host name of the test server.
+ * @param port   Port of the test server.
+ * @param type   Type of the address object used for the fetch.
+ * @param cancel Optional. Cancellation token of the fetch.
+ * @param delay  Number of milliseconds to wait before fetching.
+ */
+static void fetcher_start(fetcher_t *f, const char *host, uint16_t port,
+						  gopher_type_t type, gopher_cancel_t *cancel,
+						  unsigned int delay) {
+	f->host = host;
+	f->port = port;
+	f->type = type;
+	f->cancel = cancel;
+	f->delay = delay;
+	f->dir = NULL;
+	f->ret = -1;
+	f->elapsed = 0;
+	pthread_create(&f->thread, NULL, fetcher_run, f);
+}
+
+/**
+ * Fetches a directory timing how long it took. Meant to be run on its own
+ * thread.
+ *
+ * @param arg Fetcher.
+ *
+ * @return Always NULL.
+ */
+static void *fetcher_run(void *arg) {
+	struct timeval start;
+	gopher_addr_t *addr;
+	fetcher_t *f;
+
+	f = (fetcher_t *)arg;
+	usleep(f->delay * 1000);
+
+	addr = gopher_addr_new(f->host, f->port, "/", f->type);
+	addr->flags = GOPHER_FLAG_NOPOOL;
+	addr->timeouts.total = TOTAL;
+	addr->cancel = f->cancel;
+	gettimeofday(&start, NULL);
+	f->ret = gopher_dir_fetch(addr, &f->dir);
+	f->elapsed = elapsed_since(&start);
+	gopher_addr_free(addr);
+
+	return NULL;
+}
+
+/**
+ * Calculates the time elapsed since a reference point.
+ *
+ * @param start Reference point in time.
+ *
+ * @return Number of seconds elapsed.
+ */
+static double elapsed_since(const struct timeval *start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+		((now.tv_usec - start->tv_usec) / 1000000.0);
+}
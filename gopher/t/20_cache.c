@@ -0,0 +1,256 @@
+/**
+ * 20_cache.c
+ * Tests the in-memory response cache.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <tap.h>
+#include <unistd.h>
+
+#include "gopher.h"
+#include "server.h"
+
+/* Private definitions. */
+#define MAX_BYTES   (64 * 1024)
+#define MAX_ENTRY   (16 * 1024)
+#define TTL         5000
+#define SHORT_TTL   100
+#define STALE       5000
+#define MENU_LINES  10
+#define FRESH_LINES 5
+#define TEXT        "Hello, Gopherspace!\r\n.\r\n"
+#define BIG_TEXT    (32 * 1024)
+#define PROMPT_TIME 0.2
+#define REFRESH_MAX 40
+#define REFRESH_MS  50
+#define CONNECT     500
+static int fetch_dir(uint16_t port, const char *selector, int flags,
+					 unsigned long ttl, gopher_dir_t **dir, double *elapsed);
+static int fetch_text(uint16_t port, char **text, size_t *len);
+
+/**
+ * Gets the number of planned tests.
+ *
+ * @return Number of planned tests.
+ */
+int t_cache_plan(void) {
+	return 17;
+}
+
+/**
+ * Runs unit tests.
+ */
+void t_cache_run(void) {
+	gopher_cache_stats_t before;
+	gopher_cache_stats_t after;
+	gopher_fetch_stats_t fstats;
+	gopher_dir_t *first;
+	gopher_dir_t *dir;
+	double elapsed;
+	uint16_t ports[3];
+	uint16_t port;
+	size_t menu_len;
+	size_t one;
+	size_t len;
+	char *fresh;
+	char *menu;
+	char *big;
+	char *text;
+	pid_t pid;
+	int ret;
+	int i;
+
+	menu = tserver_menu(MENU_LINES, 1, &menu_len);
+	big = (char *)malloc(BIG_TEXT);
+	memset(big, 'x', BIG_TEXT);
+	gopher_cache_limits(MAX_BYTES, MAX_ENTRY);
+	gopher_cache_ttl(TTL, 0);
+
+	/* Menus served from the cache once the server is gone. */
+	printf("#\n# Cached menus\n");
+	gopher_cache_stats(&before);
+	pid = tserver_start(&port, menu, menu_len, 0);
+	ret = fetch_dir(port, "/", GOPHER_FLAG_NONE, 0, &first, &elapsed);
+	tserver_stop(pid);
+	ok((ret == 0) && (first->items_len == MENU_LINES), "menu fetched");
+	ret = fetch_dir(port, "/", GOPHER_FLAG_NONE, 0, &dir, &elapsed);
+	ok((ret == 0) && (dir == first), "menu served from the cache");
+	gopher_cache_stats(&after);
+	ok((after.hits - before.hits == 1) && (after.misses - before.misses == 1),
+	   "hit and miss counted");
+	ok((after.entries == 1) && (after.bytes > 0) &&
+	   (after.max_bytes == MAX_BYTES), "memory use accounted for");
+	gopher_dir_release(first);
+	gopher_dir_release(dir);
+	gopher_dir_fetch_stats(&fstats);
+	cmp_ok(fstats.shared, "==", 1, "cache holds on to the menu");
+	ret = fetch_dir(port, "/", GOPHER_FLAG_NOCACHE, 0, &dir, &elapsed);
+	ok(ret != 0, "cache can be bypassed");
+
+	/* Small documents. */
+	printf("#\n# Cached documents\n");
+	pid = tserver_start(&port, TEXT, strlen(TEXT), 0);
+	ret = fetch_text(port, &text, &len);
+	tserver_stop(pid);
+	ok((ret == 0) && (len == strlen(TEXT)) && (strcmp(text, TEXT) == 0),
+	   "document fetched");
+	free(text);
+	ret = fetch_text(port, &text, &len);
+	ok((ret == 0) && (strcmp(text, TEXT) == 0),
+	   "document served from the cache");
+	free(text);
+
+	pid = tserver_start(&port, big, BIG_TEXT, 0);
+	ret = fetch_text(port, &text, &len);
+	tserver_stop(pid);
+	ok((ret == 0) && (len == BIG_TEXT), "large document fetched");
+	free(text);
+	text = NULL;
+	ok(fetch_text(port, &text, &len) != 0, "large document wasn't cached");
+	free(text);
+
+	/* Entries that expired. */
+	printf("#\n# Expired entries\n");
+	pid = tserver_start(&port, menu, menu_len, 0);
+	ret = fetch_dir(port, "/", GOPHER_FLAG_NONE, SHORT_TTL, &dir, &elapsed);
+	gopher_dir_release(dir);
+	tserver_stop(pid);
+	usleep(SHORT_TTL * 2 * 1000);
+	ok((ret == 0) && (fetch_dir(port, "/", GOPHER_FLAG_NONE, 0, &dir,
+	   &elapsed) != 0), "entry expired on its own lifetime");
+
+	/* Stale entries served while being refreshed. */
+	printf("#\n# Stale while revalidate\n");
+	gopher_cache_ttl(SHORT_TTL, STALE);
+	fresh = tserver_menu(FRESH_LINES, 1, &len);
+	pid = tserver_start(&port, menu, menu_len, 0);
+	fetch_dir(port, "/", GOPHER_FLAG_NONE, 0, &dir, &elapsed);
+	gopher_dir_release(dir);
+	tserver_stop(pid);
+	usleep(SHORT_TTL * 2 * 1000);
+	gopher_cache_stats(&before);
+	pid = tserver_start_at(port, fresh, len, 0);
+	ret = fetch_dir(port, "/", GOPHER_FLAG_NONE, 0, &dir, &elapsed);
+	ok((ret == 0) && (dir->items_len == MENU_LINES) &&
+	   (elapsed < PROMPT_TIME), "stale menu served right away (%.3fs)",
+	   elapsed);
+	gopher_dir_release(dir);
+	for (i = 0, ret = -1; (ret != 0) && (i < REFRESH_MAX); i++) {
+		usleep(REFRESH_MS * 1000);
+		ret = fetch_dir(port, "/", GOPHER_FLAG_NONE, 0, &dir, &elapsed);
+		if ((ret == 0) && (dir->items_len != FRESH_LINES))
+			ret = -1;
+		if (dir != NULL)
+			gopher_dir_release(dir);
+	}
+	ok(ret == 0, "menu refreshed in the background");
+	gopher_cache_stats(&after);
+	ok((after.stale_hits > before.stale_hits) &&
+	   (after.refreshes - before.refreshes == 1), "refreshed only once");
+	tserver_stop(pid);
+	free(fresh);
+	gopher_cache_ttl(TTL, 0);
+
+	/* Least recently used entries get evicted. */
+	printf("#\n# Eviction\n");
+	gopher_cache_flush();
+	for (i = 0; i < 3; i++) {
+		pid = tserver_start(&ports[i], menu, menu_len, 0);
+		fetch_dir(ports[i], "/", GOPHER_FLAG_NONE, 0, &dir, &elapsed);
+		gopher_dir_release(dir);
+		tserver_stop(pid);
+
+		/* Make room for just two menus once we know how big they are. */
+		if (i == 0) {
+			gopher_cache_stats(&after);
+			one = after.bytes;
+			gopher_cache_limits(one * 2 + one / 2, MAX_ENTRY);
+		}
+
+		/* Use the first one so that the second one is the oldest. */
+		if (i == 1) {
+			fetch_dir(ports[0], "/", GOPHER_FLAG_NONE, 0, &dir, &elapsed);
+			gopher_dir_release(dir);
+		}
+	}
+	gopher_cache_stats(&after);
+	ok((after.entries == 2) && (after.bytes <= after.max_bytes) &&
+	   (after.evictions > before.evictions), "stayed within its budget");
+	ret = fetch_dir(ports[0], "/", GOPHER_FLAG_NONE, 0, &dir, &elapsed);
+	if (ret == 0)
+		gopher_dir_release(dir);
+	ok((ret == 0) &&
+	   (fetch_dir(ports[1], "/", GOPHER_FLAG_NONE, 0, &dir, &elapsed) != 0),
+	   "least recently used menu evicted");
+
+	/* Disabling the cache gets rid of everything. */
+	printf("#\n# Disabling the cache\n");
+	gopher_cache_limits(0, 0);
+	gopher_cache_stats(&after);
+	gopher_dir_fetch_stats(&fstats);
+	ok((after.entries == 0) && (after.bytes == 0) && (fstats.shared == 0),
+	   "every entry free'd");
+
+	free(big);
+	free(menu);
+}
+
+/**
+ * Fetches a directory from the test server timing how long it took.
+ *
+ * @param port     Port of the test server.
+ * @param selector Selector of the directory.
+ * @param flags    Connection flags to use.
+ * @param ttl      Lifetime of the cache entry, 0 for the default.
+ * @param dir      Returns the directory or NULL if it failed.
+ * @param elapsed  Returns the number of seconds the fetch took.
+ *
+ * @return Return value of gopher_dir_fetch().
+ */
+static int fetch_dir(uint16_t port, const char *selector, int flags,
+					 unsigned long ttl, gopher_dir_t **dir, double *elapsed) {
+	struct timeval start;
+	struct timeval now;
+	gopher_addr_t *addr;
+	int ret;
+
+	gettimeofday(&start, NULL);
+	addr = gopher_addr_new("127.0.0.1", port, selector, GOPHER_TYPE_DIR);
+	addr->flags = flags | GOPHER_FLAG_NOPOOL;
+	addr->cache_ttl = ttl;
+	addr->timeouts.connect = CONNECT;
+	ret = gopher_dir_fetch(addr, dir);
+	gopher_addr_free(addr);
+
+	gettimeofday(&now, NULL);
+	*elapsed = (now.tv_sec - start.tv_sec) +
+		((now.tv_usec - start.tv_usec) / 1000000.0);
+
+	return ret;
+}
+
+/**
+ * Fetches a text document from the test server.
+ *
+ * @param port Port of the test server.
+ * @param text Returns the document.
+ * @param len  Returns the size of the document.
+ *
+ * @return Return value of gopher_text_fetch().
+ */
+static int fetch_text(uint16_t port, char **text, size_t *len) {
+	gopher_addr_t *addr;
+	int ret;
+
+	addr = gopher_addr_new("127.0.0.1", port, "/file", GOPHER_TYPE_TEXT);
+	addr->flags = GOPHER_FLAG_NOPOOL;
+	ret = gopher_text_fetch(addr, text, len);
+	gopher_addr_free(addr);
+
+	return ret;
+}
@@ -0,0 +1,266 @@
+/**
+ * server.c
+ * Minimal local Gopher server used by the test suite.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include "server.h"
+
+/* Private definitions. */
+#define FAKE_ADDRS_MAX 4
+
+/* Fake resolver state. */
+static const char *fake_host = NULL;
+static tresolver_addr_t fake_addrs[FAKE_ADDRS_MAX];
+static int fake_count = 0;
+static unsigned int fake_lookups = 0;
+static unsigned int fake_delay = 0;
+static pid_t tserver_serve(int sockfd, const char *resp, size_t len, int hold);
+
+/**
+ * Builds a menu with a number of well formed directory lines.
+ *
+ * @warning This function dinamically allocates memory.
+ *
+ * @param lines   Number of lines in the menu.
+ * @param termdot Should the termination line be appended?
+ * @param len     Pointer to store the length of the menu.
+ *
+ * @return Newly allocated menu contents.
+ */
+char *tserver_menu(unsigned int lines, int termdot, size_t *len) {
+	unsigned int i;
+	char *menu;
+	char *p;
+
+	/* Build up the menu in a single buffer. */
+	menu = (char *)malloc((lines + 1) * 64);
+	p = menu;
+	for (i = 0; i < lines; i++)
+		p += sprintf(p, "1Item %u\t/sel/%u\tlocalhost\t70\r\n", i, i);
+	if (termdot)
+		p += sprintf(p, ".\r\n");
+	*len = p - menu;
+
+	return menu;
+}
+
+/**
+ * Forks a minimal Gopher server that answers a single request with a canned
+ * response.
+ *
+ * @param port Pointer to store the port the server is listening on.
+ * @param resp Response to be sent to the client.
+ * @param len  Length of the response.
+ * @param hold Number of seconds to hold the connection open after sending.
+ *
+ * @return PID of the server process or -1 in case of failure.
+ */
+pid_t tserver_start(uint16_t *port, const char *resp, size_t len, int hold) {
+	struct sockaddr_in sin;
+	socklen_t sin_len;
+	int sockfd;
+
+	/* Listen on a random loopback port. */
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = 0;
+	sin_len = sizeof(sin);
+	if ((bind(sockfd, (struct sockaddr *)&sin, sin_len) != 0) ||
+			(listen(sockfd, 1) != 0) ||
+			(getsockname(sockfd, (struct sockaddr *)&sin, &sin_len) != 0)) {
+		close(sockfd);
+		return -1;
+	}
+	*port = ntohs(sin.sin_port);
+
+	return tserver_serve(sockfd, resp, len, hold);
+}
+
+/**
+ * Forks a minimal Gopher server on a specific port, usually the one a server
+ * that was stopped was listening on.
+ *
+ * @param port Port to listen on.
+ * @param resp Response to be sent to the client.
+ * @param len  Length of the response.
+ * @param hold Number of seconds to hold the connection open after sending.
+ *
+ * @return PID of the server process or -1 in case of failure.
+ */
+pid_t tserver_start_at(uint16_t port, const char *resp, size_t len, int hold) {
+	struct sockaddr_in sin;
+	int sockfd;
+	int reuse;
+
+	/* Listen on the loopback port even if it was just used. */
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	reuse = 1;
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(port);
+	if ((bind(sockfd, (struct sockaddr *)&sin, sizeof(sin)) != 0) ||
+			(listen(sockfd, 1) != 0)) {
+		close(sockfd);
+		return -1;
+	}
+
+	return tserver_serve(sockfd, resp, len, hold);
+}
+
+/**
+ * Forks off a server process that answers a single request on a listening
+ * socket with a canned response.
+ *
+ * @param sockfd Listening socket.
+ * @param resp   Response to be sent to the client.
+ * @param len    Length of the response.
+ * @param hold   Number of seconds to hold the connection open after sending.
+ *
+ * @return PID of the server process.
+ */
+static pid_t tserver_serve(int sockfd, const char *resp, size_t len, int hold) {
+	char sel[256];
+	pid_t pid;
+	int fd;
+
+	/* Fork off the server. */
+	pid = fork();
+	if (pid != 0) {
+		close(sockfd);
+		return pid;
+	}
+
+	/* Serve a single request. */
+	fd = accept(sockfd, NULL, NULL);
+	recv(fd, sel, sizeof(sel), 0);
+	send(fd, resp, len, 0);
+
+	/* Be a slow server and take our time before closing the connection. */
+	if (hold)
+		sleep(hold);
+	close(fd);
+	close(sockfd);
+	_exit(0);
+}
+
+/**
+ * Stops a local test server.
+ *
+ * @param pid PID of the server process.
+ */
+void tserver_stop(pid_t pid) {
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+/**
+ * Makes a host name resolve to a set of loopback addresses, in order, without
+ * touching the system resolver.
+ *
+ * @param host  Host name to be faked. NULL stops faking.
+ * @param addrs Addresses the host should resolve to.
+ * @param count Number of addresses. 0 makes the host not exist.
+ */
+void tresolver_fake(const char *host, const tresolver_addr_t *addrs,
+					int count) {
+	int i;
+
+	fake_host = host;
+	fake_count = (count > FAKE_ADDRS_MAX) ? FAKE_ADDRS_MAX : count;
+	for (i = 0; i < fake_count; i++)
+		fake_addrs[i] = addrs[i];
+	fake_lookups = 0;
+}
+
+/**
+ * Gets the number of times the fake host was looked up.
+ *
+ * @return Number of lookups since the host was faked.
+ */
+unsigned int tresolver_lookups(void) {
+	return fake_lookups;
+}
+
+/**
+ * Makes lookups of the fake host take a while, like a slow name server would.
+ *
+ * @param msecs Number of milliseconds each lookup takes.
+ */
+void tresolver_delay(unsigned int msecs) {
+	fake_delay = msecs;
+}
+
+/*
+ * +===========================================================================+
+ * |                                                                           |
+ * |                          Name Resolution Wrapper                          |
+ * |                                                                           |
+ * +===========================================================================+
+ */
+
+int getaddrinfo(const char *node, const char *service,
+				const struct addrinfo *hints, struct addrinfo **res) {
+	static int (*real)(const char *, const char *, const struct addrinfo *,
+					   struct addrinfo **) = NULL;
+	struct addrinfo *tail;
+	struct addrinfo *ai;
+	char port[6];
+	int ret;
+	int i;
+
+	if (real == NULL)
+		*(void **)&real = dlsym(RTLD_NEXT, "getaddrinfo");
+	if ((node == NULL) || (fake_host == NULL) || (strcmp(node, fake_host) != 0))
+		return real(node, service, hints, res);
+
+	/* Host names are never numeric. */
+	if ((hints != NULL) && (hints->ai_flags & AI_NUMERICHOST))
+		return EAI_NONAME;
+
+	/* Take our time to answer. */
+	fake_lookups++;
+	if (fake_delay > 0)
+		usleep(fake_delay * 1000);
+
+	/* Pretend the host doesn't exist. */
+	*res = NULL;
+	if (fake_count == 0)
+		return EAI_NONAME;
+
+	/* Chain up the results of resolving each of our fake addresses. */
+	tail = NULL;
+	for (i = 0; i < fake_count; i++) {
+		sprintf(port, "%u", fake_addrs[i].port);
+		ret = real(fake_addrs[i].ip, port, hints, &ai);
+		if (ret != 0)
+			return ret;
+
+		if (tail == NULL) {
+			*res = ai;
+		} else {
+			tail->ai_next = ai;
+		}
+		for (tail = ai; tail->ai_next != NULL; tail = tail->ai_next)
+			;
+	}
+
+	return 0;
+}
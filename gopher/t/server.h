@@ -0,0 +1,30 @@
+/**
+ * server.h
+ * Minimal local Gopher server used by the test suite.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _TEST_SERVER_H_
+#define _TEST_SERVER_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Address handed out by the fake resolver. */
+typedef struct {
+	const char *ip;
+	uint16_t port;
+} tresolver_addr_t;
+
+char *tserver_menu(unsigned int lines, int termdot, size_t *len);
+pid_t tserver_start(uint16_t *port, const char *resp, size_t len, int hold);
+pid_t tserver_start_at(uint16_t port, const char *resp, size_t len, int hold);
+void tserver_stop(pid_t pid);
+void tresolver_fake(const char *host, const tresolver_addr_t *addrs,
+					int count);
+unsigned int tresolver_lookups(void);
+void tresolver_delay(unsigned int msecs);
+
+#endif /* _TEST_SERVER_H_ */
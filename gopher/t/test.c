@@ -12,17 +12,77 @@ extern int t_urlpar_plan(void);
 extern void t_urlpar_run(void);
 extern int t_urlgen_plan(void);
 extern void t_urlgen_run(void);
+extern int t_syscall_plan(void);
+extern void t_syscall_run(void);
+extern int t_arena_plan(void);
+extern void t_arena_run(void);
+extern int t_menu_plan(void);
+extern void t_menu_run(void);
+extern int t_parser_plan(void);
+extern void t_parser_run(void);
+extern int t_stream_plan(void);
+extern void t_stream_run(void);
+extern int t_multi_plan(void);
+extern void t_multi_run(void);
+extern int t_timeout_plan(void);
+extern void t_timeout_run(void);
+extern int t_eyeballs_plan(void);
+extern void t_eyeballs_run(void);
+extern int t_dnscache_plan(void);
+extern void t_dnscache_run(void);
+extern int t_resolver_plan(void);
+extern void t_resolver_run(void);
+extern int t_pool_plan(void);
+extern void t_pool_run(void);
+extern int t_sockprof_plan(void);
+extern void t_sockprof_run(void);
+extern int t_download_plan(void);
+extern void t_download_run(void);
+extern int t_progress_plan(void);
+extern void t_progress_run(void);
+extern int t_ratelimit_plan(void);
+extern void t_ratelimit_run(void);
+extern int t_cancel_plan(void);
+extern void t_cancel_run(void);
+extern int t_coalesce_plan(void);
+extern void t_coalesce_run(void);
+extern int t_cache_plan(void);
+extern void t_cache_run(void);
 
 /**
  * Unit testing program's main entry point.
  */
 int main() {
 	/* Setup the test harness. */
-	plan(t_urlpar_plan() + t_urlgen_plan());
+	plan(t_urlpar_plan() + t_urlgen_plan() + t_syscall_plan() +
+		 t_arena_plan() + t_menu_plan() + t_parser_plan() +
+		 t_stream_plan() + t_multi_plan() + t_timeout_plan() +
+		 t_eyeballs_plan() + t_dnscache_plan() + t_resolver_plan() +
+		 t_pool_plan() + t_sockprof_plan() + t_download_plan() +
+		 t_progress_plan() + t_ratelimit_plan() + t_cancel_plan() +
+		 t_coalesce_plan() + t_cache_plan());
 
 	/* Run tests in sequence. */
 	t_urlpar_run();
 	t_urlgen_run();
+	t_syscall_run();
+	t_arena_run();
+	t_menu_run();
+	t_parser_run();
+	t_stream_run();
+	t_multi_run();
+	t_timeout_run();
+	t_eyeballs_run();
+	t_dnscache_run();
+	t_resolver_run();
+	t_pool_run();
+	t_sockprof_run();
+	t_download_run();
+	t_progress_run();
+	t_ratelimit_run();
+	t_cancel_run();
+	t_coalesce_run();
+	t_cache_run();
 
 	/* Finish the tests. */
 	done_testing();
@@ -23,6 +23,12 @@
 #define DL_STATE_SUCCESS    0
 #define DL_STATE_CANCELLED  1
 
+/**
+ * Minimum amount of progress in between updates of the transferred bytes.
+ */
+#define DL_REPORT_BYTES (64 * 1024)
+#define DL_REPORT_MS    250
+
 /**
  * Initializes the dialog window object.
  *
@@ -134,13 +140,20 @@ void DownloadDialog::FileTransferThreadProc(void *lpArgs) {
 
 	// Update UI and set the transfer reporting callback.
 	lpThis->UpdateFileDetails();
-	lpThis->fdl->set_transfer_cb(DownloadDialog::FileTransferReportProc,
-		static_cast<void *>(lpThis));
+	lpThis->fdl->set_progress_cb(DownloadDialog::FileTransferReportProc,
+		static_cast<void *>(lpThis), DL_REPORT_BYTES, DL_REPORT_MS);
 
 	// Start the file transfer.
 	try {
 		lpThis->fdl->download();
 	} catch (const std::exception& e) {
+		// Don't leave a partial file behind if the user gave up on it.
+		if (lpThis->fdl->cancelled()) {
+			DeleteFile(lpThis->fdl->path());
+			iReturn = DL_STATE_CANCELLED;
+			goto dlcleanup;
+		}
+
 		MsgBoxException(lpThis->hDlg, e, _T("Failed to download file"));
 		iReturn = DL_STATE_FAILED;
 		goto dlcleanup;
@@ -248,9 +261,8 @@ INT_PTR DownloadDialog::OpenFolder(HWND hDlg) {
  */
 INT_PTR DownloadDialog::Cancel(HWND hDlg) {
 	// Cancel transfer and turn the cancel button into a close one.
-	// TODO: Cancel the transfer.
-	MsgBoxInfo(this->hDlg, _T("Not yet implemented"),
-		_T("Sorry, cancelling an ongoing transfer hasn't been implemented."));
+	if (this->fdl)
+		this->fdl->cancel();
 	SwitchCancelButtonToClose(true, false);
 
 	return FALSE;
@@ -366,9 +378,11 @@ void DownloadDialog::SwitchCancelButtonToClose(bool bMakeDefault,
  * Sets the number of transferred bytes on the dialog.
  *
  * @param bytes Number of bytes transferred so far.
+ * @param rate  Current transfer rate in bytes per second.
  */
-void DownloadDialog::SetTransferredBytes(size_t bytes) {
-	SetWindowFormatText(this->hwndSizeLabel, _T("%d bytes"), bytes);
+void DownloadDialog::SetTransferredBytes(size_t bytes, double rate) {
+	SetWindowFormatText(this->hwndSizeLabel, _T("%d bytes (%d KB/s)"), bytes,
+		(int)(rate / 1024));
 }
 
 /**
@@ -388,12 +402,15 @@ void DownloadDialog::SetOpenProgram(LPCTSTR szProgramPath) {
 /**
  * Handles the file transfer report events.
  *
- * @param lpgf    Gopher downloaded file object.
+ * @param gf      Gopher downloaded file object.
+ * @param prog    Progress of the download.
  * @param lpvThis Pointer to our own "this" object.
  */
-void DownloadDialog::FileTransferReportProc(const void *lpgf, void *lpvThis) {
-	const gopher_file_t *gf = static_cast<const gopher_file_t *>(lpgf);
+void DownloadDialog::FileTransferReportProc(const gopher_file_t *gf,
+											const gopher_file_progress_t *prog,
+											void *lpvThis) {
 	DownloadDialog *lpThis = static_cast<DownloadDialog *>(lpvThis);
 
-	lpThis->SetTransferredBytes(gf->fsize);
+	lpThis->SetTransferredBytes(prog->fsize,
+		(prog->finished) ? prog->avg_rate : prog->rate);
 }
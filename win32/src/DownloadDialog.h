@@ -44,7 +44,9 @@ private:
 		gopher_addr_t *addr;
 		gopher_type_t type;
 	} FileDownloadArgs;
-	static void FileTransferReportProc(const void *lpgf, void *lpvThis);
+	static void FileTransferReportProc(const gopher_file_t *gf,
+									   const gopher_file_progress_t *prog,
+									   void *lpvThis);
 
 	// Event handlers.
 	INT_PTR OpenFile(HWND hDlg);
@@ -60,7 +62,7 @@ private:
 	void EnableOpenButtons(bool bEnable);
 	void SwitchCancelButtonToClose(bool bMakeDefault, bool bEnableOpen);
 	void UpdateFileDetails();
-	void SetTransferredBytes(size_t bytes);
+	void SetTransferredBytes(size_t bytes, double rate);
 
 public:
 	// Constructor and destructor.
@@ -191,7 +191,7 @@ Address Address::replicate(const gopher_addr_t *addr) {
 
 	// Create a copy of our structure.
 	addrCopy = gopher_addr_new(addr->host, addr->port, addr->selector, addr->type);
-	addrCopy->ipaddr = (sockaddr_in *)malloc(addr->ipaddr_len);
+	addrCopy->ipaddr = (sockaddr *)malloc(addr->ipaddr_len);
 	memcpy(addrCopy->ipaddr, addr->ipaddr, addr->ipaddr_len);
 	addrCopy->ipaddr_len = addr->ipaddr_len;
 	addrCopy->sockfd = (SOCKET)(~0);
@@ -808,6 +808,7 @@ const gopher_dir_t *Directory::c_dir() const {
  */
 FileDownload::FileDownload() {
 	this->m_gfile = NULL;
+	this->m_cancel = gopher_cancel_new();
 	this->m_fpath = NULL;
 	this->m_bname = NULL;
 }
@@ -820,6 +821,7 @@ FileDownload::FileDownload() {
  */
 FileDownload::FileDownload(gopher_file_t *gfile) {
 	this->m_gfile = gfile;
+	this->m_cancel = gopher_cancel_new();
 	this->m_fpath = NULL;
 	this->m_bname = NULL;
 }
@@ -830,6 +832,7 @@ FileDownload::FileDownload(gopher_file_t *gfile) {
 FileDownload::~FileDownload() {
 	if (this->m_gfile)
 		gopher_file_free(this->m_gfile);
+	gopher_cancel_free(this->m_cancel);
 	if (this->m_fpath)
 		free(this->m_fpath);
 	if (this->m_bname)
@@ -917,21 +920,27 @@ void FileDownload::download() {
 	if (this->m_gfile == NULL)
 		throw std::exception("Can't download a file without setting up first");
 
+	// Let the transfer be cancelled from another thread.
+	this->m_gfile->addr->cancel = this->m_cancel;
+
 	// Connect to the server.
 	ret = gopher_connect(this->m_gfile->addr);
 	if (ret != 0) {
 		// Build up the exception message.
 		std::string msg("Failed to connect to server: ");
-		msg += strerror(ret);
+		msg += gopher_strerror(ret);
+		this->m_gfile->addr->cancel = NULL;
 		throw std::exception(msg.c_str());
 	}
 
 	// Download file from address.
 	ret = gopher_file_download(this->m_gfile);
+	this->m_gfile->addr->cancel = NULL;
 	if (ret != 0) {
 		// Build up the exception message.
 		std::string msg("Failed to request directory: ");
-		msg += strerror(ret);
+		msg += gopher_strerror(ret);
+		gopher_disconnect(this->m_gfile->addr);
 		throw std::exception(msg.c_str());
 	}
 
@@ -941,6 +950,24 @@ void FileDownload::download() {
 		perror("Failed to disconnect");
 }
 
+/**
+ * Cancels the download from any thread, making download() give up as soon as
+ * possible.
+ */
+void FileDownload::cancel() {
+	if (this->m_cancel)
+		gopher_cancel_trigger(this->m_cancel);
+}
+
+/**
+ * Checks if the download has been cancelled.
+ *
+ * @return TRUE if cancel() has been called.
+ */
+bool FileDownload::cancelled() const {
+	return gopher_cancel_triggered(this->m_cancel) != 0;
+}
+
 /**
  * Sets up a callback to listen for reports of transferred bytes while
  * downloading.
@@ -952,6 +979,19 @@ void FileDownload::set_transfer_cb(gopher_file_transfer_func func, void *arg) {
 	gopher_file_set_transfer_cb(this->m_gfile, func, arg);
 }
 
+/**
+ * Sets up a callback to receive throttled reports of the download progress.
+ *
+ * @param func      Callback function.
+ * @param arg       Optional. Parameter to be passed to the callback function.
+ * @param min_bytes Minimum number of bytes in between reports.
+ * @param min_ms    Minimum number of milliseconds in between reports.
+ */
+void FileDownload::set_progress_cb(gopher_file_progress_func func, void *arg,
+								   size_t min_bytes, unsigned long min_ms) {
+	gopher_file_set_progress_cb(this->m_gfile, func, arg, min_bytes, min_ms);
+}
+
 /**
  * Gets the basename from an address structure and caches the basename.
  *
@@ -130,6 +130,7 @@ public:
 class FileDownload {
 private:
 	gopher_file_t *m_gfile;
+	gopher_cancel_t *m_cancel;
 	TCHAR *m_fpath;
 	TCHAR *m_bname;
 
@@ -141,8 +142,12 @@ public:
 	void setup(gopher_addr_t *goaddr, gopher_type_t hint, const TCHAR *fpath);
 	void setup_temp(gopher_addr_t *goaddr, gopher_type_t hint);
 	void download();
+	void cancel();
+	bool cancelled() const;
 
 	void set_transfer_cb(gopher_file_transfer_func func, void *arg);
+	void set_progress_cb(gopher_file_progress_func func, void *arg,
+						 size_t min_bytes, unsigned long min_ms);
 
 	const TCHAR *basename(const gopher_addr_t *addr);
 	const TCHAR *basename();
@@ -34,6 +34,8 @@ MainWindow::MainWindow(HINSTANCE hInstance, LPCTSTR szURI) {
 	goDirectory = nullptr;
 	this->hWnd = NULL;
 	bFetching = false;
+	goFetchCancel = NULL;
+	InitializeCriticalSection(&csFetch);
 	himlToolbar = NULL;
 	himlBrowser = NULL;
 	hwndToolbar = NULL;
@@ -93,6 +95,14 @@ MainWindow::~MainWindow() {
 	DestroyWindow(this->hWnd);
 	this->hWnd = NULL;
 
+	// Make sure any directory fetch that's still under way gives up.
+	EnterCriticalSection(&csFetch);
+	if (goFetchCancel) {
+		gopher_cancel_trigger(goFetchCancel);
+		goFetchCancel = NULL;
+	}
+	LeaveCriticalSection(&csFetch);
+
 	// Free up any resources allocated by the Gopher client implementation.
 	if (goInitialDirectory) {
 		// Free the current directory.
@@ -106,6 +116,7 @@ MainWindow::~MainWindow() {
 		delete goInitialDirectory;
 		goInitialDirectory = nullptr;
 	}
+	DeleteCriticalSection(&csFetch);
 }
 
 /**
@@ -170,11 +181,21 @@ void MainWindow::BrowseTo(gopher_addr_t *addr) {
 	// Ensure we don't run into weird race conditions with the directory.
 	ListView_DeleteAllItems(hwndDirectory);
 
+	// Give up on the previous fetch if it's still under way.
+	gopher_cancel_t *cancel = gopher_cancel_new();
+	EnterCriticalSection(&csFetch);
+	if (goFetchCancel)
+		gopher_cancel_trigger(goFetchCancel);
+	goFetchCancel = cancel;
+	LeaveCriticalSection(&csFetch);
+	addr->cancel = cancel;
+
 	// Fetch directory on a separate thread.
 	DirectoryFetchArgs *dfa = (DirectoryFetchArgs *)malloc(
 		sizeof(DirectoryFetchArgs));
 	dfa->lpThis = this;
 	dfa->addr = addr;
+	dfa->cancel = cancel;
 	HANDLE hFetchThread = (HANDLE)_beginthread(
 		MainWindow::FetchDirectoryThreadProc, 0, (void *)dfa);
 }
@@ -204,16 +225,27 @@ void MainWindow::FetchDirectoryThreadProc(void *lpvArgs) {
 			lpThis->goInitialDirectory = new Gopher::Directory(lpArgs->addr);
 			lpThis->goDirectory = lpThis->goInitialDirectory;
 		}
+		lpArgs->addr->cancel = NULL;
 
 		// Update the interface to show our fetched directory.
 		lpThis->SetFetching(false, false);
 		lpThis->LoadDirectory();
 	} catch (const std::exception& e) {
-		MsgBoxException(lpThis->hWnd, e, _T("Failed to browse to address"));
-		lpThis->SetFetching(false, false);
-		lpThis->UpdateControls();
+		// A newer fetch has taken over the interface if we were cancelled.
+		if (!gopher_cancel_triggered(lpArgs->cancel)) {
+			MsgBoxException(lpThis->hWnd, e, _T("Failed to browse to address"));
+			lpThis->SetFetching(false, false);
+			lpThis->UpdateControls();
+		}
 	}
 
+	// Forget about our cancellation token.
+	EnterCriticalSection(&lpThis->csFetch);
+	if (lpThis->goFetchCancel == lpArgs->cancel)
+		lpThis->goFetchCancel = NULL;
+	LeaveCriticalSection(&lpThis->csFetch);
+	gopher_cancel_free(lpArgs->cancel);
+
 	// Free resources and exit the thread.
 	free(lpvArgs);
 	lpvArgs = NULL;
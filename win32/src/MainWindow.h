@@ -22,6 +22,8 @@ private:
 	Gopher::Directory *goDirectory;
 	tstring strInitialURL;
 	bool bFetching;
+	gopher_cancel_t *goFetchCancel;
+	CRITICAL_SECTION csFetch;
 
 	// Image lists.
 	HIMAGELIST himlToolbar;
@@ -68,6 +70,7 @@ private:
 	typedef struct {
 		MainWindow *lpThis;
 		gopher_addr_t *addr;
+		gopher_cancel_t *cancel;
 	} DirectoryFetchArgs;
 
 public: